@@ -0,0 +1,364 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "alac.h"
+
+/* element types */
+#define ALAC_ID_SCE 0
+#define ALAC_ID_CPE 1
+#define ALAC_ID_END 7
+
+/* adaptive Golomb-Rice coding: a prefix of more than ALAC_MAX_PREFIX ones means the value follows *
+ * in full; the history (mean) is kept with 9 fractional bits                                      */
+#define ALAC_MAX_PREFIX 9
+#define ALAC_HISTORY_SHIFT 9
+#define ALAC_RUN_BITS 16
+#define ALAC_MAX_HISTORY 0xffff
+
+struct alac_s {
+    int frame_length;
+    int bit_depth;
+    int channels;
+    int pb;
+    int mb;
+    int kb;
+
+    /* per channel: prediction residuals, and decoded samples */
+    int32_t *residuals[2];
+    int32_t *samples[2];
+    uint16_t *shifted[2];
+};
+
+typedef struct {
+    const unsigned char *data;
+    uint32_t size;                /* in bits */
+    uint32_t pos;                 /* in bits */
+} alac_bits_t;
+
+/* the next 32 bits of the stream (zeros past the end) */
+static inline uint32_t
+alac_bits_peek(alac_bits_t *bits)
+{
+    uint32_t byte = bits->pos >> 3;
+    uint32_t bytes = bits->size >> 3;
+    uint64_t value = 0;
+    if (byte + 5 <= bytes) {
+        const unsigned char *p = bits->data + byte;
+        value = ((uint64_t) p[0] << 32) | ((uint64_t) p[1] << 24) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 8) | p[4];
+    } else {
+        for (uint32_t i = 0; i < 5; i++) {
+            value = (value << 8) | (byte + i < bytes ? bits->data[byte + i] : 0);
+        }
+    }
+    return (uint32_t) (value >> (8 - (bits->pos & 7)));
+}
+
+static inline uint32_t
+alac_bits_read(alac_bits_t *bits, int count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t value = alac_bits_peek(bits) >> (32 - count);
+    bits->pos += count;
+    return value;
+}
+
+static inline int32_t
+alac_bits_read_signed(alac_bits_t *bits, int count)
+{
+    return (int32_t) (alac_bits_read(bits, count) << (32 - count)) >> (32 - count);
+}
+
+static inline int32_t
+alac_sign_extend(int32_t value, int bits)
+{
+    return (int32_t) ((uint32_t) value << (32 - bits)) >> (32 - bits);
+}
+
+static inline int
+alac_log2(uint32_t value)
+{
+    int log = 0;
+    while (value >>= 1) {
+        log++;
+    }
+    return log;
+}
+
+static inline int
+alac_sign(int32_t value)
+{
+    return (value > 0) - (value < 0);
+}
+
+/* one Golomb-Rice coded value with parameter k, or the escaped value of max_bits bits */
+static uint32_t
+alac_read_rice(alac_bits_t *bits, int k, int max_bits)
+{
+    /* the prefix and its terminating zero take at most 9 bits, so the k suffix bits are  *
+     * usually in the same 32 bits; larger k (kb may be up to 31) need a second peek       */
+    uint32_t stream = alac_bits_peek(bits);
+    uint32_t prefix = 0;
+    while (prefix < ALAC_MAX_PREFIX && (stream & 0x80000000)) {
+        prefix++;
+        stream <<= 1;
+    }
+    if (prefix >= ALAC_MAX_PREFIX) {
+        bits->pos += ALAC_MAX_PREFIX;
+        return alac_bits_read(bits, max_bits);
+    }
+    bits->pos += prefix + 1;
+    if (k == 1) {
+        return prefix;
+    }
+    uint32_t value = (prefix << k) - prefix;
+    uint32_t extra = (prefix + 1 + k <= 32) ? (stream << 1) >> (32 - k) : alac_bits_peek(bits) >> (32 - k);
+    if (extra > 1) {
+        value += extra - 1;
+        bits->pos += k;
+    } else {
+        bits->pos += k - 1;
+    }
+    return value;
+}
+
+static int
+alac_decode_residuals(alac_t *alac, alac_bits_t *bits, int32_t *out, int count, int sample_bits, int history_mult)
+{
+    uint32_t history = alac->mb;
+    int sign_modifier = 0;
+
+    for (int i = 0; i < count; i++) {
+        int k = alac_log2((history >> ALAC_HISTORY_SHIFT) + 3);
+        if (k > alac->kb) {
+            k = alac->kb;
+        }
+        uint32_t value = alac_read_rice(bits, k, sample_bits) + sign_modifier;
+        sign_modifier = 0;
+        out[i] = (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+
+        if (value > ALAC_MAX_HISTORY) {
+            history = ALAC_MAX_HISTORY;
+        } else {
+            history += value * history_mult - ((history * history_mult) >> ALAC_HISTORY_SHIFT);
+        }
+
+        /* a low history may be followed by a run of zeros */
+        if (history < 128 && i + 1 < count) {
+            k = 7 - alac_log2(history) + ((history + 16) >> 6);
+            if (k > alac->kb) {
+                k = alac->kb;
+            }
+            uint32_t run = alac_read_rice(bits, k, ALAC_RUN_BITS);
+            if (run >= (uint32_t) (count - i)) {
+                return -1;
+            }
+            memset(&out[i + 1], 0, run * sizeof(int32_t));
+            i += run;
+            if (run <= ALAC_MAX_HISTORY) {
+                sign_modifier = 1;
+            }
+            history = 0;
+        }
+    }
+    return (bits->pos <= bits->size) ? 0 : -1;
+}
+
+/* adaptive FIR prediction (order 31: first-order prediction without coefficients) */
+static void
+alac_predict(const int32_t *residuals, int32_t *out, int count, int sample_bits, int16_t *coefs, int order, int shift)
+{
+    int i;
+
+    out[0] = residuals[0];
+    if (order == 0) {
+        memmove(&out[1], &residuals[1], (count - 1) * sizeof(int32_t));
+        return;
+    }
+    if (order == 31) {
+        for (i = 1; i < count; i++) {
+            out[i] = alac_sign_extend(out[i - 1] + residuals[i], sample_bits);
+        }
+        return;
+    }
+    for (i = 1; i <= order && i < count; i++) {
+        out[i] = alac_sign_extend(out[i - 1] + residuals[i], sample_bits);
+    }
+    for (; i < count; i++) {
+        const int32_t *history = &out[i - order];
+        int32_t base = history[-1];
+        int32_t error = residuals[i];
+        int64_t sum = 0;
+
+        for (int j = 0; j < order; j++) {
+            sum += (int64_t) (history[j] - base) * coefs[j];
+        }
+        int32_t prediction = (int32_t) ((sum + ((int64_t) 1 << (shift - 1))) >> shift);
+        out[i] = alac_sign_extend(prediction + base + error, sample_bits);
+
+        /* adapt the coefficients towards the sign of the error */
+        int error_sign = alac_sign(error);
+        for (int j = 0; error_sign && j < order && error * error_sign > 0; j++) {
+            int32_t diff = base - history[j];
+            int sign = alac_sign(diff) * error_sign;
+            coefs[j] -= sign;
+            error -= ((diff * sign) >> shift) * (j + 1);
+        }
+    }
+}
+
+alac_t *
+alac_init(int frame_length, int bit_depth, int channels, int pb, int mb, int kb)
+{
+    alac_t *alac;
+
+    if (frame_length < 1 || frame_length > ALAC_MAX_FRAME_LENGTH || bit_depth != 16 ||
+        channels < 1 || channels > 2 || kb < 1 || kb > 31) {
+        return NULL;
+    }
+    alac = calloc(1, sizeof(alac_t));
+    if (!alac) {
+        return NULL;
+    }
+    alac->frame_length = frame_length;
+    alac->bit_depth = bit_depth;
+    alac->channels = channels;
+    alac->pb = pb;
+    alac->mb = mb;
+    alac->kb = kb;
+    for (int ch = 0; ch < 2; ch++) {
+        alac->residuals[ch] = malloc(frame_length * sizeof(int32_t));
+        alac->samples[ch] = malloc(frame_length * sizeof(int32_t));
+        alac->shifted[ch] = malloc(frame_length * sizeof(uint16_t));
+        if (!alac->residuals[ch] || !alac->samples[ch] || !alac->shifted[ch]) {
+            alac_destroy(alac);
+            return NULL;
+        }
+    }
+    return alac;
+}
+
+/* decodes one frame into out (interleaved, at least frame_length * 2 samples); returns *
+ * the number of samples per channel (channels in *channels), or -1 on error            */
+int
+alac_decode(alac_t *alac, const unsigned char *data, int data_len, int16_t *out, int *channels)
+{
+    alac_bits_t bits = { data, (uint32_t) data_len * 8, 0 };
+    int16_t coefs[2][32];
+    int order[2], mode[2], shift[2], history_mult[2];
+    int mix_bits = 0, mix_res = 0;
+
+    int element = alac_bits_read(&bits, 3);
+    if (element != ALAC_ID_SCE && element != ALAC_ID_CPE) {
+        return -1;
+    }
+    int element_channels = (element == ALAC_ID_CPE) ? 2 : 1;
+    alac_bits_read(&bits, 4);                  /* element instance tag */
+    alac_bits_read(&bits, 12);                 /* unused */
+    int has_size = alac_bits_read(&bits, 1);
+    int bytes_shifted = alac_bits_read(&bits, 2);
+    int escaped = alac_bits_read(&bits, 1);
+    int count = has_size ? (int) alac_bits_read(&bits, 32) : alac->frame_length;
+    if (count < 1 || count > alac->frame_length || bytes_shifted > 1) {
+        return -1;
+    }
+    int shift_bits = bytes_shifted * 8;
+    int sample_bits = alac->bit_depth - shift_bits + element_channels - 1;
+
+    if (!escaped) {
+        mix_bits = alac_bits_read(&bits, 8);
+        mix_res = alac_bits_read_signed(&bits, 8);
+        if (element_channels == 2 && mix_res && mix_bits > 31) {
+            return -1;
+        }
+        for (int ch = 0; ch < element_channels; ch++) {
+            mode[ch] = alac_bits_read(&bits, 4);
+            shift[ch] = alac_bits_read(&bits, 4);
+            history_mult[ch] = alac_bits_read(&bits, 3) * alac->pb / 4;
+            order[ch] = alac_bits_read(&bits, 5);
+            if (order[ch] > 0 && order[ch] < 31 && shift[ch] == 0) {
+                return -1;
+            }
+            for (int i = order[ch] - 1; i >= 0; i--) {
+                coefs[ch][i] = (int16_t) alac_bits_read_signed(&bits, 16);
+            }
+        }
+        if (shift_bits) {
+            for (int i = 0; i < count; i++) {
+                for (int ch = 0; ch < element_channels; ch++) {
+                    alac->shifted[ch][i] = (uint16_t) alac_bits_read(&bits, shift_bits);
+                }
+            }
+        }
+        for (int ch = 0; ch < element_channels; ch++) {
+            if (alac_decode_residuals(alac, &bits, alac->residuals[ch], count, sample_bits, history_mult[ch]) < 0) {
+                return -1;
+            }
+            if (mode[ch] != 0) {
+                alac_predict(alac->residuals[ch], alac->residuals[ch], count, sample_bits, NULL, 31, 0);
+            }
+            alac_predict(alac->residuals[ch], alac->samples[ch], count, sample_bits, coefs[ch], order[ch], shift[ch]);
+        }
+    } else {
+        /* uncompressed samples */
+        for (int i = 0; i < count; i++) {
+            for (int ch = 0; ch < element_channels; ch++) {
+                alac->samples[ch][i] = alac_bits_read_signed(&bits, alac->bit_depth);
+            }
+        }
+        shift_bits = 0;
+    }
+    if (bits.pos > bits.size) {
+        return -1;
+    }
+
+    /* undo the stereo decorrelation */
+    if (element_channels == 2 && mix_res) {
+        for (int i = 0; i < count; i++) {
+            int32_t a = alac->samples[0][i];
+            int32_t b = alac->samples[1][i];
+            a -= (b * mix_res) >> mix_bits;
+            b += a;
+            alac->samples[0][i] = b;
+            alac->samples[1][i] = a;
+        }
+    }
+    for (int ch = 0; ch < element_channels; ch++) {
+        for (int i = 0; i < count; i++) {
+            int32_t sample = alac->samples[ch][i];
+            if (shift_bits) {
+                sample = (int32_t) ((uint32_t) sample << shift_bits) | alac->shifted[ch][i];
+            }
+            out[i * element_channels + ch] = (int16_t) sample;
+        }
+    }
+    *channels = element_channels;
+    return count;
+}
+
+void
+alac_destroy(alac_t *alac)
+{
+    if (alac) {
+        for (int ch = 0; ch < 2; ch++) {
+            free(alac->residuals[ch]);
+            free(alac->samples[ch]);
+            free(alac->shifted[ch]);
+        }
+        free(alac);
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef ALAC_H
+#define ALAC_H
+
+#include <stdint.h>
+
+/* Decoder for the Apple Lossless (ALAC) frames of AirPlay audio streams (ct 2): 16-bit, one or two *
+ * channels, one element (SCE or CPE) per frame.  All buffers are allocated by alac_init().         */
+
+/* the AirPlay ALAC configuration (fmtp "96 352 0 16 40 10 14 2 255 0 0 44100") */
+#define ALAC_AIRPLAY_FRAME_LENGTH 352
+#define ALAC_AIRPLAY_BIT_DEPTH 16
+#define ALAC_AIRPLAY_PB 40
+#define ALAC_AIRPLAY_MB 10
+#define ALAC_AIRPLAY_KB 14
+#define ALAC_AIRPLAY_CHANNELS 2
+
+#define ALAC_MAX_FRAME_LENGTH 4096
+
+typedef struct alac_s alac_t;
+
+alac_t *alac_init(int frame_length, int bit_depth, int channels, int pb, int mb, int kb);
+int alac_decode(alac_t *alac, const unsigned char *data, int data_len, int16_t *out, int *channels);
+void alac_destroy(alac_t *alac);
+
+#endif //ALAC_H
@@ -0,0 +1,277 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "audio_conceal.h"
+
+/* a frame is only compressed where its pitch periods are this similar (normalized correlation), *
+ * or where it is quiet (rms below AUDIO_CONCEAL_QUIET_LEVEL)                                    */
+#define AUDIO_CONCEAL_MIN_CORRELATION 0.8
+#define AUDIO_CONCEAL_QUIET_LEVEL 64.0
+
+struct audio_conceal_s {
+    int channels;
+    int max_samples;
+    int min_lag;
+    int max_lag;
+    int hold;
+    int fade;
+
+    /* the last audio played, at most 2 * max_lag samples */
+    int16_t *history;
+    int history_count;
+
+    /* extension of the history by audio_conceal_fill(): pitch period, and samples extended so far */
+    int lag;
+    int extended;
+    int16_t *pending;             /* the next AUDIO_CONCEAL_CROSSFADE samples of the extension */
+    int have_pending;
+
+    double credit;                /* samples that audio_conceal_compress() may still remove */
+
+    int16_t *out;
+};
+
+/* normalized correlation of the (channel-summed) samples a[0..len) and b[0..len); *
+ * energy receives the mean square of both                                         */
+static double
+audio_conceal_correlation(const int16_t *a, const int16_t *b, int len, int channels, double *energy)
+{
+    double ab = 0, aa = 0, bb = 0;
+    for (int i = 0; i < len; i++) {
+        double x = 0, y = 0;
+        for (int c = 0; c < channels; c++) {
+            x += a[i * channels + c];
+            y += b[i * channels + c];
+        }
+        ab += x * y;
+        aa += x * x;
+        bb += y * y;
+    }
+    if (energy) {
+        *energy = (aa + bb) / (2.0 * len * channels * channels);
+    }
+    if (aa <= 0 || bb <= 0) {
+        return 0;
+    }
+    return ab / sqrt(aa * bb);
+}
+
+audio_conceal_t *
+audio_conceal_init(int channels, int sample_rate, int max_samples)
+{
+    audio_conceal_t *conceal;
+
+    assert(channels > 0);
+    assert(sample_rate > 0);
+    assert(max_samples > 0);
+    conceal = calloc(1, sizeof(audio_conceal_t));
+    if (!conceal) {
+        return NULL;
+    }
+    conceal->channels = channels;
+    conceal->max_samples = max_samples;
+    conceal->min_lag = (int) (AUDIO_CONCEAL_MIN_LAG_MS * sample_rate / 1000);
+    conceal->max_lag = (int) (AUDIO_CONCEAL_MAX_LAG_MS * sample_rate / 1000);
+    conceal->hold = AUDIO_CONCEAL_HOLD_MS * sample_rate / 1000;
+    conceal->fade = AUDIO_CONCEAL_FADE_MS * sample_rate / 1000;
+    conceal->history = calloc(2 * conceal->max_lag * channels, sizeof(int16_t));
+    conceal->pending = calloc(AUDIO_CONCEAL_CROSSFADE * channels, sizeof(int16_t));
+    conceal->out = calloc((size_t) max_samples * channels, sizeof(int16_t));
+    if (!conceal->history || !conceal->pending || !conceal->out) {
+        audio_conceal_destroy(conceal);
+        return NULL;
+    }
+    return conceal;
+}
+
+/* records a frame that is played, after crossfading its start with a preceding extension */
+void
+audio_conceal_frame(audio_conceal_t *conceal, int16_t *data, int count)
+{
+    assert(conceal);
+    int channels = conceal->channels;
+    int capacity = 2 * conceal->max_lag;
+
+    if (conceal->have_pending) {
+        int len = (count < AUDIO_CONCEAL_CROSSFADE ? count : AUDIO_CONCEAL_CROSSFADE);
+        for (int i = 0; i < len; i++) {
+            float w = (i + 0.5f) / AUDIO_CONCEAL_CROSSFADE;
+            for (int c = 0; c < channels; c++) {
+                float v = conceal->pending[i * channels + c] * (1 - w) + data[i * channels + c] * w;
+                data[i * channels + c] = (int16_t) lrintf(v);
+            }
+        }
+        conceal->have_pending = 0;
+    }
+    conceal->extended = 0;
+
+    if (count >= capacity) {
+        memcpy(conceal->history, data + (count - capacity) * channels, capacity * channels * sizeof(int16_t));
+        conceal->history_count = capacity;
+        return;
+    }
+    int keep = conceal->history_count;
+    if (keep + count > capacity) {
+        keep = capacity - count;
+    }
+    memmove(conceal->history, conceal->history + (conceal->history_count - keep) * channels,
+            keep * channels * sizeof(int16_t));
+    memcpy(conceal->history + keep * channels, data, count * channels * sizeof(int16_t));
+    conceal->history_count = keep + count;
+}
+
+/* writes count samples (at most max_samples) continuing the audio played so far to *out, *
+ * which stays valid until the next call; returns the number of samples                  */
+int
+audio_conceal_fill(audio_conceal_t *conceal, int count, int16_t **out)
+{
+    assert(conceal);
+    assert(out);
+    int channels = conceal->channels;
+    if (count > conceal->max_samples) {
+        count = conceal->max_samples;
+    }
+    *out = conceal->out;
+    if (count <= 0) {
+        return 0;
+    }
+    if (conceal->extended == 0) {
+        /* the pitch period: the lag at which the end of the history best matches itself */
+        conceal->lag = 0;
+        double best = -1;
+        int end = conceal->history_count;
+        for (int lag = conceal->min_lag; lag <= conceal->max_lag && 2 * lag <= end; lag++) {
+            int window = (lag < conceal->min_lag * 2 ? conceal->min_lag * 2 : lag);
+            if (window + lag > end) {
+                window = end - lag;
+            }
+            const int16_t *tail = conceal->history + (end - window) * channels;
+            double corr = audio_conceal_correlation(tail, tail - lag * channels, window, channels, NULL);
+            if (corr > best) {
+                best = corr;
+                conceal->lag = lag;
+            }
+        }
+    }
+    if (conceal->lag == 0) {
+        memset(conceal->out, 0, count * channels * sizeof(int16_t));
+        memset(conceal->pending, 0, AUDIO_CONCEAL_CROSSFADE * channels * sizeof(int16_t));
+        conceal->have_pending = 1;
+        conceal->extended += count;
+        return count;
+    }
+
+    const int16_t *period = conceal->history + (conceal->history_count - conceal->lag) * channels;
+    for (int i = 0; i < count + AUDIO_CONCEAL_CROSSFADE; i++) {
+        int position = conceal->extended + i;
+        float gain = 1;
+        if (position >= conceal->hold) {
+            gain = 1 - (float) (position - conceal->hold) / conceal->fade;
+            if (gain < 0) {
+                gain = 0;
+            }
+        }
+        const int16_t *src = period + (position % conceal->lag) * channels;
+        int16_t *dst = (i < count ? conceal->out + i * channels : conceal->pending + (i - count) * channels);
+        for (int c = 0; c < channels; c++) {
+            dst[c] = (int16_t) lrintf(src[c] * gain);
+        }
+    }
+    conceal->have_pending = 1;
+    conceal->extended += count;
+    return count;
+}
+
+/* removes one pitch period of at most max_remove samples from the frame, in place; *
+ * returns the new number of samples                                                 */
+int
+audio_conceal_compress(audio_conceal_t *conceal, int16_t *data, int count, int max_remove)
+{
+    assert(conceal);
+    int channels = conceal->channels;
+    conceal->credit += count * AUDIO_CONCEAL_MAX_SPEEDUP;
+    if (conceal->credit > conceal->max_lag) {
+        conceal->credit = conceal->max_lag;
+    }
+    int limit = max_remove;
+    if (limit > (int) conceal->credit) {
+        limit = (int) conceal->credit;
+    }
+    if (limit > count - conceal->min_lag) {
+        limit = count - conceal->min_lag;
+    }
+    if (limit > conceal->max_lag) {
+        limit = conceal->max_lag;
+    }
+    if (limit < conceal->min_lag) {
+        return count;
+    }
+
+    /* the lag at which the frame best matches itself, over an overlap of up to one lag */
+    int lag = 0, overlap = 0;
+    double best = -1, energy = 0;
+    for (int l = conceal->min_lag; l <= limit; l++) {
+        int len = (count - l < l ? count - l : l);
+        double e;
+        double corr = audio_conceal_correlation(data, data + l * channels, len, channels, &e);
+        if (corr > best) {
+            best = corr;
+            energy = e;
+            lag = l;
+            overlap = len;
+        }
+    }
+    if (best < AUDIO_CONCEAL_MIN_CORRELATION && energy > AUDIO_CONCEAL_QUIET_LEVEL * AUDIO_CONCEAL_QUIET_LEVEL) {
+        return count;
+    }
+
+    /* crossfade from the frame to the frame shifted by lag, then drop the first lag samples */
+    for (int i = 0; i < overlap; i++) {
+        float w = (i + 0.5f) / overlap;
+        for (int c = 0; c < channels; c++) {
+            float v = data[i * channels + c] * (1 - w) + data[(i + lag) * channels + c] * w;
+            data[i * channels + c] = (int16_t) lrintf(v);
+        }
+    }
+    memmove(data + overlap * channels, data + (overlap + lag) * channels,
+            (count - overlap - lag) * channels * sizeof(int16_t));
+    conceal->credit -= lag;
+    return count - lag;
+}
+
+/* forgets the history, e.g. after a flush */
+void
+audio_conceal_reset(audio_conceal_t *conceal)
+{
+    assert(conceal);
+    conceal->history_count = 0;
+    conceal->extended = 0;
+    conceal->lag = 0;
+    conceal->have_pending = 0;
+    conceal->credit = 0;
+}
+
+void
+audio_conceal_destroy(audio_conceal_t *conceal)
+{
+    if (conceal) {
+        free(conceal->history);
+        free(conceal->pending);
+        free(conceal->out);
+        free(conceal);
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef AUDIO_CONCEAL_H
+#define AUDIO_CONCEAL_H
+
+#include <stdint.h>
+
+/* Time-domain concealment and time-stretching of interleaved 16-bit PCM:                          *
+ *  - audio_conceal_fill() extends the audio played so far by repeating its last pitch period       *
+ *    (found by autocorrelation), fading out after AUDIO_CONCEAL_HOLD_MS, for missing frames;       *
+ *    the next real frame is crossfaded with the extension over AUDIO_CONCEAL_CROSSFADE samples.    *
+ *  - audio_conceal_compress() shortens a frame by one pitch period (WSOLA: the frame is           *
+ *    crossfaded with itself shifted by the period), at most AUDIO_CONCEAL_MAX_SPEEDUP of the       *
+ *    audio on average.                                                                             *
+ * Every frame that is played must be passed to audio_conceal_frame(), which keeps the history.    */
+
+#define AUDIO_CONCEAL_MIN_LAG_MS 2.0
+#define AUDIO_CONCEAL_MAX_LAG_MS 15.0
+#define AUDIO_CONCEAL_HOLD_MS 20
+#define AUDIO_CONCEAL_FADE_MS 60
+#define AUDIO_CONCEAL_CROSSFADE 64
+#define AUDIO_CONCEAL_MAX_SPEEDUP 0.1
+
+typedef struct audio_conceal_s audio_conceal_t;
+
+audio_conceal_t *audio_conceal_init(int channels, int sample_rate, int max_samples);
+void audio_conceal_frame(audio_conceal_t *conceal, int16_t *data, int count);
+int audio_conceal_fill(audio_conceal_t *conceal, int count, int16_t **out);
+int audio_conceal_compress(audio_conceal_t *conceal, int16_t *data, int count, int max_remove);
+void audio_conceal_reset(audio_conceal_t *conceal);
+void audio_conceal_destroy(audio_conceal_t *conceal);
+
+#endif //AUDIO_CONCEAL_H
@@ -0,0 +1,254 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "audio_decoder.h"
+#include "alac.h"
+
+#ifdef HAVE_FDK_AAC
+#include "aacdecoder_lib.h"
+#endif
+
+struct audio_decoder_s {
+    logger_t *logger;
+    unsigned char ct;
+    int sample_rate;
+    alac_t *alac;
+#ifdef HAVE_FDK_AAC
+    HANDLE_AACDECODER aac_decoder;
+#endif
+
+    /* decoded samples of the last frame */
+    int16_t pcm[AUDIO_DECODER_MAX_FRAME_SAMPLES * AUDIO_DECODER_CHANNELS];
+};
+
+#ifdef HAVE_FDK_AAC
+/* AudioSpecificConfig of the AirPlay AAC streams: 44.1 kHz stereo, *
+ * AAC-LC with 1024 samples per frame, AAC-ELD with 480             */
+static const unsigned char aac_lc_config[] = { 0x12, 0x10 };
+static const unsigned char aac_eld_config[] = { 0xf8, 0xe8, 0x50, 0x00 };
+
+static int
+audio_decoder_init_aac(audio_decoder_t *decoder)
+{
+    UCHAR config[4];
+    UINT config_len;
+
+    if (decoder->ct == 4) {
+        config_len = sizeof(aac_lc_config);
+        memcpy(config, aac_lc_config, config_len);
+    } else {
+        config_len = sizeof(aac_eld_config);
+        memcpy(config, aac_eld_config, config_len);
+    }
+    UCHAR *conf[] = { config };
+
+    decoder->aac_decoder = aacDecoder_Open(TT_MP4_RAW, 1);
+    if (!decoder->aac_decoder) {
+        logger_log(decoder->logger, LOGGER_ERR, "audio_decoder: could not open the AAC decoder");
+        return -1;
+    }
+    if (aacDecoder_ConfigRaw(decoder->aac_decoder, conf, &config_len) != AAC_DEC_OK) {
+        logger_log(decoder->logger, LOGGER_ERR, "audio_decoder: could not configure the AAC decoder (ct=%d)", decoder->ct);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+audio_decoder_get_aac_info(audio_decoder_t *decoder, audio_pcm_struct *pcm)
+{
+    CStreamInfo *info = aacDecoder_GetStreamInfo(decoder->aac_decoder);
+    if (!info || info->numChannels < 1 || info->numChannels > AUDIO_DECODER_CHANNELS) {
+        return -1;
+    }
+    pcm->sample_count = info->frameSize;
+    pcm->channels = info->numChannels;
+    pcm->sample_rate = info->sampleRate;
+    return 0;
+}
+
+static int
+audio_decoder_decode_aac(audio_decoder_t *decoder, const unsigned char *data, int data_len, audio_pcm_struct *pcm)
+{
+    UCHAR *buffer[] = { (UCHAR *) data };
+    UINT buffer_size = data_len;
+    UINT bytes_valid = data_len;
+    AAC_DECODER_ERROR error;
+
+    /* every packet holds exactly one raw frame */
+    error = aacDecoder_Fill(decoder->aac_decoder, buffer, &buffer_size, &bytes_valid);
+    if (error != AAC_DEC_OK) {
+        logger_log(decoder->logger, LOGGER_DEBUG, "audio_decoder: aacDecoder_Fill error 0x%x", error);
+        return -1;
+    }
+    error = aacDecoder_DecodeFrame(decoder->aac_decoder, decoder->pcm,
+                                   AUDIO_DECODER_MAX_FRAME_SAMPLES * AUDIO_DECODER_CHANNELS, 0);
+    if (error != AAC_DEC_OK) {
+        logger_log(decoder->logger, LOGGER_DEBUG, "audio_decoder: aacDecoder_DecodeFrame error 0x%x", error);
+        return -1;
+    }
+    return audio_decoder_get_aac_info(decoder, pcm);
+}
+#endif
+
+bool
+audio_decoder_supports(unsigned char ct)
+{
+    switch (ct) {
+    case 1:
+    case 2:
+        return true;
+#ifdef HAVE_FDK_AAC
+    case 4:
+    case 8:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/* returns NULL if ct cannot be decoded; frame_length is the samples per ALAC frame (0: the AirPlay default) */
+audio_decoder_t *
+audio_decoder_init(logger_t *logger, unsigned char ct, int sample_rate, int frame_length)
+{
+    audio_decoder_t *decoder;
+
+    assert(logger);
+    if (!audio_decoder_supports(ct)) {
+        logger_log(logger, LOGGER_INFO, "audio_decoder: no decoder for audio compression type ct=%d", ct);
+        return NULL;
+    }
+    decoder = calloc(1, sizeof(audio_decoder_t));
+    if (!decoder) {
+        return NULL;
+    }
+    decoder->logger = logger;
+    decoder->ct = ct;
+    decoder->sample_rate = sample_rate;
+    if (ct == 2) {
+        if (frame_length <= 0) {
+            frame_length = ALAC_AIRPLAY_FRAME_LENGTH;
+        }
+        decoder->alac = alac_init(frame_length, ALAC_AIRPLAY_BIT_DEPTH, ALAC_AIRPLAY_CHANNELS,
+                                  ALAC_AIRPLAY_PB, ALAC_AIRPLAY_MB, ALAC_AIRPLAY_KB);
+        if (!decoder->alac) {
+            logger_log(logger, LOGGER_ERR, "audio_decoder: could not initialize the ALAC decoder (frame length %d)",
+                       frame_length);
+            audio_decoder_destroy(decoder);
+            return NULL;
+        }
+    }
+#ifdef HAVE_FDK_AAC
+    if ((ct == 4 || ct == 8) && audio_decoder_init_aac(decoder) < 0) {
+        audio_decoder_destroy(decoder);
+        return NULL;
+    }
+#endif
+    return decoder;
+}
+
+/* decodes one frame into pcm->data (the decoder's buffer); returns -1 on error */
+int
+audio_decoder_decode(audio_decoder_t *decoder, const unsigned char *data, int data_len, audio_pcm_struct *pcm)
+{
+    assert(decoder);
+    pcm->data = decoder->pcm;
+    pcm->sample_count = 0;
+    pcm->channels = AUDIO_DECODER_CHANNELS;
+    pcm->sample_rate = decoder->sample_rate;
+
+    switch (decoder->ct) {
+    case 1: {
+        int count = data_len / 2;
+        if (count > AUDIO_DECODER_MAX_FRAME_SAMPLES * AUDIO_DECODER_CHANNELS) {
+            count = AUDIO_DECODER_MAX_FRAME_SAMPLES * AUDIO_DECODER_CHANNELS;
+        }
+        for (int i = 0; i < count; i++) {
+            decoder->pcm[i] = (int16_t) ((data[2 * i] << 8) | data[2 * i + 1]);
+        }
+        pcm->sample_count = count / AUDIO_DECODER_CHANNELS;
+        return 0;
+    }
+    case 2: {
+        int count = alac_decode(decoder->alac, data, data_len, decoder->pcm, &pcm->channels);
+        if (count < 0) {
+            logger_log(decoder->logger, LOGGER_DEBUG, "audio_decoder: invalid ALAC frame of %d bytes", data_len);
+            return -1;
+        }
+        pcm->sample_count = count;
+        return 0;
+    }
+#ifdef HAVE_FDK_AAC
+    case 4:
+    case 8:
+        return audio_decoder_decode_aac(decoder, data, data_len, pcm);
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* writes a replacement for one lost frame to pcm->data, with the decoder's own concealment *
+ * (AAC only); returns -1 if there is none, and the caller has to conceal the loss itself   */
+int
+audio_decoder_conceal(audio_decoder_t *decoder, audio_pcm_struct *pcm)
+{
+    assert(decoder);
+    pcm->data = decoder->pcm;
+    pcm->sample_count = 0;
+    pcm->channels = AUDIO_DECODER_CHANNELS;
+    pcm->sample_rate = decoder->sample_rate;
+#ifdef HAVE_FDK_AAC
+    if (decoder->aac_decoder) {
+        AAC_DECODER_ERROR error = aacDecoder_DecodeFrame(decoder->aac_decoder, decoder->pcm,
+                                                         AUDIO_DECODER_MAX_FRAME_SAMPLES * AUDIO_DECODER_CHANNELS,
+                                                         AACDEC_CONCEAL);
+        if (error != AAC_DEC_OK) {
+            logger_log(decoder->logger, LOGGER_DEBUG, "audio_decoder: AAC concealment error 0x%x", error);
+            return -1;
+        }
+        return audio_decoder_get_aac_info(decoder, pcm);
+    }
+#endif
+    return -1;
+}
+
+/* discards decoder state after a flush (e.g. a seek) */
+void
+audio_decoder_flush(audio_decoder_t *decoder)
+{
+    assert(decoder);
+#ifdef HAVE_FDK_AAC
+    if (decoder->aac_decoder) {
+        aacDecoder_SetParam(decoder->aac_decoder, AAC_TPDEC_CLEAR_BUFFER, 1);
+    }
+#endif
+}
+
+void
+audio_decoder_destroy(audio_decoder_t *decoder)
+{
+    if (decoder) {
+        alac_destroy(decoder->alac);
+#ifdef HAVE_FDK_AAC
+        if (decoder->aac_decoder) {
+            aacDecoder_Close(decoder->aac_decoder);
+        }
+#endif
+        free(decoder);
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef AUDIO_DECODER_H
+#define AUDIO_DECODER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logger.h"
+#include "stream.h"
+
+/* Decoding of received audio frames to interleaved 16-bit PCM, for the audio_process_pcm callback. *
+ * One decoder is created per audio session, for its compression type ct:                           *
+ *   ct 1: 16-bit big-endian PCM (only converted to host byte order)                                 *
+ *   ct 2: ALAC (native decoder, see alac.h)                                                         *
+ *   ct 4: AAC-LC, ct 8: AAC-ELD (only if the library is built with fdk-aac, HAVE_FDK_AAC)           *
+ * Decoded samples are written to a buffer owned by the decoder, which stays valid until the next    *
+ * call of audio_decoder_decode().                                                                   */
+
+#define AUDIO_DECODER_CHANNELS 2
+#define AUDIO_DECODER_MAX_FRAME_SAMPLES 4096      /* per channel */
+
+typedef struct audio_decoder_s audio_decoder_t;
+
+bool audio_decoder_supports(unsigned char ct);
+audio_decoder_t *audio_decoder_init(logger_t *logger, unsigned char ct, int sample_rate, int frame_length);
+int audio_decoder_decode(audio_decoder_t *decoder, const unsigned char *data, int data_len, audio_pcm_struct *pcm);
+int audio_decoder_conceal(audio_decoder_t *decoder, audio_pcm_struct *pcm);
+void audio_decoder_flush(audio_decoder_t *decoder);
+void audio_decoder_destroy(audio_decoder_t *decoder);
+
+#endif //AUDIO_DECODER_H
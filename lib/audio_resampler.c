@@ -0,0 +1,265 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "audio_resampler.h"
+
+#define AUDIO_RESAMPLER_MAX_CHANNELS 2
+
+/* the filter passes up to 0.9 times the Nyquist frequency; Kaiser window beta */
+#define AUDIO_RESAMPLER_CUTOFF 0.9
+#define AUDIO_RESAMPLER_KAISER_BETA 8.0
+
+/* the filter loops work on 4 floats at a time (SSE, NEON), or 8 with AVX, with the GCC/clang *
+ * vector extensions; the partial sums let the dot product vectorize without -ffast-math      */
+#if defined(__GNUC__) && defined(__AVX__) && AUDIO_RESAMPLER_TAPS % 8 == 0
+#define AUDIO_RESAMPLER_VECTOR_SIZE 8
+#elif defined(__GNUC__) && AUDIO_RESAMPLER_TAPS % 4 == 0
+#define AUDIO_RESAMPLER_VECTOR_SIZE 4
+#endif
+#ifdef AUDIO_RESAMPLER_VECTOR_SIZE
+typedef float audio_resampler_vector_t __attribute__((vector_size(AUDIO_RESAMPLER_VECTOR_SIZE * sizeof(float))));
+#endif
+
+struct audio_resampler_s {
+    int channels;
+    int max_input_samples;
+    double ratio;
+
+    /* position of the next output sample, in input samples from the start of history */
+    double position;
+
+    /* filter coefficients, [AUDIO_RESAMPLER_PHASES + 1][AUDIO_RESAMPLER_TAPS] */
+    float *coefs;
+
+    /* per channel: the last AUDIO_RESAMPLER_TAPS input samples, followed by the current input */
+    float *history[AUDIO_RESAMPLER_MAX_CHANNELS];
+    int history_len;
+
+    int16_t *out;
+    int max_output_samples;
+};
+
+static double
+audio_resampler_bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 30; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/* coefficient of phase p (0 .. AUDIO_RESAMPLER_PHASES) for tap t: the sinc is centred between *
+ * taps TAPS / 2 - 1 and TAPS / 2, shifted by the fraction p / PHASES of a sample               */
+static void
+audio_resampler_init_coefs(float *coefs)
+{
+    int half = AUDIO_RESAMPLER_TAPS / 2;
+    for (int p = 0; p <= AUDIO_RESAMPLER_PHASES; p++) {
+        double frac = (double) p / AUDIO_RESAMPLER_PHASES;
+        double sum = 0;
+        for (int t = 0; t < AUDIO_RESAMPLER_TAPS; t++) {
+            double x = (t - (half - 1)) - frac;
+            double sinc = (x == 0) ? 1.0 : sin(M_PI * AUDIO_RESAMPLER_CUTOFF * x) / (M_PI * AUDIO_RESAMPLER_CUTOFF * x);
+            double w = x / half;
+            double window = (fabs(w) >= 1) ? 0 : audio_resampler_bessel_i0(AUDIO_RESAMPLER_KAISER_BETA * sqrt(1 - w * w)) /
+                audio_resampler_bessel_i0(AUDIO_RESAMPLER_KAISER_BETA);
+            coefs[p * AUDIO_RESAMPLER_TAPS + t] = (float) (sinc * window);
+            sum += sinc * window;
+        }
+        /* unity gain at DC for every phase */
+        for (int t = 0; t < AUDIO_RESAMPLER_TAPS; t++) {
+            coefs[p * AUDIO_RESAMPLER_TAPS + t] = (float) (coefs[p * AUDIO_RESAMPLER_TAPS + t] / sum);
+        }
+    }
+}
+
+audio_resampler_t *
+audio_resampler_init(int channels, int max_input_samples)
+{
+    audio_resampler_t *resampler;
+
+    if (channels < 1 || channels > AUDIO_RESAMPLER_MAX_CHANNELS || max_input_samples < 1) {
+        return NULL;
+    }
+    resampler = calloc(1, sizeof(audio_resampler_t));
+    if (!resampler) {
+        return NULL;
+    }
+    resampler->channels = channels;
+    resampler->max_input_samples = max_input_samples;
+    resampler->ratio = 1.0;
+    resampler->max_output_samples = (int) (max_input_samples * (1 + AUDIO_RESAMPLER_MAX_RATIO_DEVIATION)) + 2;
+    resampler->coefs = malloc((AUDIO_RESAMPLER_PHASES + 1) * AUDIO_RESAMPLER_TAPS * sizeof(float));
+    resampler->out = malloc((size_t) resampler->max_output_samples * channels * sizeof(int16_t));
+    for (int ch = 0; ch < channels; ch++) {
+        resampler->history[ch] = malloc((AUDIO_RESAMPLER_TAPS + max_input_samples) * sizeof(float));
+        if (!resampler->history[ch]) {
+            audio_resampler_destroy(resampler);
+            return NULL;
+        }
+    }
+    if (!resampler->coefs || !resampler->out) {
+        audio_resampler_destroy(resampler);
+        return NULL;
+    }
+    audio_resampler_init_coefs(resampler->coefs);
+    audio_resampler_reset(resampler);
+    return resampler;
+}
+
+/* ratio is the number of output samples per input sample */
+void
+audio_resampler_set_ratio(audio_resampler_t *resampler, double ratio)
+{
+    assert(resampler);
+    if (ratio > 1 + AUDIO_RESAMPLER_MAX_RATIO_DEVIATION) {
+        ratio = 1 + AUDIO_RESAMPLER_MAX_RATIO_DEVIATION;
+    } else if (ratio < 1 - AUDIO_RESAMPLER_MAX_RATIO_DEVIATION) {
+        ratio = 1 - AUDIO_RESAMPLER_MAX_RATIO_DEVIATION;
+    }
+    resampler->ratio = ratio;
+}
+
+/* starts again from silence, e.g. after a flush */
+void
+audio_resampler_reset(audio_resampler_t *resampler)
+{
+    assert(resampler);
+    for (int ch = 0; ch < resampler->channels; ch++) {
+        memset(resampler->history[ch], 0, AUDIO_RESAMPLER_TAPS * sizeof(float));
+    }
+    resampler->history_len = AUDIO_RESAMPLER_TAPS;
+    resampler->position = AUDIO_RESAMPLER_TAPS / 2;
+}
+
+static inline int16_t
+audio_resampler_clip(float value)
+{
+    if (value >= 32767.0f) {
+        return 32767;
+    } else if (value <= -32768.0f) {
+        return -32768;
+    }
+    return (int16_t) lrintf(value);
+}
+
+/* taps = c0 + (c1 - c0) * t: the coefficients between two phases */
+static inline void
+audio_resampler_interpolate(float *taps, const float *c0, const float *c1, float t)
+{
+#ifdef AUDIO_RESAMPLER_VECTOR_SIZE
+    for (int k = 0; k < AUDIO_RESAMPLER_TAPS; k += AUDIO_RESAMPLER_VECTOR_SIZE) {
+        audio_resampler_vector_t a, b;
+        memcpy(&a, c0 + k, sizeof(a));
+        memcpy(&b, c1 + k, sizeof(b));
+        a += (b - a) * t;
+        memcpy(taps + k, &a, sizeof(a));
+    }
+#else
+    for (int k = 0; k < AUDIO_RESAMPLER_TAPS; k++) {
+        taps[k] = c0[k] + (c1[k] - c0[k]) * t;
+    }
+#endif
+}
+
+static inline float
+audio_resampler_dot(const float *taps, const float *x)
+{
+#ifdef AUDIO_RESAMPLER_VECTOR_SIZE
+    audio_resampler_vector_t sum = { 0 };
+    for (int k = 0; k < AUDIO_RESAMPLER_TAPS; k += AUDIO_RESAMPLER_VECTOR_SIZE) {
+        audio_resampler_vector_t a, b;
+        memcpy(&a, taps + k, sizeof(a));
+        memcpy(&b, x + k, sizeof(b));
+        sum += a * b;
+    }
+    float total = 0;
+    for (int k = 0; k < AUDIO_RESAMPLER_VECTOR_SIZE; k++) {
+        total += sum[k];
+    }
+    return total;
+#else
+    float sum = 0;
+    for (int k = 0; k < AUDIO_RESAMPLER_TAPS; k++) {
+        sum += taps[k] * x[k];
+    }
+    return sum;
+#endif
+}
+
+/* resamples count input samples per channel into a buffer owned by the resampler (valid until the next call); *
+ * returns the number of output samples per channel                                                            */
+int
+audio_resampler_process(audio_resampler_t *resampler, const int16_t *in, int count, int16_t **out)
+{
+    float taps[AUDIO_RESAMPLER_TAPS];
+    int channels = resampler->channels;
+    int half = AUDIO_RESAMPLER_TAPS / 2;
+    int produced = 0;
+
+    assert(count <= resampler->max_input_samples);
+    for (int ch = 0; ch < channels; ch++) {
+        float *history = resampler->history[ch] + resampler->history_len;
+        for (int i = 0; i < count; i++) {
+            history[i] = in[i * channels + ch];
+        }
+    }
+    int available = resampler->history_len + count;
+    double step = 1.0 / resampler->ratio;
+
+    /* output sample n is centred at position, which needs input up to position + half */
+    while (resampler->position + half < available && produced < resampler->max_output_samples) {
+        int index = (int) resampler->position;
+        double phase = (resampler->position - index) * AUDIO_RESAMPLER_PHASES;
+        int p = (int) phase;
+        float t = (float) (phase - p);
+        const float *c0 = resampler->coefs + p * AUDIO_RESAMPLER_TAPS;
+        const float *c1 = c0 + AUDIO_RESAMPLER_TAPS;
+        audio_resampler_interpolate(taps, c0, c1, t);
+        for (int ch = 0; ch < channels; ch++) {
+            const float *x = resampler->history[ch] + index - (half - 1);
+            resampler->out[produced * channels + ch] = audio_resampler_clip(audio_resampler_dot(taps, x));
+        }
+        produced++;
+        resampler->position += step;
+    }
+
+    /* keep the last AUDIO_RESAMPLER_TAPS input samples */
+    int drop = available - AUDIO_RESAMPLER_TAPS;
+    for (int ch = 0; ch < channels; ch++) {
+        memmove(resampler->history[ch], resampler->history[ch] + drop, AUDIO_RESAMPLER_TAPS * sizeof(float));
+    }
+    resampler->history_len = AUDIO_RESAMPLER_TAPS;
+    resampler->position -= drop;
+    *out = resampler->out;
+    return produced;
+}
+
+void
+audio_resampler_destroy(audio_resampler_t *resampler)
+{
+    if (resampler) {
+        free(resampler->coefs);
+        free(resampler->out);
+        for (int ch = 0; ch < AUDIO_RESAMPLER_MAX_CHANNELS; ch++) {
+            free(resampler->history[ch]);
+        }
+        free(resampler);
+    }
+}
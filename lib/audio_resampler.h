@@ -0,0 +1,35 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef AUDIO_RESAMPLER_H
+#define AUDIO_RESAMPLER_H
+
+#include <stdint.h>
+
+/* Resampling of interleaved 16-bit PCM by a ratio close to 1 (output samples per input sample), *
+ * to compensate the drift between the sender's clock and ours.  A polyphase windowed-sinc       *
+ * filter of AUDIO_RESAMPLER_TAPS taps, with AUDIO_RESAMPLER_PHASES phases interpolated          *
+ * linearly.  The output is delayed by AUDIO_RESAMPLER_TAPS / 2 input samples.                   */
+
+#define AUDIO_RESAMPLER_TAPS 24
+#define AUDIO_RESAMPLER_PHASES 128
+#define AUDIO_RESAMPLER_MAX_RATIO_DEVIATION 0.01
+
+typedef struct audio_resampler_s audio_resampler_t;
+
+audio_resampler_t *audio_resampler_init(int channels, int max_input_samples);
+void audio_resampler_set_ratio(audio_resampler_t *resampler, double ratio);
+int audio_resampler_process(audio_resampler_t *resampler, const int16_t *in, int count, int16_t **out);
+void audio_resampler_reset(audio_resampler_t *resampler);
+void audio_resampler_destroy(audio_resampler_t *resampler);
+
+#endif //AUDIO_RESAMPLER_H
@@ -19,6 +19,7 @@
 #define SECOND_IN_NSECS 1000000000UL
 
 #include <time.h>
+#include <string.h>
 #ifdef _WIN32
 # include <winsock2.h>
 #else
@@ -44,26 +45,33 @@
 #endif
 
 // The functions in this file assume a little endian cpu architecture!
+// Values are copied with memcpy, as the buffers (e.g. mirror frame headers) need not be aligned.
 
 /**
  * Reads a little endian unsigned 16 bit integer from the buffer at position offset
  */
 uint16_t byteutils_get_short(unsigned char* b, int offset) {
-    return *((uint16_t*)(b + offset));
+    uint16_t value;
+    memcpy(&value, b + offset, sizeof(value));
+    return value;
 }
 
 /**
  * Reads a little endian unsigned 32 bit integer from the buffer at position offset
  */
 uint32_t byteutils_get_int(unsigned char* b, int offset) {
-    return *((uint32_t*)(b + offset));
+    uint32_t value;
+    memcpy(&value, b + offset, sizeof(value));
+    return value;
 }
 
 /**
  * Reads a little endian unsigned 64 bit integer from the buffer at position offset
  */
 uint64_t byteutils_get_long(unsigned char* b, int offset) {
-    return *((uint64_t*)(b + offset));
+    uint64_t value;
+    memcpy(&value, b + offset, sizeof(value));
+    return value;
 }
 
 /**
@@ -91,14 +99,16 @@ uint64_t byteutils_get_long_be(unsigned char* b, int offset) {
  * Reads a float from the buffer at position offset
  */
 float byteutils_get_float(unsigned char* b, int offset) {
-    return *((float*)(b + offset));
+    float value;
+    memcpy(&value, b + offset, sizeof(value));
+    return value;
 }
 
 /**
  * Writes a little endian unsigned 32 bit integer to the buffer at position offset
  */
 void byteutils_put_int(unsigned char* b, int offset, uint32_t value) {
-    *((uint32_t*)(b + offset)) = value;
+    memcpy(b + offset, &value, sizeof(value));
 }
 
 /**
@@ -151,6 +151,14 @@ void aes_ctr_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len) {
     aes_encrypt(ctx, in, out, len);
 }
 
+/* restarts the keystream at the given 128-bit counter block, keeping the key */
+void aes_ctr_set_counter(aes_ctx_t *ctx, const uint8_t *counter) {
+    if (!EVP_EncryptInit_ex(ctx->cipher_ctx, NULL, NULL, NULL, counter)) {
+        handle_error(__func__);
+    }
+    ctx->block_offset = 0;
+}
+
 void aes_ctr_reset(aes_ctx_t *ctx) {
     aes_reset(ctx, EVP_aes_128_ctr(), AES_ENCRYPT);
 }
@@ -175,6 +183,21 @@ void aes_cbc_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len) {
     aes_decrypt(ctx, in, out, len);
 }
 
+/* decrypts a message that starts with the initial IV: only the IV is reset, *
+ * the expanded key is kept, unlike aes_cbc_decrypt() + aes_cbc_reset()     */
+void aes_cbc_decrypt_message(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len) {
+    int out_len = 0;
+    assert(ctx->direction == AES_DECRYPT);
+    assert(len % AES_128_BLOCK_SIZE == 0);
+    if (!EVP_DecryptInit_ex(ctx->cipher_ctx, NULL, NULL, NULL, ctx->iv)) {
+        handle_error(__func__);
+    }
+    if (!EVP_DecryptUpdate(ctx->cipher_ctx, out, &out_len, in, len)) {
+        handle_error(__func__);
+    }
+    assert(out_len == len);
+}
+
 void aes_cbc_reset(aes_ctx_t *ctx) {
     aes_reset(ctx, EVP_aes_128_cbc(), ctx->direction);
 }
@@ -46,12 +46,14 @@ void aes_ctr_reset(aes_ctx_t *ctx);
 void aes_ctr_encrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_ctr_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_ctr_start_fresh_block(aes_ctx_t *ctx);
+void aes_ctr_set_counter(aes_ctx_t *ctx, const uint8_t *counter);
 void aes_ctr_destroy(aes_ctx_t *ctx);
 
 aes_ctx_t *aes_cbc_init(const uint8_t *key, const uint8_t *iv, aes_direction_t direction);
 void aes_cbc_reset(aes_ctx_t *ctx);
 void aes_cbc_encrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_cbc_decrypt(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
+void aes_cbc_decrypt_message(aes_ctx_t *ctx, const uint8_t *in, uint8_t *out, int len);
 void aes_cbc_destroy(aes_ctx_t *ctx);
 
 // X25519
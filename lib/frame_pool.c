@@ -0,0 +1,181 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "frame_pool.h"
+#include "threads.h"
+
+/* maximum number of idle buffers kept in each size class */
+#define FRAME_POOL_MAX_IDLE 8
+
+/* the block header sits in front of the data, padded to keep the data cache-line aligned relative to the block */
+#define FRAME_POOL_HEADER_SIZE 64
+
+typedef struct frame_pool_block_s {
+    struct frame_pool_block_s *next;
+    int size_class;
+} frame_pool_block_t;
+
+typedef struct frame_pool_class_s {
+    frame_pool_block_t *idle;
+    int idle_count;
+} frame_pool_class_t;
+
+struct frame_pool_s {
+    logger_t *logger;
+    mutex_handle_t mutex;
+    frame_pool_class_t classes[FRAME_POOL_CLASSES];
+
+    /* statistics */
+    unsigned long gets;
+    unsigned long allocations;
+    int largest_class;
+};
+
+static int
+frame_pool_size_class(size_t size)
+{
+    size_t capacity = FRAME_POOL_MIN_SIZE;
+    for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+        if (size <= capacity) {
+            return i;
+        }
+        capacity <<= 1;
+    }
+    return -1;
+}
+
+static inline unsigned char *
+frame_pool_block_data(frame_pool_block_t *block)
+{
+    return (unsigned char *) block + FRAME_POOL_HEADER_SIZE;
+}
+
+static inline frame_pool_block_t *
+frame_pool_data_block(unsigned char *data)
+{
+    return (frame_pool_block_t *) (data - FRAME_POOL_HEADER_SIZE);
+}
+
+frame_pool_t *
+frame_pool_init(logger_t *logger)
+{
+    frame_pool_t *frame_pool;
+    assert(sizeof(frame_pool_block_t) <= FRAME_POOL_HEADER_SIZE);
+    frame_pool = calloc(1, sizeof(frame_pool_t));
+    if (!frame_pool) {
+        return NULL;
+    }
+    frame_pool->logger = logger;
+    frame_pool->largest_class = -1;
+    MUTEX_CREATE(frame_pool->mutex);
+    return frame_pool;
+}
+
+/* returns a buffer with at least size bytes, or NULL if size is too large */
+unsigned char *
+frame_pool_get(frame_pool_t *frame_pool, size_t size)
+{
+    frame_pool_block_t *block = NULL;
+    int size_class;
+
+    assert(frame_pool);
+    size_class = frame_pool_size_class(size);
+    if (size_class < 0) {
+        logger_log(frame_pool->logger, LOGGER_ERR, "frame_pool: requested buffer of %zu bytes is too large", size);
+        return NULL;
+    }
+
+    MUTEX_LOCK(frame_pool->mutex);
+    frame_pool->gets++;
+    /* a larger idle buffer is preferred to a new allocation */
+    for (int i = size_class; i < FRAME_POOL_CLASSES; i++) {
+        frame_pool_class_t *pool_class = &frame_pool->classes[i];
+        if (pool_class->idle) {
+            block = pool_class->idle;
+            pool_class->idle = block->next;
+            pool_class->idle_count--;
+            break;
+        }
+    }
+    if (!block) {
+        frame_pool->allocations++;
+        if (size_class > frame_pool->largest_class) {
+            frame_pool->largest_class = size_class;
+        }
+    }
+    MUTEX_UNLOCK(frame_pool->mutex);
+
+    if (!block) {
+        block = malloc(FRAME_POOL_HEADER_SIZE + ((size_t) FRAME_POOL_MIN_SIZE << size_class));
+        if (!block) {
+            logger_log(frame_pool->logger, LOGGER_ERR, "frame_pool: could not allocate buffer of %zu bytes", size);
+            return NULL;
+        }
+        block->size_class = size_class;
+        logger_log(frame_pool->logger, LOGGER_DEBUG, "frame_pool: new %zu byte buffer (size class %d)",
+                   (size_t) FRAME_POOL_MIN_SIZE << size_class, size_class);
+    }
+    block->next = NULL;
+    return frame_pool_block_data(block);
+}
+
+void
+frame_pool_put(frame_pool_t *frame_pool, unsigned char *data)
+{
+    frame_pool_block_t *block;
+    frame_pool_class_t *pool_class;
+
+    assert(frame_pool);
+    if (!data) {
+        return;
+    }
+    block = frame_pool_data_block(data);
+    assert(block->size_class >= 0 && block->size_class < FRAME_POOL_CLASSES);
+    pool_class = &frame_pool->classes[block->size_class];
+
+    MUTEX_LOCK(frame_pool->mutex);
+    if (pool_class->idle_count < FRAME_POOL_MAX_IDLE) {
+        block->next = pool_class->idle;
+        pool_class->idle = block;
+        pool_class->idle_count++;
+        block = NULL;
+    }
+    MUTEX_UNLOCK(frame_pool->mutex);
+
+    free(block);
+}
+
+void
+frame_pool_destroy(frame_pool_t *frame_pool)
+{
+    if (frame_pool) {
+        if (frame_pool->gets) {
+            logger_log(frame_pool->logger, LOGGER_DEBUG, "frame_pool: %lu buffer requests, %lu allocations, largest buffer %zu bytes",
+                       frame_pool->gets, frame_pool->allocations,
+                       frame_pool->largest_class < 0 ? 0 : (size_t) FRAME_POOL_MIN_SIZE << frame_pool->largest_class);
+        }
+        for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+            frame_pool_block_t *block = frame_pool->classes[i].idle;
+            while (block) {
+                frame_pool_block_t *next = block->next;
+                free(block);
+                block = next;
+            }
+        }
+        MUTEX_DESTROY(frame_pool->mutex);
+        free(frame_pool);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stddef.h>
+#include "logger.h"
+
+/* Per-session pool of video frame buffers.  Buffers are grouped in power-of-two
+ * size classes starting at FRAME_POOL_MIN_SIZE; a class is only populated once a
+ * frame of that size has been seen, so the pool grows to the largest frame size
+ * actually received.  Buffers returned by frame_pool_get() must be handed back
+ * with frame_pool_put(); get and put may be called from different threads.     */
+
+#define FRAME_POOL_MIN_SIZE   (64 * 1024)
+#define FRAME_POOL_CLASSES    12          /* 64 kB ... 128 MB */
+
+typedef struct frame_pool_s frame_pool_t;
+
+frame_pool_t *frame_pool_init(logger_t *logger);
+unsigned char *frame_pool_get(frame_pool_t *frame_pool, size_t size);
+void frame_pool_put(frame_pool_t *frame_pool, unsigned char *data);
+void frame_pool_destroy(frame_pool_t *frame_pool);
+
+#endif //FRAME_POOL_H
@@ -18,6 +18,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "httpd.h"
@@ -26,12 +29,32 @@
 #include "compat.h"
 #include "logger.h"
 
+/* On Linux, the thread waits with epoll, which keeps the set of sockets between waits and has *
+ * no FD_SETSIZE limit on descriptor numbers.  Elsewhere, it waits with select(), and          *
+ * connections with descriptors that do not fit in an fd_set are refused.                      */
+#ifdef __linux__
+#include <sys/epoll.h>
+#define HTTPD_USE_EPOLL
+#endif
+
+#ifdef HTTPD_USE_EPOLL
+/* events handled per epoll_wait() call, and the epoll data of the sockets that are not connections */
+#define HTTPD_MAX_EVENTS 64
+#define HTTPD_EVENT_WAKE 0xffffffffu
+#define HTTPD_EVENT_SERVER4 0xfffffffeu
+#define HTTPD_EVENT_SERVER6 0xfffffffdu
+#endif
+
 struct http_connection_s {
     int connected;
 
     int socket_fd;
     void *user_data;
     http_request_t *request;
+
+    /* address of the client (4 bytes for IPv4, 16 for IPv6) */
+    unsigned char remote[16];
+    int remote_len;
 };
 typedef struct http_connection_s http_connection_t;
 
@@ -52,6 +75,16 @@ struct httpd_s {
     /* Server fds for accepting connections */
     int server_fd4;
     int server_fd6;
+
+#ifdef HTTPD_USE_EPOLL
+    /* the server fds are only in the epoll set while there is room for more connections */
+    int epoll_fd;
+    bool accepting;
+#endif
+#ifndef _WIN32
+    /* written to by httpd_stop() to wake the thread */
+    int wake_pipe[2];
+#endif
 };
 
 httpd_t *
@@ -79,6 +112,15 @@ httpd_init(logger_t *logger, httpd_callbacks_t *callbacks, int max_connections)
     /* Use the logger provided */
     httpd->logger = logger;
 
+#ifndef _WIN32
+    if (pipe(httpd->wake_pipe) < 0) {
+        logger_log(logger, LOGGER_ERR, "httpd could not create wake pipe %d %s", errno, strerror(errno));
+        free(httpd->connections);
+        free(httpd);
+        return NULL;
+    }
+#endif
+
     /* Save callback pointers */
     memcpy(&httpd->callbacks, callbacks, sizeof(httpd_callbacks_t));
 
@@ -95,11 +137,48 @@ httpd_destroy(httpd_t *httpd)
     if (httpd) {
         httpd_stop(httpd);
 
+#ifndef _WIN32
+        close(httpd->wake_pipe[0]);
+        close(httpd->wake_pipe[1]);
+#endif
         free(httpd->connections);
         free(httpd);
     }
 }
 
+#ifdef HTTPD_USE_EPOLL
+static int
+httpd_watch(httpd_t *httpd, int op, int fd, uint32_t data)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = data;
+    if (epoll_ctl(httpd->epoll_fd, op, fd, &event) < 0) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd epoll_ctl error on socket %d: %s", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* watches the server sockets for new connections only while there is room for them */
+static void
+httpd_set_accepting(httpd_t *httpd, bool accepting)
+{
+    if (accepting == httpd->accepting) {
+        return;
+    }
+    int op = (accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL);
+    if (httpd->server_fd4 != -1) {
+        httpd_watch(httpd, op, httpd->server_fd4, HTTPD_EVENT_SERVER4);
+    }
+    if (httpd->server_fd6 != -1) {
+        httpd_watch(httpd, op, httpd->server_fd6, HTTPD_EVENT_SERVER6);
+    }
+    httpd->accepting = accepting;
+}
+#endif
+
 static void
 httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
 {
@@ -108,6 +187,9 @@ httpd_remove_connection(httpd_t *httpd, http_connection_t *connection)
         connection->request = NULL;
     }
     httpd->callbacks.conn_destroy(connection->user_data);
+#ifdef HTTPD_USE_EPOLL
+    epoll_ctl(httpd->epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
+#endif
     shutdown(connection->socket_fd, SHUT_WR);
     closesocket(connection->socket_fd);
     connection->connected = 0;
@@ -130,6 +212,12 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
         logger_log(httpd->logger, LOGGER_INFO, "Max connections reached");
         return -1;
     }
+#if !defined(HTTPD_USE_EPOLL) && !defined(_WIN32)
+    if (fd >= FD_SETSIZE) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd cannot select() on socket %d (FD_SETSIZE %d)", fd, FD_SETSIZE);
+        return -1;
+    }
+#endif
 
     user_data = httpd->callbacks.conn_init(httpd->callbacks.opaque, local, local_len, remote, remote_len);
     if (!user_data) {
@@ -137,10 +225,19 @@ httpd_add_connection(httpd_t *httpd, int fd, unsigned char *local, int local_len
         return -1;
     }
 
+#ifdef HTTPD_USE_EPOLL
+    if (httpd_watch(httpd, EPOLL_CTL_ADD, fd, (uint32_t) i) < 0) {
+        httpd->callbacks.conn_destroy(user_data);
+        return -1;
+    }
+#endif
+
     httpd->open_connections++;
     httpd->connections[i].socket_fd = fd;
     httpd->connections[i].connected = 1;
     httpd->connections[i].user_data = user_data;
+    httpd->connections[i].remote_len = (remote_len <= (int) sizeof(httpd->connections[i].remote) ? remote_len : 0);
+    memcpy(httpd->connections[i].remote, remote, httpd->connections[i].remote_len);
     return 0;
 }
 
@@ -176,17 +273,17 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     remote = netutils_get_address(&remote_saddr, &remote_len);
 
 #ifdef NOHOLD
-    /* remove existing connections to make way for new connections:
-     * this will only occur if max_connections > 2 */
-    if (httpd->open_connections >= 2)  {
-        logger_log(httpd->logger, LOGGER_INFO, "Destroying current connections to allow connection by new client");
-        for (int i = 0; i<httpd->max_connections; i++) {
-            http_connection_t *connection = &httpd->connections[i];
-            if (!connection->connected) {
-                continue;
-            }
-	    httpd_remove_connection(httpd, connection);
+    /* a new client takes over: remove the connections of other clients, *
+     * but not the other connections of the same client                  */
+    for (int i = 0; i<httpd->max_connections; i++) {
+        http_connection_t *connection = &httpd->connections[i];
+        if (!connection->connected ||
+            (connection->remote_len == remote_len && !memcmp(connection->remote, remote, remote_len))) {
+            continue;
         }
+        logger_log(httpd->logger, LOGGER_INFO, "Destroying connection on socket %d to allow connection by new client",
+                   connection->socket_fd);
+        httpd_remove_connection(httpd, connection);
     }
 #endif
     
@@ -199,159 +296,264 @@ httpd_accept_connection(httpd_t *httpd, int server_fd, int is_ipv6)
     return 1;
 }
 
-static THREAD_RETVAL
-httpd_thread(void *arg)
+/* reads from a connection that select() or epoll reported readable, and handles its request once complete */
+static void
+httpd_read_connection(httpd_t *httpd, http_connection_t *connection)
 {
-    httpd_t *httpd = arg;
     char buffer[1024];
-    int i;
+    int ret;
 
-    assert(httpd);
+    /* If not in the middle of request, allocate one */
+    if (!connection->request) {
+        connection->request = http_request_init();
+        assert(connection->request);
+    }
 
-    while (1) {
-        fd_set rfds;
-        struct timeval tv;
-        int nfds=0;
-        int ret;
+    logger_log(httpd->logger, LOGGER_DEBUG, "httpd receiving on socket %d", connection->socket_fd);
+    ret = recv(connection->socket_fd, buffer, sizeof(buffer), 0);
+    if (ret == 0) {
+        logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
+        httpd_remove_connection(httpd, connection);
+        return;
+    } else if (ret < 0) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in receiving on socket %d", connection->socket_fd);
+        httpd_remove_connection(httpd, connection);
+        return;
+    }
 
-        MUTEX_LOCK(httpd->run_mutex);
-        if (!httpd->running) {
-            MUTEX_UNLOCK(httpd->run_mutex);
-            break;
-        }
-        MUTEX_UNLOCK(httpd->run_mutex);
+    /* Parse HTTP request from data read from connection */
+    http_request_add_data(connection->request, buffer, ret);
+    if (http_request_has_error(connection->request)) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in parsing: %s", http_request_get_error_name(connection->request));
+        httpd_remove_connection(httpd, connection);
+        return;
+    }
+
+    /* If request is finished, process and deallocate */
+    if (http_request_is_complete(connection->request)) {
+        http_response_t *response = NULL;
+        // Callback the received data to raop
+        httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
+        http_request_destroy(connection->request);
+        connection->request = NULL;
+
+        if (response) {
+            const char *data;
+            int datalen;
+            int written;
 
-        /* Set timeout value to 5ms */
-        tv.tv_sec = 1;
-        tv.tv_usec = 5000;
-
-        /* Get the correct nfds value and set rfds */
-        FD_ZERO(&rfds);
-        if (httpd->open_connections < httpd->max_connections) {
-            if (httpd->server_fd4 != -1) {
-                FD_SET(httpd->server_fd4, &rfds);
-                if (nfds <= httpd->server_fd4) {
-                    nfds = httpd->server_fd4+1;
+            /* Get response data and datalen */
+            data = http_response_get_data(response, &datalen);
+
+            written = 0;
+            while (written < datalen) {
+                ret = send(connection->socket_fd, data+written, datalen-written, 0);
+                if (ret == -1) {
+                    logger_log(httpd->logger, LOGGER_ERR, "httpd error in sending data");
+                    break;
                 }
+                written += ret;
             }
-            if (httpd->server_fd6 != -1) {
-                FD_SET(httpd->server_fd6, &rfds);
-                if (nfds <= httpd->server_fd6) {
-                    nfds = httpd->server_fd6+1;
-                }
+
+            if (http_response_get_disconnect(response)) {
+                logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
+                httpd_remove_connection(httpd, connection);
             }
+        } else {
+            logger_log(httpd->logger, LOGGER_WARNING, "httpd didn't get response");
         }
-        for (i=0; i<httpd->max_connections; i++) {
-            int socket_fd;
-            if (!httpd->connections[i].connected) {
-                continue;
+        http_response_destroy(response);
+    } else {
+        logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
+    }
+}
+
+#ifndef _WIN32
+static void
+httpd_read_wake_pipe(httpd_t *httpd)
+{
+    char c;
+    if (read(httpd->wake_pipe[0], &c, 1) < 0) {
+        logger_log(httpd->logger, LOGGER_WARNING, "httpd could not read wake pipe %d %s", errno, strerror(errno));
+    }
+}
+#endif
+
+#ifdef HTTPD_USE_EPOLL
+/* waits for and handles the events on the sockets; returns -1 if the thread must stop */
+static int
+httpd_wait_epoll(httpd_t *httpd)
+{
+    struct epoll_event events[HTTPD_MAX_EVENTS];
+    bool accept4 = false, accept6 = false;
+    int ret, i;
+
+    httpd_set_accepting(httpd, httpd->open_connections < httpd->max_connections);
+
+    /* no timeout: httpd_stop() wakes the thread through the pipe */
+    ret = epoll_wait(httpd->epoll_fd, events, HTTPD_MAX_EVENTS, -1);
+    if (ret == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in epoll_wait");
+        return -1;
+    }
+
+    /* new connections are accepted after the others are read, as connection slots *
+     * (and socket numbers) may be reused                                           */
+    for (i = 0; i < ret; i++) {
+        uint32_t data = events[i].data.u32;
+        if (data == HTTPD_EVENT_WAKE) {
+            httpd_read_wake_pipe(httpd);
+        } else if (data == HTTPD_EVENT_SERVER4) {
+            accept4 = true;
+        } else if (data == HTTPD_EVENT_SERVER6) {
+            accept6 = true;
+        } else if (data < (uint32_t) httpd->max_connections && httpd->connections[data].connected) {
+            httpd_read_connection(httpd, &httpd->connections[data]);
+        }
+    }
+    if (accept4 && httpd->open_connections < httpd->max_connections &&
+        httpd_accept_connection(httpd, httpd->server_fd4, 0) == -1) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv4");
+        return -1;
+    }
+    if (accept6 && httpd->open_connections < httpd->max_connections &&
+        httpd_accept_connection(httpd, httpd->server_fd6, 1) == -1) {
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv6");
+        return -1;
+    }
+    return 0;
+}
+#else
+/* waits for and handles the events on the sockets; returns -1 if the thread must stop */
+static int
+httpd_wait_select(httpd_t *httpd)
+{
+    fd_set rfds;
+    struct timeval *timeout = NULL;
+    int nfds=0;
+    int ret, i;
+
+    /* Get the correct nfds value and set rfds */
+    FD_ZERO(&rfds);
+    if (httpd->open_connections < httpd->max_connections) {
+        if (httpd->server_fd4 != -1) {
+            FD_SET(httpd->server_fd4, &rfds);
+            if (nfds <= httpd->server_fd4) {
+                nfds = httpd->server_fd4+1;
             }
-            socket_fd = httpd->connections[i].socket_fd;
-            FD_SET(socket_fd, &rfds);
-            if (nfds <= socket_fd) {
-                nfds = socket_fd+1;
+        }
+        if (httpd->server_fd6 != -1) {
+            FD_SET(httpd->server_fd6, &rfds);
+            if (nfds <= httpd->server_fd6) {
+                nfds = httpd->server_fd6+1;
             }
         }
-
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
-        if (ret == 0) {
-            /* Timeout happened */
+    }
+    for (i=0; i<httpd->max_connections; i++) {
+        int socket_fd;
+        if (!httpd->connections[i].connected) {
             continue;
-        } else if (ret == -1) {
-            logger_log(httpd->logger, LOGGER_ERR, "httpd error in select");
-            break;
         }
+        socket_fd = httpd->connections[i].socket_fd;
+        FD_SET(socket_fd, &rfds);
+        if (nfds <= socket_fd) {
+            nfds = socket_fd+1;
+        }
+    }
+#ifdef _WIN32
+    /* select() on Windows only accepts sockets, so the thread polls the running flag */
+    struct timeval tv;
+    tv.tv_sec = 1;
+    tv.tv_usec = 5000;
+    timeout = &tv;
+#else
+    /* no timeout: httpd_stop() wakes the thread through the pipe */
+    FD_SET(httpd->wake_pipe[0], &rfds);
+    if (nfds <= httpd->wake_pipe[0]) {
+        nfds = httpd->wake_pipe[0]+1;
+    }
+#endif
 
-        if (httpd->open_connections < httpd->max_connections &&
-            httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
-            ret = httpd_accept_connection(httpd, httpd->server_fd4, 0);
-            if (ret == -1) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv4");
-                break;
-            } else if (ret == 0) {
-                continue;
-            }
+    ret = select(nfds, &rfds, NULL, NULL, timeout);
+    if (ret == 0) {
+        /* Timeout happened */
+        return 0;
+    } else if (ret == -1) {
+        if (errno == EINTR) {
+            return 0;
         }
-        if (httpd->open_connections < httpd->max_connections &&
-            httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds)) {
-            ret = httpd_accept_connection(httpd, httpd->server_fd6, 1);
-            if (ret == -1) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv6");
-                break;
-            } else if (ret == 0) {
-                continue;
-            }
+        logger_log(httpd->logger, LOGGER_ERR, "httpd error in select");
+        return -1;
+    }
+#ifndef _WIN32
+    if (FD_ISSET(httpd->wake_pipe[0], &rfds)) {
+        httpd_read_wake_pipe(httpd);
+    }
+#endif
+
+    if (httpd->open_connections < httpd->max_connections &&
+        httpd->server_fd4 != -1 && FD_ISSET(httpd->server_fd4, &rfds)) {
+        ret = httpd_accept_connection(httpd, httpd->server_fd4, 0);
+        if (ret == -1) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv4");
+            return -1;
+        } else if (ret == 0) {
+            return 0;
         }
-        for (i=0; i<httpd->max_connections; i++) {
-            http_connection_t *connection = &httpd->connections[i];
+    }
+    if (httpd->open_connections < httpd->max_connections &&
+        httpd->server_fd6 != -1 && FD_ISSET(httpd->server_fd6, &rfds)) {
+        ret = httpd_accept_connection(httpd, httpd->server_fd6, 1);
+        if (ret == -1) {
+            logger_log(httpd->logger, LOGGER_ERR, "httpd error in accept ipv6");
+            return -1;
+        } else if (ret == 0) {
+            return 0;
+        }
+    }
+    for (i=0; i<httpd->max_connections; i++) {
+        http_connection_t *connection = &httpd->connections[i];
 
-            if (!connection->connected) {
-                continue;
-            }
-            if (!FD_ISSET(connection->socket_fd, &rfds)) {
-                continue;
-            }
+        if (!connection->connected) {
+            continue;
+        }
+        if (!FD_ISSET(connection->socket_fd, &rfds)) {
+            continue;
+        }
+        httpd_read_connection(httpd, connection);
+    }
+    return 0;
+}
+#endif
 
-            /* If not in the middle of request, allocate one */
-            if (!connection->request) {
-                connection->request = http_request_init();
-                assert(connection->request);
-            }
+static THREAD_RETVAL
+httpd_thread(void *arg)
+{
+    httpd_t *httpd = arg;
+    int i;
 
-            logger_log(httpd->logger, LOGGER_DEBUG, "httpd receiving on socket %d", connection->socket_fd);
-            ret = recv(connection->socket_fd, buffer, sizeof(buffer), 0);
-            if (ret == 0) {
-                logger_log(httpd->logger, LOGGER_INFO, "Connection closed for socket %d", connection->socket_fd);
-                httpd_remove_connection(httpd, connection);
-                continue;
-            }
+    assert(httpd);
 
-            /* Parse HTTP request from data read from connection */
-            http_request_add_data(connection->request, buffer, ret);
-            if (http_request_has_error(connection->request)) {
-                logger_log(httpd->logger, LOGGER_ERR, "httpd error in parsing: %s", http_request_get_error_name(connection->request));
-                httpd_remove_connection(httpd, connection);
-                continue;
-            }
+    while (1) {
+        int ret;
 
-            /* If request is finished, process and deallocate */
-            if (http_request_is_complete(connection->request)) {
-                http_response_t *response = NULL;
-                // Callback the received data to raop
-                httpd->callbacks.conn_request(connection->user_data, connection->request, &response);
-                http_request_destroy(connection->request);
-                connection->request = NULL;
-
-                if (response) {
-                    const char *data;
-                    int datalen;
-                    int written;
-                    int ret;
-
-                    /* Get response data and datalen */
-                    data = http_response_get_data(response, &datalen);
-
-                    written = 0;
-                    while (written < datalen) {
-                        ret = send(connection->socket_fd, data+written, datalen-written, 0);
-                        if (ret == -1) {
-                            logger_log(httpd->logger, LOGGER_ERR, "httpd error in sending data");
-                            break;
-                        }
-                        written += ret;
-                    }
-
-                    if (http_response_get_disconnect(response)) {
-                        logger_log(httpd->logger, LOGGER_INFO, "Disconnecting on software request");
-                        httpd_remove_connection(httpd, connection);
-                    }
-                } else {
-                    logger_log(httpd->logger, LOGGER_WARNING, "httpd didn't get response");
-                }
-                http_response_destroy(response);
-            } else {
-                logger_log(httpd->logger, LOGGER_DEBUG, "Request not complete, waiting for more data...");
-            }
+        MUTEX_LOCK(httpd->run_mutex);
+        if (!httpd->running) {
+            MUTEX_UNLOCK(httpd->run_mutex);
+            break;
+        }
+        MUTEX_UNLOCK(httpd->run_mutex);
+
+#ifdef HTTPD_USE_EPOLL
+        ret = httpd_wait_epoll(httpd);
+#else
+        ret = httpd_wait_select(httpd);
+#endif
+        if (ret == -1) {
+            break;
         }
     }
 
@@ -377,6 +579,10 @@ httpd_thread(void *arg)
         closesocket(httpd->server_fd6);
         httpd->server_fd6 = -1;
     }
+#ifdef HTTPD_USE_EPOLL
+    close(httpd->epoll_fd);
+    httpd->epoll_fd = -1;
+#endif
 
     // Ensure running reflects the actual state
     MUTEX_LOCK(httpd->run_mutex);
@@ -429,6 +635,20 @@ httpd_start(httpd_t *httpd, unsigned short *port)
         MUTEX_UNLOCK(httpd->run_mutex);
         return -2;
     }
+#ifdef HTTPD_USE_EPOLL
+    httpd->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (httpd->epoll_fd == -1 || httpd_watch(httpd, EPOLL_CTL_ADD, httpd->wake_pipe[0], HTTPD_EVENT_WAKE) < 0) {
+        logger_log(httpd->logger, LOGGER_ERR, "Error initialising epoll: %s", strerror(errno));
+        if (httpd->epoll_fd != -1) {
+            close(httpd->epoll_fd);
+        }
+        closesocket(httpd->server_fd4);
+        closesocket(httpd->server_fd6);
+        MUTEX_UNLOCK(httpd->run_mutex);
+        return -2;
+    }
+    httpd->accepting = false;
+#endif
     logger_log(httpd->logger, LOGGER_INFO, "Initialized server socket(s)");
 
     /* Set values correctly and create new thread */
@@ -467,6 +687,13 @@ httpd_stop(httpd_t *httpd)
     httpd->running = 0;
     MUTEX_UNLOCK(httpd->run_mutex);
 
+#ifndef _WIN32
+    /* the thread waits for the sockets without a timeout, so it must be woken up */
+    if (write(httpd->wake_pipe[1], "", 1) < 0) {
+        logger_log(httpd->logger, LOGGER_WARNING, "httpd could not write wake pipe %d %s", errno, strerror(errno));
+    }
+#endif
+
     THREAD_JOIN(httpd->thread);
 
     MUTEX_LOCK(httpd->run_mutex);
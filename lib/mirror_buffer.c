@@ -19,6 +19,7 @@
 #include "raop_rtp.h"
 #include "raop_rtp.h"
 #include <stdint.h>
+#include <stdbool.h>
 #include "crypto.h"
 #include "compat.h"
 #include <math.h>
@@ -28,16 +29,67 @@
 #include <stdio.h>
 #include <inttypes.h>
 
-//#define DUMP_KEI_IV
+/* runs of at least this many bytes of whole blocks are decrypted in parallel, if  *
+ * worker threads have been started, in chunks of at least the minimum size.  A     *
+ * single recv() rarely returns this much, so raop_rtp_mirror holds back the        *
+ * decryption of a partly received frame until mirror_buffer_get_batch_size()      *
+ * bytes have arrived (or the frame is complete) when the workers are running.     */
+#define MIRROR_BUFFER_PARALLEL_MIN_SIZE (256 * 1024)
+#define MIRROR_BUFFER_PARALLEL_MIN_CHUNK (128 * 1024)
+
+/* a worker thread decrypts one chunk of a frame, starting at a given counter block */
+typedef struct mirror_buffer_worker_s {
+    mirror_buffer_t *mirror_buffer;
+    thread_handle_t thread;
+    aes_ctx_t *aes_ctx;
+
+    /* the job, protected by worker_mutex */
+    bool pending;
+    const unsigned char *input;
+    unsigned char *output;
+    int len;
+    uint8_t counter[AES_128_BLOCK_SIZE];
+} mirror_buffer_worker_t;
+
 struct mirror_buffer_s {
     logger_t *logger;
     aes_ctx_t *aes_ctx;
-    int nextDecryptCount;
-    uint8_t og[16];
+    /* The AES-CTR keystream runs on from one frame to the next.  The cipher context is  *
+     * always left at a block boundary; keystream holds the last block it produced for   *
+     * a partial block at the end of a frame, of which keystream_used bytes are used.    *
+     * blocks counts the keystream blocks produced since the start.                      */
+    uint8_t keystream[AES_128_BLOCK_SIZE];
+    int keystream_used;
+    uint64_t blocks;
+    uint8_t aeskey_video[AES_128_BLOCK_SIZE];
+    uint8_t aesiv_video[AES_128_BLOCK_SIZE];
     /* audio aes key is used in a hash for the video aes key and iv */
     unsigned char aeskey_audio[RAOP_AESKEY_LEN];
+
+    /* optional worker threads for parallel decryption of large frames */
+    mirror_buffer_worker_t *workers;
+    int num_workers;
+    int jobs_pending;
+    bool workers_stop;
+    mutex_handle_t worker_mutex;
+    cond_handle_t work_cond;
+    cond_handle_t done_cond;
 };
 
+/* sets counter to the counter block for keystream block number blocks */
+static void
+mirror_buffer_get_counter(mirror_buffer_t *mirror_buffer, uint64_t blocks, uint8_t *counter)
+{
+    unsigned int carry = 0;
+    memcpy(counter, mirror_buffer->aesiv_video, AES_128_BLOCK_SIZE);
+    for (int i = AES_128_BLOCK_SIZE - 1; i >= 0 && (blocks || carry); i--) {
+        unsigned int sum = counter[i] + (unsigned int) (blocks & 0xff) + carry;
+        counter[i] = (uint8_t) sum;
+        carry = sum >> 8;
+        blocks >>= 8;
+    }
+}
+
 void
 mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID)
 {
@@ -65,14 +117,24 @@ mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamCon
     sha_destroy(ctx);
 
     // Need to be initialized externally
+    if (mirror_buffer->aes_ctx) {
+        aes_ctr_destroy(mirror_buffer->aes_ctx);
+    }
     mirror_buffer->aes_ctx = aes_ctr_init(aeskey_video, aesiv_video);
+    memcpy(mirror_buffer->aeskey_video, aeskey_video, AES_128_BLOCK_SIZE);
+    memcpy(mirror_buffer->aesiv_video, aesiv_video, AES_128_BLOCK_SIZE);
+    mirror_buffer->blocks = 0;
+    mirror_buffer->keystream_used = AES_128_BLOCK_SIZE;
 
-#ifdef DUMP_KEI_IV
-    FILE* keyfile = fopen("/sdcard/111.keyiv", "wb");
-    fwrite(aeskey_video, 16, 1, keyfile);
-    fwrite(aesiv_video, 16, 1, keyfile);
-    fclose(keyfile);
-#endif
+    /* workers that are already running must use the new key; they are idle between frames */
+    MUTEX_LOCK(mirror_buffer->worker_mutex);
+    for (int i = 0; i < mirror_buffer->num_workers; i++) {
+        mirror_buffer_worker_t *worker = &mirror_buffer->workers[i];
+        assert(!worker->pending);
+        aes_ctr_destroy(worker->aes_ctx);
+        worker->aes_ctx = aes_ctr_init(aeskey_video, aesiv_video);
+    }
+    MUTEX_UNLOCK(mirror_buffer->worker_mutex);
 }
 
 mirror_buffer_t *
@@ -86,39 +148,195 @@ mirror_buffer_init(logger_t *logger, const unsigned char *aeskey)
     }
     memcpy(mirror_buffer->aeskey_audio, aeskey, RAOP_AESKEY_LEN);
     mirror_buffer->logger = logger;
-    mirror_buffer->nextDecryptCount = 0;
+    mirror_buffer->keystream_used = AES_128_BLOCK_SIZE;
+    MUTEX_CREATE(mirror_buffer->worker_mutex);
+    COND_CREATE(mirror_buffer->work_cond);
+    COND_CREATE(mirror_buffer->done_cond);
     return mirror_buffer;
 }
 
-void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, unsigned char* input, unsigned char* output, int inputLen) {
-    // Start decrypting
-    if (mirror_buffer->nextDecryptCount > 0) {//mirror_buffer->nextDecryptCount = 10
-        for (int i = 0; i < mirror_buffer->nextDecryptCount; i++) {
-            output[i] = (input[i] ^ mirror_buffer->og[(16 - mirror_buffer->nextDecryptCount) + i]);
+static THREAD_RETVAL
+mirror_buffer_worker_thread(void *arg)
+{
+    mirror_buffer_worker_t *worker = arg;
+    mirror_buffer_t *mirror_buffer = worker->mirror_buffer;
+
+    MUTEX_LOCK(mirror_buffer->worker_mutex);
+    while (1) {
+        while (!worker->pending && !mirror_buffer->workers_stop) {
+            COND_WAIT(mirror_buffer->work_cond, mirror_buffer->worker_mutex);
         }
+        if (mirror_buffer->workers_stop) {
+            break;
+        }
+        MUTEX_UNLOCK(mirror_buffer->worker_mutex);
+
+        aes_ctr_set_counter(worker->aes_ctx, worker->counter);
+        aes_ctr_decrypt(worker->aes_ctx, worker->input, worker->output, worker->len);
+
+        MUTEX_LOCK(mirror_buffer->worker_mutex);
+        worker->pending = false;
+        if (--mirror_buffer->jobs_pending == 0) {
+            COND_SIGNAL(mirror_buffer->done_cond);
+        }
+    }
+    MUTEX_UNLOCK(mirror_buffer->worker_mutex);
+    return 0;
+}
+
+/* Starts num_workers threads that, together with the calling thread, decrypt large frames. *
+ * Must be called after mirror_buffer_init_aes().  Returns the number of workers started.   */
+int
+mirror_buffer_start_workers(mirror_buffer_t *mirror_buffer, int num_workers)
+{
+    assert(mirror_buffer);
+    assert(mirror_buffer->aes_ctx);
+    if (mirror_buffer->workers || num_workers <= 0) {
+        return mirror_buffer->num_workers;
+    }
+    if (num_workers > MIRROR_BUFFER_MAX_WORKERS) {
+        num_workers = MIRROR_BUFFER_MAX_WORKERS;
+    }
+    mirror_buffer->workers = calloc(num_workers, sizeof(mirror_buffer_worker_t));
+    if (!mirror_buffer->workers) {
+        return 0;
+    }
+    mirror_buffer->workers_stop = false;
+    mirror_buffer->jobs_pending = 0;
+    for (int i = 0; i < num_workers; i++) {
+        mirror_buffer_worker_t *worker = &mirror_buffer->workers[i];
+        worker->mirror_buffer = mirror_buffer;
+        worker->aes_ctx = aes_ctr_init(mirror_buffer->aeskey_video, mirror_buffer->aesiv_video);
+        THREAD_CREATE(worker->thread, mirror_buffer_worker_thread, worker);
+        mirror_buffer->num_workers++;
+    }
+    logger_log(mirror_buffer->logger, LOGGER_DEBUG, "mirror_buffer: %d decryption worker threads started", mirror_buffer->num_workers);
+    return mirror_buffer->num_workers;
+}
+
+static void
+mirror_buffer_stop_workers(mirror_buffer_t *mirror_buffer)
+{
+    if (!mirror_buffer->workers) {
+        return;
+    }
+    MUTEX_LOCK(mirror_buffer->worker_mutex);
+    mirror_buffer->workers_stop = true;
+    COND_BROADCAST(mirror_buffer->work_cond);
+    MUTEX_UNLOCK(mirror_buffer->worker_mutex);
+    for (int i = 0; i < mirror_buffer->num_workers; i++) {
+        THREAD_JOIN(mirror_buffer->workers[i].thread);
+        aes_ctr_destroy(mirror_buffer->workers[i].aes_ctx);
+    }
+    free(mirror_buffer->workers);
+    mirror_buffer->workers = NULL;
+    mirror_buffer->num_workers = 0;
+}
+
+/* Decrypts len bytes (a whole number of blocks) in chunks on the worker threads and the   *
+ * calling thread.  Each chunk starts at its own counter block, so the cipher context      *
+ * is finally moved on to the counter block that follows the last chunk.                  */
+static void
+mirror_buffer_decrypt_parallel(mirror_buffer_t *mirror_buffer, const unsigned char *input, unsigned char *output, int len)
+{
+    int total_blocks = len / AES_128_BLOCK_SIZE;
+    int num_chunks = len / MIRROR_BUFFER_PARALLEL_MIN_CHUNK;
+    if (num_chunks > mirror_buffer->num_workers + 1) {
+        num_chunks = mirror_buffer->num_workers + 1;
+    }
+    int chunk_blocks = total_blocks / num_chunks;
+
+    /* chunks 1 .. num_chunks - 1 go to the workers, the last one takes any extra blocks */
+    MUTEX_LOCK(mirror_buffer->worker_mutex);
+    for (int i = 1; i < num_chunks; i++) {
+        mirror_buffer_worker_t *worker = &mirror_buffer->workers[i - 1];
+        int offset = i * chunk_blocks * AES_128_BLOCK_SIZE;
+        worker->input = input + offset;
+        worker->output = output + offset;
+        worker->len = (i == num_chunks - 1 ? len - offset : chunk_blocks * AES_128_BLOCK_SIZE);
+        mirror_buffer_get_counter(mirror_buffer, mirror_buffer->blocks + (uint64_t) i * chunk_blocks, worker->counter);
+        worker->pending = true;
+        mirror_buffer->jobs_pending++;
+    }
+    COND_BROADCAST(mirror_buffer->work_cond);
+    MUTEX_UNLOCK(mirror_buffer->worker_mutex);
+
+    /* chunk 0 continues from the current position of the cipher context */
+    aes_ctr_decrypt(mirror_buffer->aes_ctx, input, output, chunk_blocks * AES_128_BLOCK_SIZE);
+
+    MUTEX_LOCK(mirror_buffer->worker_mutex);
+    while (mirror_buffer->jobs_pending > 0) {
+        COND_WAIT(mirror_buffer->done_cond, mirror_buffer->worker_mutex);
+    }
+    MUTEX_UNLOCK(mirror_buffer->worker_mutex);
+
+    uint8_t counter[AES_128_BLOCK_SIZE];
+    mirror_buffer_get_counter(mirror_buffer, mirror_buffer->blocks + total_blocks, counter);
+    aes_ctr_set_counter(mirror_buffer->aes_ctx, counter);
+}
+
+/* returns the smallest amount of data worth passing to mirror_buffer_decrypt() at once *
+ * so that it can be decrypted in parallel, or 0 if there are no worker threads          */
+int
+mirror_buffer_get_batch_size(mirror_buffer_t *mirror_buffer)
+{
+    return (mirror_buffer->num_workers > 0 ? MIRROR_BUFFER_PARALLEL_MIN_SIZE + AES_128_BLOCK_SIZE : 0);
+}
+
+/* returns the number of keystream bytes used since mirror_buffer_init_aes() */
+uint64_t
+mirror_buffer_get_keystream_offset(mirror_buffer_t *mirror_buffer)
+{
+    return mirror_buffer->blocks * AES_128_BLOCK_SIZE - (uint64_t) (AES_128_BLOCK_SIZE - mirror_buffer->keystream_used);
+}
+
+/* moves the keystream to the given offset, for example to resume a captured stream */
+void
+mirror_buffer_set_keystream_offset(mirror_buffer_t *mirror_buffer, uint64_t offset)
+{
+    uint8_t counter[AES_128_BLOCK_SIZE];
+    int used = (int) (offset % AES_128_BLOCK_SIZE);
+
+    mirror_buffer->blocks = offset / AES_128_BLOCK_SIZE;
+    mirror_buffer_get_counter(mirror_buffer, mirror_buffer->blocks, counter);
+    aes_ctr_set_counter(mirror_buffer->aes_ctx, counter);
+    mirror_buffer->keystream_used = AES_128_BLOCK_SIZE;
+    if (used) {
+        memset(mirror_buffer->keystream, 0, AES_128_BLOCK_SIZE);
+        aes_ctr_encrypt(mirror_buffer->aes_ctx, mirror_buffer->keystream, mirror_buffer->keystream, AES_128_BLOCK_SIZE);
+        mirror_buffer->blocks++;
+        mirror_buffer->keystream_used = used;
+    }
+}
+
+/* decrypts inputLen bytes from input to output, which may be the same buffer */
+void mirror_buffer_decrypt(mirror_buffer_t *mirror_buffer, const unsigned char* input, unsigned char* output, int inputLen) {
+    int pos = 0;
+
+    // Use up the keystream left over from the end of the previous frame
+    while (pos < inputLen && mirror_buffer->keystream_used < AES_128_BLOCK_SIZE) {
+        output[pos] = input[pos] ^ mirror_buffer->keystream[mirror_buffer->keystream_used++];
+        pos++;
+    }
+    // Whole blocks go directly from input to output
+    int blocklen = ((inputLen - pos) / AES_128_BLOCK_SIZE) * AES_128_BLOCK_SIZE;
+    if (blocklen >= MIRROR_BUFFER_PARALLEL_MIN_SIZE && mirror_buffer->num_workers > 0) {
+        mirror_buffer_decrypt_parallel(mirror_buffer, input + pos, output + pos, blocklen);
+    } else if (blocklen > 0) {
+        aes_ctr_decrypt(mirror_buffer->aes_ctx, input + pos, output + pos, blocklen);
     }
-    // Handling encrypted bytes
-    int encryptlen = ((inputLen - mirror_buffer->nextDecryptCount) / 16) * 16;
-    // Aes decryption
-    aes_ctr_start_fresh_block(mirror_buffer->aes_ctx);
-    aes_ctr_decrypt(mirror_buffer->aes_ctx, input + mirror_buffer->nextDecryptCount,
-                    input + mirror_buffer->nextDecryptCount, encryptlen);
-    // Copy to output
-    memcpy(output + mirror_buffer->nextDecryptCount, input + mirror_buffer->nextDecryptCount, encryptlen);
-    // int outputlength = mirror_buffer->nextDecryptCount + encryptlen;
-    // Processing remaining length
-    int restlen = (inputLen - mirror_buffer->nextDecryptCount) % 16;
-    int reststart = inputLen - restlen;
-    mirror_buffer->nextDecryptCount = 0;
-    if (restlen > 0) {
-        memset(mirror_buffer->og, 0, 16);
-        memcpy(mirror_buffer->og, input + reststart, restlen);
-        aes_ctr_decrypt(mirror_buffer->aes_ctx, mirror_buffer->og, mirror_buffer->og, 16);
-        for (int j = 0; j < restlen; j++) {
-            output[reststart + j] = mirror_buffer->og[j];
+    pos += blocklen;
+    mirror_buffer->blocks += blocklen / AES_128_BLOCK_SIZE;
+    // For a final partial block, generate the next keystream block and keep what is not used
+    if (pos < inputLen) {
+        memset(mirror_buffer->keystream, 0, AES_128_BLOCK_SIZE);
+        aes_ctr_encrypt(mirror_buffer->aes_ctx, mirror_buffer->keystream, mirror_buffer->keystream, AES_128_BLOCK_SIZE);
+        mirror_buffer->blocks++;
+        mirror_buffer->keystream_used = 0;
+        while (pos < inputLen) {
+            output[pos] = input[pos] ^ mirror_buffer->keystream[mirror_buffer->keystream_used++];
+            pos++;
         }
-        //outputlength += restlen;
-        mirror_buffer->nextDecryptCount = 16 - restlen;// Difference 16-6=10 bytes
     }
 }
 
@@ -126,6 +344,10 @@ void
 mirror_buffer_destroy(mirror_buffer_t *mirror_buffer)
 {
     if (mirror_buffer) {
+        mirror_buffer_stop_workers(mirror_buffer);
+        COND_DESTROY(mirror_buffer->done_cond);
+        COND_DESTROY(mirror_buffer->work_cond);
+        MUTEX_DESTROY(mirror_buffer->worker_mutex);
         aes_ctr_destroy(mirror_buffer->aes_ctx);
         free(mirror_buffer);
     }
@@ -21,11 +21,18 @@
 #include <stdint.h>
 #include "logger.h"
 
+/* maximum number of worker threads for parallel decryption of large frames */
+#define MIRROR_BUFFER_MAX_WORKERS 7
+
 typedef struct mirror_buffer_s mirror_buffer_t;
 
 
 mirror_buffer_t *mirror_buffer_init( logger_t *logger, const unsigned char *aeskey);
 void mirror_buffer_init_aes(mirror_buffer_t *mirror_buffer, const uint64_t *streamConnectionID);
-void mirror_buffer_decrypt(mirror_buffer_t *raop_mirror, unsigned char* input, unsigned char* output, int datalen);
+int mirror_buffer_start_workers(mirror_buffer_t *mirror_buffer, int num_workers);
+int mirror_buffer_get_batch_size(mirror_buffer_t *mirror_buffer);
+void mirror_buffer_decrypt(mirror_buffer_t *raop_mirror, const unsigned char* input, unsigned char* output, int datalen);
+uint64_t mirror_buffer_get_keystream_offset(mirror_buffer_t *mirror_buffer);
+void mirror_buffer_set_keystream_offset(mirror_buffer_t *mirror_buffer, uint64_t offset);
 void mirror_buffer_destroy(mirror_buffer_t *mirror_buffer);
 #endif //MIRROR_BUFFER_H
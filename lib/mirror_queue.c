@@ -0,0 +1,178 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "mirror_queue.h"
+#include "threads.h"
+
+struct mirror_queue_s {
+    logger_t *logger;
+
+    h264_decode_struct *slots;
+    unsigned int mask;            /* slots - 1, the number of slots is a power of two */
+    int depth;                    /* the most frames queued at once, as configured */
+
+    /* head is only written by the producer, tail only by the consumer; both count *
+     * frames since the start, and wrap around naturally as unsigned integers        */
+    atomic_uint head;
+    atomic_uint tail;
+
+    /* set by the consumer, under the mutex, before it sleeps on the condition */
+    atomic_bool consumer_waiting;
+    atomic_bool closed;
+    mutex_handle_t wait_mutex;
+    cond_handle_t wait_cond;
+
+    /* statistics, written by the producer */
+    atomic_int high_water;
+    atomic_uint_least64_t frames;
+    atomic_uint_least64_t dropped;
+};
+
+mirror_queue_t *
+mirror_queue_init(logger_t *logger, int depth)
+{
+    mirror_queue_t *mirror_queue;
+    unsigned int capacity = 1;
+
+    assert(depth > 0);
+    if (depth > MIRROR_QUEUE_MAX_DEPTH) {
+        depth = MIRROR_QUEUE_MAX_DEPTH;
+    }
+    while (capacity < (unsigned int) depth) {
+        capacity <<= 1;
+    }
+
+    mirror_queue = calloc(1, sizeof(mirror_queue_t));
+    if (!mirror_queue) {
+        return NULL;
+    }
+    mirror_queue->slots = calloc(capacity, sizeof(h264_decode_struct));
+    if (!mirror_queue->slots) {
+        free(mirror_queue);
+        return NULL;
+    }
+    mirror_queue->logger = logger;
+    mirror_queue->mask = capacity - 1;
+    mirror_queue->depth = depth;
+    atomic_init(&mirror_queue->head, 0);
+    atomic_init(&mirror_queue->tail, 0);
+    atomic_init(&mirror_queue->consumer_waiting, false);
+    atomic_init(&mirror_queue->closed, false);
+    atomic_init(&mirror_queue->high_water, 0);
+    atomic_init(&mirror_queue->frames, 0);
+    atomic_init(&mirror_queue->dropped, 0);
+    MUTEX_CREATE(mirror_queue->wait_mutex);
+    COND_CREATE(mirror_queue->wait_cond);
+    logger_log(logger, LOGGER_DEBUG, "mirror_queue: created with depth %d", depth);
+    return mirror_queue;
+}
+
+/* called by the producer only; the frame is copied into the queue, and ownership of frame->data passes to the consumer */
+bool
+mirror_queue_push(mirror_queue_t *mirror_queue, const h264_decode_struct *frame)
+{
+    unsigned int head = atomic_load_explicit(&mirror_queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&mirror_queue->tail, memory_order_acquire);
+    int depth = (int) (head - tail);
+
+    if (depth >= mirror_queue->depth) {
+        atomic_fetch_add_explicit(&mirror_queue->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    mirror_queue->slots[head & mirror_queue->mask] = *frame;
+    atomic_store(&mirror_queue->head, head + 1);
+
+    depth++;
+    if (depth > atomic_load_explicit(&mirror_queue->high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&mirror_queue->high_water, depth, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&mirror_queue->frames, 1, memory_order_relaxed);
+
+    /* the store to head and the load of consumer_waiting are sequentially consistent, so either *
+     * the consumer sees the new frame before sleeping, or this sees that it must be woken up    */
+    if (atomic_load(&mirror_queue->consumer_waiting)) {
+        MUTEX_LOCK(mirror_queue->wait_mutex);
+        COND_SIGNAL(mirror_queue->wait_cond);
+        MUTEX_UNLOCK(mirror_queue->wait_mutex);
+    }
+    return true;
+}
+
+/* called by the consumer only; if wait is true, this sleeps until a frame is available or the *
+ * queue is closed.  Returns false if there is no frame.   Once the queue is closed, a waiting  *
+ * pop returns false at once, and any remaining frames can be drained with wait = false.       */
+bool
+mirror_queue_pop(mirror_queue_t *mirror_queue, h264_decode_struct *frame, bool wait)
+{
+    unsigned int tail = atomic_load_explicit(&mirror_queue->tail, memory_order_relaxed);
+
+    if (wait && atomic_load(&mirror_queue->closed)) {
+        return false;
+    }
+    if (atomic_load_explicit(&mirror_queue->head, memory_order_acquire) == tail) {
+        if (!wait) {
+            return false;
+        }
+        MUTEX_LOCK(mirror_queue->wait_mutex);
+        atomic_store(&mirror_queue->consumer_waiting, true);
+        while (atomic_load(&mirror_queue->head) == tail && !atomic_load(&mirror_queue->closed)) {
+            COND_WAIT(mirror_queue->wait_cond, mirror_queue->wait_mutex);
+        }
+        atomic_store(&mirror_queue->consumer_waiting, false);
+        MUTEX_UNLOCK(mirror_queue->wait_mutex);
+        if (atomic_load(&mirror_queue->closed) ||
+            atomic_load_explicit(&mirror_queue->head, memory_order_acquire) == tail) {
+            return false;
+        }
+    }
+    *frame = mirror_queue->slots[tail & mirror_queue->mask];
+    atomic_store_explicit(&mirror_queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/* wakes up the consumer, which will then no longer wait for frames */
+void
+mirror_queue_close(mirror_queue_t *mirror_queue)
+{
+    MUTEX_LOCK(mirror_queue->wait_mutex);
+    atomic_store(&mirror_queue->closed, true);
+    COND_SIGNAL(mirror_queue->wait_cond);
+    MUTEX_UNLOCK(mirror_queue->wait_mutex);
+}
+
+void
+mirror_queue_get_stats(mirror_queue_t *mirror_queue, mirror_queue_stats_t *stats)
+{
+    unsigned int head = atomic_load(&mirror_queue->head);
+    unsigned int tail = atomic_load(&mirror_queue->tail);
+    stats->capacity = mirror_queue->depth;
+    stats->depth = (int) (head - tail);
+    stats->high_water = atomic_load_explicit(&mirror_queue->high_water, memory_order_relaxed);
+    stats->frames = atomic_load_explicit(&mirror_queue->frames, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&mirror_queue->dropped, memory_order_relaxed);
+}
+
+/* any frames still in the queue must have been popped (and their data released) before this is called */
+void
+mirror_queue_destroy(mirror_queue_t *mirror_queue)
+{
+    if (mirror_queue) {
+        COND_DESTROY(mirror_queue->wait_cond);
+        MUTEX_DESTROY(mirror_queue->wait_mutex);
+        free(mirror_queue->slots);
+        free(mirror_queue);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef MIRROR_QUEUE_H
+#define MIRROR_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logger.h"
+#include "stream.h"
+
+/* Bounded single-producer/single-consumer queue of decrypted video frames, passed  *
+ * from the mirror TCP thread to the decode thread.  Push and pop do not take locks; *
+ * a mutex and condition variable are only used when the consumer has to sleep.      *
+ * mirror_queue_push() never blocks: it fails if the queue is full.                  */
+
+#define MIRROR_QUEUE_MAX_DEPTH 64
+
+typedef struct mirror_queue_s mirror_queue_t;
+
+typedef struct {
+    int capacity;
+    int depth;
+    int high_water;
+    uint64_t frames;      /* frames queued */
+    uint64_t dropped;     /* frames rejected because the queue was full */
+} mirror_queue_stats_t;
+
+mirror_queue_t *mirror_queue_init(logger_t *logger, int depth);
+bool mirror_queue_push(mirror_queue_t *mirror_queue, const h264_decode_struct *frame);
+bool mirror_queue_pop(mirror_queue_t *mirror_queue, h264_decode_struct *frame, bool wait);
+void mirror_queue_close(mirror_queue_t *mirror_queue);
+void mirror_queue_get_stats(mirror_queue_t *mirror_queue, mirror_queue_stats_t *stats);
+void mirror_queue_destroy(mirror_queue_t *mirror_queue);
+
+#endif //MIRROR_QUEUE_H
@@ -31,7 +31,12 @@
 #include "logger.h"
 #include "compat.h"
 #include "raop_rtp_mirror.h"
+#include "mirror_buffer.h"
+#include "stream_capture.h"
 #include "raop_ntp.h"
+#include "raop_buffer.h"
+#include "udp_batch.h"
+#include "audio_decoder.h"
 
 struct raop_s {
     /* Callbacks for audio and video */
@@ -65,6 +70,44 @@ struct raop_s {
 
     int audio_delay_micros;
     int max_ntp_timeouts;
+
+    /* number of audio packets buffered while waiting for resends (0: default) */
+    int audio_buffer_depth;
+
+    /* audio playout delay adapts to the jitter and loss, between these bounds, in sessions *
+     * without video (audio_adaptive_delay = 0: fixed at audio_delay_micros)                 */
+    uint8_t audio_adaptive_delay;
+    int audio_delay_min_micros;
+    int audio_delay_max_micros;
+
+    /* time waited for audio resends adapts to the jitter and loss, between these bounds  *
+     * (audio_adaptive_resend = 0: fixed by audio_buffer_depth); it is always less than    *
+     * the playout delay, since a resend arriving after the playout time is of no use      */
+    uint8_t audio_adaptive_resend;
+    int audio_resend_min_micros;
+    int audio_resend_max_micros;
+
+    /* audio packets read from a UDP socket at once, and socket receive buffer size (0: system default) */
+    int audio_recv_batch;
+    int audio_rcvbuf_bytes;
+
+    /* resample the decoded audio (audio_process_pcm) to follow the sender's clock drift */
+    uint8_t audio_drift_resampling;
+
+    /* conceal missing frames in the decoded audio, and catch up on late ones */
+    uint8_t audio_concealment;
+
+    /* depth of the queue between mirror video reception and decoding (0: no queue) */
+    int video_queue_depth;
+
+    /* video frames later than this are dropped up to the next IDR frame (0: never) */
+    int video_latency_budget_micros;
+
+    /* threads used to decrypt large video frames (0 or 1: no parallel decryption) */
+    int video_decrypt_threads;
+
+    /* capture of the received streams, see raop_start_capture() */
+    stream_capture_t *stream_capture;
 };
 
 struct raop_conn_s {
@@ -81,6 +124,8 @@ struct raop_conn_s {
     unsigned char *remote;
     int remotelen;
 
+    /* identifies the records of this connection in a stream capture */
+    uint32_t capture_session;
 };
 typedef struct raop_conn_s raop_conn_t;
 
@@ -101,6 +146,7 @@ conn_init(void *opaque, unsigned char *local, int locallen, unsigned char *remot
     conn->raop_rtp = NULL;
     conn->raop_rtp_mirror = NULL;
     conn->raop_ntp = NULL;
+    conn->capture_session = stream_capture_open_session(raop->stream_capture);
     conn->fairplay = fairplay_init(raop->logger);
 
     if (!conn->fairplay) {
@@ -380,6 +426,8 @@ conn_destroy(void *ptr) {
     if (conn->raop_ntp) {
         raop_ntp_destroy(conn->raop_ntp);
     }
+    /* the session keys are no longer needed once the streams are gone */
+    stream_capture_close_session(conn->raop->stream_capture, conn->capture_session);
 
     if (conn->raop->callbacks.video_flush) {
         conn->raop->callbacks.video_flush(conn->raop->callbacks.cls);
@@ -401,7 +449,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks) {
 
     assert(callbacks);
     assert(max_clients > 0);
-    assert(max_clients < 100);
+    assert(max_clients < 1000);
 
     /* Initialize the network */
     if (netutils_init() < 0) {
@@ -409,7 +457,7 @@ raop_init(int max_clients, raop_callbacks_t *callbacks) {
     }
 
     /* Validate the callbacks structure */
-    if (!callbacks->audio_process ||
+    if ((!callbacks->audio_process && !callbacks->audio_process_pcm) ||
         !callbacks->video_process) {
         return NULL;
     }
@@ -442,6 +490,14 @@ raop_init(int max_clients, raop_callbacks_t *callbacks) {
         free(raop);
         return NULL;
     }
+
+    raop->stream_capture = stream_capture_init(raop->logger);
+    if (!raop->stream_capture) {
+        httpd_destroy(httpd);
+        pairing_destroy(pairing);
+        free(raop);
+        return NULL;
+    }
     /* Copy callbacks structure */
     memcpy(&raop->callbacks, callbacks, sizeof(raop_callbacks_t));
     raop->pairing = pairing;
@@ -466,6 +522,20 @@ raop_init(int max_clients, raop_callbacks_t *callbacks) {
 
     raop->max_ntp_timeouts = 0;
     raop->audio_delay_micros = 250000;
+    raop->audio_buffer_depth = 0;
+    raop->audio_adaptive_delay = 0;
+    raop->audio_delay_min_micros = 100000;
+    raop->audio_delay_max_micros = 750000;
+    raop->audio_adaptive_resend = 0;
+    raop->audio_resend_min_micros = 50000;
+    raop->audio_resend_max_micros = 200000;
+    raop->audio_recv_batch = UDP_BATCH_DEFAULT_SIZE;
+    raop->audio_rcvbuf_bytes = 256 * 1024;
+    raop->audio_drift_resampling = 0;
+    raop->audio_concealment = 0;
+    raop->video_queue_depth = 0;
+    raop->video_latency_budget_micros = 0;
+    raop->video_decrypt_threads = 0;
 
     return raop;
 }
@@ -476,6 +546,7 @@ raop_destroy(raop_t *raop) {
         raop_stop(raop);
         pairing_destroy(raop->pairing);
         httpd_destroy(raop->httpd);
+        stream_capture_destroy(raop->stream_capture);
         logger_destroy(raop->logger);
         free(raop);
 
@@ -529,12 +600,90 @@ int raop_set_plist(raop_t *raop, const char *plist_item, const int value) {
             raop->audio_delay_micros = value;
         }
         if (raop->audio_delay_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_adaptive_delay") == 0) {
+        raop->audio_adaptive_delay = (value ? 1 : 0);
+        if ((int) raop->audio_adaptive_delay != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_delay_min_micros") == 0) {
+        if (value >= 0 && value <= 10 * SECOND_IN_USECS) {
+            raop->audio_delay_min_micros = value;
+        }
+        if (raop->audio_delay_min_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_delay_max_micros") == 0) {
+        if (value > 0 && value <= 10 * SECOND_IN_USECS) {
+            raop->audio_delay_max_micros = value;
+        }
+        if (raop->audio_delay_max_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_adaptive_resend") == 0) {
+        raop->audio_adaptive_resend = (value ? 1 : 0);
+        if ((int) raop->audio_adaptive_resend != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_resend_min_micros") == 0) {
+        if (value >= 0 && value <= 10 * SECOND_IN_USECS) {
+            raop->audio_resend_min_micros = value;
+        }
+        if (raop->audio_resend_min_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_resend_max_micros") == 0) {
+        if (value > 0 && value <= 10 * SECOND_IN_USECS) {
+            raop->audio_resend_max_micros = value;
+        }
+        if (raop->audio_resend_max_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_recv_batch") == 0) {
+        if (value >= 1 && value <= UDP_BATCH_MAX_SIZE) {
+            raop->audio_recv_batch = value;
+        }
+        if (raop->audio_recv_batch != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_rcvbuf_bytes") == 0) {
+        if (value >= 0 && value <= 64 * 1024 * 1024) {
+            raop->audio_rcvbuf_bytes = value;
+        }
+        if (raop->audio_rcvbuf_bytes != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_concealment") == 0) {
+        raop->audio_concealment = (value ? 1 : 0);
+        if ((int) raop->audio_concealment != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_drift_resampling") == 0) {
+        raop->audio_drift_resampling = (value ? 1 : 0);
+        if ((int) raop->audio_drift_resampling != value) retval = 1;
+    } else if (strcmp(plist_item, "audio_buffer_depth") == 0) {
+        if (value >= 0 && value <= RAOP_BUFFER_MAX_LENGTH) {
+            raop->audio_buffer_depth = value;
+        }
+        if (raop->audio_buffer_depth != value) retval = 1;
+    } else if (strcmp(plist_item, "video_queue_depth") == 0) {
+        if (value >= 0 && value <= MIRROR_QUEUE_MAX_DEPTH) {
+            raop->video_queue_depth = value;
+        }
+        if (raop->video_queue_depth != value) retval = 1;
+    } else if (strcmp(plist_item, "video_latency_budget_micros") == 0) {
+        if (value >= 0 && value <= 10 * SECOND_IN_USECS) {
+            raop->video_latency_budget_micros = value;
+        }
+        if (raop->video_latency_budget_micros != value) retval = 1;
+    } else if (strcmp(plist_item, "video_decrypt_threads") == 0) {
+        if (value >= 0 && value <= MIRROR_BUFFER_MAX_WORKERS + 1) {
+            raop->video_decrypt_threads = value;
+        }
+        if (raop->video_decrypt_threads != value) retval = 1;
     }  else {
         retval = -1;
     }	  
     return retval;
 }
 
+/* Starts capturing the received (encrypted) mirror and audio streams, with the session *
+ * keys and arrival times, to a file that can be replayed later.  Capture can be        *
+ * started and stopped while a client is connected.  Returns 0 on success.              */
+int
+raop_start_capture(raop_t *raop, const char *filename) {
+    assert(raop);
+    assert(filename);
+    return stream_capture_start(raop->stream_capture, filename);
+}
+
+void
+raop_stop_capture(raop_t *raop) {
+    assert(raop);
+    stream_capture_stop(raop->stream_capture);
+}
+
 void
 raop_set_port(raop_t *raop, unsigned short port) {
     assert(raop);
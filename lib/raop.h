@@ -54,6 +54,16 @@ struct raop_callbacks_s {
     void  (*audio_process)(void *cls, raop_ntp_t *ntp, audio_decode_struct *data);
     void  (*video_process)(void *cls, raop_ntp_t *ntp, h264_decode_struct *data);
 
+    /* Optional: audio decoded to PCM by the library, for the compression types it can decode *
+     * (see audio_decoder.h); audio_process may then be left unset, but audio streams of the  *
+     * other types (AAC without fdk-aac) are refused at SETUP                                  */
+    void  (*audio_process_pcm)(void *cls, raop_ntp_t *ntp, audio_pcm_struct *data);
+
+    /* Optional, with audio_process_pcm: nsecs of audio the renderer has queued but not yet played   *
+     * (-1 if unknown; a constant part, such as the device buffer, may be left out).  The drift      *
+     * resampling then follows the output device's clock instead of the system clock                 */
+    int64_t (*audio_get_pcm_delay)(void *cls);
+
     /* Optional but recommended callback functions */
     void  (*conn_init)(void *cls);
     void  (*conn_destroy)(void *cls);
@@ -76,6 +86,8 @@ RAOP_API raop_t *raop_init(int max_clients, raop_callbacks_t *callbacks);
 RAOP_API void raop_set_log_level(raop_t *raop, int level);
 RAOP_API void raop_set_log_callback(raop_t *raop, raop_log_callback_t callback, void *cls);
 RAOP_API int raop_set_plist(raop_t *raop, const char *plist_item, const int value);
+RAOP_API int raop_start_capture(raop_t *raop, const char *filename);
+RAOP_API void raop_stop_capture(raop_t *raop);
 RAOP_API void raop_set_port(raop_t *raop, unsigned short port);
 RAOP_API void raop_set_udp_ports(raop_t *raop, unsigned short port[3]);
 RAOP_API void raop_set_tcp_ports(raop_t *raop, unsigned short port[2]);
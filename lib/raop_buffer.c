@@ -33,20 +33,19 @@
 #include "utils.h"
 #include "byteutils.h"
 
-#define RAOP_BUFFER_LENGTH 32
-
 typedef struct {
-    /* Data available */
-    int filled;
-
     /* RTP header */
     unsigned short seqnum;
     uint64_t rtp_timestamp;
     uint64_t ntp_timestamp;
 
-    /* Payload data */
+    /* Payload data (a fixed slot in the slab) */
     unsigned int payload_size;
     void *payload_data;
+
+    /* while the packet is missing: time of the last resend request, and number of requests */
+    uint64_t resend_time;
+    int resend_tries;
 } raop_buffer_entry_t;
 
 struct raop_buffer_s {
@@ -59,10 +58,73 @@ struct raop_buffer_s {
     unsigned short first_seqnum;
     unsigned short last_seqnum;
 
-    /* RTP buffer entries */
-    raop_buffer_entry_t entries[RAOP_BUFFER_LENGTH];
+    /* RTP buffer entries, and the slab holding their payloads *
+     * (length is a power of 2, so seqnum % length is continuous *
+     * when the 16-bit seqnum wraps around)                      */
+    int length;
+    raop_buffer_entry_t *entries;
+    unsigned char *slab;
+
+    /* bitmap of the entries holding a packet (data available) */
+    uint32_t *filled;
+
+    /* resend requests: time of the last pass over the missing packets, and counters */
+    uint64_t resend_pass_time;
+    raop_buffer_resend_stats_t resend_stats;
+
+    /* number of entries that may be buffered behind a missing packet while waiting *
+     * for its resend (at most length); it moves by one entry per dequeued packet    *
+     * towards target_wait_length                                                    */
+    int wait_length;
+    int target_wait_length;
 };
 
+static inline bool
+raop_buffer_is_filled(raop_buffer_t *raop_buffer, int index)
+{
+    return (raop_buffer->filled[index >> 5] >> (index & 31)) & 1;
+}
+
+static inline void
+raop_buffer_set_filled(raop_buffer_t *raop_buffer, int index, bool filled)
+{
+    if (filled) {
+        raop_buffer->filled[index >> 5] |= (uint32_t) 1 << (index & 31);
+    } else {
+        raop_buffer->filled[index >> 5] &= ~((uint32_t) 1 << (index & 31));
+    }
+}
+
+static int
+raop_buffer_alloc_entries(raop_buffer_t *raop_buffer, int length)
+{
+    raop_buffer_entry_t *entries = calloc(length, sizeof(raop_buffer_entry_t));
+    unsigned char *slab = malloc((size_t) length * RAOP_BUFFER_SLOT_SIZE);
+    uint32_t *filled = calloc((length + 31) / 32, sizeof(uint32_t));
+    if (!entries || !slab || !filled) {
+        free(entries);
+        free(slab);
+        free(filled);
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        raop_buffer_entry_t *entry = &entries[i];
+        entry->payload_data = slab + (size_t) i * RAOP_BUFFER_SLOT_SIZE;
+        entry->payload_size = 0;
+    }
+    free(raop_buffer->entries);
+    free(raop_buffer->slab);
+    free(raop_buffer->filled);
+    raop_buffer->entries = entries;
+    raop_buffer->slab = slab;
+    raop_buffer->filled = filled;
+    raop_buffer->length = length;
+    raop_buffer->wait_length = length;
+    raop_buffer->target_wait_length = length;
+    raop_buffer->is_empty = 1;
+    return 0;
+}
+
 raop_buffer_t *
 raop_buffer_init(logger_t *logger,
                  const unsigned char *aeskey,
@@ -76,52 +138,67 @@ raop_buffer_init(logger_t *logger,
         return NULL;
     }
     raop_buffer->logger = logger;
+    if (raop_buffer_alloc_entries(raop_buffer, RAOP_BUFFER_DEFAULT_LENGTH) < 0) {
+        free(raop_buffer);
+        return NULL;
+    }
     // Need to be initialized internally
     raop_buffer->aes_ctx = aes_cbc_init(aeskey, aesiv, AES_DECRYPT);
 
-#ifdef DUMP_AUDIO
-    if (file_keyiv != NULL) {
-        fwrite(aeskey, 16, 1, file_keyiv);
-        fwrite(aesiv, 16, 1, file_keyiv);
-        fclose(file_keyiv);
-    }
-#endif
+    return raop_buffer;
+}
 
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        raop_buffer_entry_t *entry = &raop_buffer->entries[i];
-        entry->payload_data = NULL;
-        entry->payload_size = 0;
+/* changes the number of entries (rounded up to a power of 2); any buffered packets are discarded, *
+ * so this must only be used while no packets are being received. Returns the new length.          */
+int
+raop_buffer_set_length(raop_buffer_t *raop_buffer, int length)
+{
+    int new_length = RAOP_BUFFER_MIN_LENGTH;
+    assert(raop_buffer);
+    while (new_length < length && new_length < RAOP_BUFFER_MAX_LENGTH) {
+        new_length *= 2;
+    }
+    if (new_length != raop_buffer->length) {
+        if (raop_buffer_alloc_entries(raop_buffer, new_length) < 0) {
+            logger_log(raop_buffer->logger, LOGGER_ERR, "raop_buffer: could not allocate %d entries, keeping %d",
+                       new_length, raop_buffer->length);
+            raop_buffer_flush(raop_buffer, -1);
+        }
     }
+    return raop_buffer->length;
+}
 
-    raop_buffer->is_empty = 1;
+/* sets the number of packets buffered while waiting for the resend of a missing packet *
+ * (at most the buffer length); the change is applied gradually as packets are dequeued */
+void
+raop_buffer_set_wait_length(raop_buffer_t *raop_buffer, int wait_length)
+{
+    assert(raop_buffer);
+    if (wait_length < 1) {
+        wait_length = 1;
+    } else if (wait_length > raop_buffer->length) {
+        wait_length = raop_buffer->length;
+    }
+    raop_buffer->target_wait_length = wait_length;
+}
 
-    return raop_buffer;
+int
+raop_buffer_get_length(raop_buffer_t *raop_buffer)
+{
+    assert(raop_buffer);
+    return raop_buffer->length;
 }
 
 void
 raop_buffer_destroy(raop_buffer_t *raop_buffer)
 {
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        raop_buffer_entry_t *entry = &raop_buffer->entries[i];
-        if (entry->payload_data != NULL) {
-            free(entry->payload_data);
-        }
-    }
-
     if (raop_buffer) {
         aes_cbc_destroy(raop_buffer->aes_ctx);
+        free(raop_buffer->entries);
+        free(raop_buffer->slab);
+        free(raop_buffer->filled);
         free(raop_buffer);
     }
-
-#ifdef DUMP_AUDIO
-    if (file_aac != NULL) {
-        fclose(file_aac);
-    }
-    if (file_source != NULL) {
-        fclose(file_source);
-    }
-#endif
-
 }
 
 static short
@@ -130,31 +207,11 @@ seqnum_cmp(unsigned short s1, unsigned short s2)
     return (s1 - s2);
 }
 
-//#define DUMP_AUDIO
-
-#ifdef DUMP_AUDIO
-static FILE* file_aac = NULL;
-static FILE* file_source = NULL;
-static FILE* file_keyiv = NULL;
-#endif
-
-
 int
 raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned char* output, unsigned int payload_size, unsigned int *outputlen)
 {
     assert(raop_buffer);
     int encryptedlen;
-#ifdef DUMP_AUDIO
-    if (file_aac == NULL) {
-        file_aac = fopen("/home/pi/Airplay.aac", "wb");
-        file_source = fopen("/home/pi/Airplay.source", "wb");
-        file_keyiv = fopen("/home/pi/Airplay.keyiv", "wb");
-    }
-    // Undecrypted file
-    if (file_source != NULL) {
-        fwrite(&data[12], payloadsize, 1, file_source);
-    }
-#endif
 
     if (DECRYPTION_TEST) {
         char *str = utils_data_to_string(data,12,12);
@@ -166,12 +223,9 @@ raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned ch
             free(str);
         }
     }
+    /* each packet is encrypted from the initial IV, and any incomplete last block is unencrypted */
     encryptedlen = payload_size / 16*16;
-    memset(output, 0, payload_size);
-
-    aes_cbc_decrypt(raop_buffer->aes_ctx, &data[12], output, encryptedlen);
-    aes_cbc_reset(raop_buffer->aes_ctx);
-
+    aes_cbc_decrypt_message(raop_buffer->aes_ctx, &data[12], output, encryptedlen);
     memcpy(output + encryptedlen, &data[12 + encryptedlen], payload_size - encryptedlen);
     *outputlen = payload_size;
     if (payload_size &&  DECRYPTION_TEST){
@@ -199,13 +253,6 @@ raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned ch
             free(str);
         }
     }
-#ifdef DUMP_AUDIO
-    // Decrypted file
-    if (file_aac != NULL) {
-        fwrite(output, payloadsize, 1, file_aac);
-    }
-#endif
-
     return 1;
 }
 
@@ -223,6 +270,11 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
         return 0;
     }
     int payload_size = datalen - 12;
+    if (payload_size > RAOP_BUFFER_SLOT_SIZE) {
+        logger_log(raop_buffer->logger, LOGGER_WARNING, "raop_buffer: dropped audio packet with %d byte payload (max %d)",
+                   payload_size, RAOP_BUFFER_SLOT_SIZE);
+        return 0;
+    }
 
     /* Get correct seqnum for the packet */
     unsigned short seqnum;
@@ -238,24 +290,30 @@ raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned sh
     }
 
     /* Check that there is always space in the buffer, otherwise flush */
-    if (seqnum_cmp(seqnum, raop_buffer->first_seqnum + RAOP_BUFFER_LENGTH) >= 0) {
+    if (seqnum_cmp(seqnum, raop_buffer->first_seqnum + raop_buffer->length) >= 0) {
         raop_buffer_flush(raop_buffer, seqnum);
     }
 
     /* Get entry corresponding our seqnum */
-    raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
-    if (entry->filled && seqnum_cmp(entry->seqnum, seqnum) == 0) {
+    int index = seqnum % raop_buffer->length;
+    raop_buffer_entry_t *entry = &raop_buffer->entries[index];
+    if (raop_buffer_is_filled(raop_buffer, index) && seqnum_cmp(entry->seqnum, seqnum) == 0) {
         /* Packet resend, we can safely ignore */
         return 0;
     }
+    if (entry->resend_tries) {
+        /* a requested packet, in time */
+        raop_buffer->resend_stats.recovered++;
+        entry->resend_tries = 0;
+        entry->resend_time = 0;
+    }
 
     /* Update the raop_buffer entry header */
     entry->seqnum = seqnum;
     entry->rtp_timestamp = *rtp_timestamp;
     entry->ntp_timestamp = *ntp_timestamp;
-    entry->filled = 1;
+    raop_buffer_set_filled(raop_buffer, index, true);
 
-    entry->payload_data = malloc(payload_size);
     int decrypt_ret = raop_buffer_decrypt(raop_buffer, data, entry->payload_data, payload_size, &entry->payload_size);
     assert(decrypt_ret >= 0);
     assert(entry->payload_size <= payload_size);
@@ -285,24 +343,37 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *
     }
 
     /* Get the first buffer entry for inspection */
-    raop_buffer_entry_t *entry = &raop_buffer->entries[raop_buffer->first_seqnum % RAOP_BUFFER_LENGTH];
+    int index = raop_buffer->first_seqnum % raop_buffer->length;
+    raop_buffer_entry_t *entry = &raop_buffer->entries[index];
+    bool filled = raop_buffer_is_filled(raop_buffer, index);
     if (no_resend) {
         /* If we do no resends, always return the first entry */
-    } else if (!entry->filled) {
+    } else if (!filled) {
         /* Check how much we have space left in the buffer */
-        if (entry_count < RAOP_BUFFER_LENGTH) {
+        if (entry_count < raop_buffer->wait_length) {
             /* Return nothing and hope resend gets on time */
             return NULL;
         }
         /* Risk of buffer overrun, return empty buffer */
     }
 
-    /* Update buffer and validate entry */
+    /* Update buffer and validate entry; a dequeue is a frame boundary, where the wait length can change */
     raop_buffer->first_seqnum += 1;
-    if (!entry->filled) {
+    if (raop_buffer->wait_length < raop_buffer->target_wait_length) {
+        raop_buffer->wait_length++;
+    } else if (raop_buffer->wait_length > raop_buffer->target_wait_length) {
+        raop_buffer->wait_length--;
+    }
+    if (!filled) {
+        if (entry->resend_tries) {
+            /* requested, but not received before its playout */
+            raop_buffer->resend_stats.lost++;
+            entry->resend_tries = 0;
+            entry->resend_time = 0;
+        }
         return NULL;
     }
-    entry->filled = 0;
+    raop_buffer_set_filled(raop_buffer, index, false);
 
     /* Return entry payload buffer */
     *rtp_timestamp = entry->rtp_timestamp;
@@ -310,44 +381,95 @@ raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *
     *seqnum = entry->seqnum;
     *length = entry->payload_size;
     entry->payload_size = 0;
-    void* data = entry->payload_data;
-    entry->payload_data = NULL;
-    return data;
+    return entry->payload_data;
 }
 
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque) {
+/* Requests the resend of every missing range between first_seqnum and last_seqnum in one pass (at  *
+ * most one pass per RAOP_BUFFER_RESEND_PASS_INTERVAL).  A missing packet is requested again after   *
+ * RAOP_BUFFER_RESEND_INTERVAL, up to RAOP_BUFFER_RESEND_MAX_TRIES times, and no longer once it is   *
+ * about to be skipped by raop_buffer_dequeue() (its playout deadline).  now is in nsecs.           */
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, uint64_t now, raop_resend_cb_t resend_cb, void *opaque) {
     assert(raop_buffer);
     assert(resend_cb);
 
-    if (seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) < 0) {
-        int seqnum, count;
-        logger_log(raop_buffer->logger, LOGGER_DEBUG, "raop_buffer_handle_resends first_seqnum=%u last seqnum=%u",
-                   raop_buffer->first_seqnum, raop_buffer->last_seqnum);
-        for (seqnum = raop_buffer->first_seqnum; seqnum_cmp(seqnum, raop_buffer->last_seqnum) < 0; seqnum++) {
-            raop_buffer_entry_t *entry = &raop_buffer->entries[seqnum % RAOP_BUFFER_LENGTH];
-            if (entry->filled) {
-                break;
+    if (raop_buffer->is_empty || seqnum_cmp(raop_buffer->first_seqnum, raop_buffer->last_seqnum) >= 0) {
+        return;
+    }
+    if (now - raop_buffer->resend_pass_time < RAOP_BUFFER_RESEND_PASS_INTERVAL) {
+        return;
+    }
+    raop_buffer->resend_pass_time = now;
+
+    unsigned short seqnum = raop_buffer->first_seqnum;
+    int range_count = 0;
+    unsigned short range_start = 0;
+    while (1) {
+        bool request = false;
+        bool end = (seqnum_cmp(seqnum, raop_buffer->last_seqnum) >= 0);
+        if (!end) {
+            int index = seqnum % raop_buffer->length;
+            if (!raop_buffer_is_filled(raop_buffer, index)) {
+                raop_buffer_entry_t *entry = &raop_buffer->entries[index];
+                /* packets behind it, when this packet is dequeued (or skipped) */
+                int behind = seqnum_cmp(raop_buffer->last_seqnum, seqnum) + 1;
+                if (behind < raop_buffer->wait_length - 1 && entry->resend_tries < RAOP_BUFFER_RESEND_MAX_TRIES &&
+                    (!entry->resend_tries || now - entry->resend_time >= RAOP_BUFFER_RESEND_INTERVAL)) {
+                    if (entry->resend_tries) {
+                        raop_buffer->resend_stats.retries++;
+                    } else {
+                        raop_buffer->resend_stats.requested++;
+                    }
+                    entry->resend_tries++;
+                    entry->resend_time = now;
+                    request = true;
+                }
+            } else if ((index & 31) == 0 && raop_buffer->filled[index >> 5] == 0xffffffff &&
+                       seqnum_cmp(raop_buffer->last_seqnum, seqnum) > 32) {
+                /* skip 32 entries that all hold packets */
+                if (range_count) {
+                    resend_cb(opaque, range_start, range_count);
+                    raop_buffer->resend_stats.requests++;
+                    range_count = 0;
+                }
+                seqnum += 32;
+                continue;
+            }
+        }
+        if (request) {
+            if (!range_count) {
+                range_start = seqnum;
             }
+            range_count++;
+        } else if (range_count) {
+            logger_log(raop_buffer->logger, LOGGER_DEBUG, "raop_buffer resend request seqnum=%u count=%d (first_seqnum=%u last_seqnum=%u)",
+                       range_start, range_count, raop_buffer->first_seqnum, raop_buffer->last_seqnum);
+            resend_cb(opaque, range_start, range_count);
+            raop_buffer->resend_stats.requests++;
+            range_count = 0;
         }
-        if (seqnum_cmp(seqnum, raop_buffer->first_seqnum) == 0) {
-            return;
+        if (end) {
+            break;
         }
-        count = seqnum_cmp(seqnum, raop_buffer->first_seqnum);
-        resend_cb(opaque, raop_buffer->first_seqnum, count);
+        seqnum++;
     }
 }
 
+void
+raop_buffer_get_resend_stats(raop_buffer_t *raop_buffer, raop_buffer_resend_stats_t *stats)
+{
+    assert(raop_buffer);
+    *stats = raop_buffer->resend_stats;
+}
+
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq) {
     assert(raop_buffer);
 
-    for (int i = 0; i < RAOP_BUFFER_LENGTH; i++) {
-        if (raop_buffer->entries[i].payload_data) {
-            free(raop_buffer->entries[i].payload_data);
-            raop_buffer->entries[i].payload_data = NULL;   
-            raop_buffer->entries[i].payload_size = 0;
-        }
-        raop_buffer->entries[i].filled = 0;
+    for (int i = 0; i < raop_buffer->length; i++) {
+        raop_buffer->entries[i].payload_size = 0;
+        raop_buffer->entries[i].resend_tries = 0;
+        raop_buffer->entries[i].resend_time = 0;
     }
+    memset(raop_buffer->filled, 0, ((raop_buffer->length + 31) / 32) * sizeof(uint32_t));
     if (next_seq < 0 || next_seq > 0xffff) {
         raop_buffer->is_empty = 1;
     } else {
@@ -21,16 +21,44 @@
 #include "logger.h"
 #include "raop_rtp.h"
 
+/* number of audio packets held while waiting for resends (32 is about 350 ms of AAC-ELD) */
+#define RAOP_BUFFER_DEFAULT_LENGTH 32
+#define RAOP_BUFFER_MIN_LENGTH 8
+#define RAOP_BUFFER_MAX_LENGTH 1024
+
+/* each packet payload is stored in a fixed-size slot; ALAC frames of 352 *
+ * 16-bit stereo samples, even uncompressed, and AAC frames fit in this   */
+#define RAOP_BUFFER_SLOT_SIZE 2048
+
+/* resend requests: at most one pass over the missing packets per PASS_INTERVAL, and *
+ * a missing packet is requested again after RESEND_INTERVAL, up to MAX_TRIES times   */
+#define RAOP_BUFFER_RESEND_PASS_INTERVAL (5 * 1000000ULL)
+#define RAOP_BUFFER_RESEND_INTERVAL (30 * 1000000ULL)
+#define RAOP_BUFFER_RESEND_MAX_TRIES 3
+
 typedef struct raop_buffer_s raop_buffer_t;
 
+typedef struct {
+    uint32_t requests;            /* resend requests sent (one per missing range) */
+    uint32_t requested;           /* missing packets that were requested */
+    uint32_t retries;             /* repeated requests for the same packet */
+    uint32_t recovered;           /* requested packets received in time */
+    uint32_t lost;                /* requested packets not received before their playout */
+} raop_buffer_resend_stats_t;
+
 typedef int (*raop_resend_cb_t)(void *opaque, unsigned short seqno, unsigned short count);
 
 raop_buffer_t *raop_buffer_init(logger_t *logger,
                                 const unsigned char *aeskey,
                                 const unsigned char *aesiv);
+int raop_buffer_set_length(raop_buffer_t *raop_buffer, int length);
+int raop_buffer_get_length(raop_buffer_t *raop_buffer);
+void raop_buffer_set_wait_length(raop_buffer_t *raop_buffer, int wait_length);
 int raop_buffer_enqueue(raop_buffer_t *raop_buffer, unsigned char *data, unsigned short datalen, uint64_t *ntp_timestamp, uint64_t *rtp_timestamp, int use_seqnum);
+/* the returned payload belongs to raop_buffer, and is only valid until the next enqueue or flush */
 void *raop_buffer_dequeue(raop_buffer_t *raop_buffer, unsigned int *length, uint64_t *ntp_timestamp, uint64_t *rtp_timestamp, unsigned short *seqnum, int no_resend);
-void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, raop_resend_cb_t resend_cb, void *opaque);
+void raop_buffer_handle_resends(raop_buffer_t *raop_buffer, uint64_t now, raop_resend_cb_t resend_cb, void *opaque);
+void raop_buffer_get_resend_stats(raop_buffer_t *raop_buffer, raop_buffer_resend_stats_t *stats);
 void raop_buffer_flush(raop_buffer_t *raop_buffer, int next_seq);
 
 int raop_buffer_decrypt(raop_buffer_t *raop_buffer, unsigned char *data, unsigned char* output,
@@ -453,6 +453,19 @@ raop_handler_setup(raop_conn_t *conn,
         conn->raop_rtp = raop_rtp_init(conn->raop->logger, &conn->raop->callbacks, conn->raop_ntp, conn->remote, conn->remotelen, aeskey, aesiv);
         conn->raop_rtp_mirror = raop_rtp_mirror_init(conn->raop->logger, &conn->raop->callbacks, conn->raop_ntp, conn->remote, conn->remotelen, aeskey);
 
+        /* the keys are kept by the stream capture, in case capture is started later */
+        unsigned char capture_keys[2 * RAOP_AESKEY_LEN];
+        memcpy(capture_keys, aeskey, RAOP_AESKEY_LEN);
+        memcpy(capture_keys + RAOP_AESKEY_LEN, aesiv, RAOP_AESIV_LEN);
+        stream_capture_session(conn->raop->stream_capture, conn->capture_session, STREAM_CAPTURE_AUDIO_KEYS,
+                               capture_keys, sizeof(capture_keys));
+        if (conn->raop_rtp) {
+            raop_rtp_set_stream_capture(conn->raop_rtp, conn->raop->stream_capture, conn->capture_session);
+        }
+        if (conn->raop_rtp_mirror) {
+            raop_rtp_mirror_set_stream_capture(conn->raop_rtp_mirror, conn->raop->stream_capture, conn->capture_session);
+        }
+
         plist_t res_event_port_node = plist_new_uint(conn->raop->port);
         plist_t res_timing_port_node = plist_new_uint(timing_lport);
         plist_dict_set_item(res_root_node, "timingPort", res_timing_port_node);
@@ -483,8 +496,18 @@ raop_handler_setup(raop_conn_t *conn,
                     plist_get_uint_val(stream_id_node, &stream_connection_id);
                     logger_log(conn->raop->logger, LOGGER_DEBUG, "streamConnectionID (needed for AES-CTR video decryption key and iv): %llu", stream_connection_id);
 
+                    unsigned char capture_id[8];
+                    for (int j = 0; j < 8; j++) {
+                        capture_id[j] = (unsigned char) (stream_connection_id >> (8 * j));
+                    }
+                    stream_capture_session(conn->raop->stream_capture, conn->capture_session, STREAM_CAPTURE_MIRROR_STREAM,
+                                           capture_id, sizeof(capture_id));
+
                     if (conn->raop_rtp_mirror) {
                         raop_rtp_init_mirror_aes(conn->raop_rtp_mirror, &stream_connection_id);
+                        raop_rtp_mirror_set_queue_depth(conn->raop_rtp_mirror, conn->raop->video_queue_depth);
+                        raop_rtp_mirror_set_latency_budget(conn->raop_rtp_mirror, conn->raop->video_latency_budget_micros);
+                        raop_rtp_mirror_set_decrypt_threads(conn->raop_rtp_mirror, conn->raop->video_decrypt_threads);
                         raop_rtp_start_mirror(conn->raop_rtp_mirror, use_udp, &dport, conn->raop->clientFPSdata);
                         logger_log(conn->raop->logger, LOGGER_DEBUG, "Mirroring initialized successfully");
                     } else {
@@ -505,6 +528,7 @@ raop_handler_setup(raop_conn_t *conn,
                     unsigned short cport = conn->raop->control_lport, dport = conn->raop->data_lport; 
                     unsigned short remote_cport = 0;
                     unsigned char ct;
+                    unsigned short spf;
                     unsigned int sr = AUDIO_SAMPLE_RATE; /* all AirPlay audio formats supported so far have sample rate 44.1kHz */
 
                     uint64_t uint_val = 0;
@@ -516,17 +540,26 @@ raop_handler_setup(raop_conn_t *conn,
                     plist_get_uint_val(req_stream_ct_node, &uint_val);
                     ct = (unsigned char) uint_val;
 
+                    uint_val = 0;
+                    plist_t req_stream_spf_node = plist_dict_get_item(req_stream_node, "spf");
+                    plist_get_uint_val(req_stream_spf_node, &uint_val);
+                    spf = (unsigned short) uint_val;
+
+                    /* true when the audio goes with a mirrored screen */
+                    bool usingScreen;
+                    uint8_t bool_val = 0;
+                    plist_t req_stream_using_screen_node = plist_dict_get_item(req_stream_node, "usingScreen");
+                    if (req_stream_using_screen_node) {
+                        plist_get_bool_val(req_stream_using_screen_node, &bool_val);
+                        usingScreen = (bool) bool_val;
+                    } else {
+                        usingScreen = false;
+                    }
+
                     if (conn->raop->callbacks.audio_get_format) {
 		        /* get additional audio format parameters  */
                         uint64_t audioFormat;
-                        unsigned short spf;
                         bool isMedia; 
-                        bool usingScreen;
-                        uint8_t bool_val = 0;
-
-                        plist_t req_stream_spf_node = plist_dict_get_item(req_stream_node, "spf");
-                        plist_get_uint_val(req_stream_spf_node, &uint_val);
-                        spf = (unsigned short) uint_val;
 
                         plist_t req_stream_audio_format_node = plist_dict_get_item(req_stream_node, "audioFormat");
                         plist_get_uint_val(req_stream_audio_format_node, &audioFormat);
@@ -539,18 +572,34 @@ raop_handler_setup(raop_conn_t *conn,
                             isMedia = false;
                         }
 
-                        plist_t req_stream_using_screen_node = plist_dict_get_item(req_stream_node, "usingScreen");
-                        if (req_stream_using_screen_node) {
-                            plist_get_bool_val(req_stream_using_screen_node, &bool_val);
-                            usingScreen = (bool) bool_val;
-                        } else {
-                            usingScreen = false;
-                        }
-
                         conn->raop->callbacks.audio_get_format(conn->raop->callbacks.cls, &ct, &spf, &usingScreen, &isMedia, &audioFormat);
                     }
 
-                    if (conn->raop_rtp) {
+                    stream_capture_session(conn->raop->stream_capture, conn->capture_session, STREAM_CAPTURE_AUDIO_FORMAT,
+                                           &ct, 1);
+
+                    if (!conn->raop->callbacks.audio_process && !audio_decoder_supports(ct)) {
+                        /* only audio_process_pcm is set, and the library cannot decode this audio */
+                        logger_log(conn->raop->logger, LOGGER_ERR, "SETUP: no decoder for audio compression type ct=%d "
+                                   "and no audio_process callback, refusing the audio stream", ct);
+                        http_response_set_disconnect(response, 1);
+                    } else if (conn->raop_rtp) {
+                        raop_rtp_set_buffer_depth(conn->raop_rtp, conn->raop->audio_buffer_depth);
+                        raop_rtp_set_receive_options(conn->raop_rtp, conn->raop->audio_recv_batch, conn->raop->audio_rcvbuf_bytes);
+                        raop_rtp_set_concealment(conn->raop_rtp, conn->raop->audio_concealment);
+                        raop_rtp_set_drift_resampling(conn->raop_rtp, conn->raop->audio_drift_resampling);
+                        raop_rtp_set_samples_per_frame(conn->raop_rtp, spf);
+                        if (conn->raop->audio_adaptive_delay && !usingScreen) {
+                            /* moving the audio against mirrored video would break A/V sync */
+                            raop_rtp_set_playout_delay(conn->raop_rtp, conn->raop->audio_delay_micros,
+                                                       conn->raop->audio_delay_min_micros, conn->raop->audio_delay_max_micros);
+                        } else {
+                            raop_rtp_set_playout_delay(conn->raop_rtp, conn->raop->audio_delay_micros, 0, 0);
+                        }
+                        if (conn->raop->audio_adaptive_resend) {
+                            raop_rtp_set_adaptive_resend(conn->raop_rtp, conn->raop->audio_resend_min_micros,
+                                                         conn->raop->audio_resend_max_micros);
+                        }
                         raop_rtp_start_audio(conn->raop_rtp, use_udp, &remote_cport, &cport, &dport, &ct, &sr);
                         logger_log(conn->raop->logger, LOGGER_DEBUG, "RAOP initialized success");
                     } else {
@@ -693,7 +742,15 @@ raop_handler_record(raop_conn_t *conn,
                     char **response_data, int *response_datalen)
 {
     char audio_latency[12];
-    unsigned int ad = (unsigned int) (((uint64_t) conn->raop->audio_delay_micros) * AUDIO_SAMPLE_RATE / SECOND_IN_USECS);
+    int audio_delay_micros = conn->raop->audio_delay_micros;
+    if (conn->raop_rtp) {
+        /* the current target when the playout delay is adaptive */
+        int target_delay_micros = raop_rtp_report_playout_delay(conn->raop_rtp);
+        if (target_delay_micros >= 0) {
+            audio_delay_micros = target_delay_micros;
+        }
+    }
+    unsigned int ad = (unsigned int) (((uint64_t) audio_delay_micros) * AUDIO_SAMPLE_RATE / SECOND_IN_USECS);
     sprintf(audio_latency, "%u", ad);
     logger_log(conn->raop->logger, LOGGER_DEBUG, "raop_handler_record");
     http_response_add_header(response, "Audio-Latency", audio_latency);
@@ -23,10 +23,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #ifdef _WIN32
-#define CAST (char *)
+#define poll WSAPoll
 #else
-#define CAST
+#include <poll.h>
 #endif
 
 #include "raop.h"
@@ -35,6 +36,7 @@
 #include "netutils.h"
 #include "byteutils.h"
 #include "utils.h"
+#include "udp_batch.h"
 
 #define SECOND_IN_NSECS 1000000000UL
 #define RAOP_NTP_DATA_COUNT   8
@@ -46,6 +48,34 @@
 
 #define RAOP_NTP_CLOCK_BASE (2208988800ull << 32)
 
+/* how long to wait for the response to a timing request */
+#define RAOP_NTP_RESPONSE_TIMEOUT_MS 300
+#define RAOP_NTP_RESPONSE_SIZE 128
+
+/* timing requests are sent every RAOP_NTP_INTERVAL_MS, but at the start of a session, every     *
+ * RAOP_NTP_BURST_INTERVAL_MS until RAOP_NTP_BURST_MIN_SAMPLES samples have a delay within         *
+ * RAOP_NTP_BURST_DELAY_MARGIN of the lowest one (the offset is taken from the sample with the     *
+ * lowest delay), or RAOP_NTP_BURST_MAX_REQUESTS requests have been sent, or a request timed out   */
+#define RAOP_NTP_INTERVAL_MS 3000
+#define RAOP_NTP_BURST_INTERVAL_MS 100
+#define RAOP_NTP_BURST_MIN_SAMPLES 4
+#define RAOP_NTP_BURST_DELAY_MARGIN (2 * 1000000ll)  // nsecs
+#define RAOP_NTP_BURST_MAX_REQUESTS 16
+
+/* clock model: offset(t) = offset + skew * (t - time), through the sample with the lowest delay.  The  *
+ * skew is fitted by least squares to the last RAOP_NTP_SKEW_COUNT samples with a delay within          *
+ * RAOP_NTP_BURST_DELAY_MARGIN of the lowest one, with weights 1 / (delay - lowest delay +              *
+ * RAOP_NTP_SKEW_DELAY_WEIGHT)^2, once they span RAOP_NTP_SKEW_MIN_SPAN seconds, and is kept within     *
+ * RAOP_NTP_MAX_SKEW_PPM.  A change of the model is slewed in at up to RAOP_NTP_MAX_SLEW_PPM, unless it *
+ * is larger than RAOP_NTP_STEP_THRESHOLD.                                                              */
+#define RAOP_NTP_SKEW_COUNT 16
+#define RAOP_NTP_SKEW_MIN_SPAN 10
+#define RAOP_NTP_SKEW_UNIT 1e12                      // skew in parts per 10^12
+#define RAOP_NTP_SKEW_DELAY_WEIGHT (200 * 1000.0)  // nsecs
+#define RAOP_NTP_MAX_SKEW_PPM 200
+#define RAOP_NTP_MAX_SLEW_PPM 500
+#define RAOP_NTP_STEP_THRESHOLD (10 * 1000000ll)     // nsecs
+
 typedef struct raop_ntp_data_s {
     uint64_t time; // The local wall clock time at time of ntp packet arrival
     uint64_t dispersion;
@@ -53,10 +83,22 @@ typedef struct raop_ntp_data_s {
     int64_t offset; // The difference between remote and local wall clock time
 } raop_ntp_data_t;
 
+typedef struct raop_ntp_sync_params_s {
+    int64_t time; // The local wall clock time at which the model was updated
+    int64_t offset; // The offset at that time, before slewing
+    int64_t skew; // The rate of change of the offset, in RAOP_NTP_SKEW_UNIT
+    int64_t slew; // The part of offset not yet applied at that time, reduced to 0 at slew_end
+    int64_t slew_end;
+} raop_ntp_sync_params_t;
+
 struct raop_ntp_s {
     logger_t *logger;
     raop_callbacks_t callbacks;
 
+    // The local clock is the monotonic clock plus this offset, the wall clock time at which the
+    // monotonic clock started, so that it reads as wall clock time but never jumps
+    int64_t wall_offset;
+
     int max_ntp_timeouts;
 
     thread_handle_t thread;
@@ -68,11 +110,22 @@ struct raop_ntp_s {
     raop_ntp_data_t data[RAOP_NTP_DATA_COUNT];
     int data_index;
 
-    // The clock sync params are periodically updated to the AirPlay client's NTP clock
-    mutex_handle_t sync_params_mutex;
-    int64_t sync_offset;
-    int64_t sync_dispersion;
-    int64_t sync_delay;
+    // Low-delay samples for the skew estimate (only used by the NTP thread)
+    raop_ntp_data_t skew_data[RAOP_NTP_SKEW_COUNT];
+    int skew_count;
+    int skew_index;
+
+    // The clock sync params are periodically updated to the AirPlay client's NTP clock.
+    // They are written by the NTP thread only, and read without a lock (a seqlock): sync_seq is
+    // odd while they are being written, and readers retry if it changed while they were reading.
+    atomic_uint sync_seq;
+    atomic_int_least64_t sync_time;
+    atomic_int_least64_t sync_offset;
+    atomic_int_least64_t sync_skew;
+    atomic_int_least64_t sync_slew;
+    atomic_int_least64_t sync_slew_end;
+    atomic_int_least64_t sync_dispersion;
+    atomic_int_least64_t sync_delay;
 
     // Socket address of the AirPlay client
     struct sockaddr_storage remote_saddr;
@@ -91,9 +144,28 @@ struct raop_ntp_s {
 
     // UDP socket
     int tsock;
+
+    // Receives the responses with their kernel arrival time (only used by the NTP thread)
+    udp_batch_t *response_batch;
 };
 
 
+static int64_t
+raop_ntp_get_monotonic_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t) time.tv_nsec + (int64_t) time.tv_sec * SECOND_IN_NSECS;
+}
+
+static int64_t
+raop_ntp_get_system_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return (int64_t) time.tv_nsec + (int64_t) time.tv_sec * SECOND_IN_NSECS;
+}
+
 /*
  * Used for sorting the data array by delay
  */
@@ -151,6 +223,7 @@ raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const u
     }
     raop_ntp->logger = logger;
     memcpy(&raop_ntp->callbacks, callbacks, sizeof(raop_callbacks_t));    
+    raop_ntp->wall_offset = raop_ntp_get_system_time() - raop_ntp_get_monotonic_time();
     raop_ntp->timing_rport = timing_rport;
 
     if (raop_ntp_parse_remote_address(raop_ntp, remote_addr, remote_addr_len) < 0) {
@@ -173,14 +246,33 @@ raop_ntp_t *raop_ntp_init(logger_t *logger, raop_callbacks_t *callbacks, const u
         raop_ntp->data[i].time      = time;
     }
 
-    raop_ntp->sync_delay = 0;
-    raop_ntp->sync_dispersion = 0;
-    raop_ntp->sync_offset = 0;
+    atomic_init(&raop_ntp->sync_seq, 0);
+    atomic_init(&raop_ntp->sync_delay, 0);
+    atomic_init(&raop_ntp->sync_dispersion, 0);
+    atomic_init(&raop_ntp->sync_time, 0);
+    atomic_init(&raop_ntp->sync_offset, 0);
+    atomic_init(&raop_ntp->sync_skew, 0);
+    atomic_init(&raop_ntp->sync_slew, 0);
+    atomic_init(&raop_ntp->sync_slew_end, 0);
+
+    raop_ntp->response_batch = udp_batch_init(logger, 1, RAOP_NTP_RESPONSE_SIZE);
+    if (!raop_ntp->response_batch) {
+        free(raop_ntp);
+        return NULL;
+    }
 
     MUTEX_CREATE(raop_ntp->run_mutex);
     MUTEX_CREATE(raop_ntp->wait_mutex);
+#ifdef __APPLE__
     COND_CREATE(raop_ntp->wait_cond);
-    MUTEX_CREATE(raop_ntp->sync_params_mutex);
+#else
+    /* the wait between requests is timed on the monotonic clock too */
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&raop_ntp->wait_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+#endif
     return raop_ntp;
 }
 
@@ -192,7 +284,7 @@ raop_ntp_destroy(raop_ntp_t *raop_ntp)
         MUTEX_DESTROY(raop_ntp->run_mutex);
         MUTEX_DESTROY(raop_ntp->wait_mutex);
         COND_DESTROY(raop_ntp->wait_cond);
-        MUTEX_DESTROY(raop_ntp->sync_params_mutex);
+        udp_batch_destroy(raop_ntp->response_batch);
         free(raop_ntp);
     }
 }
@@ -212,14 +304,8 @@ raop_ntp_init_socket(raop_ntp_t *raop_ntp, int use_ipv6)
         goto sockets_cleanup;
     }
 
-    // We're calling recvfrom without knowing whether there is any data, so we need a timeout
-
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 300000;
-    if (setsockopt(tsock, SOL_SOCKET, SO_RCVTIMEO, CAST &tv, sizeof(tv)) < 0) {
-        goto sockets_cleanup;
-    }
+    // The arrival time of a response is taken from the kernel where possible (SO_TIMESTAMPNS)
+    udp_batch_setup_socket(raop_ntp->logger, tsock, 0);
 
     /* Set socket descriptors */
     raop_ntp->tsock = tsock;
@@ -257,12 +343,177 @@ raop_ntp_flush_socket(int fd)
     }
 }
 
+/*
+ * Publishes a new clock model (called by the NTP thread only)
+ */
+static void
+raop_ntp_set_sync_params(raop_ntp_t *raop_ntp, const raop_ntp_sync_params_t *params, int64_t dispersion, int64_t delay)
+{
+    unsigned int seq = atomic_load_explicit(&raop_ntp->sync_seq, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&raop_ntp->sync_time, params->time, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_offset, params->offset, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_skew, params->skew, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_slew, params->slew, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_slew_end, params->slew_end, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_dispersion, dispersion, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_delay, delay, memory_order_relaxed);
+    atomic_store_explicit(&raop_ntp->sync_seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Reads the clock model without a lock, retrying if it was updated at the same time
+ */
+static void
+raop_ntp_get_sync_params(raop_ntp_t *raop_ntp, raop_ntp_sync_params_t *params)
+{
+    unsigned int seq;
+    do {
+        seq = atomic_load_explicit(&raop_ntp->sync_seq, memory_order_acquire);
+        params->time = atomic_load_explicit(&raop_ntp->sync_time, memory_order_relaxed);
+        params->offset = atomic_load_explicit(&raop_ntp->sync_offset, memory_order_relaxed);
+        params->skew = atomic_load_explicit(&raop_ntp->sync_skew, memory_order_relaxed);
+        params->slew = atomic_load_explicit(&raop_ntp->sync_slew, memory_order_relaxed);
+        params->slew_end = atomic_load_explicit(&raop_ntp->sync_slew_end, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&raop_ntp->sync_seq, memory_order_relaxed));
+}
+
+/*
+ * The offset (remote - local) of the clock model at a given local time
+ */
+static int64_t
+raop_ntp_sync_offset_at(const raop_ntp_sync_params_t *params, int64_t local_time)
+{
+    int64_t offset = params->offset + (int64_t) ((double) (local_time - params->time) * params->skew / RAOP_NTP_SKEW_UNIT);
+    if (params->slew != 0 && local_time < params->slew_end) {
+        double remaining = 1.0;
+        if (local_time > params->time) {
+            remaining = (double) (params->slew_end - local_time) / (double) (params->slew_end - params->time);
+        }
+        offset -= (int64_t) (params->slew * remaining);
+    }
+    return offset;
+}
+
+/*
+ * Weighted least-squares fit of the skew (in RAOP_NTP_SKEW_UNIT) over the samples for the skew
+ * estimate, weighted down by their delay above min_delay; returns false if they span less than
+ * RAOP_NTP_SKEW_MIN_SPAN seconds
+ */
+static bool
+raop_ntp_fit_skew(raop_ntp_t *raop_ntp, int64_t min_delay, int64_t *skew)
+{
+    const raop_ntp_data_t *ref = NULL;
+    double sum_w = 0, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, min_x = 0, max_x = 0;
+
+    for (int i = 0; i < raop_ntp->skew_count; ++i) {
+        const raop_ntp_data_t *data = &raop_ntp->skew_data[i];
+        if (data->delay > min_delay + RAOP_NTP_BURST_DELAY_MARGIN) {
+            continue;
+        }
+        if (!ref) {
+            ref = data;
+        }
+        /* relative to the first sample used, to keep the precision */
+        double x = (double) (int64_t) (data->time - ref->time);
+        double y = (double) (data->offset - ref->offset);
+        double d = (double) (data->delay - min_delay + RAOP_NTP_SKEW_DELAY_WEIGHT);
+        double w = 1.0 / (d * d);
+        sum_w += w;
+        sum_x += w * x;
+        sum_y += w * y;
+        sum_xx += w * x * x;
+        sum_xy += w * x * y;
+        if (x < min_x) {
+            min_x = x;
+        } else if (x > max_x) {
+            max_x = x;
+        }
+    }
+    if (!ref || max_x - min_x < (double) RAOP_NTP_SKEW_MIN_SPAN * SECOND_IN_NSECS) {
+        return false;
+    }
+    double var_x = sum_xx - sum_x * sum_x / sum_w;
+    if (var_x <= 0) {
+        return false;
+    }
+    double slope = (sum_xy - sum_x * sum_y / sum_w) / var_x;
+    double max_slope = RAOP_NTP_MAX_SKEW_PPM / 1000000.0;
+    if (slope > max_slope) {
+        slope = max_slope;
+    } else if (slope < -max_slope) {
+        slope = -max_slope;
+    }
+    *skew = (int64_t) (slope * RAOP_NTP_SKEW_UNIT);
+    return true;
+}
+
+/*
+ * Checks whether enough samples (sorted by delay) have a delay close to the lowest one
+ */
+static bool
+raop_ntp_is_stable(const raop_ntp_data_t *data_sorted)
+{
+    int count = 0;
+    for (int i = 0; i < RAOP_NTP_DATA_COUNT; ++i) {
+        if (data_sorted[i].delay <= data_sorted[0].delay + RAOP_NTP_BURST_DELAY_MARGIN) {
+            count++;
+        }
+    }
+    return count >= RAOP_NTP_BURST_MIN_SAMPLES;
+}
+
+/*
+ * Waits up to RAOP_NTP_RESPONSE_TIMEOUT_MS for the response to the request, skipping responses to
+ * earlier requests; returns its length, or -1 on timeout or error.  arrival receives the local time
+ * at which the kernel received it, or if that is unknown, at which it was read.
+ */
+static int
+raop_ntp_receive_response(raop_ntp_t *raop_ntp, int tsock, const unsigned char *request, unsigned char **response, int64_t *arrival)
+{
+    int64_t deadline = raop_ntp_get_monotonic_time() + RAOP_NTP_RESPONSE_TIMEOUT_MS * 1000000ll;
+    while (1) {
+        int64_t remaining = deadline - raop_ntp_get_monotonic_time();
+        if (remaining <= 0) {
+            return -1;
+        }
+        struct pollfd pfd;
+        pfd.fd = tsock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, (int) ((remaining + 999999) / 1000000)) <= 0) {
+            return -1;
+        }
+        int count = udp_batch_receive(raop_ntp->response_batch, tsock);
+        if (count < 0) {
+            return -1;
+        } else if (count == 0) {
+            continue;
+        }
+        int64_t read_time = (int64_t) raop_ntp_get_local_time(raop_ntp);
+        udp_packet_t *packet = udp_batch_get_packet(raop_ntp->response_batch, 0);
+
+        // The response echoes the send time of the request
+        if (packet->len < 32 || memcmp(packet->data + 8, request + 24, 8)) {
+            logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp ignoring a response to an earlier request");
+            continue;
+        }
+        *response = packet->data;
+        *arrival = (packet->arrival ? (int64_t) raop_ntp_convert_system_time(raop_ntp, packet->arrival) : read_time);
+        return (int) packet->len;
+    }
+}
+
 static THREAD_RETVAL
 raop_ntp_thread(void *arg)
 {
     raop_ntp_t *raop_ntp = arg;
     assert(raop_ntp);
-    unsigned char response[128];
+    /* the socket stays open until raop_ntp_stop() has joined this thread */
+    int tsock = raop_ntp->tsock;
+    unsigned char *response;
     int response_len;
     unsigned char request[32] = {0x80, 0xd2, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
                                  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
@@ -271,7 +522,12 @@ raop_ntp_thread(void *arg)
     const unsigned  two_pow_n[RAOP_NTP_DATA_COUNT] = {2, 4, 8, 16, 32, 64, 128, 256};
     int timeout_counter = 0;
     bool conn_reset = false;
-      
+    bool burst = true;
+    int burst_requests = 0;
+    uint64_t burst_start = raop_ntp_get_local_time(raop_ntp);
+    int64_t first_offset = 0;
+    bool have_model = false;
+
     while (1) {
         MUTEX_LOCK(raop_ntp->run_mutex);
         if (!raop_ntp->running) {
@@ -281,12 +537,12 @@ raop_ntp_thread(void *arg)
         MUTEX_UNLOCK(raop_ntp->run_mutex);
 
         // Flush the socket in case a super delayed response arrived or something
-        raop_ntp_flush_socket(raop_ntp->tsock);
+        raop_ntp_flush_socket(tsock);
 
-        // Send request
+        // Send request, with the send time taken just before it is sent
         uint64_t send_time = raop_ntp_get_local_time(raop_ntp);
         byteutils_put_ntp_timestamp(request, 24, send_time);
-        int send_len = sendto(raop_ntp->tsock, (char *)request, sizeof(request), 0,
+        int send_len = sendto(tsock, (char *)request, sizeof(request), 0,
                               (struct sockaddr *) &raop_ntp->remote_saddr, raop_ntp->remote_saddr_len);
         char *str = utils_data_to_string(request, send_len, 16);
         logger_log(raop_ntp->logger, LOGGER_DEBUG, "\nraop_ntp send time type_t=%d send_len = %d, now = %8.6f\n%s",
@@ -296,8 +552,8 @@ raop_ntp_thread(void *arg)
             logger_log(raop_ntp->logger, LOGGER_ERR, "raop_ntp error sending request");
         } else {
             // Read response
-            response_len = recvfrom(raop_ntp->tsock, (char *)response, sizeof(response), 0,
-                                    (struct sockaddr *) &raop_ntp->remote_saddr, &raop_ntp->remote_saddr_len);
+            int64_t t3;
+            response_len = raop_ntp_receive_response(raop_ntp, tsock, request, &response, &t3);
             if (response_len < 0) {
                 timeout_counter++;
                 char time[30];
@@ -309,9 +565,14 @@ raop_ntp_thread(void *arg)
                     conn_reset = true;   /* client is no longer responding */
                     break;
                 }
+                if (burst) {
+                    /* do not use up the allowed timeouts at the burst rate */
+                    burst = false;
+                    logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp startup burst ended by a timeout after %d samples",
+                               burst_requests);
+                }
 	    } else {
-                //local time of the server when the NTP response packet returns
-                int64_t t3 = (int64_t) raop_ntp_get_local_time(raop_ntp);
+                // t3 is the local time of the server when the NTP response packet returns
                 timeout_counter = 0;
 
                 // Local time of the server when the NTP request packet leaves the server
@@ -352,24 +613,75 @@ raop_ntp_thread(void *arg)
                     dispersion += disp / two_pow_n[i];
                 }
 
-                MUTEX_LOCK(raop_ntp->sync_params_mutex);
-
-                int64_t correction = offset - raop_ntp->sync_offset;
-                raop_ntp->sync_offset = offset;
-                raop_ntp->sync_dispersion = dispersion;
-                raop_ntp->sync_delay = delay;
-                MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
+                // Keep the low-delay samples for the skew estimate
+                raop_ntp_data_t *sample = &raop_ntp->data[raop_ntp->data_index];
+                if (sample->delay <= data_sorted[0].delay + RAOP_NTP_BURST_DELAY_MARGIN) {
+                    raop_ntp->skew_data[raop_ntp->skew_index] = *sample;
+                    raop_ntp->skew_index = (raop_ntp->skew_index + 1) % RAOP_NTP_SKEW_COUNT;
+                    if (raop_ntp->skew_count < RAOP_NTP_SKEW_COUNT) {
+                        raop_ntp->skew_count++;
+                    }
+                }
 
-                logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld", correction);
+                // Update the clock model; the change is slewed in, unless it is too large
+                raop_ntp_sync_params_t params;
+                raop_ntp_get_sync_params(raop_ntp, &params);
+                int64_t current = raop_ntp_sync_offset_at(&params, t3);
+                int64_t skew = params.skew;
+                raop_ntp_fit_skew(raop_ntp, data_sorted[0].delay, &skew);
+                offset = data_sorted[0].offset + (int64_t) ((double) (t3 - (int64_t) data_sorted[0].time) * skew / RAOP_NTP_SKEW_UNIT);
+                int64_t correction = offset - current;
+                params.time = t3;
+                params.offset = offset;
+                params.skew = skew;
+                params.slew = 0;
+                params.slew_end = t3;
+                if (have_model && llabs(correction) <= RAOP_NTP_STEP_THRESHOLD) {
+                    params.slew = correction;
+                    params.slew_end = t3 + llabs(correction) * 1000000 / RAOP_NTP_MAX_SLEW_PPM;
+                }
+                raop_ntp_set_sync_params(raop_ntp, &params, (int64_t) dispersion, delay);
+                have_model = true;
+
+                logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp sync correction = %lld (%s), skew = %.3f ppm", correction,
+                           params.slew ? "slewed" : "stepped", (double) skew * 1000000 / RAOP_NTP_SKEW_UNIT);
+
+                if (burst) {
+                    if (++burst_requests == 1) {
+                        first_offset = offset;
+                    }
+                    if (raop_ntp_is_stable(data_sorted) || burst_requests >= RAOP_NTP_BURST_MAX_REQUESTS) {
+                        burst = false;
+                        logger_log(raop_ntp->logger, LOGGER_INFO, "raop_ntp clock offset stable after %.3f sec (%d samples, "
+                                   "lowest delay %.3f ms), %.3f ms from the first sample", (double) (t3 - burst_start) / SECOND_IN_NSECS,
+                                   burst_requests, (double) data_sorted[0].delay / 1000000, (double) (offset - first_offset) / 1000000);
+                    }
+                }
             }
         }
 
-        // Sleep for 3 seconds
+        // Sleep until the next request (3 seconds, or less during the startup burst)
         struct timespec wait_time;
+        long interval_ms = (burst ? RAOP_NTP_BURST_INTERVAL_MS : RAOP_NTP_INTERVAL_MS);
         MUTEX_LOCK(raop_ntp->wait_mutex);
+#ifdef __APPLE__
         clock_gettime(CLOCK_REALTIME, &wait_time);
-        wait_time.tv_sec += 3;
-        pthread_cond_timedwait(&raop_ntp->wait_cond, &raop_ntp->wait_mutex, &wait_time);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &wait_time);
+#endif
+        wait_time.tv_sec += interval_ms / 1000;
+        wait_time.tv_nsec += (interval_ms % 1000) * 1000000;
+        if (wait_time.tv_nsec >= 1000000000) {
+            wait_time.tv_sec++;
+            wait_time.tv_nsec -= 1000000000;
+        }
+        /* raop_ntp_stop() clears running before it signals wait_cond under wait_mutex */
+        MUTEX_LOCK(raop_ntp->run_mutex);
+        bool running = raop_ntp->running;
+        MUTEX_UNLOCK(raop_ntp->run_mutex);
+        if (running) {
+            pthread_cond_timedwait(&raop_ntp->wait_cond, &raop_ntp->wait_mutex, &wait_time);
+        }
         MUTEX_UNLOCK(raop_ntp->wait_mutex);
     }
 
@@ -445,13 +757,14 @@ raop_ntp_stop(raop_ntp_t *raop_ntp)
     COND_SIGNAL(raop_ntp->wait_cond);
     MUTEX_UNLOCK(raop_ntp->wait_mutex);
 
+    /* the thread returns within RAOP_NTP_RESPONSE_TIMEOUT_MS; its socket is closed after that */
+    THREAD_JOIN(raop_ntp->thread);
+
     if (raop_ntp->tsock != -1) {
         closesocket(raop_ntp->tsock);
         raop_ntp->tsock = -1;
     }
 
-    THREAD_JOIN(raop_ntp->thread);
-
     logger_log(raop_ntp->logger, LOGGER_DEBUG, "raop_ntp stopped time thread");
 
     /* Mark thread as joined */
@@ -475,40 +788,47 @@ uint64_t raop_ntp_timestamp_to_nano_seconds(uint64_t ntp_timestamp, bool account
 
 /**
  * Returns the current time in nano seconds according to the local wall clock.
- * The system Unix time is used as the local wall clock.
+ * The monotonic clock is used, offset to the system Unix time when the session started,
+ * so that steps of the system clock (e.g. by ntpd) do not disturb the clock sync.
  */
 uint64_t raop_ntp_get_local_time(raop_ntp_t *raop_ntp) {
-    struct timespec time;
-    clock_gettime(CLOCK_REALTIME, &time);
-    return ((uint64_t) time.tv_nsec) + (uint64_t) time.tv_sec * SECOND_IN_NSECS;
+    return (uint64_t) (raop_ntp_get_monotonic_time() + raop_ntp->wall_offset);
+}
+
+/**
+ * Converts a system Unix time in nano seconds (e.g. a kernel receive timestamp) to local wall clock time
+ */
+uint64_t raop_ntp_convert_system_time(raop_ntp_t *raop_ntp, uint64_t system_time) {
+    int64_t local_time = (int64_t) raop_ntp_get_local_time(raop_ntp);
+    return (uint64_t) ((int64_t) system_time + (local_time - raop_ntp_get_system_time()));
 }
 
 /**
  * Returns the current time in nano seconds according to the remote wall clock.
  */
 uint64_t raop_ntp_get_remote_time(raop_ntp_t *raop_ntp) {
-    MUTEX_LOCK(raop_ntp->sync_params_mutex);
-    int64_t offset = raop_ntp->sync_offset;
-    MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
-    return (uint64_t) ((int64_t) raop_ntp_get_local_time(raop_ntp) + offset);
+    raop_ntp_sync_params_t params;
+    raop_ntp_get_sync_params(raop_ntp, &params);
+    int64_t local_time = (int64_t) raop_ntp_get_local_time(raop_ntp);
+    return (uint64_t) (local_time + raop_ntp_sync_offset_at(&params, local_time));
 }
 
 /**
  * Returns the local wall clock time in nano seconds for the given point in remote clock time
  */
 uint64_t raop_ntp_convert_remote_time(raop_ntp_t *raop_ntp, uint64_t remote_time) {
-    MUTEX_LOCK(raop_ntp->sync_params_mutex);
-    int64_t offset = raop_ntp->sync_offset;
-    MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
-    return (uint64_t) ((int64_t) remote_time - offset);
+    raop_ntp_sync_params_t params;
+    raop_ntp_get_sync_params(raop_ntp, &params);
+    /* the offset changes so slowly that it can be evaluated at remote_time - offset */
+    int64_t local_time = (int64_t) remote_time - params.offset;
+    return (uint64_t) ((int64_t) remote_time - raop_ntp_sync_offset_at(&params, local_time));
 }
 
 /**
  * Returns the remote wall clock time in nano seconds for the given point in local clock time
  */
 uint64_t raop_ntp_convert_local_time(raop_ntp_t *raop_ntp, uint64_t local_time) {
-    MUTEX_LOCK(raop_ntp->sync_params_mutex);
-    int64_t offset = raop_ntp->sync_offset;
-    MUTEX_UNLOCK(raop_ntp->sync_params_mutex);
-    return (uint64_t) ((int64_t) local_time + offset);
+    raop_ntp_sync_params_t params;
+    raop_ntp_get_sync_params(raop_ntp, &params);
+    return (uint64_t) ((int64_t) local_time + raop_ntp_sync_offset_at(&params, (int64_t) local_time));
 }
@@ -0,0 +1,285 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "raop_replay.h"
+#include "stream_capture.h"
+#include "threads.h"
+
+#define SECOND_IN_NSECS 1000000000ULL
+
+/* all AirPlay audio formats supported so far have sample rate 44.1kHz */
+#define RAOP_REPLAY_SAMPLE_RATE 44100
+
+/* the mirror frame header, as in raop_rtp_mirror.c */
+#define RAOP_REPLAY_MIRROR_HEADER_SIZE 128
+
+typedef struct raop_replay_s {
+    logger_t *logger;
+    raop_callbacks_t *callbacks;
+    raop_ntp_t *ntp;
+    raop_rtp_t *raop_rtp;
+    raop_rtp_mirror_t *raop_rtp_mirror;
+    bool mirror_aes;              /* raop_rtp_init_mirror_aes() has been called */
+    bool audio_started;           /* raop_rtp_start_replay() has been called */
+    unsigned char keys[2 * RAOP_AESKEY_LEN];
+    bool have_keys;
+    uint32_t session;             /* the session being replayed, 0 until its keys are found */
+    raop_replay_stats_t *stats;
+} raop_replay_t;
+
+static uint64_t
+raop_replay_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static uint32_t
+raop_replay_get_le32(const unsigned char *b)
+{
+    return (uint32_t) b[0] | ((uint32_t) b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static uint64_t
+raop_replay_get_le64(const unsigned char *b)
+{
+    return (uint64_t) raop_replay_get_le32(b) | ((uint64_t) raop_replay_get_le32(b + 4) << 32);
+}
+
+static void
+raop_replay_close_session(raop_replay_t *replay)
+{
+    if (replay->raop_rtp) {
+        raop_rtp_destroy(replay->raop_rtp);
+        replay->raop_rtp = NULL;
+    }
+    if (replay->raop_rtp_mirror) {
+        raop_rtp_mirror_destroy(replay->raop_rtp_mirror);
+        replay->raop_rtp_mirror = NULL;
+    }
+    replay->mirror_aes = false;
+    replay->audio_started = false;
+}
+
+/* a new set of keys starts a new session, as a SETUP request does */
+static int
+raop_replay_open_session(raop_replay_t *replay)
+{
+    const unsigned char remote[4] = { 127, 0, 0, 1 };
+    const unsigned char *aeskey = replay->keys;
+    const unsigned char *aesiv = replay->keys + RAOP_AESKEY_LEN;
+
+    raop_replay_close_session(replay);
+    replay->raop_rtp = raop_rtp_init(replay->logger, replay->callbacks, replay->ntp, remote, sizeof(remote), aeskey, aesiv);
+    replay->raop_rtp_mirror = raop_rtp_mirror_init(replay->logger, replay->callbacks, replay->ntp, remote, sizeof(remote), aeskey);
+    if (!replay->raop_rtp || !replay->raop_rtp_mirror) {
+        logger_log(replay->logger, LOGGER_ERR, "raop_replay: could not initialize session");
+        raop_replay_close_session(replay);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+raop_replay_record(raop_replay_t *replay, int type, unsigned char *data, uint32_t len)
+{
+    switch (type) {
+    case STREAM_CAPTURE_AUDIO_KEYS:
+        if (len != sizeof(replay->keys)) {
+            break;
+        }
+        memcpy(replay->keys, data, sizeof(replay->keys));
+        replay->have_keys = true;
+        raop_replay_open_session(replay);
+        return;
+    case STREAM_CAPTURE_MIRROR_STREAM:
+        if (len != 8 || !replay->have_keys) {
+            break;
+        }
+        /* the mirror AES key and IV can only be set once */
+        if (replay->mirror_aes || !replay->raop_rtp_mirror) {
+            const unsigned char remote[4] = { 127, 0, 0, 1 };
+            if (replay->raop_rtp_mirror) {
+                raop_rtp_mirror_destroy(replay->raop_rtp_mirror);
+            }
+            replay->raop_rtp_mirror = raop_rtp_mirror_init(replay->logger, replay->callbacks, replay->ntp, remote, sizeof(remote), replay->keys);
+            replay->mirror_aes = false;
+            if (!replay->raop_rtp_mirror) {
+                break;
+            }
+        }
+        uint64_t stream_connection_id = raop_replay_get_le64(data);
+        raop_rtp_init_mirror_aes(replay->raop_rtp_mirror, &stream_connection_id);
+        replay->mirror_aes = true;
+        return;
+    case STREAM_CAPTURE_AUDIO_FORMAT:
+        if (len != 1 || !replay->raop_rtp) {
+            break;
+        }
+        raop_rtp_start_replay(replay->raop_rtp, data[0], RAOP_REPLAY_SAMPLE_RATE, &replay->stats->audio);
+        replay->audio_started = true;
+        return;
+    case STREAM_CAPTURE_MIRROR_FRAME:
+        if (len < 8 + RAOP_REPLAY_MIRROR_HEADER_SIZE || !replay->mirror_aes) {
+            break;
+        }
+        unsigned char *packet = data + 8;
+        int payload_size = (int) (len - 8 - RAOP_REPLAY_MIRROR_HEADER_SIZE);
+        if (raop_replay_get_le32(packet) != (uint32_t) payload_size) {
+            logger_log(replay->logger, LOGGER_ERR, "raop_replay: mirror frame with inconsistent payload size");
+            break;
+        }
+        raop_rtp_mirror_replay_frame(replay->raop_rtp_mirror, raop_replay_get_le64(data), packet, payload_size,
+                                     &replay->stats->video);
+        return;
+    case STREAM_CAPTURE_AUDIO_DATA:
+    case STREAM_CAPTURE_AUDIO_CONTROL:
+        if (!replay->audio_started) {
+            break;
+        }
+        raop_rtp_replay_packet(replay->raop_rtp, type == STREAM_CAPTURE_AUDIO_CONTROL, data, len);
+        return;
+    default:
+        break;
+    }
+    replay->stats->skipped++;
+}
+
+/* Replays the records of one session (one connection), the first one with keys if session *
+ * is 0; returns 0 when the whole file has been replayed, -1 on error                      */
+int
+raop_replay_file(logger_t *logger, raop_callbacks_t *callbacks, const char *filename,
+                 uint32_t session, bool realtime, raop_replay_stats_t *stats)
+{
+    unsigned char header[STREAM_CAPTURE_FILE_HEADER_SIZE];
+    unsigned char record[STREAM_CAPTURE_RECORD_HEADER_SIZE];
+    const unsigned char remote[4] = { 127, 0, 0, 1 };
+    unsigned char *data = NULL;
+    size_t data_size = 0;
+    uint64_t first_time = 0, last_time = 0, wall_start;
+    bool have_time = false;
+    int ret = 0;
+    raop_replay_t replay;
+    FILE *file;
+
+    assert(logger);
+    assert(callbacks);
+    assert(filename);
+    assert(stats);
+    memset(stats, 0, sizeof(raop_replay_stats_t));
+    memset(&replay, 0, sizeof(replay));
+    replay.logger = logger;
+    replay.callbacks = callbacks;
+    replay.stats = stats;
+    replay.session = session;
+
+    file = fopen(filename, "rb");
+    if (!file) {
+        logger_log(logger, LOGGER_ERR, "raop_replay: could not open %s", filename);
+        return -1;
+    }
+    if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, STREAM_CAPTURE_MAGIC, 8) ||
+        raop_replay_get_le32(header + 8) != STREAM_CAPTURE_VERSION) {
+        logger_log(logger, LOGGER_ERR, "raop_replay: %s is not a capture file", filename);
+        fclose(file);
+        return -1;
+    }
+    replay.ntp = raop_ntp_init(logger, callbacks, remote, sizeof(remote), 0);
+    if (!replay.ntp) {
+        fclose(file);
+        return -1;
+    }
+
+    wall_start = raop_replay_now();
+    while (fread(record, sizeof(record), 1, file) == 1) {
+        int type = (int) raop_replay_get_le32(record);
+        uint32_t len = raop_replay_get_le32(record + 4);
+        uint64_t time = raop_replay_get_le64(record + 8);
+        uint32_t record_session = raop_replay_get_le32(record + 16);
+
+        if (type == STREAM_CAPTURE_INDEX) {
+            if (fseek(file, (long) len, SEEK_CUR) != 0) {
+                break;
+            }
+            continue;
+        }
+        if (len > data_size) {
+            unsigned char *new_data = realloc(data, len);
+            if (!new_data) {
+                logger_log(logger, LOGGER_ERR, "raop_replay: record of %u bytes is too large", len);
+                ret = -1;
+                break;
+            }
+            data = new_data;
+            data_size = len;
+        }
+        if (len && fread(data, len, 1, file) != 1) {
+            logger_log(logger, LOGGER_WARNING, "raop_replay: capture file ends in the middle of a record");
+            break;
+        }
+        stats->records++;
+        stats->bytes += sizeof(record) + len;
+
+        /* records of other sessions (connections) are skipped */
+        if (!replay.session && type == STREAM_CAPTURE_AUDIO_KEYS) {
+            replay.session = record_session;
+            logger_log(logger, LOGGER_INFO, "raop_replay: replaying session %u", record_session);
+        }
+        if (record_session != replay.session) {
+            stats->skipped++;
+            continue;
+        }
+        if (type == STREAM_CAPTURE_SESSION_END) {
+            raop_replay_close_session(&replay);
+            replay.have_keys = false;
+            continue;
+        }
+
+        /* session records may have been recorded long before the capture started, *
+         * so only the stream records are used for timing                           */
+        if (type >= STREAM_CAPTURE_MIRROR_FRAME) {
+            if (!have_time) {
+                first_time = time;
+                have_time = true;
+            }
+            if (time > last_time) {
+                last_time = time;
+            }
+            if (realtime && time > first_time) {
+                uint64_t due = wall_start + (time - first_time);
+                uint64_t now = raop_replay_now();
+                if (due > now) {
+                    struct timespec wait;
+                    wait.tv_sec = (time_t) ((due - now) / SECOND_IN_NSECS);
+                    wait.tv_nsec = (long) ((due - now) % SECOND_IN_NSECS);
+                    nanosleep(&wait, NULL);
+                }
+            }
+        }
+        raop_replay_record(&replay, type, data, len);
+    }
+
+    stats->wall_seconds = (double) (raop_replay_now() - wall_start) / SECOND_IN_NSECS;
+    stats->capture_seconds = (double) (last_time - first_time) / SECOND_IN_NSECS;
+    raop_replay_close_session(&replay);
+    raop_ntp_destroy(replay.ntp);
+    free(data);
+    fclose(file);
+    return ret;
+}
@@ -0,0 +1,41 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef RAOP_REPLAY_H
+#define RAOP_REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "raop.h"
+#include "logger.h"
+#include "raop_rtp.h"
+#include "raop_rtp_mirror.h"
+
+/* Replay of a session recorded with raop_start_capture(), through the same decryption, *
+ * NAL conversion, audio buffering and callbacks as a live session, but without network *
+ * sockets or receiving threads.  Frames are processed as fast as possible, or with     *
+ * their recorded timing if realtime is set.                                             */
+
+typedef struct {
+    uint64_t records;
+    uint64_t bytes;               /* size of the records read */
+    uint64_t skipped;             /* records that could not be replayed (e.g. no keys yet) */
+    double wall_seconds;          /* time taken by the replay */
+    double capture_seconds;       /* time between the first and last recorded packet */
+    raop_rtp_mirror_timing_t video;
+    raop_rtp_timing_t audio;
+} raop_replay_stats_t;
+
+int raop_replay_file(logger_t *logger, raop_callbacks_t *callbacks, const char *filename,
+                     uint32_t session, bool realtime, raop_replay_stats_t *stats);
+
+#endif //RAOP_REPLAY_H
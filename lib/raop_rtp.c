@@ -21,6 +21,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
+#include <math.h>
 
 #include "raop_rtp.h"
 #include "raop.h"
@@ -30,15 +32,63 @@
 #include "logger.h"
 #include "byteutils.h"
 #include "mirror_buffer.h"
+#include "stream_capture.h"
+#include "udp_batch.h"
+#include "audio_decoder.h"
+#include "audio_resampler.h"
+#include "audio_conceal.h"
 #include "stream.h"
 #include "utils.h"
 
 #define NO_FLUSH (-42)
 
 #define SECOND_IN_NSECS 1000000000
-#define RAOP_RTP_SYNC_DATA_COUNT 8
 #define SEC SECOND_IN_NSECS
 
+/* RTP to NTP clock model: a least-squares fit of the offset and rate of the sender's RTP clock *
+ * over the last RAOP_RTP_SYNC_DATA_COUNT sync packets (about one per second).  The rate is only  *
+ * fitted once the history spans RAOP_RTP_SYNC_MIN_SPAN seconds, and is kept within               *
+ * RAOP_RTP_SYNC_MAX_DRIFT_PPM of the nominal rate; a sync further than RAOP_RTP_SYNC_RESET_NSECS *
+ * from the model (e.g. after a seek) starts a new history.                                       */
+#define RAOP_RTP_SYNC_DATA_COUNT 32
+#define RAOP_RTP_SYNC_MIN_SPAN 4
+#define RAOP_RTP_SYNC_MAX_DRIFT_PPM 500
+#define RAOP_RTP_SYNC_RESET_NSECS (50 * 1000000LL)
+
+/* UDP packets larger than this are dropped (audio packets have at most RAOP_BUFFER_SLOT_SIZE *
+ * bytes of payload, and resent packets add 4 bytes to that)                                  */
+#define RAOP_RTP_UDP_SLOT_SIZE 4096
+
+/* adaptive resend window: it covers ADAPTIVE_JITTER_FACTOR times the interarrival jitter, *
+ * plus ADAPTIVE_LOSS_DELAY seconds per unit of packet loss fraction.  The adaptive playout  *
+ * delay covers that window and one frame, and moves by at most ADAPTIVE_DELAY_SLEW of the   *
+ * duration of each frame (well within the range of the drift resampler).                    */
+#define ADAPTIVE_JITTER_FACTOR 4.0
+#define ADAPTIVE_LOSS_DELAY 2.0
+#define ADAPTIVE_UPDATE_INTERVAL (SECOND_IN_NSECS / 2)
+#define ADAPTIVE_DELAY_SLEW 0.0005
+
+/* drift compensation of the decoded audio: the number of output samples follows the local time *
+ * elapsed since the first frame; the resampling ratio is the sender's clock rate from the sync  *
+ * model, corrected so that an error of N samples is removed in about DRIFT_CORRECTION_TIME      *
+ * seconds, and kept within DRIFT_MAX_PPM.  Errors over DRIFT_RESET_SECONDS (e.g. after a gap)   *
+ * restart the timeline.  When the renderer reports the audio it has queued                      *
+ * (audio_get_pcm_delay), the error is instead, after the first DRIFT_OUTPUT_FILTER_TIME        *
+ * seconds of the timeline, how much later than then the frames will be played, averaged over    *
+ * DRIFT_OUTPUT_FILTER_TIME seconds: the output then follows the clock of the output device,     *
+ * which consumes the queue.                                                                     */
+#define DRIFT_CORRECTION_TIME 10.0
+#define DRIFT_MAX_PPM 1000.0
+#define DRIFT_RESET_SECONDS 0.1
+#define DRIFT_OUTPUT_FILTER_TIME 1.0
+
+/* concealment of the decoded audio: gaps of up to CONCEAL_MAX_GAP are filled (by the decoder's *
+ * own concealment, or audio_conceal_fill()); a frame decoded after its playout time delays the  *
+ * following ones by its lateness (up to CONCEAL_MAX_OFFSET in all), and this delay is removed   *
+ * again by compressing the audio with audio_conceal_compress().                                 */
+#define CONCEAL_MAX_GAP (SECOND_IN_NSECS / 5)
+#define CONCEAL_MAX_OFFSET (SECOND_IN_NSECS / 2)
+
 #define DELAY_AAC  0.275  //empirical, matches audio latency of about -0.25 sec after first clock sync event
 
 /* note: it is unclear what will happen in the unlikely event that this code is running at the time of the unix-time 
@@ -56,7 +106,10 @@ struct raop_rtp_s {
     // Time and sync
     raop_ntp_t *ntp;
     double rtp_clock_rate;
-    int64_t rtp_sync_offset;
+    /* clock model fitted to the sync history: ntp = rtp_sync_ntp + rtp_sync_rate * (rtp - rtp_sync_rtp) */
+    uint64_t rtp_sync_rtp;
+    int64_t rtp_sync_ntp;
+    double rtp_sync_rate;
     raop_rtp_sync_data_t sync_data[RAOP_RTP_SYNC_DATA_COUNT];
     int sync_data_index;
     uint64_t ntp_start_time;
@@ -64,13 +117,30 @@ struct raop_rtp_s {
     uint64_t rtp_time;
     bool rtp_clock_started;
 
-    // Transmission Stats, could be used if a playout buffer is needed
-    // float interarrival_jitter; // As defined by RTP RFC 3550, Section 6.4.1
-    // unsigned int last_packet_transit_time;
-    //int transit = (packet_receive_time - packet_send_time);
-    // int d = transit - last_packet_transit_time;
-    // if (d < 0) d = -d;
-    // interarrival_jitter = (1.f / 16.f) * ((double) d - interarrival_jitter);
+    /* Decoder for the audio_process_pcm callback (NULL if not used) */
+    audio_decoder_t *decoder;
+
+    /* Drift compensation of the decoded audio (NULL if not used) */
+    bool drift_resampling;
+    audio_resampler_t *resampler;
+    bool drift_started;
+    bool drift_flushed;           /* the resampler history is not continuous with the next frame */
+    uint64_t drift_start_time;    /* local time of the first frame of the timeline */
+    uint64_t drift_next_rtp;      /* rtp time of the frame that should follow */
+    double drift_output_samples;  /* output samples since drift_start_time */
+    double drift_ratio;
+    bool drift_output;            /* the timeline follows the renderer's queue (audio_get_pcm_delay) */
+    int64_t drift_output_start;   /* nsecs after their playout time that frames were played at the start */
+    double drift_output_delay;    /* averaged nsecs by which frames are played later than at the start */
+
+    /* Concealment of missing and late frames in the decoded audio (NULL if not used) */
+    bool concealment;
+    audio_conceal_t *conceal;
+    bool conceal_started;
+    uint64_t conceal_next_rtp;    /* rtp time of the frame that should follow */
+    uint64_t conceal_offset;      /* nsecs by which the decoded audio is played later than its sender's timing */
+    uint64_t concealed_samples;
+    uint64_t compressed_samples;
 
     /* Buffer to handle all resends */
     raop_buffer_t *buffer;
@@ -98,6 +168,13 @@ struct raop_rtp_s {
     int progress_changed;
 
     int flush;
+
+    /* adaptive playout delay (nsecs): the current target, and the delay the client was told  *
+     * to time the audio for (at RECORD); playout_target_delay is only written by the thread  *
+     * that processes packets                                                                 */
+    uint64_t playout_target_delay;
+    uint64_t playout_reported_delay;
+
     thread_handle_t thread;
     mutex_handle_t run_mutex;
     /* MUTEX LOCKED VARIABLES END */
@@ -119,6 +196,54 @@ struct raop_rtp_s {
 
     /* audio compression type: ct = 2 (ALAC), ct = 8 (AAC_ELD) (ct = 4 would be AAC-MAIN) */
     unsigned char ct;
+
+    /* state of the received stream, only used by the thread that processes packets */
+    bool have_synced;
+    bool no_data_yet;
+    int rtp_count;
+    double sync_adjustment;
+    uint64_t delay;
+    unsigned short seqnum1, seqnum2;
+    int no_resend;
+
+    /* adaptive playout delay (playout_max_delay = 0: disabled), in nsecs: the audio is played   *
+     * playout_offset later than the sender's timing, which is for playout_delay (a copy of     *
+     * playout_reported_delay, 0: unknown), so that the delay follows playout_target_delay      */
+    uint64_t playout_delay;
+    uint64_t playout_min_delay;
+    uint64_t playout_max_delay;
+    int64_t playout_offset;
+    bool playout_offset_started;
+
+    /* adaptive resend window (resend_max_window = 0: disabled), in nsecs: how long raop_buffer *
+     * waits for the resend of a missing packet, always less than the playout delay            */
+    uint64_t resend_min_window;
+    uint64_t resend_max_window;
+    uint64_t resend_window;
+    /* RFC 3550 interarrival jitter estimate (nsecs) and packet loss, from the data packets */
+    double jitter;
+    int64_t last_transit;
+    bool have_transit;
+    uint32_t max_ext_seqnum;
+    uint32_t interval_base_seqnum;
+    uint32_t interval_received;
+    uint64_t interval_start;
+    double loss_fraction;
+    uint32_t last_rtp_timestamp;
+    unsigned int spf;
+    unsigned int setup_spf;       /* samples per frame announced at SETUP (0: unknown) */
+
+    /* batched reception: packets per socket read, and SO_RCVBUF size (0: system default) */
+    int receive_batch_size;
+    int receive_buffer_size;
+    raop_rtp_receive_stats_t receive_stats;  /* protected by run_mutex */
+
+    /* optional capture of the received packets (owned by raop_t) */
+    stream_capture_t *stream_capture;
+    uint32_t capture_session;
+
+    /* optional time spent in each stage, when replaying a capture */
+    raop_rtp_timing_t *timing;
 };
 
 static int
@@ -164,7 +289,9 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
     raop_rtp->logger = logger;
     raop_rtp->ntp = ntp;
 
-    raop_rtp->rtp_sync_offset = 0;
+    raop_rtp->rtp_sync_rtp = 0;
+    raop_rtp->rtp_sync_ntp = 0;
+    raop_rtp->rtp_sync_rate = 0;
     raop_rtp->sync_data_index = 0;
     for (int i = 0; i < RAOP_RTP_SYNC_DATA_COUNT; ++i) {
         raop_rtp->sync_data[i].ntp_time = 0;
@@ -194,6 +321,8 @@ raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, co
     raop_rtp->running = 0;
     raop_rtp->joined = 1;
     raop_rtp->flush = NO_FLUSH;
+    raop_rtp->receive_batch_size = UDP_BATCH_DEFAULT_SIZE;
+    raop_rtp->receive_buffer_size = 0;
 
     MUTEX_CREATE(raop_rtp->run_mutex);
     return raop_rtp;
@@ -207,6 +336,9 @@ raop_rtp_destroy(raop_rtp_t *raop_rtp)
         raop_rtp_stop(raop_rtp);
         MUTEX_DESTROY(raop_rtp->run_mutex);
         raop_buffer_destroy(raop_rtp->buffer);
+        audio_decoder_destroy(raop_rtp->decoder);
+        audio_resampler_destroy(raop_rtp->resampler);
+        audio_conceal_destroy(raop_rtp->conceal);
         free(raop_rtp->metadata);
         free(raop_rtp->coverart);
         free(raop_rtp->dacp_id);
@@ -263,6 +395,9 @@ raop_rtp_init_sockets(raop_rtp_t *raop_rtp, int use_ipv6, int use_udp)
         goto sockets_cleanup;
     }
 
+    udp_batch_setup_socket(raop_rtp->logger, csock, raop_rtp->receive_buffer_size);
+    udp_batch_setup_socket(raop_rtp->logger, dsock, raop_rtp->receive_buffer_size);
+
     /* Set socket descriptors */
     raop_rtp->csock = csock;
     raop_rtp->dsock = dsock;
@@ -314,6 +449,9 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
     flush = raop_rtp->flush;
     raop_rtp->flush = NO_FLUSH;
 
+    /* Read the playout delay the client times the audio for */
+    raop_rtp->playout_delay = raop_rtp->playout_reported_delay;
+
     /* Read the metadata */
     metadata = raop_rtp->metadata;
     metadata_len = raop_rtp->metadata_len;
@@ -351,6 +489,18 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
 
     /* Handle flush if requested */
     if (flush != NO_FLUSH) {
+        if (raop_rtp->decoder) {
+            audio_decoder_flush(raop_rtp->decoder);
+        }
+        raop_rtp->drift_started = false;
+        raop_rtp->drift_flushed = true;
+        if (raop_rtp->conceal) {
+            audio_conceal_reset(raop_rtp->conceal);
+        }
+        raop_rtp->conceal_started = false;
+        raop_rtp->conceal_offset = 0;
+        /* a change of the playout delay can be made at once in the silence after a flush */
+        raop_rtp->playout_offset_started = false;
         if (raop_rtp->callbacks.audio_flush) {
             raop_rtp->callbacks.audio_flush(raop_rtp->callbacks.cls);
         }
@@ -389,35 +539,74 @@ raop_rtp_process_events(raop_rtp_t *raop_rtp, void *cb_data)
     return 0;
 }
 
+/* remote ntp time of rtp_time, from the clock model (only valid once have_synced is set) */
+static uint64_t
+raop_rtp_sync_ntp_time(raop_rtp_t *raop_rtp, uint64_t rtp_time)
+{
+    int64_t rtp_delta = (int64_t) (rtp_time - raop_rtp->rtp_sync_rtp);
+    return (uint64_t) (raop_rtp->rtp_sync_ntp + (int64_t) (raop_rtp->rtp_sync_rate * (double) rtp_delta));
+}
+
 void raop_rtp_sync_clock(raop_rtp_t *raop_rtp, uint64_t *ntp_time, uint64_t *rtp_time) {
-    /* ntp_time = (uint64_t)(((int64_t)(raop_rtp->rtp_clock_rate * rtp_time)) + raop_rtp->rtp_sync_offset)  */
     int latest, valid_data_count = 0;
-    uint64_t ntp_sum = 0, rtp_sum = 0;
-    double offset = ((double) *ntp_time) - raop_rtp->rtp_clock_rate * *rtp_time;
-    int64_t correction = 0;
+    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, min_x = 0;
+    double slope = 0, max_slope;
+
+    for (int i = 0; i < RAOP_RTP_SYNC_DATA_COUNT; i++) {
+        if (raop_rtp->sync_data[i].ntp_time != 0) {
+            valid_data_count++;
+        }
+    }
+    if (valid_data_count) {
+        int64_t error = (int64_t) (*ntp_time - raop_rtp_sync_ntp_time(raop_rtp, *rtp_time));
+        if (error > RAOP_RTP_SYNC_RESET_NSECS || error < -RAOP_RTP_SYNC_RESET_NSECS) {
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp sync is %8.6f sec from the clock model, starting a new sync history",
+                       (double) error / SEC);
+            for (int i = 0; i < RAOP_RTP_SYNC_DATA_COUNT; i++) {
+                raop_rtp->sync_data[i].ntp_time = 0;
+            }
+        }
+    }
 
     raop_rtp->sync_data_index = (raop_rtp->sync_data_index + 1) % RAOP_RTP_SYNC_DATA_COUNT;
     latest = raop_rtp->sync_data_index;
     raop_rtp->sync_data[latest].rtp_time = *rtp_time;
     raop_rtp->sync_data[latest].ntp_time = *ntp_time;
 
+    /* fit y = intercept + slope * x, with x = rtp - latest rtp (samples) and y = ntp - latest ntp  *
+     * - rtp_clock_rate * x (nsecs), so that slope is the rate correction, and intercept the offset *
+     * correction at the latest sync                                                                */
+    valid_data_count = 0;
     for (int i = 0; i < RAOP_RTP_SYNC_DATA_COUNT; i++) {
         if (raop_rtp->sync_data[i].ntp_time == 0) continue;
+        double x = (double) (int64_t) (raop_rtp->sync_data[i].rtp_time - *rtp_time);
+        double y = (double) (int64_t) (raop_rtp->sync_data[i].ntp_time - *ntp_time) - raop_rtp->rtp_clock_rate * x;
         valid_data_count++;
-        if (i == latest) continue;
-        ntp_sum += *ntp_time - raop_rtp->sync_data[i].ntp_time;
-        rtp_sum += *rtp_time - raop_rtp->sync_data[i].rtp_time;
+        sum_x += x;
+        sum_y += y;
+        sum_xx += x * x;
+        sum_xy += x * y;
+        if (x < min_x) min_x = x;
     }
-
-    if (valid_data_count > 1) {
-        correction -= raop_rtp->rtp_sync_offset;
-        offset += (((double) ntp_sum) - raop_rtp->rtp_clock_rate * rtp_sum) / valid_data_count;
+    double mean_x = sum_x / valid_data_count;
+    double mean_y = sum_y / valid_data_count;
+    if (-min_x * raop_rtp->rtp_clock_rate >= (double) RAOP_RTP_SYNC_MIN_SPAN * SECOND_IN_NSECS) {
+        slope = (sum_xy - valid_data_count * mean_x * mean_y) / (sum_xx - valid_data_count * mean_x * mean_x);
+        max_slope = raop_rtp->rtp_clock_rate * RAOP_RTP_SYNC_MAX_DRIFT_PPM / 1000000.0;
+        if (slope > max_slope) {
+            slope = max_slope;
+        } else if (slope < -max_slope) {
+            slope = -max_slope;
+        }
     }
-    raop_rtp->rtp_sync_offset = (int64_t) offset;
-    correction += raop_rtp->rtp_sync_offset;
-
-    logger_log(raop_rtp->logger, LOGGER_DEBUG, "dataset %d raop_rtp sync correction=%lld, rtp_sync_offset = %8.6f ",
-               valid_data_count, correction, offset);
+    int64_t sync_ntp = (int64_t) *ntp_time + (int64_t) (mean_y - slope * mean_x);
+    int64_t correction = sync_ntp - (int64_t) raop_rtp_sync_ntp_time(raop_rtp, *rtp_time);
+    raop_rtp->rtp_sync_rtp = *rtp_time;
+    raop_rtp->rtp_sync_ntp = sync_ntp;
+    raop_rtp->rtp_sync_rate = raop_rtp->rtp_clock_rate + slope;
+
+    logger_log(raop_rtp->logger, LOGGER_DEBUG, "dataset %d raop_rtp sync correction=%lld, drift = %.1f ppm",
+               valid_data_count, (long long) correction, 1000000.0 * slope / raop_rtp->rtp_clock_rate);
 }
 
 uint64_t rtp64_time (raop_rtp_t *raop_rtp, const uint32_t *rtp32) {
@@ -444,32 +633,741 @@ uint64_t rtp64_time (raop_rtp_t *raop_rtp, const uint32_t *rtp32) {
     return  raop_rtp->rtp_time;
 }
 
-static THREAD_RETVAL
-raop_rtp_thread_udp(void *arg)
+static inline uint64_t
+raop_rtp_timing_now(void)
 {
-    raop_rtp_t *raop_rtp = arg;
-    unsigned char packet[RAOP_PACKET_LEN];
-    unsigned int packetlen;
-    struct sockaddr_storage saddr;
-    socklen_t saddrlen;
-
-    /* for initial rtp to ntp conversions */    
-    bool have_synced = false;
-    bool no_data_yet = true;
-    unsigned char no_data_marker[] = {0x00, 0x68, 0x34, 0x00 };
-    int rtp_count = 0;
-    double sync_adjustment = 0;
-    uint64_t delay = 0;
-    unsigned short seqnum1 = 0, seqnum2 = 0;
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
 
-    assert(raop_rtp);
+static void
+raop_rtp_capture_packet(raop_rtp_t *raop_rtp, int type, const unsigned char *packet, int packetlen)
+{
+    if (raop_rtp->stream_capture && stream_capture_is_active(raop_rtp->stream_capture) && packetlen > 0) {
+        stream_capture_record(raop_rtp->stream_capture, raop_rtp->capture_session, type, NULL, 0, packet, packetlen);
+    }
+}
+
+/* resets the state used to process received packets, before the first packet */
+static void
+raop_rtp_reset_receive_state(raop_rtp_t *raop_rtp)
+{
     raop_rtp->ntp_start_time = raop_ntp_get_local_time(raop_rtp->ntp);
     raop_rtp->rtp_clock_started = false;
     for (int i = 0; i < RAOP_RTP_SYNC_DATA_COUNT; i++) {
         raop_rtp->sync_data[i].ntp_time = 0;
     }
+    raop_rtp->have_synced = false;
+    raop_rtp->no_data_yet = true;
+    raop_rtp->rtp_count = 0;
+    raop_rtp->sync_adjustment = 0;
+    raop_rtp->delay = 0;
+    raop_rtp->seqnum1 = 0;
+    raop_rtp->seqnum2 = 0;
+    raop_rtp->no_resend = (raop_rtp->control_rport == 0); /* true when control_rport is not set */
+    raop_rtp->jitter = 0;
+    raop_rtp->have_transit = false;
+    raop_rtp->interval_start = 0;
+    raop_rtp->loss_fraction = 0;
+    raop_rtp->playout_offset_started = false;
+}
+
+/* samples per frame (and packet) expected for the audio compression type */
+static unsigned int
+raop_rtp_default_spf(unsigned char ct)
+{
+    switch (ct) {
+    case 2:
+        return 352;   /* ALAC */
+    case 8:
+        return 480;   /* AAC-ELD */
+    default:
+        return 1024;  /* AAC */
+    }
+}
+
+/* the resend window is applied as the number of packets raop_buffer *
+ * holds behind a missing packet while waiting for its resend         */
+static void
+raop_rtp_apply_resend_window(raop_rtp_t *raop_rtp)
+{
+    uint64_t frame_duration = (uint64_t) (raop_rtp->rtp_clock_rate * raop_rtp->spf);
+    if (frame_duration == 0) {
+        return;
+    }
+    int wait_length = (int) ((raop_rtp->resend_window + frame_duration - 1) / frame_duration);
+    raop_buffer_set_wait_length(raop_rtp->buffer, wait_length);
+}
+
+/* a resend arriving after the playout time is of no use: the resend window is limited to the *
+ * playout delay minus one frame (no limit while the playout delay is unknown)                 */
+static uint64_t
+raop_rtp_resend_limit(raop_rtp_t *raop_rtp, uint64_t playout_delay)
+{
+    uint64_t frame_duration = (uint64_t) (raop_rtp->rtp_clock_rate * raop_rtp->spf);
+    if (playout_delay == 0) {
+        return UINT64_MAX;
+    }
+    return (playout_delay > frame_duration ? playout_delay - frame_duration : 0);
+}
+
+/* prepares the adaptive resend window and playout delay, once the compression type and *
+ * sample rate are known                                                                 */
+static void
+raop_rtp_init_adaptive(raop_rtp_t *raop_rtp)
+{
+    raop_rtp->spf = raop_rtp->setup_spf ? raop_rtp->setup_spf : raop_rtp_default_spf(raop_rtp->ct);
+    raop_rtp->playout_offset = 0;
+    raop_rtp->playout_offset_started = false;
+    if (!raop_rtp->resend_max_window) {
+        return;
+    }
+    /* the window can grow with an adaptive playout delay, and starts at its limit */
+    uint64_t limit = raop_rtp_resend_limit(raop_rtp, raop_rtp->playout_max_delay ? raop_rtp->playout_max_delay :
+                                                     raop_rtp->playout_delay);
+    if (limit == 0) {
+        logger_log(raop_rtp->logger, LOGGER_WARNING, "raop_rtp: the playout delay is too short to wait for resends");
+        raop_rtp->resend_max_window = 0;
+        return;
+    } else if (raop_rtp->resend_max_window > limit) {
+        raop_rtp->resend_max_window = limit;
+    }
+    if (raop_rtp->resend_min_window > raop_rtp->resend_max_window) {
+        raop_rtp->resend_min_window = raop_rtp->resend_max_window;
+    }
+    raop_rtp->resend_window = raop_rtp_resend_limit(raop_rtp, raop_rtp->playout_delay);
+    if (raop_rtp->resend_window > raop_rtp->resend_max_window) {
+        raop_rtp->resend_window = raop_rtp->resend_max_window;
+    } else if (raop_rtp->resend_window < raop_rtp->resend_min_window) {
+        raop_rtp->resend_window = raop_rtp->resend_min_window;
+    }
+
+    /* make sure the buffer can hold the largest window */
+    uint64_t frame_duration = (uint64_t) (raop_rtp->rtp_clock_rate * raop_rtp->spf);
+    int length = (int) ((raop_rtp->resend_max_window + frame_duration - 1) / frame_duration);
+    if (length > raop_buffer_get_length(raop_rtp->buffer)) {
+        raop_buffer_set_length(raop_rtp->buffer, length);
+    }
+    raop_rtp_apply_resend_window(raop_rtp);
+}
+
+/* creates the decoder for the audio_process_pcm callback, once the compression type is known */
+static void
+raop_rtp_init_decoder(raop_rtp_t *raop_rtp, unsigned int sr)
+{
+    audio_decoder_destroy(raop_rtp->decoder);
+    raop_rtp->decoder = NULL;
+    audio_resampler_destroy(raop_rtp->resampler);
+    raop_rtp->resampler = NULL;
+    raop_rtp->drift_started = false;
+    raop_rtp->drift_flushed = false;
+    audio_conceal_destroy(raop_rtp->conceal);
+    raop_rtp->conceal = NULL;
+    raop_rtp->conceal_started = false;
+    raop_rtp->conceal_offset = 0;
+    if (raop_rtp->callbacks.audio_process_pcm) {
+        raop_rtp->decoder = audio_decoder_init(raop_rtp->logger, raop_rtp->ct, (int) sr, (int) raop_rtp->spf);
+    }
+    if (raop_rtp->decoder && raop_rtp->drift_resampling) {
+        raop_rtp->resampler = audio_resampler_init(AUDIO_DECODER_CHANNELS, AUDIO_DECODER_MAX_FRAME_SAMPLES);
+    }
+    if (raop_rtp->decoder && raop_rtp->concealment) {
+        raop_rtp->conceal = audio_conceal_init(AUDIO_DECODER_CHANNELS, (int) sr, AUDIO_DECODER_MAX_FRAME_SAMPLES);
+    }
+}
+
+/* resamples a decoded frame so that the output follows the local clock, or the output device's *
+ * clock (see DRIFT_CORRECTION_TIME)                                                             */
+static void
+raop_rtp_resample(raop_rtp_t *raop_rtp, audio_pcm_struct *pcm)
+{
+    double sample_rate = pcm->sample_rate;
+    int16_t *out;
+    bool have_output_delay = false;
+    int64_t output_delay = 0;
+
+    if (!pcm->sync_status || pcm->channels != AUDIO_DECODER_CHANNELS || raop_rtp->rtp_sync_rate <= 0) {
+        /* this frame is not resampled */
+        raop_rtp->drift_started = false;
+        raop_rtp->drift_flushed = true;
+        return;
+    }
+    if (raop_rtp->callbacks.audio_get_pcm_delay) {
+        int64_t queued = raop_rtp->callbacks.audio_get_pcm_delay(raop_rtp->callbacks.cls);
+        if (queued >= 0) {
+            /* the first sample of this frame will be played after the queued audio */
+            output_delay = (int64_t) raop_ntp_get_local_time(raop_rtp->ntp) + queued - (int64_t) pcm->ntp_time_local;
+            have_output_delay = true;
+        }
+    }
+    if (raop_rtp->drift_started && raop_rtp->drift_output != have_output_delay) {
+        raop_rtp->drift_started = false;
+    }
+    if (raop_rtp->drift_started) {
+        /* missing frames are counted as if they had been played */
+        int64_t gap = (int64_t) (pcm->rtp_time - raop_rtp->drift_next_rtp);
+        raop_rtp->drift_output_samples += gap * raop_rtp->drift_ratio;
+        double expected = (double) (int64_t) (pcm->ntp_time_local - raop_rtp->drift_start_time) * sample_rate / SECOND_IN_NSECS;
+        double error = raop_rtp->drift_output_samples - expected;
+        if (raop_rtp->drift_output && expected < DRIFT_OUTPUT_FILTER_TIME * sample_rate) {
+            /* the local clock is followed until the renderer's queue has settled (it may be filling up) */
+            raop_rtp->drift_output_start = output_delay;
+        } else if (raop_rtp->drift_output) {
+            /* they are not in the renderer's queue, so the frames are played that much earlier */
+            raop_rtp->drift_output_start -= (int64_t) (gap * raop_rtp->drift_ratio * SECOND_IN_NSECS / sample_rate);
+            double delay = (double) (output_delay - raop_rtp->drift_output_start);
+            double weight = (double) pcm->sample_count / (sample_rate * DRIFT_OUTPUT_FILTER_TIME);
+            raop_rtp->drift_output_delay += (delay - raop_rtp->drift_output_delay) * (weight < 1 ? weight : 1);
+            error = raop_rtp->drift_output_delay * sample_rate / SECOND_IN_NSECS;
+        }
+        if (fabs(error) > DRIFT_RESET_SECONDS * sample_rate) {
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp drift: output is %.1f ms from the %s clock, restarting",
+                       1000.0 * error / sample_rate, raop_rtp->drift_output ? "output device" : "local");
+            raop_rtp->drift_started = false;
+        } else {
+            double ratio = (raop_rtp->rtp_sync_rate / raop_rtp->rtp_clock_rate) * (1 - error / (sample_rate * DRIFT_CORRECTION_TIME));
+            double max_deviation = DRIFT_MAX_PPM / 1000000.0;
+            if (ratio > 1 + max_deviation) {
+                ratio = 1 + max_deviation;
+            } else if (ratio < 1 - max_deviation) {
+                ratio = 1 - max_deviation;
+            }
+            raop_rtp->drift_ratio = ratio;
+        }
+    }
+    if (!raop_rtp->drift_started) {
+        /* a new timeline; the resampler keeps its history unless the audio was interrupted, *
+         * since resetting it restarts the output with silence                             */
+        raop_rtp->drift_started = true;
+        raop_rtp->drift_start_time = pcm->ntp_time_local;
+        raop_rtp->drift_output_samples = 0;
+        raop_rtp->drift_ratio = raop_rtp->rtp_sync_rate / raop_rtp->rtp_clock_rate;
+        raop_rtp->drift_output = have_output_delay;
+        raop_rtp->drift_output_start = output_delay;
+        raop_rtp->drift_output_delay = 0;
+        if (raop_rtp->drift_flushed) {
+            audio_resampler_reset(raop_rtp->resampler);
+            raop_rtp->drift_flushed = false;
+        }
+    }
+    audio_resampler_set_ratio(raop_rtp->resampler, raop_rtp->drift_ratio);
+    raop_rtp->drift_next_rtp = pcm->rtp_time + pcm->sample_count;
+    pcm->sample_count = audio_resampler_process(raop_rtp->resampler, pcm->data, pcm->sample_count, &out);
+    pcm->data = out;
+    raop_rtp->drift_output_samples += pcm->sample_count;
+}
+
+static void
+raop_rtp_deliver_pcm(raop_rtp_t *raop_rtp, audio_pcm_struct *pcm, raop_rtp_timing_t *timing)
+{
+    uint64_t time_start = 0;
+
+    if (raop_rtp->resampler) {
+        if (timing) {
+            time_start = raop_rtp_timing_now();
+        }
+        raop_rtp_resample(raop_rtp, pcm);
+        if (timing) {
+            timing->resample_ns += raop_rtp_timing_now() - time_start;
+        }
+    }
+    raop_rtp->callbacks.audio_process_pcm(raop_rtp->callbacks.cls, raop_rtp->ntp, pcm);
+}
+
+/* fills the gap between the last decoded frame and audio_data (see CONCEAL_MAX_GAP) */
+static void
+raop_rtp_conceal_gap(raop_rtp_t *raop_rtp, audio_decode_struct *audio_data, raop_rtp_timing_t *timing)
+{
+    audio_pcm_struct pcm;
+
+    if (!raop_rtp->conceal_started || audio_data->rtp_time <= raop_rtp->conceal_next_rtp) {
+        return;
+    }
+    uint64_t gap = audio_data->rtp_time - raop_rtp->conceal_next_rtp;
+    if (raop_rtp->rtp_clock_rate * gap > CONCEAL_MAX_GAP) {
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp conceal: gap of %llu samples is too long",
+                   (unsigned long long) gap);
+        audio_conceal_reset(raop_rtp->conceal);
+        raop_rtp->conceal_offset = 0;
+        return;
+    }
+    while (gap > 0) {
+        uint64_t ahead = (uint64_t) (raop_rtp->rtp_clock_rate * (audio_data->rtp_time - raop_rtp->conceal_next_rtp));
+        bool own = (audio_decoder_conceal(raop_rtp->decoder, &pcm) == 0 && pcm.sample_count > 0 &&
+                    pcm.channels == AUDIO_DECODER_CHANNELS);
+        if (!own) {
+            pcm.sample_count = audio_conceal_fill(raop_rtp->conceal, (int) gap, &pcm.data);
+            pcm.channels = AUDIO_DECODER_CHANNELS;
+            if (pcm.sample_count <= 0) {
+                break;
+            }
+        } else {
+            audio_conceal_frame(raop_rtp->conceal, pcm.data, pcm.sample_count);
+        }
+        pcm.sync_status = audio_data->sync_status;
+        pcm.ntp_time_local = audio_data->ntp_time_local - ahead + raop_rtp->conceal_offset;
+        pcm.ntp_time_remote = audio_data->ntp_time_remote - ahead + raop_rtp->conceal_offset;
+        pcm.rtp_time = raop_rtp->conceal_next_rtp;
+        pcm.seqnum = audio_data->seqnum;
+        raop_rtp->concealed_samples += pcm.sample_count;
+        raop_rtp->conceal_next_rtp += pcm.sample_count;
+        gap = (pcm.sample_count < (int) gap ? gap - pcm.sample_count : 0);
+        raop_rtp_deliver_pcm(raop_rtp, &pcm, timing);
+    }
+}
+
+/* delays a frame decoded after its playout time, and compresses frames while they are delayed *
+ * (see CONCEAL_MAX_OFFSET)                                                                     */
+static void
+raop_rtp_conceal_frame(raop_rtp_t *raop_rtp, audio_pcm_struct *pcm)
+{
+    uint64_t now = raop_ntp_get_local_time(raop_rtp->ntp);
+    uint64_t playout = pcm->ntp_time_local + raop_rtp->conceal_offset;
+    int count = pcm->sample_count;
+
+    if (now > playout) {
+        raop_rtp->conceal_offset += now - playout;
+        if (raop_rtp->conceal_offset > CONCEAL_MAX_OFFSET) {
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp conceal: audio is %8.6f sec late, not catching up",
+                       (double) raop_rtp->conceal_offset / SEC);
+            raop_rtp->conceal_offset = 0;
+        }
+        /* the output timeline has moved */
+        raop_rtp->drift_started = false;
+    }
+    pcm->ntp_time_local += raop_rtp->conceal_offset;
+    pcm->ntp_time_remote += raop_rtp->conceal_offset;
+    if (raop_rtp->conceal_offset > 0 && pcm->channels == AUDIO_DECODER_CHANNELS) {
+        int wanted = (int) ceil((double) raop_rtp->conceal_offset / raop_rtp->rtp_clock_rate);
+        pcm->sample_count = audio_conceal_compress(raop_rtp->conceal, pcm->data, count, wanted);
+        uint64_t removed = (uint64_t) (raop_rtp->rtp_clock_rate * (count - pcm->sample_count));
+        raop_rtp->conceal_offset = (removed < raop_rtp->conceal_offset ? raop_rtp->conceal_offset - removed : 0);
+        raop_rtp->compressed_samples += count - pcm->sample_count;
+    }
+    if (pcm->channels == AUDIO_DECODER_CHANNELS) {
+        audio_conceal_frame(raop_rtp->conceal, pcm->data, pcm->sample_count);
+    }
+    raop_rtp->conceal_started = true;
+    raop_rtp->conceal_next_rtp = pcm->rtp_time + count;
+}
+
+static void
+raop_rtp_decode(raop_rtp_t *raop_rtp, audio_decode_struct *audio_data, raop_rtp_timing_t *timing)
+{
+    audio_pcm_struct pcm;
+    uint64_t time_start = 0;
+
+    /* the decoder's concealment has to run before the next frame is decoded */
+    if (raop_rtp->conceal) {
+        if (timing) {
+            time_start = raop_rtp_timing_now();
+        }
+        raop_rtp_conceal_gap(raop_rtp, audio_data, timing);
+        if (timing) {
+            timing->conceal_ns += raop_rtp_timing_now() - time_start;
+        }
+    }
+    if (timing) {
+        time_start = raop_rtp_timing_now();
+    }
+    int ret = audio_decoder_decode(raop_rtp->decoder, audio_data->data, audio_data->data_len, &pcm);
+    if (timing) {
+        timing->decode_ns += raop_rtp_timing_now() - time_start;
+    }
+    if (ret < 0 || pcm.sample_count == 0) {
+        return;
+    }
+    pcm.sync_status = audio_data->sync_status;
+    pcm.ntp_time_local = audio_data->ntp_time_local;
+    pcm.ntp_time_remote = audio_data->ntp_time_remote;
+    pcm.rtp_time = audio_data->rtp_time;
+    pcm.seqnum = audio_data->seqnum;
+    if (raop_rtp->conceal) {
+        if (timing) {
+            time_start = raop_rtp_timing_now();
+        }
+        raop_rtp_conceal_frame(raop_rtp, &pcm);
+        if (timing) {
+            timing->conceal_ns += raop_rtp_timing_now() - time_start;
+        }
+    }
+    raop_rtp_deliver_pcm(raop_rtp, &pcm, timing);
+}
+
+/* moves an adaptive value towards desired, within min and max: it grows at once but shrinks gradually */
+static uint64_t
+raop_rtp_adapt(uint64_t value, double desired, uint64_t min, uint64_t max)
+{
+    if (desired < (double) min) {
+        desired = (double) min;
+    } else if (desired > (double) max) {
+        desired = (double) max;
+    }
+    if ((uint64_t) desired > value) {
+        return (uint64_t) desired;
+    }
+    return value - (value - (uint64_t) desired) / 4;
+}
+
+/* Estimates the interarrival jitter and packet loss of the data packets as in RFC 3550 (A.3 and *
+ * A.8), and every ADAPTIVE_UPDATE_INTERVAL derives from them a new resend window and target     *
+ * playout delay.  stored is false for duplicate or late packets.                                */
+static void
+raop_rtp_update_adaptive(raop_rtp_t *raop_rtp, unsigned short seqnum, uint64_t rtp_time, uint64_t arrival, bool stored)
+{
+    if (!raop_rtp->resend_max_window && !raop_rtp->playout_max_delay) {
+        return;
+    }
+    uint64_t now = (arrival ? raop_ntp_convert_system_time(raop_rtp->ntp, arrival) : raop_ntp_get_local_time(raop_rtp->ntp));
+    if (raop_rtp->interval_start == 0) {
+        raop_rtp->max_ext_seqnum = seqnum;
+        raop_rtp->interval_base_seqnum = (uint32_t) seqnum - 1;
+        raop_rtp->interval_received = 0;
+        raop_rtp->interval_start = now;
+        raop_rtp->last_rtp_timestamp = (uint32_t) rtp_time;
+    } else {
+        short delta = (short) (seqnum - (unsigned short) raop_rtp->max_ext_seqnum);
+        if (delta > 0) {
+            uint32_t spf = (uint32_t) rtp_time - raop_rtp->last_rtp_timestamp;
+            if (delta == 1 && spf > 0 && spf <= 4096) {
+                raop_rtp->spf = spf;
+            }
+            raop_rtp->max_ext_seqnum += delta;
+            raop_rtp->last_rtp_timestamp = (uint32_t) rtp_time;
+        }
+    }
+    if (stored) {
+        int64_t transit = (int64_t) now - (int64_t) (raop_rtp->rtp_clock_rate * rtp_time);
+        if (raop_rtp->have_transit) {
+            double d = (double) (transit - raop_rtp->last_transit);
+            raop_rtp->jitter += (fabs(d) - raop_rtp->jitter) / 16.0;
+        }
+        raop_rtp->last_transit = transit;
+        raop_rtp->have_transit = true;
+        raop_rtp->interval_received++;
+    }
+    if (now - raop_rtp->interval_start < ADAPTIVE_UPDATE_INTERVAL) {
+        return;
+    }
+
+    uint32_t expected = raop_rtp->max_ext_seqnum - raop_rtp->interval_base_seqnum;
+    double fraction = 0.0;
+    if (expected > raop_rtp->interval_received) {
+        fraction = (double) (expected - raop_rtp->interval_received) / expected;
+    }
+    raop_rtp->loss_fraction += (fraction - raop_rtp->loss_fraction) / 4.0;
+    raop_rtp->interval_base_seqnum = raop_rtp->max_ext_seqnum;
+    raop_rtp->interval_received = 0;
+    raop_rtp->interval_start = now;
+
+    double desired = ADAPTIVE_JITTER_FACTOR * raop_rtp->jitter + ADAPTIVE_LOSS_DELAY * SECOND_IN_NSECS * raop_rtp->loss_fraction;
+    if (raop_rtp->playout_max_delay) {
+        double frame_duration = raop_rtp->rtp_clock_rate * raop_rtp->spf;
+        uint64_t target = raop_rtp_adapt(raop_rtp->playout_target_delay, desired + frame_duration,
+                                         raop_rtp->playout_min_delay, raop_rtp->playout_max_delay);
+        MUTEX_LOCK(raop_rtp->run_mutex);
+        raop_rtp->playout_target_delay = target;
+        MUTEX_UNLOCK(raop_rtp->run_mutex);
+    }
+    if (raop_rtp->resend_max_window) {
+        /* limited by the playout delay in effect */
+        int64_t playout_delay = (int64_t) raop_rtp->playout_delay + raop_rtp->playout_offset;
+        uint64_t max_window = raop_rtp_resend_limit(raop_rtp, (uint64_t) (playout_delay > 0 ? playout_delay : 1));
+        if (max_window > raop_rtp->resend_max_window) {
+            max_window = raop_rtp->resend_max_window;
+        }
+        uint64_t min_window = (raop_rtp->resend_min_window < max_window ? raop_rtp->resend_min_window : max_window);
+        raop_rtp->resend_window = raop_rtp_adapt(raop_rtp->resend_window, desired, min_window, max_window);
+        raop_rtp_apply_resend_window(raop_rtp);
+    }
+    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp adaptive: jitter %8.6f, loss %5.3f, resend window %8.6f, "
+               "playout delay %8.6f (target %8.6f)", raop_rtp->jitter / SEC, raop_rtp->loss_fraction,
+               (double) raop_rtp->resend_window / SEC, ((double) raop_rtp->playout_delay + raop_rtp->playout_offset) / SEC,
+               (double) (raop_rtp->playout_max_delay ? raop_rtp->playout_target_delay : raop_rtp->playout_delay) / SEC);
+}
+
+/* plays the audio playout_offset later than the sender's timing, so that the playout delay follows *
+ * its target: the offset moves by at most ADAPTIVE_DELAY_SLEW of each frame's duration, except     *
+ * when playback starts or restarts after a flush, where it is set at once                          */
+static void
+raop_rtp_apply_playout_delay(raop_rtp_t *raop_rtp, audio_decode_struct *audio_data)
+{
+    if (!raop_rtp->playout_max_delay || !raop_rtp->playout_delay) {
+        return;
+    }
+    int64_t wanted = (int64_t) raop_rtp->playout_target_delay - (int64_t) raop_rtp->playout_delay;
+    if (!raop_rtp->playout_offset_started) {
+        raop_rtp->playout_offset = wanted;
+        raop_rtp->playout_offset_started = true;
+    } else {
+        int64_t step = (int64_t) (ADAPTIVE_DELAY_SLEW * raop_rtp->rtp_clock_rate * raop_rtp->spf);
+        if (wanted > raop_rtp->playout_offset + step) {
+            raop_rtp->playout_offset += step;
+        } else if (wanted < raop_rtp->playout_offset - step) {
+            raop_rtp->playout_offset -= step;
+        } else {
+            raop_rtp->playout_offset = wanted;
+        }
+    }
+    audio_data->ntp_time_local += raop_rtp->playout_offset;
+    audio_data->ntp_time_remote += raop_rtp->playout_offset;
+}
+
+static void
+raop_rtp_process_control_packet(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen)
+{
+    int type_c = packet[1] & ~0x80;
+    logger_log(raop_rtp->logger, LOGGER_DEBUG, "\nraop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
+
+    if (type_c == 0x56 && packetlen >= 8) {
+        /* Handle resent data packet, which begins at offset 4 of these packets */
+        unsigned char *resent_packet =  &packet[4];
+        unsigned int resent_packetlen = packetlen - 4;
+        unsigned short seqnum = byteutils_get_short_be(resent_packet, 2);
+        if (resent_packetlen >= 12) {
+            uint32_t timestamp = byteutils_get_int_be(resent_packet, 4);
+            uint64_t rtp_time = rtp64_time(raop_rtp, &timestamp);
+            uint64_t ntp_time = 0;
+            if (raop_rtp->have_synced) {
+                ntp_time = raop_rtp_sync_ntp_time(raop_rtp, rtp_time);
+            }
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp resent audio packet: seqnum=%u", seqnum);
+            int result = raop_buffer_enqueue(raop_rtp->buffer, resent_packet, resent_packetlen, &ntp_time, &rtp_time, 1);
+            assert(result >= 0);
+        } else {
+            /* type_c = 0x56 packets  with length 8 have been reported */
+            char *str = utils_data_to_string(packet, packetlen, 16);
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received empty resent audio packet length %d, seqnum=%u:\n%s",
+                       packetlen, seqnum, str);
+            free (str);
+        }
+    } else if (type_c == 0x54 && packetlen >= 20) {
+        /* packet[0] = 0x90 (first sync ?) or 0x80 (subsequent ones)
+         * packet[1] = 0xd4,  (0xd4 && ~0x80 = type 0x54)
+         * packet[2:3] = 0x00 0x04
+         * packet[4:7] : sync_rtp (big-endian uint32_t)
+         * packet[8:15]: remote ntp timestamp (big-endian uint64_t)  
+         * packet[16:20]: next_rtp (big-endian uint32_t)
+         * next_rtp = sync_rtp + 7497 =  441 *  17 (0.17 sec) for AAC-ELD
+         * next_rtp = sync_rtp + 77175  = 441 * 175 (1.75 sec) for ALAC */
+
+        // The unit for the rtp clock is 1 / sample rate = 1 / 44100
+        uint32_t sync_rtp = byteutils_get_int_be(packet, 4);
+        uint64_t sync_rtp64 = rtp64_time(raop_rtp, &sync_rtp);
+        if (raop_rtp->have_synced == false) {
+            logger_log(raop_rtp->logger, LOGGER_DEBUG, "first audio rtp sync");
+            raop_rtp->have_synced = true;
+        }
+        uint64_t sync_ntp_raw = byteutils_get_long_be(packet, 8);
+        uint64_t sync_ntp_remote = raop_ntp_timestamp_to_nano_seconds(sync_ntp_raw, true);
+        uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp, sync_ntp_remote);
+        char *str = utils_data_to_string(packet, packetlen, 20);
+        logger_log(raop_rtp->logger, LOGGER_DEBUG,
+                   "raop_rtp sync: client ntp=%8.6f, ntp = %8.6f, ntp_start_time %8.6f\nts_client = %8.6f sync_rtp=%u\n%s",
+                   (double) sync_ntp_remote / SEC, (double) sync_ntp_local / SEC,
+                   (double) raop_rtp->ntp_start_time / SEC, (double) sync_ntp_remote / SEC, sync_rtp, str);
+        free(str);
+        raop_rtp_sync_clock(raop_rtp, &sync_ntp_remote, &sync_rtp64);		
+    } else {
+        char *str = utils_data_to_string(packet, packetlen, 16);
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown udp control packet\n%s", str);
+        free(str);
+    }
+}
+
+/* rtp audio data packets:
+ * packet[0] 0x80
+ * packet[1] 0x60 = 96
+ * packet[2:3] seqnum (big-endian unsigned short)
+ * packet[4:7] rtp timestamp (big-endian unsigned int)
+ * packet[8:11] 0x00 0x00 0x00 0x00
+ * packet[12:packetlen - 1] encrypted audio payload
+ * For (AAC-ELD only), the payload of initial packets at the start of
+ * the stream may be replaced by a 4-byte "no_data_marker" 0x00 0x68 0x34 0x00 */
+
+/* consecutive AAC-ELD rtp timestamps differ by spf = 480
+ * consecutive ALAC rtp timestamps differ by spf = 352
+ * both have PCM uncompressed sampling rate = 441000 Hz */
+
+/* clock time in microseconds advances at (rtp_timestamp * 1000000)/44100 between frames */
+
+/* every AAC-ELD packet is sent three times:  0  0 1  0 1 2  1 2 3  2 3 4 ... 
+ * (after decoding AAC-ELD into PCM, the sound frame is three times bigger)
+ * ALAC packets are sent once only  0 1 2 3 4 5  ...  */
+
+/* When the AAC-ELD audio stream starts, the initial packets are length-16 packets with
+ * a four-byte "no_data_marker" 0x00 0x68 0x34 0x00 replacing the payload.
+ * The 12-byte packetheader contains  a secnum and rtp_timestamp, and each  packets is sent
+ * three times; the secnum and rtp_timestamp increment according to the same pattern as 
+ * AAC-ELD packets with audio content.*/
+
+/* When the ALAC audio stream starts, the initial packets are length-44 packets with 
+ * the same 32-byte encrypted payload which after decryption is the beginning of a
+ * 32-byte ALAC packet, presumably with format information, but not actual audio data.
+ * The secnum and rtp_timestamp in the packet header increment according to the same
+ * pattern as ALAC packets with audio content */	
+
+/* The first ALAC packet with data seems to be decoded just before the first sync event
+ * so its dequeuing should be delayed until the first rtp sync has occurred */
+
+static void
+raop_rtp_process_data_packet(raop_rtp_t *raop_rtp, unsigned char *packet, unsigned int packetlen, uint64_t arrival)
+{
+    unsigned char no_data_marker[] = {0x00, 0x68, 0x34, 0x00 };
+    raop_rtp_timing_t *timing = raop_rtp->timing;
+    uint64_t time_start = 0;
+
+    if (packetlen < 12)  {
+        char *str = utils_data_to_string(packet, packetlen, 16);
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received short type_d = 0x%2x  packet with length %d:\n%s", packet[1] & ~0x80, packetlen, str);
+        free (str);
+        return;
+    }
+
+    uint32_t rtp_timestamp =  byteutils_get_int_be(packet, 4);
+    uint64_t rtp_time = rtp64_time(raop_rtp, &rtp_timestamp);
+    uint64_t ntp_time = 0;
+
+    if (raop_rtp->ct == 2 && packetlen == 44)  return;   /* ignore the ALAC packets with format information only. */
+
+    if (raop_rtp->have_synced) {
+        ntp_time = raop_rtp_sync_ntp_time(raop_rtp, rtp_time);
+    } else if (packetlen == 16 && memcmp(packet + 12, no_data_marker, 4) == 0) {
+        /* use the special "no_data"  packet to help determine an initial offset before the first rtp sync. 
+         * until the first rtp sync occurs, we don't know the exact client ntp timestamp that matches the client rtp timestamp */
+        if (raop_rtp->no_data_yet) {
+            int64_t sync_ntp =  ((int64_t) raop_ntp_get_local_time(raop_rtp->ntp)) - ((int64_t) raop_rtp->ntp_start_time) ;
+            int64_t sync_rtp = ((int64_t) rtp_time) - ((int64_t) raop_rtp->rtp_start_time);
+            unsigned short seqnum = byteutils_get_short_be(packet, 2);
+            if  (raop_rtp->rtp_count == 0) {
+                raop_rtp->sync_adjustment =  ((double) sync_ntp); 
+                raop_rtp->rtp_count = 1;
+                raop_rtp->seqnum1 = seqnum;
+                raop_rtp->seqnum2 = seqnum;
+            }
+            if (raop_rtp->seqnum2 != seqnum) {  /* for AAC-ELD  only use copy 1 of the 3 copies of each  frame */
+                raop_rtp->rtp_count++;
+                raop_rtp->sync_adjustment += (((double) sync_ntp) - raop_rtp->rtp_clock_rate * sync_rtp - raop_rtp->sync_adjustment) / raop_rtp->rtp_count;
+            }
+            raop_rtp->seqnum2 = raop_rtp->seqnum1;
+            raop_rtp->seqnum1 = seqnum;
+        }
+        return;
+    } else {
+        raop_rtp->no_data_yet = false;
+    }
+    if (timing) {
+        time_start = raop_rtp_timing_now();
+    }
+    int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, &ntp_time, &rtp_time, 1);
+    assert(result >= 0);
+    if (timing) {
+        timing->enqueue_ns += raop_rtp_timing_now() - time_start;
+    }
+    raop_rtp_update_adaptive(raop_rtp, byteutils_get_short_be(packet, 2), rtp_time, arrival, result > 0);
+
+    if (raop_rtp->ct == 2 && !raop_rtp->have_synced) {
+        /* in ALAC Audio-only  mode wait until the first sync before dequeing */
+        return;
+    }
+
+    // Render continuous buffer entries
+    void *payload = NULL;
+    unsigned int payload_size;
+    unsigned short seqnum;
+    uint64_t rtp64_timestamp;
+    uint64_t ntp_timestamp;
+
+    while (1) {
+        if (timing) {
+            time_start = raop_rtp_timing_now();
+        }
+        payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &ntp_timestamp, &rtp64_timestamp, &seqnum, raop_rtp->no_resend);
+        if (timing) {
+            timing->dequeue_ns += raop_rtp_timing_now() - time_start;
+        }
+        if (!payload) {
+            break;
+        }
+        audio_decode_struct audio_data; 
+        audio_data.rtp_time = rtp64_timestamp;
+        audio_data.seqnum = seqnum;
+        audio_data.data_len = payload_size;
+        audio_data.data = payload;
+        audio_data.ct = raop_rtp->ct;
+        if (raop_rtp->have_synced) {
+            if (ntp_timestamp == 0) {
+                ntp_timestamp = raop_rtp_sync_ntp_time(raop_rtp, rtp64_timestamp);
+            }
+            audio_data.ntp_time_remote = ntp_timestamp;
+            audio_data.ntp_time_local  = raop_ntp_convert_remote_time(raop_rtp->ntp, audio_data.ntp_time_remote);
+            audio_data.sync_status = 1;
+        } else {
+            double elapsed_time =  raop_rtp->rtp_clock_rate * (rtp64_timestamp - raop_rtp->rtp_start_time) + raop_rtp->sync_adjustment
+                + DELAY_AAC * SECOND_IN_NSECS; 
+            audio_data.ntp_time_local = raop_rtp->ntp_start_time + raop_rtp->delay + (uint64_t) elapsed_time;
+            audio_data.ntp_time_remote = raop_ntp_convert_local_time(raop_rtp->ntp, audio_data.ntp_time_local);
+            audio_data.sync_status = 0;
+        }
+        raop_rtp_apply_playout_delay(raop_rtp, &audio_data);
+        if (timing) {
+            time_start = raop_rtp_timing_now();
+        }
+        if (raop_rtp->callbacks.audio_process) {
+            raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
+        }
+        if (timing) {
+            timing->callback_ns += raop_rtp_timing_now() - time_start;
+            timing->frames++;
+            timing->bytes += payload_size;
+        }
+        if (raop_rtp->decoder) {
+            raop_rtp_decode(raop_rtp, &audio_data, timing);
+        }
+        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
+        int64_t latency = ((int64_t) ntp_now) - ((int64_t) audio_data.ntp_time_local); 
+        logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio: now = %8.6f, ntp = %8.6f, latency = %8.6f, rtp_time=%u seqnum = %u",
+                   (double) ntp_now / SEC, (double) audio_data.ntp_time_local / SEC, (double) latency / SEC, (uint32_t) rtp64_timestamp,
+                   seqnum);
+    }
+
+    /* Handle possible resend requests */
+    if (!raop_rtp->no_resend) {
+        raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_timing_now(), raop_rtp_resend_callback, raop_rtp);
+    }
+}
 
-    int no_resend = (raop_rtp->control_rport == 0); /* true when control_rport is not set */
+static void
+raop_rtp_count_batch(raop_rtp_receive_stats_t *stats, int count)
+{
+    if (count <= 0) {
+        return;
+    }
+    stats->packets += count;
+    stats->batches++;
+    if ((uint32_t) count > stats->max_batch) {
+        stats->max_batch = count;
+    }
+}
+
+static THREAD_RETVAL
+raop_rtp_thread_udp(void *arg)
+{
+    raop_rtp_t *raop_rtp = arg;
+    udp_batch_t *control_batch, *data_batch;
+    raop_rtp_receive_stats_t stats;
+
+    assert(raop_rtp);
+    raop_rtp_reset_receive_state(raop_rtp);
+    memset(&stats, 0, sizeof(stats));
+
+    control_batch = udp_batch_init(raop_rtp->logger, raop_rtp->receive_batch_size, RAOP_RTP_UDP_SLOT_SIZE);
+    data_batch = udp_batch_init(raop_rtp->logger, raop_rtp->receive_batch_size, RAOP_RTP_UDP_SLOT_SIZE);
+    if (!control_batch || !data_batch) {
+        logger_log(raop_rtp->logger, LOGGER_ERR, "raop_rtp could not allocate receive buffers");
+        goto thread_exit;
+    }
 
     logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp start_time = %8.6f (raop_rtp audio)",
                ((double) raop_rtp->ntp_start_time) / SEC);
@@ -477,7 +1375,8 @@ raop_rtp_thread_udp(void *arg)
     while(1) {
         fd_set rfds;
         struct timeval tv;
-        int nfds, ret;	
+        int nfds, ret, count;
+        uint64_t packets = stats.packets;
         /* Check if we are still running and process callbacks */
         if (raop_rtp_process_events(raop_rtp, NULL)) {
             break;
@@ -506,209 +1405,74 @@ raop_rtp_thread_udp(void *arg)
             break;
         }
 
+        /* a ready socket is drained in batches, until a read returns less than a full batch */
         if (FD_ISSET(raop_rtp->csock, &rfds)) {
-            saddrlen = sizeof(saddr);
-            packetlen = recvfrom(raop_rtp->csock, (char *)packet, sizeof(packet), 0,
-                                 (struct sockaddr *)&saddr, &saddrlen);
-
-            memcpy(&raop_rtp->control_saddr, &saddr, saddrlen);
-            raop_rtp->control_saddr_len = saddrlen;
-            int type_c = packet[1] & ~0x80;
-            logger_log(raop_rtp->logger, LOGGER_DEBUG, "\nraop_rtp type_c 0x%02x, packetlen = %d", type_c, packetlen);
-
-            if (type_c == 0x56 && packetlen >= 8) {
-	        /* Handle resent data packet, which begins at offset 4 of these packets */
-                unsigned char *resent_packet =  &packet[4];
-                unsigned int resent_packetlen = packetlen - 4;
-                unsigned short seqnum = byteutils_get_short_be(resent_packet, 2);
-                if (resent_packetlen >= 12) {
-                    uint32_t timestamp = byteutils_get_int_be(resent_packet, 4);
-                    uint64_t rtp_time = rtp64_time(raop_rtp, &timestamp);
-		    uint64_t ntp_time = 0;
-		    if (have_synced) {
-                        ntp_time = (uint64_t) (raop_rtp->rtp_sync_offset + (int64_t) (raop_rtp->rtp_clock_rate * rtp_time));
-		    }
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp resent audio packet: seqnum=%u", seqnum);
-                    int result = raop_buffer_enqueue(raop_rtp->buffer, resent_packet, resent_packetlen, &ntp_time, &rtp_time, 1);
-                    assert(result >= 0);
-                } else {
-                    /* type_c = 0x56 packets  with length 8 have been reported */
-                    char *str = utils_data_to_string(packet, packetlen, 16);
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received empty resent audio packet length %d, seqnum=%u:\n%s",
-                               packetlen, seqnum, str);
-                    free (str);
-                }
-            } else if (type_c == 0x54 && packetlen >= 20) {
-                /* packet[0] = 0x90 (first sync ?) or 0x80 (subsequent ones)
-                 * packet[1] = 0xd4,  (0xd4 && ~0x80 = type 0x54)
-                 * packet[2:3] = 0x00 0x04
-                 * packet[4:7] : sync_rtp (big-endian uint32_t)
-                 * packet[8:15]: remote ntp timestamp (big-endian uint64_t)  
-                 * packet[16:20]: next_rtp (big-endian uint32_t)
-                 * next_rtp = sync_rtp + 7497 =  441 *  17 (0.17 sec) for AAC-ELD
-                 * next_rtp = sync_rtp + 77175  = 441 * 175 (1.75 sec) for ALAC */
-
-                // The unit for the rtp clock is 1 / sample rate = 1 / 44100
-                uint32_t sync_rtp = byteutils_get_int_be(packet, 4);
-                uint64_t sync_rtp64 = rtp64_time(raop_rtp, &sync_rtp);
-                if (have_synced == false) {
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "first audio rtp sync");
-                    have_synced = true;
+            do {
+                count = udp_batch_receive(control_batch, raop_rtp->csock);
+                for (int i = 0; i < count; i++) {
+                    udp_packet_t *packet = udp_batch_get_packet(control_batch, i);
+                    raop_rtp_capture_packet(raop_rtp, STREAM_CAPTURE_AUDIO_CONTROL, packet->data, (int) packet->len);
+
+                    memcpy(&raop_rtp->control_saddr, &packet->saddr, packet->saddr_len);
+                    raop_rtp->control_saddr_len = packet->saddr_len;
+                    raop_rtp_process_control_packet(raop_rtp, packet->data, packet->len);
                 }
-                uint64_t sync_ntp_raw = byteutils_get_long_be(packet, 8);
-                uint64_t sync_ntp_remote = raop_ntp_timestamp_to_nano_seconds(sync_ntp_raw, true);
-                uint64_t sync_ntp_local = raop_ntp_convert_remote_time(raop_rtp->ntp, sync_ntp_remote);
-                char *str = utils_data_to_string(packet, packetlen, 20);
-                logger_log(raop_rtp->logger, LOGGER_DEBUG,
-                           "raop_rtp sync: client ntp=%8.6f, ntp = %8.6f, ntp_start_time %8.6f\nts_client = %8.6f sync_rtp=%u\n%s",
-                           (double) sync_ntp_remote / SEC, (double) sync_ntp_local / SEC,
-                           (double) raop_rtp->ntp_start_time / SEC, (double) sync_ntp_remote / SEC, sync_rtp, str);
-                free(str);
-                raop_rtp_sync_clock(raop_rtp, &sync_ntp_remote, &sync_rtp64);		
-            } else {
-                char *str = utils_data_to_string(packet, packetlen, 16);
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp unknown udp control packet\n%s", str);
-                free(str);
-            }
+                raop_rtp_count_batch(&stats, count);
+            } while (count == raop_rtp->receive_batch_size);
+            stats.control_drops = udp_batch_get_drops(control_batch);
         }
 
-        /* rtp audio data packets:
-         * packet[0] 0x80
-         * packet[1] 0x60 = 96
-         * packet[2:3] seqnum (big-endian unsigned short)
-         * packet[4:7] rtp timestamp (big-endian unsigned int)
-         * packet[8:11] 0x00 0x00 0x00 0x00
-         * packet[12:packetlen - 1] encrypted audio payload
-         * For (AAC-ELD only), the payload of initial packets at the start of
-         * the stream may be replaced by a 4-byte "no_data_marker" 0x00 0x68 0x34 0x00 */
-	
-        /* consecutive AAC-ELD rtp timestamps differ by spf = 480
-         * consecutive ALAC rtp timestamps differ by spf = 352
-         * both have PCM uncompressed sampling rate = 441000 Hz */
-
-        /* clock time in microseconds advances at (rtp_timestamp * 1000000)/44100 between frames */
-
-        /* every AAC-ELD packet is sent three times:  0  0 1  0 1 2  1 2 3  2 3 4 ... 
-         * (after decoding AAC-ELD into PCM, the sound frame is three times bigger)
-         * ALAC packets are sent once only  0 1 2 3 4 5  ...  */
-
-        /* When the AAC-ELD audio stream starts, the initial packets are length-16 packets with
-         * a four-byte "no_data_marker" 0x00 0x68 0x34 0x00 replacing the payload.
-         * The 12-byte packetheader contains  a secnum and rtp_timestamp, and each  packets is sent
-         * three times; the secnum and rtp_timestamp increment according to the same pattern as 
-         * AAC-ELD packets with audio content.*/
-
-	 /* When the ALAC audio stream starts, the initial packets are length-44 packets with 
-	  * the same 32-byte encrypted payload which after decryption is the beginning of a
-          * 32-byte ALAC packet, presumably with format information, but not actual audio data.
-          * The secnum and rtp_timestamp in the packet header increment according to the same
-          * pattern as ALAC packets with audio content */	
-
-         /* The first ALAC packet with data seems to be decoded just before the first sync event
-          * so its dequeuing should be delayed until the first rtp sync has occurred */
-
-
-	if (FD_ISSET(raop_rtp->dsock, &rfds)) {
-            //logger_log(raop_rtp->logger, LOGGER_INFO, "Would have data packet in queue");
-            // Receiving audio data here
-            saddrlen = sizeof(saddr);
-            packetlen = recvfrom(raop_rtp->dsock, (char *)packet, sizeof(packet), 0,
-                                 (struct sockaddr *)&saddr, &saddrlen);
-            // rtp payload type
-            //int type_d = packet[1] & ~0x80;
-            //logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp_thread_udp type_d 0x%02x, packetlen = %d", type_d, packetlen);
-	    
-            if (packetlen < 12)  {
-                char *str = utils_data_to_string(packet, packetlen, 16);                                                                                                                                                                          
-                logger_log(raop_rtp->logger, LOGGER_DEBUG, "Received short type_d = 0x%2x  packet with length %d:\n%s", packet[1] & ~0x80, packetlen, str);                                                                                       
-                free (str);           
-                continue;
-	    }
-
-            uint32_t rtp_timestamp =  byteutils_get_int_be(packet, 4);
-            uint64_t rtp_time = rtp64_time(raop_rtp, &rtp_timestamp);
-	    uint64_t ntp_time = 0;
-
-	    if (raop_rtp->ct == 2 && packetlen == 44)  continue;   /* ignore the ALAC packets with format information only. */
-
-	    if (have_synced) {
-                ntp_time = (uint64_t) (raop_rtp->rtp_sync_offset + (int64_t) (raop_rtp->rtp_clock_rate * rtp_time));
-	    } else if (packetlen == 16 && memcmp(packet + 12, no_data_marker, 4) == 0) {
-	        /* use the special "no_data"  packet to help determine an initial offset before the first rtp sync. 
-                 * until the first rtp sync occurs, we don't know the exact client ntp timestamp that matches the client rtp timestamp */
-                if (no_data_yet) {
-	            int64_t sync_ntp =  ((int64_t) raop_ntp_get_local_time(raop_rtp->ntp)) - ((int64_t) raop_rtp->ntp_start_time) ;
-                    int64_t sync_rtp = ((int64_t) rtp_time) - ((int64_t) raop_rtp->rtp_start_time);
-                    unsigned short seqnum = byteutils_get_short_be(packet, 2);
-                    if  (rtp_count == 0) {
-                        sync_adjustment =  ((double) sync_ntp); 
-                        rtp_count = 1;
-                        seqnum1 = seqnum;
-                        seqnum2 = seqnum;
-                    }
-                    if (seqnum2 != seqnum) {  /* for AAC-ELD  only use copy 1 of the 3 copies of each  frame */
-                        rtp_count++;
-                        sync_adjustment += (((double) sync_ntp) - raop_rtp->rtp_clock_rate * sync_rtp - sync_adjustment) / rtp_count;
-                    }
-                    seqnum2 = seqnum1;
-                    seqnum1 = seqnum;
-                }
-                continue;
-	    } else {
-                no_data_yet = false;
-	    }
-            int result = raop_buffer_enqueue(raop_rtp->buffer, packet, packetlen, &ntp_time, &rtp_time, 1);
-            assert(result >= 0);
-
-	    if (raop_rtp->ct == 2 && !have_synced) {
-                /* in ALAC Audio-only  mode wait until the first sync before dequeing */
-                continue;
-            } else {
-            // Render continuous buffer entries
-                void *payload = NULL;
-                unsigned int payload_size;
-                unsigned short seqnum;
-                uint64_t rtp64_timestamp;
-                uint64_t ntp_timestamp;
-
-                while ((payload = raop_buffer_dequeue(raop_rtp->buffer, &payload_size, &ntp_timestamp, &rtp64_timestamp, &seqnum, no_resend))) {
-                    audio_decode_struct audio_data; 
-                    audio_data.rtp_time = rtp64_timestamp;
-                    audio_data.seqnum = seqnum;
-                    audio_data.data_len = payload_size;
-                    audio_data.data = payload;
-                    audio_data.ct = raop_rtp->ct;
-                    if (have_synced) {
-                        if (ntp_timestamp == 0) {
-                            ntp_timestamp = (uint64_t) (raop_rtp->rtp_sync_offset + (int64_t) (raop_rtp->rtp_clock_rate * rtp64_timestamp));
-                        }
-                        audio_data.ntp_time_remote = ntp_timestamp;
-                        audio_data.ntp_time_local  = raop_ntp_convert_remote_time(raop_rtp->ntp, audio_data.ntp_time_remote);
-                        audio_data.sync_status = 1;
-                    } else {
-                        double elapsed_time =  raop_rtp->rtp_clock_rate * (rtp64_timestamp - raop_rtp->rtp_start_time) + sync_adjustment
-                            + DELAY_AAC * SECOND_IN_NSECS; 
-                        audio_data.ntp_time_local = raop_rtp->ntp_start_time + delay + (uint64_t) elapsed_time;
-                        audio_data.ntp_time_remote = raop_ntp_convert_local_time(raop_rtp->ntp, audio_data.ntp_time_local);
-                        audio_data.sync_status = 0;
-                    }
-                    raop_rtp->callbacks.audio_process(raop_rtp->callbacks.cls, raop_rtp->ntp, &audio_data);
-                    free(payload);
-                    uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp->ntp);
-                    int64_t latency = ((int64_t) ntp_now) - ((int64_t) audio_data.ntp_time_local); 
-                    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio: now = %8.6f, ntp = %8.6f, latency = %8.6f, rtp_time=%u seqnum = %u",
-                               (double) ntp_now / SEC, (double) audio_data.ntp_time_local / SEC, (double) latency / SEC, (uint32_t) rtp64_timestamp,
-                               seqnum);
+        if (FD_ISSET(raop_rtp->dsock, &rfds)) {
+            do {
+                count = udp_batch_receive(data_batch, raop_rtp->dsock);
+                for (int i = 0; i < count; i++) {
+                    udp_packet_t *packet = udp_batch_get_packet(data_batch, i);
+                    raop_rtp_capture_packet(raop_rtp, STREAM_CAPTURE_AUDIO_DATA, packet->data, (int) packet->len);
+                    raop_rtp_process_data_packet(raop_rtp, packet->data, packet->len, packet->arrival);
                 }
+                raop_rtp_count_batch(&stats, count);
+            } while (count == raop_rtp->receive_batch_size);
+            stats.data_drops = udp_batch_get_drops(data_batch);
+        }
 
-                /* Handle possible resend requests */
-                if (!no_resend) {
-                    raop_buffer_handle_resends(raop_rtp->buffer, raop_rtp_resend_callback, raop_rtp);
-                }
-            }
+        if (stats.packets != packets) {
+            raop_buffer_resend_stats_t resend_stats;
+            raop_buffer_get_resend_stats(raop_rtp->buffer, &resend_stats);
+            stats.resend_requests = resend_stats.requests;
+            stats.resend_packets = resend_stats.requested;
+            stats.resend_retries = resend_stats.retries;
+            stats.resend_recovered = resend_stats.recovered;
+            stats.resend_lost = resend_stats.lost;
+            stats.concealed_ms = (uint32_t) (raop_rtp->concealed_samples * raop_rtp->rtp_clock_rate / 1000000);
+            stats.compressed_ms = (uint32_t) (raop_rtp->compressed_samples * raop_rtp->rtp_clock_rate / 1000000);
+            MUTEX_LOCK(raop_rtp->run_mutex);
+            raop_rtp->receive_stats = stats;
+            MUTEX_UNLOCK(raop_rtp->run_mutex);
         }
     }
 
+    if (stats.data_drops || stats.control_drops) {
+        logger_log(raop_rtp->logger, LOGGER_INFO, "raop_rtp: %u data and %u control packets were dropped by the kernel",
+                   stats.data_drops, stats.control_drops);
+    }
+    if (stats.resend_packets) {
+        logger_log(raop_rtp->logger, LOGGER_INFO, "raop_rtp: %u missing packets requested in %u resend requests (%u retries), "
+                   "%u recovered (%.1f%%), %u lost", stats.resend_packets, stats.resend_requests, stats.resend_retries,
+                   stats.resend_recovered, 100.0 * stats.resend_recovered / stats.resend_packets, stats.resend_lost);
+    }
+    if (stats.concealed_ms || stats.compressed_ms) {
+        logger_log(raop_rtp->logger, LOGGER_INFO, "raop_rtp: %u ms of missing audio concealed, %u ms of late audio caught up",
+                   stats.concealed_ms, stats.compressed_ms);
+    }
+    if (raop_rtp->resampler && raop_rtp->drift_started) {
+        logger_log(raop_rtp->logger, LOGGER_INFO, "raop_rtp: audio resampled by %+.1f ppm to follow the sender's clock",
+                   (raop_rtp->drift_ratio - 1) * 1000000.0);
+    }
+
+    thread_exit:
+    udp_batch_destroy(control_batch);
+    udp_batch_destroy(data_batch);
+
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp->run_mutex);
     raop_rtp->running = false;
@@ -719,6 +1483,179 @@ raop_rtp_thread_udp(void *arg)
     return 0;
 }
 
+/* Prepares for raop_rtp_replay_packet(), which processes packets from a capture file *
+ * without sockets or a thread: raop_rtp_start_audio() must not be used with this.    */
+void
+raop_rtp_start_replay(raop_rtp_t *raop_rtp, unsigned char ct, unsigned int sr, raop_rtp_timing_t *timing)
+{
+    assert(raop_rtp);
+    raop_rtp->ct = ct;
+    raop_rtp->rtp_clock_rate = SECOND_IN_NSECS / sr;
+    raop_rtp->control_rport = 0;
+    raop_rtp->timing = timing;
+    raop_rtp_init_adaptive(raop_rtp);
+    raop_rtp_init_decoder(raop_rtp, sr);
+    raop_rtp_reset_receive_state(raop_rtp);
+}
+
+void
+raop_rtp_replay_packet(raop_rtp_t *raop_rtp, bool control, unsigned char *packet, unsigned int packetlen)
+{
+    assert(raop_rtp);
+    if (control) {
+        raop_rtp_process_control_packet(raop_rtp, packet, packetlen);
+    } else {
+        raop_rtp_process_data_packet(raop_rtp, packet, packetlen, 0);
+    }
+}
+
+/* must be called before raop_rtp_start_audio(); depth is the number of audio packets *
+ * buffered while waiting for resends of missing packets (0: default)                */
+void
+raop_rtp_set_buffer_depth(raop_rtp_t *raop_rtp, int depth)
+{
+    assert(raop_rtp);
+    if (depth <= 0) {
+        depth = RAOP_BUFFER_DEFAULT_LENGTH;
+    }
+    depth = raop_buffer_set_length(raop_rtp->buffer, depth);
+    logger_log(raop_rtp->logger, LOGGER_DEBUG, "raop_rtp audio buffer depth %d packets", depth);
+}
+
+/* must be called before raop_rtp_start_audio(); delay_micros is the playout delay the client is *
+ * told by default.  With max_micros > 0 the playout delay then adapts to the measured jitter    *
+ * and loss between min and max (usecs), by playing the audio later or earlier than the          *
+ * sender's timing; this is only for audio without video, which would lose A/V sync.             */
+void
+raop_rtp_set_playout_delay(raop_rtp_t *raop_rtp, int delay_micros, int min_micros, int max_micros)
+{
+    assert(raop_rtp);
+    if (delay_micros < 0) {
+        delay_micros = 0;
+    }
+    if (max_micros <= 0) {
+        raop_rtp->playout_min_delay = 0;
+        raop_rtp->playout_max_delay = 0;
+    } else {
+        if (min_micros < 0) {
+            min_micros = 0;
+        } else if (min_micros > max_micros) {
+            min_micros = max_micros;
+        }
+        raop_rtp->playout_min_delay = (uint64_t) min_micros * 1000;
+        raop_rtp->playout_max_delay = (uint64_t) max_micros * 1000;
+    }
+    raop_rtp->playout_delay = (uint64_t) delay_micros * 1000;
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    raop_rtp->playout_reported_delay = raop_rtp->playout_delay;
+    raop_rtp->playout_target_delay = raop_rtp->playout_delay;
+    if (raop_rtp->playout_max_delay && raop_rtp->playout_target_delay > raop_rtp->playout_max_delay) {
+        raop_rtp->playout_target_delay = raop_rtp->playout_max_delay;
+    } else if (raop_rtp->playout_target_delay < raop_rtp->playout_min_delay) {
+        raop_rtp->playout_target_delay = raop_rtp->playout_min_delay;
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+/* the current target playout delay in usecs, which the client is told (at RECORD) and then times *
+ * the audio for, or -1 if the delay is not adaptive                                             */
+int
+raop_rtp_report_playout_delay(raop_rtp_t *raop_rtp)
+{
+    int target_micros = -1;
+    assert(raop_rtp);
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    if (raop_rtp->playout_max_delay) {
+        raop_rtp->playout_reported_delay = raop_rtp->playout_target_delay;
+        target_micros = (int) (raop_rtp->playout_target_delay / 1000);
+    }
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+    return target_micros;
+}
+
+/* must be called before raop_rtp_start_audio(), after raop_rtp_set_playout_delay(); the time     *
+ * waited for the resend of a missing packet then adapts to the measured jitter and loss between *
+ * min and max (usecs), but stays below the playout delay by at least one frame.  max = 0        *
+ * disables this.                                                                                 */
+void
+raop_rtp_set_adaptive_resend(raop_rtp_t *raop_rtp, int min_micros, int max_micros)
+{
+    assert(raop_rtp);
+    if (max_micros <= 0) {
+        raop_rtp->resend_min_window = 0;
+        raop_rtp->resend_max_window = 0;
+        return;
+    }
+    if (min_micros < 0) {
+        min_micros = 0;
+    } else if (min_micros > max_micros) {
+        min_micros = max_micros;
+    }
+    raop_rtp->resend_min_window = (uint64_t) min_micros * 1000;
+    raop_rtp->resend_max_window = (uint64_t) max_micros * 1000;
+}
+
+/* must be called before raop_rtp_start_audio(); batch_size is the number of packets read from *
+ * a socket at once, and receive_buffer_size the socket SO_RCVBUF size (0: system default)    */
+void
+raop_rtp_set_receive_options(raop_rtp_t *raop_rtp, int batch_size, int receive_buffer_size)
+{
+    assert(raop_rtp);
+    if (batch_size <= 0) {
+        batch_size = UDP_BATCH_DEFAULT_SIZE;
+    } else if (batch_size > UDP_BATCH_MAX_SIZE) {
+        batch_size = UDP_BATCH_MAX_SIZE;
+    }
+    raop_rtp->receive_batch_size = batch_size;
+    raop_rtp->receive_buffer_size = (receive_buffer_size > 0 ? receive_buffer_size : 0);
+}
+
+/* must be called before raop_rtp_start_audio(); conceals missing frames in the decoded audio      *
+ * (audio_process_pcm), and catches up on late ones by compressing it instead of dropping them    */
+void
+raop_rtp_set_concealment(raop_rtp_t *raop_rtp, bool enabled)
+{
+    assert(raop_rtp);
+    raop_rtp->concealment = enabled;
+}
+
+/* must be called before raop_rtp_start_audio(); the samples per frame (spf) of the SETUP request, *
+ * which sets the frame length of the ALAC decoder (0: the default for the compression type)      */
+void
+raop_rtp_set_samples_per_frame(raop_rtp_t *raop_rtp, unsigned int spf)
+{
+    assert(raop_rtp);
+    raop_rtp->setup_spf = spf;
+}
+
+/* must be called before raop_rtp_start_audio(); resamples the decoded audio (audio_process_pcm) *
+ * so that it follows the local clock instead of the sender's                                   */
+void
+raop_rtp_set_drift_resampling(raop_rtp_t *raop_rtp, bool enabled)
+{
+    assert(raop_rtp);
+    raop_rtp->drift_resampling = enabled;
+}
+
+void
+raop_rtp_get_receive_stats(raop_rtp_t *raop_rtp, raop_rtp_receive_stats_t *stats)
+{
+    assert(raop_rtp);
+    assert(stats);
+    MUTEX_LOCK(raop_rtp->run_mutex);
+    *stats = raop_rtp->receive_stats;
+    MUTEX_UNLOCK(raop_rtp->run_mutex);
+}
+
+/* must be called before raop_rtp_start_audio() */
+void
+raop_rtp_set_stream_capture(raop_rtp_t *raop_rtp, stream_capture_t *stream_capture, uint32_t session)
+{
+    assert(raop_rtp);
+    raop_rtp->stream_capture = stream_capture;
+    raop_rtp->capture_session = session;
+}
+
 // Start rtp service, three udp ports
 void
 raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short *control_rport, unsigned short *control_lport,
@@ -737,6 +1674,8 @@ raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short *control_
 
     raop_rtp->ct = *ct;
     raop_rtp->rtp_clock_rate = SECOND_IN_NSECS / *sr;
+    raop_rtp_init_adaptive(raop_rtp);
+    raop_rtp_init_decoder(raop_rtp, *sr);
 
     /* Initialize ports and sockets */
     raop_rtp->control_lport = *control_lport;
@@ -22,6 +22,7 @@
 #include "raop.h"
 #include "logger.h"
 #include "raop_ntp.h"
+#include "stream_capture.h"
 
 #define RAOP_AESIV_LEN  16
 #define RAOP_AESKEY_LEN 16
@@ -29,12 +30,53 @@
 
 typedef struct raop_rtp_s raop_rtp_t;
 
+/* time spent in each stage of audio packet processing (see raop_rtp_start_replay) */
+typedef struct {
+    uint64_t enqueue_ns;          /* raop_buffer_enqueue, including decryption */
+    uint64_t dequeue_ns;          /* raop_buffer_dequeue */
+    uint64_t callback_ns;         /* audio_process */
+    uint64_t decode_ns;           /* audio_decoder_decode, for audio_process_pcm */
+    uint64_t resample_ns;         /* drift compensation of the decoded audio */
+    uint64_t conceal_ns;          /* concealment of missing and late frames in the decoded audio */
+    uint64_t frames;
+    uint64_t bytes;
+} raop_rtp_timing_t;
+
+/* counters of the audio packets received on the data and control sockets, and of the resend requests */
+typedef struct {
+    uint64_t packets;
+    uint64_t batches;             /* socket reads that returned packets */
+    uint32_t max_batch;           /* most packets returned by one read */
+    uint32_t data_drops;          /* packets dropped by the kernel for lack of buffer space (Linux only) */
+    uint32_t control_drops;
+    uint32_t resend_requests;     /* resend requests sent to the client (one per missing range) */
+    uint32_t resend_packets;      /* missing packets that were requested */
+    uint32_t resend_retries;      /* repeated requests for the same packet */
+    uint32_t resend_recovered;    /* requested packets received before their playout */
+    uint32_t resend_lost;         /* requested packets that never arrived in time */
+    uint32_t concealed_ms;        /* decoded audio filled in for missing frames */
+    uint32_t compressed_ms;       /* decoded audio removed to catch up on late frames */
+} raop_rtp_receive_stats_t;
+
 raop_rtp_t *raop_rtp_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp, const unsigned char *remote, 
                           int remotelen, const unsigned char *aeskey, const unsigned char *aesiv);
 
+void raop_rtp_set_buffer_depth(raop_rtp_t *raop_rtp, int depth);
+void raop_rtp_set_playout_delay(raop_rtp_t *raop_rtp, int delay_micros, int min_micros, int max_micros);
+int raop_rtp_report_playout_delay(raop_rtp_t *raop_rtp);
+void raop_rtp_set_adaptive_resend(raop_rtp_t *raop_rtp, int min_micros, int max_micros);
+void raop_rtp_set_receive_options(raop_rtp_t *raop_rtp, int batch_size, int receive_buffer_size);
+void raop_rtp_get_receive_stats(raop_rtp_t *raop_rtp, raop_rtp_receive_stats_t *stats);
+void raop_rtp_set_concealment(raop_rtp_t *raop_rtp, bool enabled);
+void raop_rtp_set_drift_resampling(raop_rtp_t *raop_rtp, bool enabled);
+void raop_rtp_set_samples_per_frame(raop_rtp_t *raop_rtp, unsigned int spf);
+void raop_rtp_set_stream_capture(raop_rtp_t *raop_rtp, stream_capture_t *stream_capture, uint32_t session);
 void raop_rtp_start_audio(raop_rtp_t *raop_rtp, int use_udp, unsigned short *control_rport, unsigned short *control_lport,
                           unsigned short *data_lport, unsigned char *ct, unsigned int *sr);
 
+void raop_rtp_start_replay(raop_rtp_t *raop_rtp, unsigned char ct, unsigned int sr, raop_rtp_timing_t *timing);
+void raop_rtp_replay_packet(raop_rtp_t *raop_rtp, bool control, unsigned char *packet, unsigned int packetlen);
+
 void raop_rtp_set_volume(raop_rtp_t *raop_rtp, float volume);
 void raop_rtp_set_metadata(raop_rtp_t *raop_rtp, const char *data, int datalen);
 void raop_rtp_set_coverart(raop_rtp_t *raop_rtp, const char *data, int datalen);
@@ -23,6 +23,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
 #ifdef _WIN32
 #include <winsock2.h>
 #else
@@ -35,6 +36,9 @@
 #include "logger.h"
 #include "byteutils.h"
 #include "mirror_buffer.h"
+#include "frame_pool.h"
+#include "mirror_queue.h"
+#include "stream_capture.h"
 #include "stream.h"
 #include "utils.h"
 #include "plist/plist.h"
@@ -54,6 +58,9 @@
 #define SECOND_IN_NSECS 1000000000UL
 #define SEC SECOND_IN_NSECS
 
+/* video latencies above this are taken to mean that the NTP clock offset is not yet known */
+#define RAOP_MIRROR_MAX_VALID_LATENCY (10 * (int64_t) SEC)
+
 /* for MacOS, where SOL_TCP and TCP_KEEPIDLE are not defined */
 #if !defined(SOL_TCP) && defined(IPPROTO_TCP)
 #define SOL_TCP IPPROTO_TCP
@@ -76,6 +83,25 @@
 //    unsigned char version;
 //};
 
+/* State of the video frame being received.  Its payload is decrypted, and the AVCC NAL *
+ * length prefixes are rewritten as Annex-B start codes, as the payload arrives.         */
+typedef struct video_frame_s {
+    bool active;
+    bool dropped;                 /* no output buffer: the payload is decrypted in place and discarded */
+    bool sps_pps;                 /* the stored SPS+PPS is prepended */
+    unsigned char *out;           /* pooled buffer: optional SPS+PPS, then the decrypted payload */
+    unsigned char *decrypted;     /* where the decrypted payload starts */
+    int decrypted_len;
+    int nal_pos;                  /* offset in the payload of the next NAL length prefix */
+    int nal_count;
+    int flags;
+    int nal_index_count;          /* offsets are relative to the decrypted payload */
+    h264_nal_info nal_index[H264_MAX_NAL_INDEX];
+    bool valid;
+    bool scan_done;
+    uint64_t keystream_offset;    /* AES-CTR keystream offset at the start of the payload */
+} video_frame_t;
+
 struct raop_rtp_mirror_s {
     logger_t *logger;
     raop_callbacks_t callbacks;
@@ -84,6 +110,30 @@ struct raop_rtp_mirror_s {
     /* Buffer to handle all resends */
     mirror_buffer_t *buffer;
 
+    /* Pool of buffers for decrypted video frames */
+    frame_pool_t *frame_pool;
+
+    /* Optional queue of decrypted frames for a separate decode thread (queue_depth = 0: *
+     * video_process is called directly from the TCP thread).  After a frame is dropped  *
+     * because the queue is full, frames are skipped until the next IDR frame.           */
+    int queue_depth;
+    mirror_queue_t *queue;
+    thread_handle_t thread_decode;
+    bool skip_to_idr;
+    uint64_t frames_skipped;
+
+    /* Latency budget (0: none).  A frame that reaches the decoder later than this is    *
+     * dropped if no other frame refers to it; otherwise, it and all following frames    *
+     * are dropped until the next IDR frame.  Only accessed by the thread that calls     *
+     * video_process.                                                                    */
+    uint64_t latency_budget;
+    bool late_skip_to_idr;
+    uint64_t frames_late;
+
+    /* number of threads used to decrypt large frames (0 or 1: the TCP thread only); with more, *
+     * a partly received frame is decrypted in batches rather than after every recv()          */
+    int decrypt_threads;
+
     /* Remote address as sockaddr */
     struct sockaddr_storage remote_saddr;
     socklen_t remote_saddr_len;
@@ -107,11 +157,42 @@ struct raop_rtp_mirror_s {
 
     /* SPS and PPS */
     int sps_pps_len;
+    int sps_nal_len;              /* the SPS NAL, with its start code, at the start of sps_pps */
     unsigned char* sps_pps;
     bool sps_pps_waiting;
+    uint64_t ntp_timestamp_nal;
+
+    /* Receive buffer for the TCP stream: frames are parsed in place from rx_start, *
+     * and received data ends at rx_end.  Only accessed by the mirror thread.       */
+    unsigned char *rx_buf;
+    size_t rx_capacity;
+    size_t rx_start;
+    size_t rx_end;
+
+    /* the encrypted video frame at rx_start, once its header has been received */
+    video_frame_t frame;
 
+#ifndef _WIN32
+    /* written to by raop_rtp_mirror_stop() to wake the thread from select() */
+    int wake_pipe[2];
+#endif
+
+    /* optional capture of the received stream (owned by raop_t) */
+    stream_capture_t *stream_capture;
+    uint32_t capture_session;
+
+    /* optional time spent in each stage, when replaying a capture */
+    raop_rtp_mirror_timing_t *timing;
 };
 
+static inline uint64_t
+raop_rtp_mirror_timing_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
 static int
 raop_rtp_parse_remote(raop_rtp_mirror_t *raop_rtp_mirror, const unsigned char *remote, int remotelen)
 {
@@ -155,6 +236,7 @@ raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *call
     raop_rtp_mirror->logger = logger;
     raop_rtp_mirror->ntp = ntp;
     raop_rtp_mirror->sps_pps_len = 0;
+    raop_rtp_mirror->sps_nal_len = 0;
     raop_rtp_mirror->sps_pps = NULL;
     raop_rtp_mirror->sps_pps_waiting = false;
 
@@ -164,10 +246,27 @@ raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *call
         free(raop_rtp_mirror);
         return NULL;
     }
+    raop_rtp_mirror->frame_pool = frame_pool_init(logger);
+    if (!raop_rtp_mirror->frame_pool) {
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        free(raop_rtp_mirror);
+        return NULL;
+    }
     if (raop_rtp_parse_remote(raop_rtp_mirror, remote, remotelen) < 0) {
+        frame_pool_destroy(raop_rtp_mirror->frame_pool);
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
         free(raop_rtp_mirror);
         return NULL;
     }
+#ifndef _WIN32
+    if (pipe(raop_rtp_mirror->wake_pipe) < 0) {
+        logger_log(logger, LOGGER_ERR, "raop_rtp_mirror could not create wake pipe %d %s", errno, strerror(errno));
+        frame_pool_destroy(raop_rtp_mirror->frame_pool);
+        mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        free(raop_rtp_mirror);
+        return NULL;
+    }
+#endif
     raop_rtp_mirror->running = 0;
     raop_rtp_mirror->joined = 1;
     raop_rtp_mirror->flush = NO_FLUSH;
@@ -182,9 +281,710 @@ raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamCon
     mirror_buffer_init_aes(raop_rtp_mirror->buffer, streamConnectionID);
 }
 
-//#define DUMP_H264
+/* must be called before raop_rtp_start_mirror(); depth 0 disables the decode queue */
+void
+raop_rtp_mirror_set_queue_depth(raop_rtp_mirror_t *raop_rtp_mirror, int queue_depth)
+{
+    assert(raop_rtp_mirror);
+    if (queue_depth < 0) {
+        queue_depth = 0;
+    } else if (queue_depth > MIRROR_QUEUE_MAX_DEPTH) {
+        queue_depth = MIRROR_QUEUE_MAX_DEPTH;
+    }
+    raop_rtp_mirror->queue_depth = queue_depth;
+}
+
+/* must be called before raop_rtp_start_mirror(); budget 0 disables latency-based frame dropping */
+void
+raop_rtp_mirror_set_latency_budget(raop_rtp_mirror_t *raop_rtp_mirror, int latency_budget_micros)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->latency_budget = (latency_budget_micros > 0 ? (uint64_t) latency_budget_micros * 1000 : 0);
+}
+
+/* must be called before raop_rtp_start_mirror() */
+void
+raop_rtp_mirror_set_decrypt_threads(raop_rtp_mirror_t *raop_rtp_mirror, int decrypt_threads)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->decrypt_threads = decrypt_threads;
+}
+
+/* must be called before raop_rtp_start_mirror() */
+void
+raop_rtp_mirror_set_stream_capture(raop_rtp_mirror_t *raop_rtp_mirror, stream_capture_t *stream_capture, uint32_t session)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->stream_capture = stream_capture;
+    raop_rtp_mirror->capture_session = session;
+}
+
+/* returns false if the decode queue is not in use */
+bool
+raop_rtp_mirror_get_queue_stats(raop_rtp_mirror_t *raop_rtp_mirror, mirror_queue_stats_t *stats)
+{
+    assert(raop_rtp_mirror);
+    if (!raop_rtp_mirror->queue) {
+        return false;
+    }
+    mirror_queue_get_stats(raop_rtp_mirror->queue, stats);
+    return true;
+}
+
+static void
+raop_rtp_mirror_log_queue_stats(raop_rtp_mirror_t *raop_rtp_mirror, int level)
+{
+    mirror_queue_stats_t stats;
+    if (raop_rtp_mirror_get_queue_stats(raop_rtp_mirror, &stats)) {
+        logger_log(raop_rtp_mirror->logger, level, "raop_rtp_mirror decode queue: depth %d/%d, high water %d, "
+                   "%llu frames queued, %llu dropped (queue full), %llu skipped before next IDR frame",
+                   stats.depth, stats.capacity, stats.high_water, (unsigned long long) stats.frames,
+                   (unsigned long long) stats.dropped, (unsigned long long) raop_rtp_mirror->frames_skipped);
+    }
+}
+
+/* Applies the latency budget to a frame that is about to be decoded; returns true if it should be dropped. *
+ * An SPS+PPS is never dropped, as later frames may depend on it.                                        */
+static bool
+raop_rtp_mirror_drop_late_frame(raop_rtp_mirror_t *raop_rtp_mirror, const h264_decode_struct *h264_data)
+{
+    if (!raop_rtp_mirror->latency_budget || (h264_data->flags & H264_FRAME_SPS_PPS)) {
+        return false;
+    }
+
+    if (raop_rtp_mirror->late_skip_to_idr) {
+        if (!(h264_data->flags & H264_FRAME_IDR)) {
+            raop_rtp_mirror->frames_late++;
+            return true;
+        }
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: resuming video at IDR frame, %llu late frames dropped so far",
+                   (unsigned long long) raop_rtp_mirror->frames_late);
+        raop_rtp_mirror->late_skip_to_idr = false;
+    }
+
+    int64_t latency = ((int64_t) raop_ntp_get_local_time(raop_rtp_mirror->ntp)) - ((int64_t) h264_data->ntp_time_local);
+    /* a negative or very large latency means the clocks are not synchronized yet */
+    if (latency <= (int64_t) raop_rtp_mirror->latency_budget || latency > RAOP_MIRROR_MAX_VALID_LATENCY) {
+        return false;
+    }
+    if (h264_data->flags & H264_FRAME_IDR) {
+        /* an IDR frame starts a new GOP, so dropping it would just move the problem to the next GOP */
+        return false;
+    }
+    raop_rtp_mirror->frames_late++;
+    if (h264_data->flags & H264_FRAME_REFERENCE) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: video latency %8.6f exceeds budget, skipping to next IDR frame",
+                   (double) latency / SEC);
+        raop_rtp_mirror->late_skip_to_idr = true;
+    }
+    return true;
+}
+
+static THREAD_RETVAL
+raop_rtp_mirror_decode_thread(void *arg)
+{
+    raop_rtp_mirror_t *raop_rtp_mirror = arg;
+    h264_decode_struct h264_data;
+    assert(raop_rtp_mirror);
+
+    while (mirror_queue_pop(raop_rtp_mirror->queue, &h264_data, true)) {
+        if (!raop_rtp_mirror_drop_late_frame(raop_rtp_mirror, &h264_data)) {
+            raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &h264_data);
+        }
+        frame_pool_put(raop_rtp_mirror->frame_pool, h264_data.data);
+    }
+    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror exiting decode thread");
+    return 0;
+}
+
+/* hands a decrypted frame to the decoder, directly or through the decode queue */
+static void
+raop_rtp_mirror_deliver_frame(raop_rtp_mirror_t *raop_rtp_mirror, h264_decode_struct *h264_data)
+{
+    if (!raop_rtp_mirror->queue) {
+        if (!raop_rtp_mirror_drop_late_frame(raop_rtp_mirror, h264_data)) {
+            raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, h264_data);
+        }
+        frame_pool_put(raop_rtp_mirror->frame_pool, h264_data->data);
+        return;
+    }
+
+    if (raop_rtp_mirror->skip_to_idr && (h264_data->flags & H264_FRAME_IDR)) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror: resuming video at IDR frame after skipping %llu frames",
+                   (unsigned long long) raop_rtp_mirror->frames_skipped);
+        raop_rtp_mirror->skip_to_idr = false;
+    }
+    if (!raop_rtp_mirror->skip_to_idr && mirror_queue_push(raop_rtp_mirror->queue, h264_data)) {
+        return;
+    }
+    if (!raop_rtp_mirror->skip_to_idr) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror: video decode queue is full, skipping frames until next IDR frame");
+        raop_rtp_mirror->skip_to_idr = true;
+    } else {
+        raop_rtp_mirror->frames_skipped++;
+    }
+    /* a dropped SPS+PPS is prepended again to the next frame */
+    if (h264_data->flags & H264_FRAME_SPS_PPS) {
+        raop_rtp_mirror->sps_pps_waiting = true;
+    }
+    frame_pool_put(raop_rtp_mirror->frame_pool, h264_data->data);
+}
 
 #define RAOP_PACKET_LEN 32768
+
+/* each frame on the mirror TCP stream is a 128 byte header followed by payload_size bytes of payload */
+#define RAOP_MIRROR_HEADER_SIZE 128
+#define RAOP_MIRROR_MAX_PAYLOAD (64 * 1024 * 1024)
+
+/* initial size of the receive buffer (it grows if a larger frame arrives), and the *
+ * smallest amount of free space offered to each recv()                             */
+#define RAOP_MIRROR_RX_BUFFER_SIZE (1024 * 1024)
+#define RAOP_MIRROR_RX_MIN_READ (64 * 1024)
+
+#ifdef _WIN32
+/* select() on Windows only accepts sockets, so the thread polls the running flag */
+#define RAOP_MIRROR_SELECT_TIMEOUT_USECS 5000
+#endif
+
+static const unsigned char nal_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
+
+/* starts an encrypted video frame, once its header has been received */
+static void
+raop_rtp_mirror_video_begin(raop_rtp_mirror_t *raop_rtp_mirror, unsigned char *packet, int payload_size)
+{
+    video_frame_t *frame = &raop_rtp_mirror->frame;
+
+    if (!raop_rtp_mirror->sps_pps_waiting && packet[5] != 0x00) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "unexpected: packet[5] = %2.2x, but  not preceded  by SPS+PPS packet", packet[5]);
+    }
+    /* if a previous unencrypted packet contains an SPS (type 7) and PPS (type 8) NAL which has not
+     * yet been sent, it should be prepended to the current NAL.    In this case packet[5] is usually
+     * 0x10; however, the M1 Macs have increased the h264 level, and now the encrypted packet after the
+     * unencrypted SPS+PPS packet may contain a SEI (type 6) NAL prepended to the next VCL NAL, with
+     * packet[5] = 0x00.   Now the flag raop_rtp_mirror->sps_pps_waiting = true will signal that a
+     * previous packet contained a SPS NAL + a PPS NAL, that has not yet been sent.   This will trigger
+     * prepending it to the current NAL, and the sps_pps_waiting flag will be set to false after
+     * it has been prepended.    It is not clear if the case packet[5] = 0x10 will occur when
+     * raop_rtp_mirror->sps_pps = false, but if it does, the current code will prepend the stored
+     * PPS + SPS NAL to the current encrypted NAL, and issue a warning message */
+
+    /* the decrypted frame goes into a pooled buffer, with headroom for the SPS+PPS if it is prepended */
+    memset(frame, 0, sizeof(video_frame_t));
+    frame->active = true;
+    frame->valid = true;
+    frame->keystream_offset = mirror_buffer_get_keystream_offset(raop_rtp_mirror->buffer);
+    frame->sps_pps = (raop_rtp_mirror->sps_pps_waiting || packet[5] != 0x00);
+    int headroom = 0;
+    if (frame->sps_pps) {
+        assert(raop_rtp_mirror->sps_pps);
+        headroom = raop_rtp_mirror->sps_pps_len;
+    }
+    frame->out = frame_pool_get(raop_rtp_mirror->frame_pool, (size_t) payload_size + headroom);
+    if (!frame->out) {
+        /* the AES-CTR keystream runs continuously across frames, so a dropped frame must still be decrypted */
+        logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror: no buffer for %d byte video frame, frame dropped", payload_size);
+        frame->dropped = true;
+        return;
+    }
+    frame->decrypted = frame->out + headroom;
+    if (frame->sps_pps) {
+        memcpy(frame->out, raop_rtp_mirror->sps_pps, raop_rtp_mirror->sps_pps_len);
+        raop_rtp_mirror->sps_pps_waiting = false;
+    }
+}
+
+/* It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte  *
+ * start code for the NAL Byte-Stream Format.  A NAL is handled once its size and header byte have     *
+ * been decrypted; at the end of the frame, everything left is handled and the frame is checked.       */
+static void
+raop_rtp_mirror_video_scan_nals(raop_rtp_mirror_t *raop_rtp_mirror, int payload_size)
+{
+    video_frame_t *frame = &raop_rtp_mirror->frame;
+    unsigned char *payload_decrypted = frame->decrypted;
+    bool complete = (frame->decrypted_len == payload_size);
+    int nalu_type;               /* 0x01 non-IDR VCL, 0x05 IDR VCL, 0x06 SEI 0x07 SPS, 0x08 PPS */
+
+    while (!frame->scan_done && frame->nal_pos < payload_size) {
+        int nalu_size = frame->nal_pos;
+        if (!complete && nalu_size + 5 > frame->decrypted_len) {
+            return;
+        }
+        int nc_len = byteutils_get_int_be(payload_decrypted, nalu_size);
+        if (nc_len < 0 || nalu_size + 4 > payload_size) {
+            frame->valid = false;
+            frame->scan_done = true;
+            break;
+        }
+        memcpy(payload_decrypted + nalu_size, nal_start_code, 4);
+        nalu_size += 4;
+        frame->nal_count++;
+        int nal_ref_idc = 0;
+        if (nalu_size < payload_size) {
+            if (payload_decrypted[nalu_size] & 0x80) frame->valid = false;  /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
+            nalu_type = payload_decrypted[nalu_size] & 0x1f;
+            nal_ref_idc = (payload_decrypted[nalu_size] >> 5) & 0x03;
+            if (nalu_type == 5) frame->flags |= H264_FRAME_IDR;
+            if (nalu_type == 7) frame->flags |= H264_FRAME_SPS;
+            if (nal_ref_idc) frame->flags |= H264_FRAME_REFERENCE;
+        } else {
+            nalu_type = -1;
+        }
+        if (nc_len > payload_size - nalu_size) {
+            /* runs past the end of the payload */
+            frame->valid = false;
+            frame->scan_done = true;
+            break;
+        }
+        if (frame->nal_index_count < H264_MAX_NAL_INDEX) {
+            h264_nal_info *nal = &frame->nal_index[frame->nal_index_count++];
+            nal->offset = nalu_size - 4;
+            nal->length = nc_len + 4;
+            nal->type = (uint8_t) (nalu_type < 0 ? 0 : nalu_type);
+            nal->ref_idc = (uint8_t) nal_ref_idc;
+        } else {
+            frame->flags |= H264_FRAME_NAL_INDEX_TRUNCATED;
+        }
+        nalu_size += nc_len;
+        frame->nal_pos = nalu_size;
+        if (nalu_type != 1) {
+             logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu_type = %d, nalu_size = %d,  processed bytes %d, payloadsize = %d nalus_count = %d",
+                        nalu_type, nc_len, nalu_size, payload_size, frame->nal_count);
+        }
+    }
+    if (complete && frame->nal_pos != payload_size) {
+        frame->valid = false;
+    }
+}
+
+/* decrypts the payload received since the last call, up to available bytes */
+static void
+raop_rtp_mirror_video_decrypt(raop_rtp_mirror_t *raop_rtp_mirror, unsigned char *payload, int available, int payload_size)
+{
+    video_frame_t *frame = &raop_rtp_mirror->frame;
+    int len = available - frame->decrypted_len;
+
+    if (len <= 0 && available < payload_size) {
+        return;
+    }
+    /* with decryption worker threads, wait for enough data to decrypt it in parallel */
+    if (available < payload_size && len < mirror_buffer_get_batch_size(raop_rtp_mirror->buffer)) {
+        return;
+    }
+    if (frame->dropped) {
+        /* the received payload is left as it is, so that it can still be captured */
+        unsigned char discard[4096];
+        for (int pos = 0; pos < len; pos += (int) sizeof(discard)) {
+            int chunk = (len - pos < (int) sizeof(discard) ? len - pos : (int) sizeof(discard));
+            mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload + frame->decrypted_len + pos, discard, chunk);
+        }
+        frame->decrypted_len = available;
+        return;
+    }
+    raop_rtp_mirror_timing_t *timing = raop_rtp_mirror->timing;
+    uint64_t time_start = (timing ? raop_rtp_mirror_timing_now() : 0);
+    mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload + frame->decrypted_len, frame->decrypted + frame->decrypted_len, len);
+    frame->decrypted_len = available;
+    if (timing) {
+        uint64_t time_decrypted = raop_rtp_mirror_timing_now();
+        timing->decrypt_ns += time_decrypted - time_start;
+        raop_rtp_mirror_video_scan_nals(raop_rtp_mirror, payload_size);
+        timing->nal_ns += raop_rtp_mirror_timing_now() - time_decrypted;
+        return;
+    }
+    raop_rtp_mirror_video_scan_nals(raop_rtp_mirror, payload_size);
+}
+
+/* adds the prepended SPS and PPS to the NAL index; h264_data must not have any entries yet */
+static void
+raop_rtp_mirror_index_sps_pps(raop_rtp_mirror_t *raop_rtp_mirror, h264_decode_struct *h264_data)
+{
+    const unsigned char *sps_pps = raop_rtp_mirror->sps_pps;
+    int sps_nal_len = raop_rtp_mirror->sps_nal_len;
+    h264_nal_info *nal = h264_data->nal_index;
+
+    nal[0].offset = 0;
+    nal[0].length = sps_nal_len;
+    nal[0].type = sps_pps[4] & 0x1f;
+    nal[0].ref_idc = (sps_pps[4] >> 5) & 0x03;
+    nal[1].offset = sps_nal_len;
+    nal[1].length = raop_rtp_mirror->sps_pps_len - sps_nal_len;
+    nal[1].type = sps_pps[sps_nal_len + 4] & 0x1f;
+    nal[1].ref_idc = (sps_pps[sps_nal_len + 4] >> 5) & 0x03;
+    h264_data->nal_index_count = 2;
+}
+
+/* appends the NAL index of the decrypted payload, which follows headroom bytes in h264_data */
+static void
+raop_rtp_mirror_index_payload(video_frame_t *frame, h264_decode_struct *h264_data)
+{
+    int headroom = (int) (frame->decrypted - h264_data->data);
+    int count = frame->nal_index_count;
+
+    if (count > H264_MAX_NAL_INDEX - h264_data->nal_index_count) {
+        count = H264_MAX_NAL_INDEX - h264_data->nal_index_count;
+        h264_data->flags |= H264_FRAME_NAL_INDEX_TRUNCATED;
+    }
+    for (int i = 0; i < count; i++) {
+        h264_nal_info *nal = &h264_data->nal_index[h264_data->nal_index_count++];
+        *nal = frame->nal_index[i];
+        nal->offset += headroom;
+    }
+}
+
+/* abandons a partly received video frame, when the connection is closed */
+static void
+raop_rtp_mirror_video_reset(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    video_frame_t *frame = &raop_rtp_mirror->frame;
+    if (frame->out) {
+        frame_pool_put(raop_rtp_mirror->frame_pool, frame->out);
+    }
+    memset(frame, 0, sizeof(video_frame_t));
+}
+
+static void
+raop_rtp_mirror_process_frame(raop_rtp_mirror_t *raop_rtp_mirror, unsigned char *packet, unsigned char *payload, int payload_size)
+{
+    uint64_t ntp_timestamp_raw = 0;
+    uint64_t ntp_timestamp_remote = 0;
+    uint64_t ntp_timestamp_local  = 0;
+
+    char packet_description[13] = {0};
+    char *p = packet_description;
+    for (int i = 4; i < 8; i++) {
+        sprintf(p, "%2.2x ", (unsigned int) packet[i]);
+        p += 3;
+    }
+    ntp_timestamp_raw = byteutils_get_long(packet, 8);
+    ntp_timestamp_remote = raop_ntp_timestamp_to_nano_seconds(ntp_timestamp_raw, false);
+
+    /* packet[4] appears to have one of three possible values:                           *
+     * 0x00 : encrypted packet                                                           *
+     * 0x01 : unencrypted packet with a SPS and a PPS NAL, sent initially, and also when *
+     *        a change in video format (e.g., width, height) subsequently occurs         *
+     * 0x05 : unencrypted packet with a "streaming report", sent once per second         */
+
+    /* encrypted packets have packet[5] = 0x00 or 0x10, and packet[6]= packet[7] = 0x00; *
+     * encrypted packets immediately following an unencrypted SPS/PPS packet appear to   *
+     * be the only ones with packet[5] = 0x10, and almost always have packet[5] = 0x10,  *
+     * but occasionally have packet[5] = 0x00.                                           */
+
+    /* unencrypted SPS/PPS packets have packet[4:7] = 0x01 0x00 (0x16 or 0x56) 0x01      *
+     * they are followed by an encrypted packet with the same timestamp in packet[8:15]  */
+
+    /* "streaming report" packages have packet[4:7] = 0x05 0x00 0x00 0x00, and have no    *
+     * timestamp in packet[8:15]                                                         */
+
+    //unsigned short payload_type = byteutils_get_short(packet, 4) & 0xff;
+    //unsigned short payload_option = byteutils_get_short(packet, 6);
+
+    switch (packet[4]) {
+    case  0x00:
+        // Normal video data (VCL NAL)
+
+        // Conveniently, the video data is already stamped with the remote wall clock time,
+        // so no additional clock syncing needed. The only thing odd here is that the video
+        // ntp time stamps don't include the SECONDS_FROM_1900_TO_1970, so it's really just
+        // counting nano seconds since last boot.
+
+        ntp_timestamp_local = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
+        uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
+        int64_t latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp_local);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp video: now = %8.6f, ntp = %8.6f, latency = %8.6f, ts = %8.6f, %s",
+                   (double) ntp_now / SEC, (double) ntp_timestamp_local / SEC, (double) latency / SEC, (double) ntp_timestamp_remote / SEC, packet_description);
+
+        /* most of a large frame has usually been decrypted already, while it was being received */
+        video_frame_t *frame = &raop_rtp_mirror->frame;
+        if (!frame->active) {
+            raop_rtp_mirror_video_begin(raop_rtp_mirror, packet, payload_size);
+        }
+        raop_rtp_mirror_video_decrypt(raop_rtp_mirror, payload, payload_size, payload_size);
+        frame->active = false;
+        if (frame->dropped) {
+            break;
+        }
+
+        if(!frame->valid) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu marked as invalid");
+            frame->out[0] = 1; /* mark video data as invalid h264 (failed decryption) */
+        }
+        h264_decode_struct h264_data;
+        h264_data.ntp_time_local = ntp_timestamp_local;
+        h264_data.ntp_time_remote = ntp_timestamp_remote;
+        h264_data.nal_count = frame->nal_count;   /*nal_count will be the number of nal units in the packet */
+        h264_data.data_len = payload_size;
+        h264_data.data = frame->out;
+        h264_data.flags = frame->flags;
+        h264_data.nal_index_count = 0;
+        frame->out = NULL;
+        if (frame->sps_pps) {
+            h264_data.flags |= H264_FRAME_SPS_PPS | H264_FRAME_SPS;
+            h264_data.data_len += raop_rtp_mirror->sps_pps_len;
+            h264_data.nal_count += 2;
+            raop_rtp_mirror_index_sps_pps(raop_rtp_mirror, &h264_data);
+            if (ntp_timestamp_raw != raop_rtp_mirror->ntp_timestamp_nal) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror: prepended sps_pps timestamp does not match that of video payload");
+            }
+        }
+        raop_rtp_mirror_index_payload(frame, &h264_data);
+        if (raop_rtp_mirror->timing) {
+            raop_rtp_mirror_timing_t *timing = raop_rtp_mirror->timing;
+            uint64_t time_start = raop_rtp_mirror_timing_now();
+            raop_rtp_mirror_deliver_frame(raop_rtp_mirror, &h264_data);
+            timing->deliver_ns += raop_rtp_mirror_timing_now() - time_start;
+            timing->frames++;
+            timing->bytes += payload_size;
+        } else {
+            raop_rtp_mirror_deliver_frame(raop_rtp_mirror, &h264_data);
+        }
+        break;
+    case 0x01:
+        // The information in the payload contains an SPS and a PPS NAL
+        // The sps_pps is not encrypted
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived unencryted codec packet from client: payload_size %d header %s ts_client = %8.6f",
+                   payload_size, packet_description, (double) ntp_timestamp_remote / SEC);
+        if (payload_size == 0) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror, discard type 0x01 packet with no payload");
+            break;
+        }
+        raop_rtp_mirror->ntp_timestamp_nal = ntp_timestamp_raw;
+        float width = byteutils_get_float(packet, 16);
+        float height = byteutils_get_float(packet, 20);
+        float width_source = byteutils_get_float(packet, 40);
+        float height_source = byteutils_get_float(packet, 44);
+        if (width != width_source || height != height_source) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: Unexpected : data  %f, %f != width_source = %f, height_source = %f",
+                   width, height, width_source, height_source);
+        }
+        width = byteutils_get_float(packet, 48);
+        height = byteutils_get_float(packet, 52);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: unidentified extra header data  %f, %f", width, height);
+        width = byteutils_get_float(packet, 56);
+        height = byteutils_get_float(packet, 60);
+        if (raop_rtp_mirror->callbacks.video_report_size) {
+            raop_rtp_mirror->callbacks.video_report_size(raop_rtp_mirror->callbacks.cls, &width_source, &height_source, &width, &height);
+        }
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror width_source = %f height_source = %f width = %f height = %f",
+                   width_source, height_source, width, height);
+
+        short sps_size = byteutils_get_short_be(payload,6);
+        unsigned char *sequence_parameter_set = payload + 8;
+        short pps_size = byteutils_get_short_be(payload, sps_size + 9);
+        unsigned char *picture_parameter_set = payload + sps_size + 11;
+        int data_size = 6;
+        char *str = utils_data_to_string(payload, data_size, 16);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: sps/pps header size = %d", data_size);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 sps/pps header:\n%s", str);
+        free(str);
+        str = utils_data_to_string(sequence_parameter_set, sps_size,16);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror sps size = %d",  sps_size);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
+        free(str);
+        str = utils_data_to_string(picture_parameter_set, pps_size, 16);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror pps size = %d", pps_size);
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Picture Parameter Set:\n%s", str);
+        free(str);
+        data_size = payload_size - sps_size - pps_size - 11;
+        if (data_size > 0) {
+            str = utils_data_to_string (picture_parameter_set + pps_size, data_size, 16);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder size = %d", data_size);
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder of sps+pps packet:\n%s", str);
+            free(str);
+        } else if (data_size < 0) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, " pps_sps error: packet remainder size = %d < 0", data_size);
+        }
+
+        // Copy the sps and pps into a buffer to prepend to the next NAL unit.
+        raop_rtp_mirror->sps_pps_len = sps_size + pps_size + 8;
+        raop_rtp_mirror->sps_nal_len = sps_size + 4;
+        if (raop_rtp_mirror->sps_pps) {
+            free(raop_rtp_mirror->sps_pps);
+        }
+        raop_rtp_mirror->sps_pps = (unsigned char*) malloc(raop_rtp_mirror->sps_pps_len);
+        assert(raop_rtp_mirror->sps_pps);
+        memcpy(raop_rtp_mirror->sps_pps, nal_start_code, 4);
+        memcpy(raop_rtp_mirror->sps_pps + 4, sequence_parameter_set, sps_size);
+        memcpy(raop_rtp_mirror->sps_pps + sps_size + 4, nal_start_code, 4);
+        memcpy(raop_rtp_mirror->sps_pps + sps_size + 8, payload + sps_size + 11, pps_size);
+        raop_rtp_mirror->sps_pps_waiting = true;
+
+        // h264codec_t h264;
+        // h264.version = payload[0];
+        // h264.profile_high = payload[1];
+        // h264.compatibility = payload[2];
+        // h264.level = payload[3];
+        // h264.reserved_6_and_nal = payload[4];
+        // h264.reserved_3_and_sps = payload[5];
+        // h264.sps_size =  sps_size;
+        // h264.sequence_parameter_set = malloc(h264.sps_size);
+        // memcpy(h264.sequence_parameter_set, sequence_parameter_set, sps_size);
+        // h264.number_of_pps = payload[h264.sps_size + 8];
+        // h264.pps_size = pps_size;
+        // h264.picture_parameter_set = malloc(h264.pps_size);
+        // memcpy(h264.picture_parameter_set, picture_parameter_set, pps_size);
+
+        break;
+    case 0x05:
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived video streaming performance info packet from client: payload_size %d header %s ts_raw = %llu",
+                   payload_size, packet_description, ntp_timestamp_raw);
+        /* payloads with packet[4] = 0x05 have no timestamp, and carry video info from the client as a binary plist *
+         * Sometimes (e.g, when the client has a locked screen), there is a 25kB trailer attached to the packet.    *
+         * This 25000 Byte trailer with unidentified content seems to be the same data each time it is sent.        */
+
+        raop_rtp_mirror_log_queue_stats(raop_rtp_mirror, LOGGER_DEBUG);
+
+        if (payload_size && raop_rtp_mirror->show_client_FPS_data) {
+            //char *str = utils_data_to_string(packet, 128, 16);
+            //logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "type 5 video packet header:\n%s", str);
+            //free (str);
+
+            int plist_size = payload_size;
+            if (payload_size > 25000) {
+                plist_size = payload_size - 25000;
+                char *str = utils_data_to_string(payload + plist_size, 16, 16);
+                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "video_info packet had 25kB trailer; first 16 bytes are:\n%s", str);
+                free(str);
+            }
+            if (plist_size) {
+                char *plist_xml;
+                uint32_t plist_len;
+                plist_t root_node = NULL;
+                plist_from_bin((char *) payload, plist_size, &root_node);
+                plist_to_xml(root_node, &plist_xml, &plist_len);
+                logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "%s", plist_xml);
+                free(plist_xml);
+            }
+        }
+        break;
+    default:
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "\nReceived unexpected TCP packet from client, size %d, %s ts_raw = raw%llu",
+                   payload_size, packet_description, ntp_timestamp_raw);
+        break;
+    }
+}
+
+/* Processes a frame from a capture file, without the mirror thread (raop_rtp_start_mirror() *
+ * must not be used with this).  The payload is decrypted with the keystream at the offset  *
+ * recorded for it, so that frames missing from the capture do not matter.                  */
+void
+raop_rtp_mirror_replay_frame(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t keystream_offset,
+                             unsigned char *packet, int payload_size, raop_rtp_mirror_timing_t *timing)
+{
+    assert(raop_rtp_mirror);
+    raop_rtp_mirror->timing = timing;
+    if (packet[4] == 0x00 && keystream_offset != mirror_buffer_get_keystream_offset(raop_rtp_mirror->buffer)) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: replay continues at keystream offset %llu",
+                   (unsigned long long) keystream_offset);
+        mirror_buffer_set_keystream_offset(raop_rtp_mirror->buffer, keystream_offset);
+    }
+    raop_rtp_mirror_process_frame(raop_rtp_mirror, packet, packet + RAOP_MIRROR_HEADER_SIZE, payload_size);
+}
+
+/* captures a complete frame as it was received, with the keystream offset needed to decrypt it */
+static void
+raop_rtp_mirror_capture_frame(raop_rtp_mirror_t *raop_rtp_mirror, const unsigned char *packet, int payload_size)
+{
+    unsigned char prefix[8 + RAOP_MIRROR_HEADER_SIZE];
+    uint64_t keystream_offset;
+
+    if (!stream_capture_is_active(raop_rtp_mirror->stream_capture)) {
+        return;
+    }
+    if (raop_rtp_mirror->frame.active) {
+        keystream_offset = raop_rtp_mirror->frame.keystream_offset;
+    } else {
+        keystream_offset = mirror_buffer_get_keystream_offset(raop_rtp_mirror->buffer);
+    }
+    for (int i = 0; i < 8; i++) {
+        prefix[i] = (unsigned char) (keystream_offset >> (8 * i));
+    }
+    memcpy(prefix + 8, packet, RAOP_MIRROR_HEADER_SIZE);
+    stream_capture_record(raop_rtp_mirror->stream_capture, raop_rtp_mirror->capture_session, STREAM_CAPTURE_MIRROR_FRAME,
+                          prefix, sizeof(prefix),
+                          packet + RAOP_MIRROR_HEADER_SIZE, payload_size);
+}
+
+/* Processes every complete frame in the receive buffer.  A trailing partial frame is
+ * left in place, to be completed by later reads; returns -1 if a frame header is bad */
+static int
+raop_rtp_mirror_parse_frames(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    while (raop_rtp_mirror->rx_end - raop_rtp_mirror->rx_start >= RAOP_MIRROR_HEADER_SIZE) {
+        unsigned char *packet = raop_rtp_mirror->rx_buf + raop_rtp_mirror->rx_start;
+
+        /*packet[0:3] contains the payload size */
+        uint32_t payload_size = byteutils_get_int(packet, 0);
+        if (payload_size > RAOP_MIRROR_MAX_PAYLOAD) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror: bad frame header, payload size %u", payload_size);
+            return -1;
+        }
+        if (raop_rtp_mirror->rx_end - raop_rtp_mirror->rx_start < RAOP_MIRROR_HEADER_SIZE + payload_size) {
+            /* an encrypted video frame is decrypted as far as it has been received */
+            if (packet[4] == 0x00) {
+                if (!raop_rtp_mirror->frame.active) {
+                    raop_rtp_mirror_video_begin(raop_rtp_mirror, packet, (int) payload_size);
+                }
+                int available = (int) (raop_rtp_mirror->rx_end - raop_rtp_mirror->rx_start - RAOP_MIRROR_HEADER_SIZE);
+                raop_rtp_mirror_video_decrypt(raop_rtp_mirror, packet + RAOP_MIRROR_HEADER_SIZE, available, (int) payload_size);
+            }
+            break;
+        }
+        if (raop_rtp_mirror->stream_capture) {
+            raop_rtp_mirror_capture_frame(raop_rtp_mirror, packet, (int) payload_size);
+        }
+        raop_rtp_mirror_process_frame(raop_rtp_mirror, packet, packet + RAOP_MIRROR_HEADER_SIZE, (int) payload_size);
+        raop_rtp_mirror->rx_start += RAOP_MIRROR_HEADER_SIZE + payload_size;
+    }
+    if (raop_rtp_mirror->rx_start == raop_rtp_mirror->rx_end) {
+        raop_rtp_mirror->rx_start = 0;
+        raop_rtp_mirror->rx_end = 0;
+    }
+    return 0;
+}
+
+/* Makes room at the end of the receive buffer for the next recv().  Space taken by  *
+ * processed frames is reclaimed, and the buffer grows if needed so that a partial   *
+ * frame whose header has arrived will fit completely, without being moved again.    */
+static int
+raop_rtp_mirror_rx_reserve(raop_rtp_mirror_t *raop_rtp_mirror)
+{
+    size_t pending = raop_rtp_mirror->rx_end - raop_rtp_mirror->rx_start;
+    size_t wanted = RAOP_MIRROR_HEADER_SIZE;
+    if (pending >= RAOP_MIRROR_HEADER_SIZE) {
+        wanted += byteutils_get_int(raop_rtp_mirror->rx_buf, raop_rtp_mirror->rx_start);
+    }
+    wanted = (wanted > pending ? wanted - pending : 0);
+    if (wanted < RAOP_MIRROR_RX_MIN_READ) {
+        wanted = RAOP_MIRROR_RX_MIN_READ;
+    }
+    if (raop_rtp_mirror->rx_capacity - raop_rtp_mirror->rx_end >= wanted) {
+        return 0;
+    }
+
+    if (raop_rtp_mirror->rx_start > 0) {
+        memmove(raop_rtp_mirror->rx_buf, raop_rtp_mirror->rx_buf + raop_rtp_mirror->rx_start, pending);
+        raop_rtp_mirror->rx_start = 0;
+        raop_rtp_mirror->rx_end = pending;
+    }
+    if (raop_rtp_mirror->rx_capacity - raop_rtp_mirror->rx_end < wanted) {
+        size_t capacity = (raop_rtp_mirror->rx_capacity ? raop_rtp_mirror->rx_capacity : RAOP_MIRROR_RX_BUFFER_SIZE);
+        while (capacity - pending < wanted) {
+            capacity *= 2;
+        }
+        unsigned char *rx_buf = realloc(raop_rtp_mirror->rx_buf, capacity);
+        if (!rx_buf) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not allocate %zu byte receive buffer", capacity);
+            return -1;
+        }
+        if (raop_rtp_mirror->rx_capacity) {
+            logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror receive buffer grown to %zu bytes", capacity);
+        }
+        raop_rtp_mirror->rx_buf = rx_buf;
+        raop_rtp_mirror->rx_capacity = capacity;
+    }
+    return 0;
+}
+
 /**
  * Mirror
  */
@@ -195,29 +995,16 @@ raop_rtp_mirror_thread(void *arg)
     assert(raop_rtp_mirror);
 
     int stream_fd = -1;
-    unsigned char packet[128];
-    memset(packet, 0 , 128);
-    unsigned char* payload = NULL;
-    unsigned int readstart = 0;
     bool conn_reset = false;
-    uint64_t ntp_timestamp_nal = 0;
-    uint64_t ntp_timestamp_raw = 0;
-    uint64_t ntp_timestamp_remote = 0;
-    uint64_t ntp_timestamp_local  = 0;
-    unsigned char nal_start_code[4] = { 0x00, 0x00, 0x00, 0x01 };
-
-#ifdef DUMP_H264
-    // C decrypted
-    FILE* file = fopen("/home/pi/Airplay.h264", "wb");
-    // Encrypted source file
-    FILE* file_source = fopen("/home/pi/Airplay.source", "wb");
-    FILE* file_len = fopen("/home/pi/Airplay.len", "wb");
-#endif
+
+    raop_rtp_mirror->rx_start = 0;
+    raop_rtp_mirror->rx_end = 0;
+    raop_rtp_mirror->ntp_timestamp_nal = 0;
 
     while (1) {
         fd_set rfds;
-        struct timeval tv;
-        int nfds, ret;
+        struct timeval *timeout = NULL;
+        int sock_fd, nfds, ret;
         MUTEX_LOCK(raop_rtp_mirror->run_mutex);
         if (!raop_rtp_mirror->running) {
             MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
@@ -226,31 +1013,44 @@ raop_rtp_mirror_thread(void *arg)
         }
         MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
-        /* Set timeout valu to 5ms */
-        tv.tv_sec = 0;
-        tv.tv_usec = 5000;
-
         /* Get the correct nfds value and set rfds */
+        sock_fd = (stream_fd == -1 ? raop_rtp_mirror->mirror_data_sock : stream_fd);
         FD_ZERO(&rfds);
-        if (stream_fd == -1) {
-            FD_SET(raop_rtp_mirror->mirror_data_sock, &rfds);
-            nfds = raop_rtp_mirror->mirror_data_sock+1;
-        } else {
-            FD_SET(stream_fd, &rfds);
-            nfds = stream_fd+1;
+        FD_SET(sock_fd, &rfds);
+        nfds = sock_fd + 1;
+#ifdef _WIN32
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = RAOP_MIRROR_SELECT_TIMEOUT_USECS;
+        timeout = &tv;
+#else
+        /* no timeout: raop_rtp_mirror_stop() wakes the thread through the pipe */
+        FD_SET(raop_rtp_mirror->wake_pipe[0], &rfds);
+        if (raop_rtp_mirror->wake_pipe[0] >= nfds) {
+            nfds = raop_rtp_mirror->wake_pipe[0] + 1;
         }
-        ret = select(nfds, &rfds, NULL, NULL, &tv);
+#endif
+        ret = select(nfds, &rfds, NULL, NULL, timeout);
         if (ret == 0) {
             /* Timeout happened */
             continue;
         } else if (ret == -1) {
+            if (errno == EINTR) continue;
             logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in select");
             break;
         }
 
-        if (stream_fd == -1 &&
-	    (raop_rtp_mirror && raop_rtp_mirror->mirror_data_sock >= 0) &&
-            FD_ISSET(raop_rtp_mirror->mirror_data_sock, &rfds)) {
+#ifndef _WIN32
+        if (FD_ISSET(raop_rtp_mirror->wake_pipe[0], &rfds)) {
+            char c;
+            if (read(raop_rtp_mirror->wake_pipe[0], &c, 1) < 0) {
+                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not read wake pipe %d %s", errno, strerror(errno));
+            }
+            continue;
+        }
+#endif
+
+        if (stream_fd == -1 && FD_ISSET(raop_rtp_mirror->mirror_data_sock, &rfds)) {
             struct sockaddr_storage saddr;
             socklen_t saddrlen;
             logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror accepting client");
@@ -261,15 +1061,6 @@ raop_rtp_mirror_thread(void *arg)
                 break;
             }
 
-            // We're calling recv for a certain amount of data, so we need a timeout
-            struct timeval tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = 5000;
-            if (setsockopt(stream_fd, SOL_SOCKET, SO_RCVTIMEO, CAST &tv, sizeof(tv)) < 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror could not set stream socket timeout %d %s", errno, strerror(errno));
-                break;
-            }
-
             int option;
             option = 1;
             if (setsockopt(stream_fd, SOL_SOCKET, SO_KEEPALIVE, CAST &option, sizeof(option)) < 0) {
@@ -287,310 +1078,42 @@ raop_rtp_mirror_thread(void *arg)
             if (setsockopt(stream_fd, SOL_TCP, TCP_KEEPCNT, CAST &option, sizeof(option)) < 0) {
                 logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not set stream socket keepalive probes %d %s", errno, strerror(errno));
             }
-            readstart = 0;
+            raop_rtp_mirror->rx_start = 0;
+            raop_rtp_mirror->rx_end = 0;
+            raop_rtp_mirror_video_reset(raop_rtp_mirror);
+            continue;
         }
 
         if (stream_fd != -1 && FD_ISSET(stream_fd, &rfds)) {
-
-            // The first 128 bytes are some kind of header for the payload that follows
-            while (payload == NULL && readstart < 128) {
-                unsigned char* pos  = packet + readstart;
-                ret = recv(stream_fd, CAST pos, 128 - readstart, 0);
-                if (ret <= 0) break;
-                readstart = readstart + ret;
-            }
-
-            if (payload == NULL && ret == 0) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket is closed, got %d bytes of 128 byte header",readstart);
-                FD_CLR(stream_fd, &rfds);
-                stream_fd = -1;
-                continue;
-            } else if (payload == NULL && ret == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // Timeouts can happen even if the connection is fine
-                logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error  in header recv: %d %s", errno, strerror(errno));
-                if (errno == ECONNRESET) conn_reset = true;; 
+            /* a single recv() takes whatever the kernel has; this may hold several frames, or only part of one */
+            if (raop_rtp_mirror_rx_reserve(raop_rtp_mirror) < 0) {
                 break;
             }
-
-            /*packet[0:3] contains the payload size */
-            int payload_size = byteutils_get_int(packet, 0);
-            char packet_description[13] = {0};
-	    char *p = packet_description;
-	    for (int i = 4; i < 8; i++) {
-                sprintf(p, "%2.2x ", (unsigned int) packet[i]);
-                p += 3;
-	    }
-            ntp_timestamp_raw = byteutils_get_long(packet, 8);
-            ntp_timestamp_remote = raop_ntp_timestamp_to_nano_seconds(ntp_timestamp_raw, false);
-	    
-            /* packet[4] appears to have one of three possible values:                           *
-             * 0x00 : encrypted packet                                                           *    
-             * 0x01 : unencrypted packet with a SPS and a PPS NAL, sent initially, and also when *
-             *        a change in video format (e.g., width, height) subsequently occurs         *
-             * 0x05 : unencrypted packet with a "streaming report", sent once per second         */
-
-            /* encrypted packets have packet[5] = 0x00 or 0x10, and packet[6]= packet[7] = 0x00; *
-             * encrypted packets immediately following an unencrypted SPS/PPS packet appear to   *
-             * be the only ones with packet[5] = 0x10, and almost always have packet[5] = 0x10,  *
-             * but occasionally have packet[5] = 0x00.                                           */
-
-            /* unencrypted SPS/PPS packets have packet[4:7] = 0x01 0x00 (0x16 or 0x56) 0x01      *
-             * they are followed by an encrypted packet with the same timestamp in packet[8:15]  */
-
-            /* "streaming report" packages have packet[4:7] = 0x05 0x00 0x00 0x00, and have no    *
-             * timestamp in packet[8:15]                                                         */
-
-            //unsigned short payload_type = byteutils_get_short(packet, 4) & 0xff;
-            //unsigned short payload_option = byteutils_get_short(packet, 6);
-
-            if (payload == NULL) {
-                payload = malloc(payload_size);
-                readstart = 0;
-            }
-
-            while (readstart < payload_size) {
-                // Payload data
-                unsigned char *pos = payload + readstart;
-                ret = recv(stream_fd, CAST pos, payload_size - readstart, 0);
-                if (ret <= 0) break;
-                readstart = readstart + ret;
-            }
-
+            unsigned char *pos = raop_rtp_mirror->rx_buf + raop_rtp_mirror->rx_end;
+            ret = recv(stream_fd, CAST pos, raop_rtp_mirror->rx_capacity - raop_rtp_mirror->rx_end, 0);
             if (ret == 0) {
+                size_t pending = raop_rtp_mirror->rx_end - raop_rtp_mirror->rx_start;
+                if (pending < RAOP_MIRROR_HEADER_SIZE) {
+                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket is closed, got %zu bytes of 128 byte header", pending);
+                    closesocket(stream_fd);
+                    stream_fd = -1;
+                    raop_rtp_mirror->rx_start = 0;
+                    raop_rtp_mirror->rx_end = 0;
+                    continue;
+                }
                 logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror tcp socket is closed");
                 break;
             } else if (ret == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // Timeouts can happen even if the connection is fine
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
                 logger_log(raop_rtp_mirror->logger, LOGGER_ERR, "raop_rtp_mirror error in recv: %d %s", errno, strerror(errno));
                 if (errno == ECONNRESET) conn_reset = true;
                 break;
             }
+            raop_rtp_mirror->rx_end += ret;
 
-	    switch (packet[4]) {
-            case  0x00:
-                // Normal video data (VCL NAL)
-
-                // Conveniently, the video data is already stamped with the remote wall clock time,
-                // so no additional clock syncing needed. The only thing odd here is that the video
-                // ntp time stamps don't include the SECONDS_FROM_1900_TO_1970, so it's really just
-                // counting nano seconds since last boot.
-
-                ntp_timestamp_local = raop_ntp_convert_remote_time(raop_rtp_mirror->ntp, ntp_timestamp_remote);
-                uint64_t ntp_now = raop_ntp_get_local_time(raop_rtp_mirror->ntp);
-                int64_t latency = ((int64_t) ntp_now) - ((int64_t) ntp_timestamp_local);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp video: now = %8.6f, ntp = %8.6f, latency = %8.6f, ts = %8.6f, %s",
-                           (double) ntp_now / SEC, (double) ntp_timestamp_local / SEC, (double) latency / SEC, (double) ntp_timestamp_remote / SEC, packet_description);
-
-#ifdef DUMP_H264
-                fwrite(payload, payload_size, 1, file_source);
-                fwrite(&readstart, sizeof(readstart), 1, file_len);
-#endif
-                unsigned char* payload_out;
-		unsigned char* payload_decrypted;
-                if (!raop_rtp_mirror->sps_pps_waiting && packet[5] != 0x00) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "unexpected: packet[5] = %2.2x, but  not preceded  by SPS+PPS packet", packet[5]);
-                }
-                /* if a previous unencrypted packet contains an SPS (type 7) and PPS (type 8) NAL which has not 
-                 * yet been sent, it should be prepended to the current NAL.    In this case packet[5] is usually 
-                 * 0x10; however, the M1 Macs have increased the h264 level, and now the encrypted packet after the
-                 * unencrypted SPS+PPS packet may contain a SEI (type 6) NAL prepended to the next VCL NAL, with
-                 * packet[5] = 0x00.   Now the flag raop_rtp_mirror->sps_pps_waiting = true will signal that a 
-                 * previous packet contained a SPS NAL + a PPS NAL, that has not yet been sent.   This will trigger
-                 * prepending it to the current NAL, and the sps_pps_waiting flag will be set to false after
-                 * it has been prepended.    It is not clear if the case packet[5] = 0x10 will occur when
-                 * raop_rtp_mirror->sps_pps = false, but if it does, the current code will prepend the stored
-                 * PPS + SPS NAL to the current encrypted NAL, and issue a warning message */
-
-                bool prepend_sps_pps = (raop_rtp_mirror->sps_pps_waiting || packet[5] != 0x00);
-                if (prepend_sps_pps) {
-                    assert(raop_rtp_mirror->sps_pps);
-                    payload_out = (unsigned char*)  malloc(payload_size + raop_rtp_mirror->sps_pps_len);
-                    payload_decrypted = payload_out + raop_rtp_mirror->sps_pps_len;
-                    memcpy(payload_out, raop_rtp_mirror->sps_pps, raop_rtp_mirror->sps_pps_len);
-                    raop_rtp_mirror->sps_pps_waiting = false;
-                } else {
-                    payload_out = (unsigned char*)  malloc(payload_size);
-                    payload_decrypted = payload_out;
-                }
-                // Decrypt data
-                mirror_buffer_decrypt(raop_rtp_mirror->buffer, payload, payload_decrypted, payload_size);
-
-                // It seems the AirPlay protocol prepends NALs with their size, which we're replacing with the 4-byte
-                // start code for the NAL Byte-Stream Format.
-                bool valid_data = true;
-                int nalu_size = 0;
-                int nalus_count = 0;
-                int nalu_type;               /* 0x01 non-IDR VCL, 0x05 IDR VCL, 0x06 SEI 0x07 SPS, 0x08 PPS */
-                while (nalu_size < payload_size) {
-                    int nc_len = byteutils_get_int_be(payload_decrypted, nalu_size);
-                    if (nc_len < 0 || nalu_size + 4 > payload_size) {
-                        valid_data = false;
-                        break;
-                    }
-                    memcpy(payload_decrypted + nalu_size, nal_start_code, 4);
-                    nalu_size += 4;
-                    nalus_count++;
-                    if (payload_decrypted[nalu_size] & 0x80) valid_data = false;  /* first bit of h264 nalu MUST be 0 ("forbidden_zero_bit") */
-                    nalu_type = payload_decrypted[nalu_size] & 0x1f;
-                    nalu_size += nc_len;
-                    if (nalu_type != 1) {
-                         logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu_type = %d, nalu_size = %d,  processed bytes %d, payloadsize = %d nalus_count = %d",
-                                    nalu_type, nc_len, nalu_size, payload_size, nalus_count);
-                    }
-                 }
-                if (nalu_size != payload_size) valid_data = false;
-                if(!valid_data) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "nalu marked as invalid");
-                    payload_out[0] = 1; /* mark video data as invalid h264 (failed decryption) */
-                }
-#ifdef DUMP_H264
-                fwrite(payload_decrypted, payload_size, 1, file);
-#endif
-                payload_decrypted = NULL;
-                h264_decode_struct h264_data;
-                h264_data.ntp_time_local = ntp_timestamp_local;
-                h264_data.ntp_time_remote = ntp_timestamp_remote;
-                h264_data.nal_count = nalus_count;   /*nal_count will be the number of nal units in the packet */
-                h264_data.data_len = payload_size;
-                h264_data.data = payload_out;
-                if (prepend_sps_pps) {
-                    h264_data.data_len += raop_rtp_mirror->sps_pps_len;
-                    h264_data.nal_count += 2;
-                    if (ntp_timestamp_raw != ntp_timestamp_nal) {
-                        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror: prepended sps_pps timestamp does not match that of video payload");
-                    }
-                }
-                raop_rtp_mirror->callbacks.video_process(raop_rtp_mirror->callbacks.cls, raop_rtp_mirror->ntp, &h264_data);
-                free(payload_out);
-                break;
-            case 0x01:
-                // The information in the payload contains an SPS and a PPS NAL
-                // The sps_pps is not encrypted
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived unencryted codec packet from client: payload_size %d header %s ts_client = %8.6f",
-			   payload_size, packet_description, (double) ntp_timestamp_remote / SEC);
-                if (payload_size == 0) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror, discard type 0x01 packet with no payload");
-                    break;
-                }
-                ntp_timestamp_nal = ntp_timestamp_raw;
-                float width = byteutils_get_float(packet, 16);
-                float height = byteutils_get_float(packet, 20);
-                float width_source = byteutils_get_float(packet, 40);
-                float height_source = byteutils_get_float(packet, 44);
-                if (width != width_source || height != height_source) {
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: Unexpected : data  %f, %f != width_source = %f, height_source = %f",
-                           width, height, width_source, height_source);
-                }
-                width = byteutils_get_float(packet, 48);
-                height = byteutils_get_float(packet, 52);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: unidentified extra header data  %f, %f", width, height);
-                width = byteutils_get_float(packet, 56);
-                height = byteutils_get_float(packet, 60);
-                if (raop_rtp_mirror->callbacks.video_report_size) {
-                    raop_rtp_mirror->callbacks.video_report_size(raop_rtp_mirror->callbacks.cls, &width_source, &height_source, &width, &height);
-                }
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror width_source = %f height_source = %f width = %f height = %f",
-                           width_source, height_source, width, height);
-
-                short sps_size = byteutils_get_short_be(payload,6);
-                unsigned char *sequence_parameter_set = payload + 8;
-                short pps_size = byteutils_get_short_be(payload, sps_size + 9);
-                unsigned char *picture_parameter_set = payload + sps_size + 11;
-                int data_size = 6; 
-                char *str = utils_data_to_string(payload, data_size, 16);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror: sps/pps header size = %d", data_size);		
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 sps/pps header:\n%s", str);
-                free(str);
-                str = utils_data_to_string(sequence_parameter_set, sps_size,16);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror sps size = %d",  sps_size);		
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Sequence Parameter Set:\n%s", str);
-                free(str);
-                str = utils_data_to_string(picture_parameter_set, pps_size, 16);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror pps size = %d", pps_size);
-                logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "raop_rtp_mirror h264 Picture Parameter Set:\n%s", str);
-                free(str);
-                data_size = payload_size - sps_size - pps_size - 11; 
-                if (data_size > 0) {
-                    str = utils_data_to_string (picture_parameter_set + pps_size, data_size, 16);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder size = %d", data_size);
-                    logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "remainder of sps+pps packet:\n%s", str);
-                    free(str);
-                } else if (data_size < 0) {
-                    logger_log(raop_rtp_mirror->logger, LOGGER_ERR, " pps_sps error: packet remainder size = %d < 0", data_size);
-                }
-
-                // Copy the sps and pps into a buffer to prepend to the next NAL unit.
-                raop_rtp_mirror->sps_pps_len = sps_size + pps_size + 8;
-                if (raop_rtp_mirror->sps_pps) {
-                    free(raop_rtp_mirror->sps_pps);
-                }
-                raop_rtp_mirror->sps_pps = (unsigned char*) malloc(raop_rtp_mirror->sps_pps_len);
-                assert(raop_rtp_mirror->sps_pps);
-                memcpy(raop_rtp_mirror->sps_pps, nal_start_code, 4);
-                memcpy(raop_rtp_mirror->sps_pps + 4, sequence_parameter_set, sps_size);
-                memcpy(raop_rtp_mirror->sps_pps + sps_size + 4, nal_start_code, 4); 
-                memcpy(raop_rtp_mirror->sps_pps + sps_size + 8, payload + sps_size + 11, pps_size);
-                raop_rtp_mirror->sps_pps_waiting = true;
-#ifdef DUMP_H264
-                fwrite(raop_rtp_mirror->sps_pps, raop_rtp_mirror->sps_pps_len, 1, file);
-#endif
-
-                // h264codec_t h264;
-                // h264.version = payload[0];
-                // h264.profile_high = payload[1];
-                // h264.compatibility = payload[2];
-                // h264.level = payload[3];
-                // h264.reserved_6_and_nal = payload[4];
-                // h264.reserved_3_and_sps = payload[5];
-                // h264.sps_size =  sps_size;
-                // h264.sequence_parameter_set = malloc(h264.sps_size);
-                // memcpy(h264.sequence_parameter_set, sequence_parameter_set, sps_size);
-                // h264.number_of_pps = payload[h264.sps_size + 8];
-                // h264.pps_size = pps_size;
-                // h264.picture_parameter_set = malloc(h264.pps_size);
-                // memcpy(h264.picture_parameter_set, picture_parameter_set, pps_size);
-
-                break;
-            case 0x05:
-	      logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "\nReceived video streaming performance info packet from client: payload_size %d header %s ts_raw = %llu",
-                         payload_size, packet_description, ntp_timestamp_raw);
-                /* payloads with packet[4] = 0x05 have no timestamp, and carry video info from the client as a binary plist *
-                 * Sometimes (e.g, when the client has a locked screen), there is a 25kB trailer attached to the packet.    *
-                 * This 25000 Byte trailer with unidentified content seems to be the same data each time it is sent.        */
-
-                if (payload_size && raop_rtp_mirror->show_client_FPS_data) {
-                    //char *str = utils_data_to_string(packet, 128, 16);
-                    //logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "type 5 video packet header:\n%s", str);
-                    //free (str);
-		    
-                    int plist_size = payload_size;
-                    if (payload_size > 25000) {
-		        plist_size = payload_size - 25000;
-                        char *str = utils_data_to_string(payload + plist_size, 16, 16);
-                        logger_log(raop_rtp_mirror->logger, LOGGER_DEBUG, "video_info packet had 25kB trailer; first 16 bytes are:\n%s", str);
-                        free(str);
-                    }
-                    if (plist_size) {
-                        char *plist_xml;
-                        uint32_t plist_len;
-                        plist_t root_node = NULL;
-                        plist_from_bin((char *) payload, plist_size, &root_node);
-                        plist_to_xml(root_node, &plist_xml, &plist_len);
-                        logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "%s", plist_xml);
-                        free(plist_xml);
-                    }
-                }
-                break;
-            default:
-                logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "\nReceived unexpected TCP packet from client, size %d, %s ts_raw = raw%llu",
-                           payload_size, packet_description, ntp_timestamp_raw);
+            if (raop_rtp_mirror_parse_frames(raop_rtp_mirror) < 0) {
                 break;
             }
-
-            free(payload);
-            payload = NULL;
-            memset(packet, 0, 128);
-            readstart = 0;
         }
     }
 
@@ -598,12 +1121,10 @@ raop_rtp_mirror_thread(void *arg)
     if (stream_fd != -1) {
         closesocket(stream_fd);
     }
-
-#ifdef DUMP_H264
-    fclose(file);
-    fclose(file_source);
-    fclose(file_len);
-#endif
+    raop_rtp_mirror_video_reset(raop_rtp_mirror);
+    free(raop_rtp_mirror->rx_buf);
+    raop_rtp_mirror->rx_buf = NULL;
+    raop_rtp_mirror->rx_capacity = 0;
 
     // Ensure running reflects the actual state
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
@@ -676,6 +1197,22 @@ raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, int use_udp, unsigned
     }
     *mirror_data_lport = raop_rtp_mirror->mirror_data_lport;
 
+    raop_rtp_mirror->late_skip_to_idr = false;
+    raop_rtp_mirror->frames_late = 0;
+    if (raop_rtp_mirror->decrypt_threads > 1) {
+        mirror_buffer_start_workers(raop_rtp_mirror->buffer, raop_rtp_mirror->decrypt_threads - 1);
+    }
+    if (raop_rtp_mirror->queue_depth > 0) {
+        raop_rtp_mirror->queue = mirror_queue_init(raop_rtp_mirror->logger, raop_rtp_mirror->queue_depth);
+        if (raop_rtp_mirror->queue) {
+            raop_rtp_mirror->skip_to_idr = false;
+            raop_rtp_mirror->frames_skipped = 0;
+            THREAD_CREATE(raop_rtp_mirror->thread_decode, raop_rtp_mirror_decode_thread, raop_rtp_mirror);
+        } else {
+            logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not create decode queue, decoding on TCP thread");
+        }
+    }
+
     /* Create the thread and initialize running values */
     raop_rtp_mirror->running = 1;
     raop_rtp_mirror->joined = 0;
@@ -697,14 +1234,38 @@ void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror) {
     raop_rtp_mirror->running = 0;
     MUTEX_UNLOCK(raop_rtp_mirror->run_mutex);
 
-    if (raop_rtp_mirror->mirror_data_sock != -1) {
-        closesocket(raop_rtp_mirror->mirror_data_sock);
-        raop_rtp_mirror->mirror_data_sock = -1;
+#ifndef _WIN32
+    /* the thread blocks in select() without a timeout, so it must be woken up */
+    if (write(raop_rtp_mirror->wake_pipe[1], "", 1) < 0) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_WARNING, "raop_rtp_mirror could not write wake pipe %d %s", errno, strerror(errno));
     }
+#endif
 
     /* Join the thread */
     THREAD_JOIN(raop_rtp_mirror->thread_mirror);
 
+    /* the TCP thread has stopped queuing frames: stop the decode thread, and release any frames it did not take */
+    if (raop_rtp_mirror->queue) {
+        h264_decode_struct h264_data;
+        mirror_queue_close(raop_rtp_mirror->queue);
+        THREAD_JOIN(raop_rtp_mirror->thread_decode);
+        while (mirror_queue_pop(raop_rtp_mirror->queue, &h264_data, false)) {
+            frame_pool_put(raop_rtp_mirror->frame_pool, h264_data.data);
+        }
+        raop_rtp_mirror_log_queue_stats(raop_rtp_mirror, LOGGER_INFO);
+        mirror_queue_destroy(raop_rtp_mirror->queue);
+        raop_rtp_mirror->queue = NULL;
+    }
+    if (raop_rtp_mirror->frames_late) {
+        logger_log(raop_rtp_mirror->logger, LOGGER_INFO, "raop_rtp_mirror: %llu video frames dropped for exceeding the latency budget",
+                   (unsigned long long) raop_rtp_mirror->frames_late);
+    }
+
+    if (raop_rtp_mirror->mirror_data_sock != -1) {
+        closesocket(raop_rtp_mirror->mirror_data_sock);
+        raop_rtp_mirror->mirror_data_sock = -1;
+    }
+
     /* Mark thread as joined */
     MUTEX_LOCK(raop_rtp_mirror->run_mutex);
     raop_rtp_mirror->joined = 1;
@@ -716,6 +1277,11 @@ void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror) {
         raop_rtp_mirror_stop(raop_rtp_mirror);
         MUTEX_DESTROY(raop_rtp_mirror->run_mutex);
         mirror_buffer_destroy(raop_rtp_mirror->buffer);
+        frame_pool_destroy(raop_rtp_mirror->frame_pool);
+#ifndef _WIN32
+        close(raop_rtp_mirror->wake_pipe[0]);
+        close(raop_rtp_mirror->wake_pipe[1]);
+#endif
         if (raop_rtp_mirror->sps_pps) {
             free(raop_rtp_mirror->sps_pps);
         }
@@ -21,13 +21,31 @@
 #include <stdint.h>
 #include "raop.h"
 #include "logger.h"
+#include "mirror_queue.h"
+#include "stream_capture.h"
 
 typedef struct raop_rtp_mirror_s raop_rtp_mirror_t;
 typedef struct h264codec_s h264codec_t;
 
+/* time spent in each stage of video frame processing (see raop_rtp_mirror_replay_frame) */
+typedef struct {
+    uint64_t decrypt_ns;          /* mirror_buffer_decrypt */
+    uint64_t nal_ns;              /* AVCC to Annex-B conversion and NAL index */
+    uint64_t deliver_ns;          /* video_process, or queueing for the decode thread */
+    uint64_t frames;
+    uint64_t bytes;
+} raop_rtp_mirror_timing_t;
+
 raop_rtp_mirror_t *raop_rtp_mirror_init(logger_t *logger, raop_callbacks_t *callbacks, raop_ntp_t *ntp,
                                         const unsigned char *remote, int remotelen, const unsigned char *aeskey);
 void raop_rtp_init_mirror_aes(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t *streamConnectionID);
+void raop_rtp_mirror_set_queue_depth(raop_rtp_mirror_t *raop_rtp_mirror, int queue_depth);
+void raop_rtp_mirror_set_latency_budget(raop_rtp_mirror_t *raop_rtp_mirror, int latency_budget_micros);
+void raop_rtp_mirror_set_decrypt_threads(raop_rtp_mirror_t *raop_rtp_mirror, int decrypt_threads);
+void raop_rtp_mirror_set_stream_capture(raop_rtp_mirror_t *raop_rtp_mirror, stream_capture_t *stream_capture, uint32_t session);
+void raop_rtp_mirror_replay_frame(raop_rtp_mirror_t *raop_rtp_mirror, uint64_t keystream_offset,
+                                  unsigned char *packet, int payload_size, raop_rtp_mirror_timing_t *timing);
+bool raop_rtp_mirror_get_queue_stats(raop_rtp_mirror_t *raop_rtp_mirror, mirror_queue_stats_t *stats);
 void raop_rtp_start_mirror(raop_rtp_mirror_t *raop_rtp_mirror, int use_udp, unsigned short *mirror_data_lport,  uint8_t show_client_FPS_data);
 void raop_rtp_mirror_stop(raop_rtp_mirror_t *raop_rtp_mirror);
 void raop_rtp_mirror_destroy(raop_rtp_mirror_t *raop_rtp_mirror);
@@ -21,10 +21,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* h264_decode_struct flags */
+#define H264_FRAME_IDR        0x01    /* contains an IDR slice (NAL type 5) */
+#define H264_FRAME_REFERENCE  0x02    /* contains a NAL with nal_ref_idc != 0 */
+#define H264_FRAME_SPS_PPS    0x04    /* starts with a prepended SPS and PPS */
+#define H264_FRAME_SPS        0x08    /* contains an SPS NAL (type 7), prepended or not */
+#define H264_FRAME_NAL_INDEX_TRUNCATED 0x10    /* more than H264_MAX_NAL_INDEX NALs: nal_index is incomplete */
+
+#define H264_MAX_NAL_INDEX 32
+
+/* position of one NAL unit in h264_decode_struct data, found while its AVCC length *
+ * prefix was replaced by a start code, so that it need not be searched for again    */
+typedef struct {
+    int offset;                   /* offset of the 4-byte start code in data */
+    int length;                   /* including the start code */
+    uint8_t type;                 /* nal_unit_type */
+    uint8_t ref_idc;              /* nal_ref_idc */
+} h264_nal_info;
+
 typedef struct {
     int nal_count;
     unsigned char *data;
     int data_len;
+    int flags;
+    int nal_index_count;          /* entries used in nal_index, at most H264_MAX_NAL_INDEX */
+    h264_nal_info nal_index[H264_MAX_NAL_INDEX];
     uint64_t ntp_time_local;
     uint64_t ntp_time_remote;
 } h264_decode_struct;
@@ -40,4 +61,17 @@ typedef struct {
     unsigned short seqnum;
 } audio_decode_struct;
 
+/* a decoded audio frame (see audio_decoder.h): interleaved signed 16-bit samples */
+typedef struct {
+    int16_t *data;
+    int sample_count;             /* samples per channel */
+    int channels;
+    int sample_rate;
+    int sync_status;
+    uint64_t ntp_time_local;
+    uint64_t ntp_time_remote;
+    uint64_t rtp_time;
+    unsigned short seqnum;
+} audio_pcm_struct;
+
 #endif //AIRPLAYSERVER_STREAM_H
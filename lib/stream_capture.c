@@ -0,0 +1,507 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "stream_capture.h"
+#include "threads.h"
+
+/* records that have not yet been written are dropped beyond this */
+#define STREAM_CAPTURE_MAX_PENDING (64 * 1024 * 1024)
+#define STREAM_CAPTURE_MIN_BUFFER (1024 * 1024)
+#define STREAM_CAPTURE_INDEX_SIZE (STREAM_CAPTURE_INDEX_CHUNK * STREAM_CAPTURE_INDEX_ENTRY_SIZE)
+
+#define SECOND_IN_NSECS 1000000000ULL
+
+/* session records are types 1 .. STREAM_CAPTURE_SESSION_TYPES */
+#define STREAM_CAPTURE_SESSION_TYPES STREAM_CAPTURE_AUDIO_FORMAT
+
+typedef struct stream_capture_session_record_s {
+    unsigned char *data;
+    int len;
+    uint64_t time;
+} stream_capture_session_record_t;
+
+/* the latest session records of a connection, kept until the connection is closed */
+typedef struct stream_capture_session_s {
+    uint32_t id;
+    stream_capture_session_record_t record[STREAM_CAPTURE_SESSION_TYPES];
+    struct stream_capture_session_s *next;
+} stream_capture_session_t;
+
+struct stream_capture_s {
+    logger_t *logger;
+
+    /* checked without the mutex by the receiving threads */
+    atomic_bool active;
+
+    mutex_handle_t mutex;
+    cond_handle_t cond;
+    thread_handle_t thread;
+
+    /* MUTEX LOCKED VARIABLES START */
+    bool stop;
+    FILE *file;
+    /* records not yet handed to the writer thread */
+    unsigned char *pending;
+    size_t pending_len;
+    size_t pending_size;
+    /* index entries of the records since the last index record, STREAM_CAPTURE_INDEX_SIZE bytes */
+    unsigned char *index;
+    size_t index_len;
+    uint64_t index_offset;        /* file offset of the last index record, 0 if none */
+    uint64_t offset;              /* file offset of the next record */
+    uint64_t records;
+    uint64_t dropped;
+    uint32_t last_session;
+    stream_capture_session_t *sessions;
+    /* MUTEX LOCKED VARIABLES END */
+
+    /* only used by the writer thread */
+    unsigned char *writing;
+    size_t writing_size;
+    bool write_error;
+};
+
+static void
+stream_capture_put_le32(unsigned char *b, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        b[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+static void
+stream_capture_put_le64(unsigned char *b, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) {
+        b[i] = (unsigned char) (value >> (8 * i));
+    }
+}
+
+/* all records are timestamped with this clock, whichever connection they belong to */
+static uint64_t
+stream_capture_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static void
+stream_capture_put_header(unsigned char *header, int type, uint32_t len, uint64_t time, uint32_t session)
+{
+    stream_capture_put_le32(header, (uint32_t) type);
+    stream_capture_put_le32(header + 4, len);
+    stream_capture_put_le64(header + 8, time);
+    stream_capture_put_le32(header + 16, session);
+    stream_capture_put_le32(header + 20, 0);
+}
+
+static bool
+stream_capture_reserve(unsigned char **buffer, size_t *size, size_t needed)
+{
+    size_t new_size = *size ? *size : STREAM_CAPTURE_MIN_BUFFER;
+    unsigned char *new_buffer;
+
+    if (needed <= *size) {
+        return true;
+    }
+    while (new_size < needed) {
+        new_size <<= 1;
+    }
+    new_buffer = realloc(*buffer, new_size);
+    if (!new_buffer) {
+        return false;
+    }
+    *buffer = new_buffer;
+    *size = new_size;
+    return true;
+}
+
+/* Queues an index record with the entries collected since the previous one; called with *
+ * the mutex locked, while capture is active.  Returns false if there is no room for it.  */
+static bool
+stream_capture_append_index(stream_capture_t *stream_capture)
+{
+    size_t record_len = STREAM_CAPTURE_RECORD_HEADER_SIZE + 8 + stream_capture->index_len;
+    unsigned char *record;
+
+    if (stream_capture->pending_len + record_len > STREAM_CAPTURE_MAX_PENDING ||
+        !stream_capture_reserve(&stream_capture->pending, &stream_capture->pending_size,
+                                stream_capture->pending_len + record_len)) {
+        return false;
+    }
+    record = stream_capture->pending + stream_capture->pending_len;
+    stream_capture_put_header(record, STREAM_CAPTURE_INDEX, (uint32_t) (8 + stream_capture->index_len),
+                              stream_capture_now(), 0);
+    stream_capture_put_le64(record + STREAM_CAPTURE_RECORD_HEADER_SIZE, stream_capture->index_offset);
+    memcpy(record + STREAM_CAPTURE_RECORD_HEADER_SIZE + 8, stream_capture->index, stream_capture->index_len);
+    stream_capture->pending_len += record_len;
+
+    stream_capture->index_offset = stream_capture->offset;
+    stream_capture->offset += record_len;
+    stream_capture->index_len = 0;
+    return true;
+}
+
+/* called with the mutex locked, while capture is active */
+static void
+stream_capture_append(stream_capture_t *stream_capture, uint32_t session, int type, uint64_t time,
+                      const unsigned char *prefix, int prefix_len, const unsigned char *data, int len)
+{
+    size_t record_len = STREAM_CAPTURE_RECORD_HEADER_SIZE + (size_t) prefix_len + (size_t) len;
+    unsigned char *record;
+    unsigned char *entry;
+
+    if (stream_capture->index_len == STREAM_CAPTURE_INDEX_SIZE && !stream_capture_append_index(stream_capture)) {
+        stream_capture->dropped++;
+        return;
+    }
+    if (stream_capture->pending_len + record_len > STREAM_CAPTURE_MAX_PENDING ||
+        !stream_capture_reserve(&stream_capture->pending, &stream_capture->pending_size,
+                                stream_capture->pending_len + record_len)) {
+        stream_capture->dropped++;
+        return;
+    }
+
+    record = stream_capture->pending + stream_capture->pending_len;
+    stream_capture_put_header(record, type, (uint32_t) (prefix_len + len), time, session);
+    record += STREAM_CAPTURE_RECORD_HEADER_SIZE;
+    if (prefix_len) {
+        memcpy(record, prefix, prefix_len);
+    }
+    if (len) {
+        memcpy(record + prefix_len, data, len);
+    }
+    stream_capture->pending_len += record_len;
+
+    entry = stream_capture->index + stream_capture->index_len;
+    stream_capture_put_le64(entry, stream_capture->offset);
+    stream_capture_put_le64(entry + 8, time);
+    stream_capture_put_le32(entry + 16, (uint32_t) type);
+    stream_capture_put_le32(entry + 20, (uint32_t) (prefix_len + len));
+    stream_capture_put_le32(entry + 24, session);
+    stream_capture_put_le32(entry + 28, 0);
+    stream_capture->index_len += STREAM_CAPTURE_INDEX_ENTRY_SIZE;
+
+    stream_capture->offset += record_len;
+    stream_capture->records++;
+}
+
+/* called with the mutex locked */
+static stream_capture_session_t *
+stream_capture_find_session(stream_capture_t *stream_capture, uint32_t id)
+{
+    stream_capture_session_t *session;
+
+    for (session = stream_capture->sessions; session; session = session->next) {
+        if (session->id == id) {
+            break;
+        }
+    }
+    return session;
+}
+
+static void
+stream_capture_free_session(stream_capture_session_t *session)
+{
+    for (int i = 0; i < STREAM_CAPTURE_SESSION_TYPES; i++) {
+        free(session->record[i].data);
+    }
+    free(session);
+}
+
+static THREAD_RETVAL
+stream_capture_thread(void *arg)
+{
+    stream_capture_t *stream_capture = arg;
+
+    MUTEX_LOCK(stream_capture->mutex);
+    while (1) {
+        while (!stream_capture->pending_len && !stream_capture->stop) {
+            COND_WAIT(stream_capture->cond, stream_capture->mutex);
+        }
+        if (!stream_capture->pending_len) {
+            break;
+        }
+
+        /* swap buffers, so that records can be added while this one is written */
+        unsigned char *buffer = stream_capture->pending;
+        size_t size = stream_capture->pending_size;
+        size_t len = stream_capture->pending_len;
+        stream_capture->pending = stream_capture->writing;
+        stream_capture->pending_size = stream_capture->writing_size;
+        stream_capture->pending_len = 0;
+        stream_capture->writing = buffer;
+        stream_capture->writing_size = size;
+        MUTEX_UNLOCK(stream_capture->mutex);
+
+        if (fwrite(buffer, len, 1, stream_capture->file) != 1 && !stream_capture->write_error) {
+            logger_log(stream_capture->logger, LOGGER_ERR, "stream_capture: error writing capture file");
+            stream_capture->write_error = true;
+        }
+
+        MUTEX_LOCK(stream_capture->mutex);
+    }
+    MUTEX_UNLOCK(stream_capture->mutex);
+    return 0;
+}
+
+stream_capture_t *
+stream_capture_init(logger_t *logger)
+{
+    stream_capture_t *stream_capture;
+
+    stream_capture = calloc(1, sizeof(stream_capture_t));
+    if (!stream_capture) {
+        return NULL;
+    }
+    stream_capture->index = malloc(STREAM_CAPTURE_INDEX_SIZE);
+    if (!stream_capture->index) {
+        free(stream_capture);
+        return NULL;
+    }
+    stream_capture->logger = logger;
+    atomic_init(&stream_capture->active, false);
+    MUTEX_CREATE(stream_capture->mutex);
+    COND_CREATE(stream_capture->cond);
+    return stream_capture;
+}
+
+/* starts writing to a new file; returns 0 on success, -1 on error */
+int
+stream_capture_start(stream_capture_t *stream_capture, const char *filename)
+{
+    unsigned char header[STREAM_CAPTURE_FILE_HEADER_SIZE] = { 0 };
+    FILE *file;
+
+    assert(stream_capture);
+    assert(filename);
+    stream_capture_stop(stream_capture);
+
+    file = fopen(filename, "wb");
+    if (!file) {
+        logger_log(stream_capture->logger, LOGGER_ERR, "stream_capture: could not open %s", filename);
+        return -1;
+    }
+    memcpy(header, STREAM_CAPTURE_MAGIC, 8);
+    stream_capture_put_le32(header + 8, STREAM_CAPTURE_VERSION);
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+        logger_log(stream_capture->logger, LOGGER_ERR, "stream_capture: could not write to %s", filename);
+        fclose(file);
+        return -1;
+    }
+
+    MUTEX_LOCK(stream_capture->mutex);
+    stream_capture->file = file;
+    stream_capture->stop = false;
+    stream_capture->write_error = false;
+    stream_capture->pending_len = 0;
+    stream_capture->index_len = 0;
+    stream_capture->index_offset = 0;
+    stream_capture->offset = STREAM_CAPTURE_FILE_HEADER_SIZE;
+    stream_capture->records = 0;
+    stream_capture->dropped = 0;
+    for (stream_capture_session_t *session = stream_capture->sessions; session; session = session->next) {
+        for (int i = 0; i < STREAM_CAPTURE_SESSION_TYPES; i++) {
+            stream_capture_session_record_t *record = &session->record[i];
+            if (record->data) {
+                stream_capture_append(stream_capture, session->id, i + 1, record->time, NULL, 0, record->data, record->len);
+            }
+        }
+    }
+    THREAD_CREATE(stream_capture->thread, stream_capture_thread, stream_capture);
+    if (!stream_capture->thread) {
+        stream_capture->file = NULL;
+        MUTEX_UNLOCK(stream_capture->mutex);
+        logger_log(stream_capture->logger, LOGGER_ERR, "stream_capture: could not start writer thread");
+        fclose(file);
+        return -1;
+    }
+    atomic_store(&stream_capture->active, true);
+    MUTEX_UNLOCK(stream_capture->mutex);
+
+    logger_log(stream_capture->logger, LOGGER_INFO, "stream_capture: capturing to %s", filename);
+    return 0;
+}
+
+/* waits until all records have been written, then adds the last index record and closes the file */
+void
+stream_capture_stop(stream_capture_t *stream_capture)
+{
+    unsigned char header[STREAM_CAPTURE_RECORD_HEADER_SIZE + 8];
+    unsigned char trailer[STREAM_CAPTURE_TRAILER_SIZE];
+
+    assert(stream_capture);
+    MUTEX_LOCK(stream_capture->mutex);
+    if (!atomic_load(&stream_capture->active)) {
+        MUTEX_UNLOCK(stream_capture->mutex);
+        return;
+    }
+    atomic_store(&stream_capture->active, false);
+    stream_capture->stop = true;
+    COND_SIGNAL(stream_capture->cond);
+    MUTEX_UNLOCK(stream_capture->mutex);
+    THREAD_JOIN(stream_capture->thread);
+
+    /* the writer thread has finished, so the file and index are no longer shared */
+    stream_capture_put_header(header, STREAM_CAPTURE_INDEX, (uint32_t) (8 + stream_capture->index_len),
+                              stream_capture_now(), 0);
+    stream_capture_put_le64(header + STREAM_CAPTURE_RECORD_HEADER_SIZE, stream_capture->index_offset);
+    stream_capture_put_le64(trailer, stream_capture->offset);
+    memcpy(trailer + 8, STREAM_CAPTURE_INDEX_MAGIC, 8);
+    if (fwrite(header, sizeof(header), 1, stream_capture->file) != 1 ||
+        (stream_capture->index_len &&
+         fwrite(stream_capture->index, stream_capture->index_len, 1, stream_capture->file) != 1) ||
+        fwrite(trailer, sizeof(trailer), 1, stream_capture->file) != 1) {
+        stream_capture->write_error = true;
+    }
+    if (fclose(stream_capture->file) != 0) {
+        stream_capture->write_error = true;
+    }
+    stream_capture->file = NULL;
+
+    logger_log(stream_capture->logger, stream_capture->write_error ? LOGGER_ERR : LOGGER_INFO,
+               "stream_capture: stopped, %llu records (%llu bytes), %llu records dropped%s",
+               (unsigned long long) stream_capture->records, (unsigned long long) stream_capture->offset,
+               (unsigned long long) stream_capture->dropped,
+               stream_capture->write_error ? ", file incomplete" : "");
+}
+
+bool
+stream_capture_is_active(stream_capture_t *stream_capture)
+{
+    return atomic_load_explicit(&stream_capture->active, memory_order_relaxed);
+}
+
+/* returns a new session id, for the records of one connection */
+uint32_t
+stream_capture_open_session(stream_capture_t *stream_capture)
+{
+    uint32_t id;
+
+    assert(stream_capture);
+    MUTEX_LOCK(stream_capture->mutex);
+    id = ++stream_capture->last_session;
+    MUTEX_UNLOCK(stream_capture->mutex);
+    return id;
+}
+
+/* forgets the session records (and keys) of a session, and marks its end if capture is active */
+void
+stream_capture_close_session(stream_capture_t *stream_capture, uint32_t session)
+{
+    stream_capture_session_t **link;
+
+    assert(stream_capture);
+    MUTEX_LOCK(stream_capture->mutex);
+    for (link = &stream_capture->sessions; *link; link = &(*link)->next) {
+        if ((*link)->id == session) {
+            stream_capture_session_t *closed = *link;
+            *link = closed->next;
+            stream_capture_free_session(closed);
+            break;
+        }
+    }
+    if (atomic_load(&stream_capture->active)) {
+        stream_capture_append(stream_capture, session, STREAM_CAPTURE_SESSION_END, stream_capture_now(), NULL, 0, NULL, 0);
+        COND_SIGNAL(stream_capture->cond);
+    }
+    MUTEX_UNLOCK(stream_capture->mutex);
+}
+
+/* stores a session record (keys, stream id, audio format), which is written now if capture *
+ * is active, and at the start of any capture started before the session is closed          */
+void
+stream_capture_session(stream_capture_t *stream_capture, uint32_t session, int type,
+                       const unsigned char *data, int len)
+{
+    stream_capture_session_t *entry;
+    stream_capture_session_record_t *record;
+    unsigned char *copy;
+    uint64_t time;
+
+    assert(stream_capture);
+    assert(type >= 1 && type <= STREAM_CAPTURE_SESSION_TYPES);
+    copy = malloc(len);
+    if (!copy) {
+        return;
+    }
+    memcpy(copy, data, len);
+
+    MUTEX_LOCK(stream_capture->mutex);
+    entry = stream_capture_find_session(stream_capture, session);
+    if (!entry) {
+        entry = calloc(1, sizeof(stream_capture_session_t));
+        if (!entry) {
+            MUTEX_UNLOCK(stream_capture->mutex);
+            free(copy);
+            return;
+        }
+        entry->id = session;
+        entry->next = stream_capture->sessions;
+        stream_capture->sessions = entry;
+    }
+    time = stream_capture_now();
+    record = &entry->record[type - 1];
+    free(record->data);
+    record->data = copy;
+    record->len = len;
+    record->time = time;
+    if (atomic_load(&stream_capture->active)) {
+        stream_capture_append(stream_capture, session, type, time, NULL, 0, data, len);
+        COND_SIGNAL(stream_capture->cond);
+    }
+    MUTEX_UNLOCK(stream_capture->mutex);
+}
+
+/* adds a record made of prefix followed by data, if capture is active */
+void
+stream_capture_record(stream_capture_t *stream_capture, uint32_t session, int type,
+                      const unsigned char *prefix, int prefix_len,
+                      const unsigned char *data, int len)
+{
+    if (!stream_capture || !stream_capture_is_active(stream_capture)) {
+        return;
+    }
+    MUTEX_LOCK(stream_capture->mutex);
+    if (atomic_load(&stream_capture->active)) {
+        stream_capture_append(stream_capture, session, type, stream_capture_now(), prefix, prefix_len, data, len);
+        COND_SIGNAL(stream_capture->cond);
+    }
+    MUTEX_UNLOCK(stream_capture->mutex);
+}
+
+void
+stream_capture_destroy(stream_capture_t *stream_capture)
+{
+    if (stream_capture) {
+        stream_capture_stop(stream_capture);
+        while (stream_capture->sessions) {
+            stream_capture_session_t *session = stream_capture->sessions;
+            stream_capture->sessions = session->next;
+            stream_capture_free_session(session);
+        }
+        free(stream_capture->pending);
+        free(stream_capture->writing);
+        free(stream_capture->index);
+        COND_DESTROY(stream_capture->cond);
+        MUTEX_DESTROY(stream_capture->mutex);
+        free(stream_capture);
+    }
+}
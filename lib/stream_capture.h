@@ -0,0 +1,74 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef STREAM_CAPTURE_H
+#define STREAM_CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "logger.h"
+
+/* Capture of the received (still encrypted) mirror and audio streams, with the session keys *
+ * and arrival times, for later replay.  Records are copied into a memory buffer and written *
+ * to the file by a separate thread, so capturing adds little work to the receiving threads. *
+ * Each connection has its own session id, and all records are timestamped with the same    *
+ * monotonic clock, so that concurrent sessions can be told apart and replayed separately.   *
+ *                                                                                           *
+ * File format (all integers little-endian):                                                 *
+ *   file header:   "RAOPCAP1", uint32 version, uint32 reserved                              *
+ *   each record:   uint32 type, uint32 length, uint64 arrival time (ns), uint32 session,    *
+ *                  uint32 reserved, length bytes                                            *
+ *   index records: STREAM_CAPTURE_INDEX records (session 0) are written every               *
+ *                  STREAM_CAPTURE_INDEX_CHUNK records and when the capture stops; each has  *
+ *                  the uint64 file offset of the previous index record (0 for the first),   *
+ *                  then one entry per record since then (uint64 file offset, uint64 time,   *
+ *                  uint32 type, uint32 length, uint32 session, uint32 reserved).            *
+ *   at the end:    uint64 offset of the last index record and "RAOPIDX1".                   *
+ * If the file was not closed properly, the trailer and last index record are missing, but  *
+ * the records can still be read one after the other.                                       */
+
+#define STREAM_CAPTURE_MAGIC "RAOPCAP1"
+#define STREAM_CAPTURE_INDEX_MAGIC "RAOPIDX1"
+#define STREAM_CAPTURE_VERSION 1
+#define STREAM_CAPTURE_FILE_HEADER_SIZE 16
+#define STREAM_CAPTURE_RECORD_HEADER_SIZE 24
+#define STREAM_CAPTURE_INDEX_ENTRY_SIZE 32
+#define STREAM_CAPTURE_INDEX_CHUNK 65536
+#define STREAM_CAPTURE_TRAILER_SIZE 16
+
+/* record types; the session records (keys and audio format) of every open session are     *
+ * repeated at the start of every capture file, even if it is started in the middle of it  */
+#define STREAM_CAPTURE_AUDIO_KEYS     1   /* 16-byte aeskey and 16-byte aesiv, as passed to raop_buffer_init */
+#define STREAM_CAPTURE_MIRROR_STREAM  2   /* uint64 streamConnectionID, as passed to mirror_buffer_init_aes */
+#define STREAM_CAPTURE_AUDIO_FORMAT   3   /* 1-byte compression type ct */
+#define STREAM_CAPTURE_MIRROR_FRAME   4   /* uint64 AES-CTR keystream offset, 128-byte header, payload */
+#define STREAM_CAPTURE_AUDIO_DATA     5   /* RTP packet received on the audio data socket */
+#define STREAM_CAPTURE_AUDIO_CONTROL  6   /* packet received on the audio control socket */
+#define STREAM_CAPTURE_INDEX          7
+#define STREAM_CAPTURE_SESSION_END    8   /* no data; the connection of the session was closed */
+
+typedef struct stream_capture_s stream_capture_t;
+
+stream_capture_t *stream_capture_init(logger_t *logger);
+int stream_capture_start(stream_capture_t *stream_capture, const char *filename);
+void stream_capture_stop(stream_capture_t *stream_capture);
+bool stream_capture_is_active(stream_capture_t *stream_capture);
+uint32_t stream_capture_open_session(stream_capture_t *stream_capture);
+void stream_capture_close_session(stream_capture_t *stream_capture, uint32_t session);
+void stream_capture_session(stream_capture_t *stream_capture, uint32_t session, int type,
+                            const unsigned char *data, int len);
+void stream_capture_record(stream_capture_t *stream_capture, uint32_t session, int type,
+                           const unsigned char *prefix, int prefix_len,
+                           const unsigned char *data, int len);
+void stream_capture_destroy(stream_capture_t *stream_capture);
+
+#endif //STREAM_CAPTURE_H
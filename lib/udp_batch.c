@@ -0,0 +1,248 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE   /* recvmmsg */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "udp_batch.h"
+
+#ifdef __linux__
+#define UDP_BATCH_USE_RECVMMSG
+/* room for the SO_TIMESTAMPNS and SO_RXQ_OVFL control messages */
+#define UDP_BATCH_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+#endif
+
+struct udp_batch_s {
+    logger_t *logger;
+    int batch_size;
+    int slot_size;
+
+    /* one slot per packet of a batch, reused by the next batch */
+    unsigned char *slab;
+    udp_packet_t *packets;
+#ifdef UDP_BATCH_USE_RECVMMSG
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    unsigned char *control;
+#endif
+
+    /* packets dropped by the kernel, as last reported for the socket */
+    uint32_t drops;
+};
+
+udp_batch_t *
+udp_batch_init(logger_t *logger, int batch_size, int slot_size)
+{
+    udp_batch_t *udp_batch;
+
+    if (batch_size < 1) {
+        batch_size = 1;
+    } else if (batch_size > UDP_BATCH_MAX_SIZE) {
+        batch_size = UDP_BATCH_MAX_SIZE;
+    }
+    udp_batch = calloc(1, sizeof(udp_batch_t));
+    if (!udp_batch) {
+        return NULL;
+    }
+    udp_batch->logger = logger;
+    udp_batch->batch_size = batch_size;
+    udp_batch->slot_size = slot_size;
+    udp_batch->slab = malloc((size_t) batch_size * slot_size);
+    udp_batch->packets = calloc(batch_size, sizeof(udp_packet_t));
+#ifdef UDP_BATCH_USE_RECVMMSG
+    udp_batch->msgs = calloc(batch_size, sizeof(struct mmsghdr));
+    udp_batch->iovecs = calloc(batch_size, sizeof(struct iovec));
+    udp_batch->control = calloc(batch_size, UDP_BATCH_CONTROL_SIZE);
+    if (!udp_batch->msgs || !udp_batch->iovecs || !udp_batch->control) {
+        udp_batch_destroy(udp_batch);
+        return NULL;
+    }
+#endif
+    if (!udp_batch->slab || !udp_batch->packets) {
+        udp_batch_destroy(udp_batch);
+        return NULL;
+    }
+    for (int i = 0; i < batch_size; i++) {
+        udp_batch->packets[i].data = udp_batch->slab + (size_t) i * slot_size;
+    }
+    return udp_batch;
+}
+
+/* sets the socket receive buffer size (if rcvbuf_size > 0), and requests kernel receive *
+ * timestamps and drop counts where available; returns -1 if a setting was not accepted  */
+int
+udp_batch_setup_socket(logger_t *logger, int sock, int rcvbuf_size)
+{
+    int ret = 0;
+    if (rcvbuf_size > 0) {
+        int size = rcvbuf_size;
+        socklen_t len = sizeof(size);
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char *) &size, sizeof(size)) < 0) {
+            logger_log(logger, LOGGER_WARNING, "udp_batch: could not set SO_RCVBUF to %d", rcvbuf_size);
+            ret = -1;
+        } else if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *) &size, &len) == 0) {
+            /* the kernel may limit the size (e.g. net.core.rmem_max on Linux) */
+            logger_log(logger, LOGGER_DEBUG, "udp_batch: socket %d SO_RCVBUF %d (requested %d)", sock, size, rcvbuf_size);
+        }
+    }
+#ifdef UDP_BATCH_USE_RECVMMSG
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        logger_log(logger, LOGGER_WARNING, "udp_batch: could not enable SO_TIMESTAMPNS");
+        ret = -1;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        logger_log(logger, LOGGER_WARNING, "udp_batch: could not enable SO_RXQ_OVFL");
+        ret = -1;
+    }
+#endif
+    return ret;
+}
+
+#ifdef UDP_BATCH_USE_RECVMMSG
+static void
+udp_batch_parse_control(udp_batch_t *udp_batch, struct msghdr *msg, udp_packet_t *packet)
+{
+    struct cmsghdr *cmsg;
+    packet->arrival = 0;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cmsg->cmsg_type == SO_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            packet->arrival = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+        } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&udp_batch->drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        }
+    }
+}
+#endif
+
+/* reads the packets waiting on the socket, up to the batch size, without blocking; returns *
+ * the number of packets (0 if none were waiting), or -1 on error                           */
+int
+udp_batch_receive(udp_batch_t *udp_batch, int sock)
+{
+    assert(udp_batch);
+#ifdef UDP_BATCH_USE_RECVMMSG
+    for (int i = 0; i < udp_batch->batch_size; i++) {
+        struct msghdr *hdr = &udp_batch->msgs[i].msg_hdr;
+        udp_batch->iovecs[i].iov_base = udp_batch->packets[i].data;
+        udp_batch->iovecs[i].iov_len = udp_batch->slot_size;
+        hdr->msg_name = &udp_batch->packets[i].saddr;
+        hdr->msg_namelen = sizeof(struct sockaddr_storage);
+        hdr->msg_iov = &udp_batch->iovecs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = udp_batch->control + (size_t) i * UDP_BATCH_CONTROL_SIZE;
+        hdr->msg_controllen = UDP_BATCH_CONTROL_SIZE;
+        hdr->msg_flags = 0;
+    }
+    int count = recvmmsg(sock, udp_batch->msgs, udp_batch->batch_size, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        logger_log(udp_batch->logger, LOGGER_WARNING, "udp_batch: recvmmsg on socket %d failed: %d", sock, errno);
+        return -1;
+    }
+    int received = 0;
+    for (int i = 0; i < count; i++) {
+        struct msghdr *hdr = &udp_batch->msgs[i].msg_hdr;
+        udp_packet_t *packet = &udp_batch->packets[received];
+        if (hdr->msg_flags & MSG_TRUNC) {
+            logger_log(udp_batch->logger, LOGGER_WARNING, "udp_batch: dropped packet larger than %d bytes", udp_batch->slot_size);
+            continue;
+        }
+        if (received != i) {
+            /* keep the packets contiguous: swap slots with the truncated one */
+            udp_packet_t *src = &udp_batch->packets[i];
+            unsigned char *data = packet->data;
+            packet->data = src->data;
+            src->data = data;
+            memcpy(&packet->saddr, &src->saddr, sizeof(packet->saddr));
+        }
+        packet->len = udp_batch->msgs[i].msg_len;
+        packet->saddr_len = hdr->msg_namelen;
+        udp_batch_parse_control(udp_batch, hdr, packet);
+        received++;
+    }
+    return received;
+#else
+    udp_packet_t *packet = &udp_batch->packets[0];
+#ifdef MSG_DONTWAIT
+    int flags = MSG_DONTWAIT;
+#else
+    /* no MSG_DONTWAIT (Windows): only read when a datagram is waiting */
+    int flags = 0;
+    u_long bytes_available = 0;
+    if (ioctlsocket(sock, FIONREAD, &bytes_available) != 0) {
+        logger_log(udp_batch->logger, LOGGER_WARNING, "udp_batch: FIONREAD on socket %d failed: %d", sock, SOCKET_GET_ERROR());
+        return -1;
+    } else if (bytes_available == 0) {
+        return 0;
+    }
+#endif
+    packet->saddr_len = sizeof(packet->saddr);
+    int len = recvfrom(sock, (char *) packet->data, udp_batch->slot_size, flags,
+                       (struct sockaddr *) &packet->saddr, &packet->saddr_len);
+    if (len < 0) {
+        int error = SOCKET_GET_ERROR();
+        if (error == SOCKET_ERRORNAME(EAGAIN) || error == SOCKET_ERRORNAME(EWOULDBLOCK) || error == SOCKET_ERRORNAME(EINTR)) {
+            return 0;
+        }
+        logger_log(udp_batch->logger, LOGGER_WARNING, "udp_batch: recvfrom on socket %d failed: %d", sock, error);
+        return -1;
+    }
+    packet->len = (unsigned int) len;
+    packet->arrival = 0;
+    return 1;
+#endif
+}
+
+udp_packet_t *
+udp_batch_get_packet(udp_batch_t *udp_batch, int index)
+{
+    assert(udp_batch);
+    assert(index >= 0 && index < udp_batch->batch_size);
+    return &udp_batch->packets[index];
+}
+
+/* packets dropped by the kernel on the socket since it was opened, as last reported */
+uint32_t
+udp_batch_get_drops(udp_batch_t *udp_batch)
+{
+    assert(udp_batch);
+    return udp_batch->drops;
+}
+
+void
+udp_batch_destroy(udp_batch_t *udp_batch)
+{
+    if (udp_batch) {
+#ifdef UDP_BATCH_USE_RECVMMSG
+        free(udp_batch->msgs);
+        free(udp_batch->iovecs);
+        free(udp_batch->control);
+#endif
+        free(udp_batch->packets);
+        free(udp_batch->slab);
+        free(udp_batch);
+    }
+}
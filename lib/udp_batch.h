@@ -0,0 +1,46 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#include <stdint.h>
+#include "compat.h"
+#include "logger.h"
+
+/* Batched reception of UDP packets into a ring of preallocated packet slots.  On Linux, *
+ * a socket is drained with one recvmmsg() call per batch, and each packet carries the    *
+ * kernel receive time (SO_TIMESTAMPNS) and the socket keeps a count of the packets the   *
+ * kernel dropped for lack of buffer space (SO_RXQ_OVFL).  Elsewhere, packets are read    *
+ * one at a time with a non-blocking recvfrom(), without kernel timestamps or drop counts. */
+
+#define UDP_BATCH_DEFAULT_SIZE 16
+#define UDP_BATCH_MAX_SIZE 64
+
+typedef struct {
+    unsigned char *data;
+    unsigned int len;
+    uint64_t arrival;       /* kernel receive time (nsecs since the unix epoch), 0 if unknown */
+    struct sockaddr_storage saddr;
+    socklen_t saddr_len;
+} udp_packet_t;
+
+typedef struct udp_batch_s udp_batch_t;
+
+udp_batch_t *udp_batch_init(logger_t *logger, int batch_size, int slot_size);
+int udp_batch_setup_socket(logger_t *logger, int sock, int rcvbuf_size);
+int udp_batch_receive(udp_batch_t *udp_batch, int sock);
+udp_packet_t *udp_batch_get_packet(udp_batch_t *udp_batch, int index);
+uint32_t udp_batch_get_drops(udp_batch_t *udp_batch);
+void udp_batch_destroy(udp_batch_t *udp_batch);
+
+#endif //UDP_BATCH_H
@@ -57,6 +57,11 @@ typedef struct audio_renderer_funcs_s {
     void (*set_volume)(audio_renderer_t *renderer, float volume);
     void (*flush)(audio_renderer_t *renderer);
     void (*destroy)(audio_renderer_t *renderer);
+    /* optional (may be NULL): audio decoded by the library, as interleaved 16-bit samples */
+    void (*render_pcm)(audio_renderer_t *renderer, raop_ntp_t *ntp,
+                       const int16_t *samples, int sample_count, int channels, uint64_t pts);
+    /* optional (may be NULL): nsecs of audio from render_pcm queued but not yet played, -1 if unknown */
+    int64_t (*get_pcm_delay)(audio_renderer_t *renderer);
 } audio_renderer_funcs_t;
 
 typedef struct audio_renderer_s {
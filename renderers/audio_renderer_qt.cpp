@@ -11,12 +11,69 @@
 #include <QAudioDecoder>
 #include <QBuffer>
 #include <QCoreApplication>
+#include <QMutex>
+#include <QMutexLocker>
+#include <cstring>
 #include <memory>
 
+/* at most this much decoded audio waits for the audio sink */
+#define AUDIO_RENDERER_QT_QUEUE_SECONDS 2
+
+/**
+ * Decoded audio waiting for the audio sink. render_pcm runs on the RTP thread, and QIODevice
+ * is not thread-safe, so the samples are queued under a mutex and the sink pulls them on its
+ * own thread. When the queue runs dry the sink gets silence, so that it never stops.
+ */
+class AudioRendererQtQueue : public QIODevice {
+public:
+    explicit AudioRendererQtQueue(qint64 capacity) : capacity(capacity) {}
+
+    /* returns the number of bytes queued (less than len if the queue is full) */
+    qint64 push(const char *data, qint64 len) {
+        QMutexLocker locker(&mutex);
+        if (len > capacity - queue.size()) {
+            len = capacity - queue.size();
+        }
+        queue.append(data, len);
+        return len;
+    }
+
+    void clear() {
+        QMutexLocker locker(&mutex);
+        queue.clear();
+    }
+
+    qint64 queued() {
+        QMutexLocker locker(&mutex);
+        return queue.size();
+    }
+
+    bool isSequential() const override { return true; }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override {
+        QMutexLocker locker(&mutex);
+        qint64 len = qMin(maxlen, (qint64) queue.size());
+        memcpy(data, queue.constData(), len);
+        queue.remove(0, len);
+        memset(data + len, 0, maxlen - len);
+        return maxlen;
+    }
+
+    qint64 writeData(const char *data, qint64 len) override {
+        return -1;
+    }
+
+private:
+    QMutex mutex;
+    QByteArray queue;
+    qint64 capacity;
+};
+
 typedef struct audio_renderer_qt_s {
     audio_renderer_t base;
     QAudioSink *audio_sink;
-    QIODevice *audio_device;
+    AudioRendererQtQueue *queue;
     QAudioDecoder *decoder;
     QAudioFormat audio_format;
     QBuffer *input_buffer;
@@ -26,7 +83,8 @@ typedef struct audio_renderer_qt_s {
 static void audio_renderer_qt_start(audio_renderer_t *renderer) {
     audio_renderer_qt_t *r = (audio_renderer_qt_t *)renderer;
     if (r->audio_sink) {
-        r->audio_device = r->audio_sink->start();
+        /* pull mode: the sink reads the queue on its own thread */
+        r->audio_sink->start(r->queue);
     }
 }
 
@@ -44,12 +102,33 @@ static void audio_renderer_qt_render_buffer(audio_renderer_t *renderer, raop_ntp
     // r->decoder->start();
 }
 
+static void audio_renderer_qt_render_pcm(audio_renderer_t *renderer, raop_ntp_t *ntp,
+                                        const int16_t *samples, int sample_count, int channels, uint64_t pts) {
+    audio_renderer_qt_t *r = (audio_renderer_qt_t *)renderer;
+    if (channels != r->audio_format.channelCount()) {
+        return;
+    }
+    qint64 len = (qint64)sample_count * channels * sizeof(int16_t);
+    qint64 queued = r->queue->push((const char *)samples, len);
+    if (queued < len) {
+        logger_log(r->base.logger, LOGGER_DEBUG, "Qt audio renderer: queue full, dropped %lld bytes",
+                   (long long)(len - queued));
+    }
+}
+
+/* the audio waiting in the queue; the sink's own buffer is left out, as its size does not change */
+static int64_t audio_renderer_qt_get_pcm_delay(audio_renderer_t *renderer) {
+    audio_renderer_qt_t *r = (audio_renderer_qt_t *)renderer;
+    return (int64_t)r->audio_format.durationForBytes((qint32)r->queue->queued()) * 1000;
+}
+
 static void audio_renderer_qt_flush(audio_renderer_t *renderer) {
     audio_renderer_qt_t *r = (audio_renderer_qt_t *)renderer;
     if (r->decoder) {
         r->decoder->stop();
     }
     r->pending_data.clear();
+    r->queue->clear();
 }
 
 static void audio_renderer_qt_destroy(audio_renderer_t *renderer) {
@@ -64,6 +143,7 @@ static void audio_renderer_qt_destroy(audio_renderer_t *renderer) {
     if (r->input_buffer) {
         delete r->input_buffer;
     }
+    delete r->queue;
     free(renderer);
 }
 
@@ -80,6 +160,8 @@ static const audio_renderer_funcs_t audio_renderer_qt_funcs = {
     .set_volume = audio_renderer_qt_set_volume,
     .flush = audio_renderer_qt_flush,
     .destroy = audio_renderer_qt_destroy,
+    .render_pcm = audio_renderer_qt_render_pcm,
+    .get_pcm_delay = audio_renderer_qt_get_pcm_delay,
 };
 
 extern "C" audio_renderer_t *audio_renderer_qt_init(logger_t *logger, 
@@ -92,8 +174,11 @@ extern "C" audio_renderer_t *audio_renderer_qt_init(logger_t *logger,
     renderer->audio_format.setChannelCount(2);
     renderer->audio_format.setSampleFormat(QAudioFormat::Int16);
     
-    // Create audio sink
+    // Create audio sink, and the queue it pulls the audio from
     renderer->audio_sink = new QAudioSink(renderer->audio_format);
+    renderer->queue = new AudioRendererQtQueue(AUDIO_RENDERER_QT_QUEUE_SECONDS *
+                                               renderer->audio_format.bytesForDuration(1000000));
+    renderer->queue->open(QIODevice::ReadOnly | QIODevice::Unbuffered);
     renderer->input_buffer = new QBuffer();
     
     // Create decoder for AAC
@@ -102,10 +187,10 @@ extern "C" audio_renderer_t *audio_renderer_qt_init(logger_t *logger,
     // Connect decoder signals
     QObject::connect(renderer->decoder, &QAudioDecoder::bufferReady, [renderer]() {
         QAudioBuffer buffer = renderer->decoder->read();
-        if (renderer->audio_device && buffer.isValid()) {
+        if (buffer.isValid()) {
             const char* data = buffer.constData<char>();
             int size = buffer.byteCount();
-            renderer->audio_device->write(data, size);
+            renderer->queue->push(data, size);
         }
     });
     
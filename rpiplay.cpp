@@ -147,12 +147,31 @@ extern "C" void audio_process(void *cls, raop_ntp_t *ntp,
     }
 }
 
+extern "C" void audio_process_pcm(void *cls, raop_ntp_t *ntp,
+                                  audio_pcm_struct *data)
+{
+    if (audio_renderer != NULL) {
+        audio_renderer->funcs->render_pcm(audio_renderer, ntp, data->data,
+                                          data->sample_count, data->channels,
+                                          data->ntp_time_remote);
+    }
+}
+
+extern "C" int64_t audio_get_pcm_delay(void *cls)
+{
+    if (audio_renderer != NULL) {
+        return audio_renderer->funcs->get_pcm_delay(audio_renderer);
+    }
+    return -1;
+}
+
 extern "C" void video_process(void *cls, raop_ntp_t *ntp,
                               h264_decode_struct *data)
 {
     if (video_renderer != NULL) {
         video_renderer->funcs->render_buffer(video_renderer, ntp, data->data,
-                                             data->data_len, 0, 0);
+                                             data->data_len, 0,
+                                             (data->flags & H264_FRAME_SPS) ? 0 : 1);
     }
 }
 
@@ -204,25 +223,6 @@ int start_server(std::vector<char> hw_addr, std::string name, bool debug_log,
                  audio_renderer_config_t const *audio_config, int display_width,
                  int display_height, float display_framerate, void *callbacks)
 {
-    raop_callbacks_t raop_cbs;
-    memset(&raop_cbs, 0, sizeof(raop_cbs));
-    raop_cbs.conn_init = conn_init;
-    raop_cbs.conn_destroy = conn_destroy;
-    raop_cbs.audio_process = audio_process;
-    raop_cbs.video_process = video_process;
-    raop_cbs.audio_flush = audio_flush;
-    raop_cbs.video_flush = video_flush;
-    raop_cbs.audio_set_volume = audio_set_volume;
-
-    raop = raop_init(10, &raop_cbs);
-    if (raop == NULL) {
-        LOGE("Error initializing raop!");
-        return -1;
-    }
-
-    raop_set_log_callback(raop, log_callback, NULL);
-    raop_set_log_level(raop, debug_log ? RAOP_LOG_DEBUG : LOGGER_INFO);
-
     render_logger = logger_init();
     logger_set_callback(render_logger, log_callback, NULL);
     logger_set_level(render_logger, debug_log ? LOGGER_DEBUG : LOGGER_INFO);
@@ -244,6 +244,30 @@ int start_server(std::vector<char> hw_addr, std::string name, bool debug_log,
         return -1;
     }
 
+    raop_callbacks_t raop_cbs;
+    memset(&raop_cbs, 0, sizeof(raop_cbs));
+    raop_cbs.conn_init = conn_init;
+    raop_cbs.conn_destroy = conn_destroy;
+    raop_cbs.audio_process = audio_process;
+    raop_cbs.video_process = video_process;
+    raop_cbs.audio_flush = audio_flush;
+    raop_cbs.video_flush = video_flush;
+    raop_cbs.audio_set_volume = audio_set_volume;
+    /* renderers that play PCM get the audio decoded by the library (ALAC, and AAC with fdk-aac) */
+    if (audio_renderer && audio_renderer->funcs->render_pcm)
+        raop_cbs.audio_process_pcm = audio_process_pcm;
+    if (audio_renderer && audio_renderer->funcs->render_pcm && audio_renderer->funcs->get_pcm_delay)
+        raop_cbs.audio_get_pcm_delay = audio_get_pcm_delay;
+
+    raop = raop_init(10, &raop_cbs);
+    if (raop == NULL) {
+        LOGE("Error initializing raop!");
+        return -1;
+    }
+
+    raop_set_log_callback(raop, log_callback, NULL);
+    raop_set_log_level(raop, debug_log ? RAOP_LOG_DEBUG : LOGGER_INFO);
+
     if (video_renderer)
         video_renderer->funcs->start(video_renderer);
     if (audio_renderer)
@@ -0,0 +1,111 @@
+/*
+ * Measures the time taken to decrypt one audio packet payload (AES-CBC, starting from the
+ * session IV for every packet) with aes_cbc_decrypt_message(), as raop_buffer does, and
+ * with the earlier implementation (clear the output, decrypt, then reset the cipher
+ * context, which expands the key again).  It also checks that both give the same output.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto.h"
+
+#define SECOND_IN_NSECS 1000000000ULL
+#define MAX_PAYLOAD_SIZE 2048
+
+/* typical payload sizes: AAC-ELD, AAC, and ALAC (352 stereo 16-bit samples, and a little more) */
+static const int payload_sizes[] = { 160, 352, 720, 1408 };
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static void
+print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n packets]\n", name);
+    fprintf(stderr, "  -n   packets decrypted per payload size and path (default 1000000)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned char aeskey[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+    const unsigned char aesiv[16] = { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+    unsigned char input[MAX_PAYLOAD_SIZE];
+    unsigned char old_output[MAX_PAYLOAD_SIZE];
+    unsigned char new_output[MAX_PAYLOAD_SIZE];
+    int packets = 1000000, opt;
+    int mismatches = 0;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            packets = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (packets <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    srand(1);
+    for (int i = 0; i < MAX_PAYLOAD_SIZE; i++) {
+        input[i] = (unsigned char) rand();
+    }
+    aes_ctx_t *old_ctx = aes_cbc_init(aeskey, aesiv, AES_DECRYPT);
+    aes_ctx_t *new_ctx = aes_cbc_init(aeskey, aesiv, AES_DECRYPT);
+
+    printf("%12s %14s %14s %10s\n", "payload", "old ns/packet", "new ns/packet", "speedup");
+    for (size_t n = 0; n < sizeof(payload_sizes) / sizeof(payload_sizes[0]); n++) {
+        int len = payload_sizes[n] / 16 * 16;
+
+        /* the old path, as in raop_buffer_decrypt() before */
+        uint64_t start = now_ns();
+        for (int i = 0; i < packets; i++) {
+            memset(old_output, 0, len);
+            aes_cbc_decrypt(old_ctx, input, old_output, len);
+            aes_cbc_reset(old_ctx);
+        }
+        double old_ns = (double) (now_ns() - start) / packets;
+
+        start = now_ns();
+        for (int i = 0; i < packets; i++) {
+            aes_cbc_decrypt_message(new_ctx, input, new_output, len);
+        }
+        double new_ns = (double) (now_ns() - start) / packets;
+
+        bool same = (memcmp(old_output, new_output, len) == 0);
+        if (!same) {
+            mismatches++;
+        }
+        printf("%12d %14.1f %14.1f %9.2fx%s\n", payload_sizes[n], old_ns, new_ns, old_ns / new_ns,
+               same ? "" : "  OUTPUT MISMATCH");
+    }
+    aes_cbc_destroy(old_ctx);
+    aes_cbc_destroy(new_ctx);
+    return mismatches ? 1 : 0;
+}
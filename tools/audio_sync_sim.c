@@ -0,0 +1,185 @@
+/*
+ * Simulates an audio stream from a sender whose sample clock drifts from its NTP clock, with
+ * jitter on the timestamps of its sync packets, and measures how far the remote NTP times
+ * given to the audio packets (from the RTP to NTP clock model fitted in raop_rtp) are from
+ * the true ones.  Sync packets are sent every second, and the audio packets run between 1
+ * and 2 seconds ahead of the last sync, as senders do.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "raop.h"
+#include "raop_rtp.h"
+#include "raop_ntp.h"
+#include "logger.h"
+
+#define SECOND_IN_NSECS 1000000000ULL
+#define SECONDS_FROM_1900_TO_1970 2208988800ULL
+#define SAMPLE_RATE 44100
+#define SAMPLES_PER_FRAME 352
+/* frames timestamped before this (seconds) are not counted, while the model settles */
+#define WARM_UP_SECONDS 10
+
+typedef struct {
+    double true_rate;             /* nsecs per sample of the sender's clock */
+    uint64_t ntp_start;
+    uint64_t rtp_start;
+    uint32_t rtp_counted;         /* frames before this rtp time (from the start) are not counted */
+    double max_error;
+    double sum_squares;
+    uint64_t frames;
+} simulation_t;
+
+static double
+gaussian(void)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+static void
+put_be32(unsigned char *b, uint32_t value)
+{
+    b[0] = (unsigned char) (value >> 24);
+    b[1] = (unsigned char) (value >> 16);
+    b[2] = (unsigned char) (value >> 8);
+    b[3] = (unsigned char) value;
+}
+
+static void
+audio_process(void *cls, raop_ntp_t *ntp, audio_decode_struct *data)
+{
+    simulation_t *sim = cls;
+    /* raop_rtp extends the RTP timestamps to 64 bits with its own epoch, so only the low *
+     * 32 bits are compared (a run is much shorter than the 27 hours they wrap around in)  */
+    uint32_t elapsed = (uint32_t) data->rtp_time - (uint32_t) sim->rtp_start;
+    if (!data->sync_status || elapsed < sim->rtp_counted) {
+        return;
+    }
+    double truth = (double) sim->ntp_start + sim->true_rate * (double) elapsed;
+    double error = fabs((double) data->ntp_time_remote - truth);
+    if (error > sim->max_error) {
+        sim->max_error = error;
+    }
+    sim->sum_squares += error * error;
+    sim->frames++;
+}
+
+static void
+run(logger_t *logger, simulation_t *sim, double ppm, double jitter_us, int seconds)
+{
+    const unsigned char aeskey[16] = { 0 };
+    const unsigned char remote[4] = { 127, 0, 0, 1 };
+    raop_callbacks_t callbacks;
+    unsigned char sync[20];
+    unsigned char packet[12 + 64];
+    unsigned short seqnum = 0;
+
+    memset(sim, 0, sizeof(simulation_t));
+    sim->true_rate = (double) SECOND_IN_NSECS / SAMPLE_RATE * (1.0 + ppm * 1e-6);
+    sim->ntp_start = 1700000000ULL * SECOND_IN_NSECS;
+    /* close to the 32-bit limit, so that the RTP timestamps wrap around during the run */
+    sim->rtp_start = 4294000000ULL;
+    sim->rtp_counted = WARM_UP_SECONDS * SAMPLE_RATE;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.cls = sim;
+    callbacks.audio_process = audio_process;
+    raop_ntp_t *ntp = raop_ntp_init(logger, &callbacks, remote, sizeof(remote), 0);
+    raop_rtp_t *raop_rtp = raop_rtp_init(logger, &callbacks, ntp, remote, sizeof(remote), aeskey, aeskey);
+    raop_rtp_start_replay(raop_rtp, 2, SAMPLE_RATE, NULL);
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x80;
+    packet[1] = 0x60;
+    uint64_t next_frame = sim->rtp_start;
+    for (int t = 0; t < seconds; t++) {
+        uint64_t sync_rtp = sim->rtp_start + (uint64_t) t * SAMPLE_RATE;
+        double sync_ntp = (double) sim->ntp_start + sim->true_rate * (double) (sync_rtp - sim->rtp_start) + gaussian() * jitter_us * 1000.0;
+        uint64_t ntp_nsecs = (uint64_t) sync_ntp;
+        uint64_t ntp_seconds = ntp_nsecs / SECOND_IN_NSECS + SECONDS_FROM_1900_TO_1970;
+        uint64_t ntp_fraction = ((ntp_nsecs % SECOND_IN_NSECS) << 32) / SECOND_IN_NSECS;
+
+        memset(sync, 0, sizeof(sync));
+        sync[0] = (t == 0 ? 0x90 : 0x80);
+        sync[1] = 0xd4;
+        sync[3] = 0x07;
+        put_be32(sync + 4, (uint32_t) sync_rtp);
+        put_be32(sync + 8, (uint32_t) ntp_seconds);
+        put_be32(sync + 12, (uint32_t) ntp_fraction);
+        put_be32(sync + 16, (uint32_t) (sync_rtp + SAMPLES_PER_FRAME));
+        raop_rtp_replay_packet(raop_rtp, true, sync, sizeof(sync));
+
+        /* the audio runs 1 to 2 seconds ahead of the last sync */
+        while (next_frame < sync_rtp + 2 * SAMPLE_RATE) {
+            packet[2] = (unsigned char) (seqnum >> 8);
+            packet[3] = (unsigned char) seqnum;
+            put_be32(packet + 4, (uint32_t) next_frame);
+            raop_rtp_replay_packet(raop_rtp, false, packet, sizeof(packet));
+            seqnum++;
+            next_frame += SAMPLES_PER_FRAME;
+        }
+    }
+    raop_rtp_destroy(raop_rtp);
+    raop_ntp_destroy(ntp);
+}
+
+static void
+print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s seconds]\n", name);
+    fprintf(stderr, "  -s   length of each simulated stream (default 600)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    /* sender clock drift (ppm) and sync jitter (standard deviation, usecs) */
+    const double cases[][2] = { { 0, 0 }, { 100, 0 }, { -100, 0 }, { 100, 200 }, { -100, 200 },
+                                { 100, 500 }, { -100, 500 } };
+    int seconds = 600, opt;
+    simulation_t sim;
+
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (seconds <= WARM_UP_SECONDS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_WARNING);
+    srand(3);
+    printf("%10s %12s %14s %14s %10s\n", "drift ppm", "jitter us", "max error us", "rms error us", "frames");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        run(logger, &sim, cases[i][0], cases[i][1], seconds);
+        printf("%+10.0f %12.0f %14.1f %14.1f %10llu\n", cases[i][0], cases[i][1], sim.max_error / 1000.0,
+               sim.frames ? sqrt(sim.sum_squares / sim.frames) / 1000.0 : 0.0, (unsigned long long) sim.frames);
+    }
+    logger_destroy(logger);
+    return 0;
+}
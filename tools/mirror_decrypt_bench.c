@@ -0,0 +1,173 @@
+/*
+ * Measures the throughput of mirror video frame decryption (AES-CTR) for frame sizes
+ * from 64 KB to 2 MB, with mirror_buffer_decrypt() and with the earlier implementation
+ * (decrypt in place in the input, then copy to the output).  With worker threads, it
+ * also checks that the parallel decryption gives the same output.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "logger.h"
+#include "mirror_buffer.h"
+
+#define SECOND_IN_NSECS 1000000000ULL
+#define MIN_FRAME_SIZE (64 * 1024)
+#define MAX_FRAME_SIZE (2 * 1024 * 1024)
+
+/* the decryption before it wrote straight to the output buffer */
+typedef struct {
+    aes_ctx_t *aes_ctx;
+    int next_decrypt_count;
+    uint8_t og[16];
+} old_decrypt_t;
+
+static void
+old_decrypt(old_decrypt_t *old, unsigned char *input, unsigned char *output, int input_len)
+{
+    if (old->next_decrypt_count > 0) {
+        for (int i = 0; i < old->next_decrypt_count; i++) {
+            output[i] = (input[i] ^ old->og[(16 - old->next_decrypt_count) + i]);
+        }
+    }
+    int encryptlen = ((input_len - old->next_decrypt_count) / 16) * 16;
+    aes_ctr_start_fresh_block(old->aes_ctx);
+    aes_ctr_decrypt(old->aes_ctx, input + old->next_decrypt_count, input + old->next_decrypt_count, encryptlen);
+    memcpy(output + old->next_decrypt_count, input + old->next_decrypt_count, encryptlen);
+    int restlen = (input_len - old->next_decrypt_count) % 16;
+    int reststart = input_len - restlen;
+    old->next_decrypt_count = 0;
+    if (restlen > 0) {
+        memset(old->og, 0, 16);
+        memcpy(old->og, input + reststart, restlen);
+        aes_ctr_decrypt(old->aes_ctx, old->og, old->og, 16);
+        for (int j = 0; j < restlen; j++) {
+            output[reststart + j] = old->og[j];
+        }
+        old->next_decrypt_count = 16 - restlen;
+    }
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static void
+print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-m megabytes]\n", name);
+    fprintf(stderr, "  -t   also measure mirror_buffer_decrypt() with this many worker threads\n");
+    fprintf(stderr, "  -m   data decrypted per frame size and path (default 256)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned char aeskey[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+    const uint64_t stream_connection_id = 0x1234567890ULL;
+    int threads = 0, megabytes = 256, opt;
+
+    while ((opt = getopt(argc, argv, "t:m:h")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'm':
+            megabytes = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_WARNING);
+    unsigned char *input = malloc(MAX_FRAME_SIZE);
+    unsigned char *scratch = malloc(MAX_FRAME_SIZE);
+    unsigned char *output = malloc(MAX_FRAME_SIZE);
+    if (!input || !scratch || !output) {
+        return 1;
+    }
+    srand(1);
+    for (int i = 0; i < MAX_FRAME_SIZE; i++) {
+        input[i] = (unsigned char) rand();
+    }
+    memcpy(scratch, input, MAX_FRAME_SIZE);
+
+    printf("%10s %12s %12s", "frame size", "old GB/s", "new GB/s");
+    if (threads > 0) {
+        printf(" %8s GB/s", "threads");
+    }
+    printf("\n");
+    for (int size = MIN_FRAME_SIZE; size <= MAX_FRAME_SIZE; size *= 2) {
+        /* an odd length, so that the keystream carries over from one frame to the next */
+        int len = size - 7;
+        int frames = (int) (((uint64_t) megabytes << 20) / size);
+        double gbps[3] = { 0, 0, 0 };
+        uint32_t checksum[3] = { 0, 0, 0 };
+
+        for (int path = 0; path < (threads > 0 ? 3 : 2); path++) {
+            mirror_buffer_t *mirror_buffer = NULL;
+            old_decrypt_t old;
+            memset(&old, 0, sizeof(old));
+            if (path == 0) {
+                /* the key does not matter for the throughput */
+                old.aes_ctx = aes_ctr_init(aeskey, aeskey);
+            } else {
+                mirror_buffer = mirror_buffer_init(logger, aeskey);
+                mirror_buffer_init_aes(mirror_buffer, &stream_connection_id);
+                if (path == 2 && mirror_buffer_start_workers(mirror_buffer, threads) < 0) {
+                    fprintf(stderr, "could not start %d worker threads\n", threads);
+                    return 1;
+                }
+            }
+            uint64_t start = now_ns();
+            for (int i = 0; i < frames; i++) {
+                if (path == 0) {
+                    /* the old path decrypts in place; the cost does not depend on the data, *
+                     * so the same buffer is decrypted again and again                        */
+                    old_decrypt(&old, scratch, output, len);
+                } else {
+                    mirror_buffer_decrypt(mirror_buffer, input, output, len);
+                }
+                checksum[path] = checksum[path] * 31 + output[i % len] + output[len - 1];
+            }
+            gbps[path] = (double) frames * len / (double) (now_ns() - start);
+            if (path == 0) {
+                aes_ctr_destroy(old.aes_ctx);
+            } else {
+                mirror_buffer_destroy(mirror_buffer);
+            }
+        }
+        printf("%10d %12.3f %12.3f", len, gbps[0], gbps[1]);
+        if (threads > 0) {
+            printf(" %13.3f%s", gbps[2], checksum[2] != checksum[1] ? "  OUTPUT MISMATCH" : "");
+        }
+        printf("\n");
+    }
+    free(input);
+    free(scratch);
+    free(output);
+    logger_destroy(logger);
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Measures how the conversion of remote to local times (raop_ntp_convert_remote_time(), called
+ * for every audio packet and video frame) scales with the number of reader threads, while the
+ * NTP thread of a running session publishes new clock models (a local client answers its timing
+ * requests).  The earlier implementation, which read the clock model under a mutex, is measured
+ * the same way, with a writer thread updating it at the NTP startup burst rate.  On a machine
+ * with several cores, readers of the mutex contend for its cache line, while readers of the
+ * seqlock only share it.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "raop.h"
+#include "raop_ntp.h"
+#include "byteutils.h"
+#include "logger.h"
+
+#define SECOND_IN_NSECS 1000000000ULL
+#define MAX_READERS 64
+/* the client clock is this far ahead of the local one */
+#define CLIENT_OFFSET (1000ULL * SECOND_IN_NSECS)
+/* the writer of the old path updates the clock model at the NTP startup burst rate */
+#define OLD_WRITER_INTERVAL_US 100000
+#define CONVERSIONS_PER_CHECK 1000
+
+/* the clock model as it was read before, under a mutex */
+typedef struct {
+    pthread_mutex_t mutex;
+    int64_t time;
+    int64_t offset;
+    int64_t skew;
+    int64_t slew;
+    int64_t slew_end;
+} old_sync_params_t;
+
+typedef struct {
+    raop_ntp_t *ntp;              /* NULL: the old path */
+    old_sync_params_t *old;
+    atomic_bool *stop;
+    uint64_t conversions;
+    uint64_t checksum;
+} reader_t;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return (uint64_t) time.tv_sec * SECOND_IN_NSECS + (uint64_t) time.tv_nsec;
+}
+
+static uint64_t
+old_convert_remote_time(old_sync_params_t *old, uint64_t remote_time)
+{
+    pthread_mutex_lock(&old->mutex);
+    int64_t offset = old->offset;
+    pthread_mutex_unlock(&old->mutex);
+    return (uint64_t) ((int64_t) remote_time - offset);
+}
+
+static void *
+reader_thread(void *arg)
+{
+    reader_t *reader = arg;
+    uint64_t remote_time = now_ns() + CLIENT_OFFSET;
+    uint64_t checksum = 0, conversions = 0;
+
+    while (!atomic_load_explicit(reader->stop, memory_order_relaxed)) {
+        for (int i = 0; i < CONVERSIONS_PER_CHECK; i++) {
+            remote_time += 1000;
+            if (reader->ntp) {
+                checksum += raop_ntp_convert_remote_time(reader->ntp, remote_time);
+            } else {
+                checksum += old_convert_remote_time(reader->old, remote_time);
+            }
+        }
+        conversions += CONVERSIONS_PER_CHECK;
+    }
+    reader->conversions = conversions;
+    reader->checksum = checksum;
+    return NULL;
+}
+
+static void *
+old_writer_thread(void *arg)
+{
+    reader_t *writer = arg;
+    int64_t update = 0;
+
+    while (!atomic_load_explicit(writer->stop, memory_order_relaxed)) {
+        update++;
+        pthread_mutex_lock(&writer->old->mutex);
+        writer->old->time = update;
+        writer->old->offset = (int64_t) CLIENT_OFFSET + update;
+        writer->old->skew = update;
+        writer->old->slew = 0;
+        writer->old->slew_end = update;
+        pthread_mutex_unlock(&writer->old->mutex);
+        usleep(OLD_WRITER_INTERVAL_US);
+    }
+    return NULL;
+}
+
+/* a client that answers the timing requests of raop_ntp from its own clock, until it gets an empty datagram */
+static void *
+client_thread(void *arg)
+{
+    int sock = *(int *) arg;
+    unsigned char request[128], response[32];
+    struct sockaddr_storage from;
+
+    while (1) {
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(sock, request, sizeof(request), 0, (struct sockaddr *) &from, &from_len);
+        if (len <= 0) {
+            break;
+        } else if (len < 32) {
+            continue;
+        }
+        memset(response, 0, sizeof(response));
+        response[0] = 0x80;
+        response[1] = 0xd3;
+        response[3] = 0x07;
+        memcpy(response + 8, request + 24, 8);
+        byteutils_put_ntp_timestamp(response, 16, now_ns() + CLIENT_OFFSET);
+        byteutils_put_ntp_timestamp(response, 24, now_ns() + CLIENT_OFFSET);
+        sendto(sock, response, sizeof(response), 0, (struct sockaddr *) &from, from_len);
+    }
+    return NULL;
+}
+
+/* returns the conversions per second of all readers together */
+static double
+run(raop_ntp_t *ntp, old_sync_params_t *old, int readers, int duration_ms)
+{
+    pthread_t threads[MAX_READERS], writer_thread;
+    reader_t reader[MAX_READERS], writer;
+    atomic_bool stop;
+
+    atomic_init(&stop, false);
+    memset(&writer, 0, sizeof(writer));
+    writer.old = old;
+    writer.stop = &stop;
+    if (!ntp) {
+        pthread_create(&writer_thread, NULL, old_writer_thread, &writer);
+    }
+    for (int i = 0; i < readers; i++) {
+        memset(&reader[i], 0, sizeof(reader_t));
+        reader[i].ntp = ntp;
+        reader[i].old = old;
+        reader[i].stop = &stop;
+        pthread_create(&threads[i], NULL, reader_thread, &reader[i]);
+    }
+    uint64_t start = now_ns();
+    usleep(duration_ms * 1000);
+    atomic_store(&stop, true);
+    uint64_t conversions = 0;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(threads[i], NULL);
+        conversions += reader[i].conversions;
+    }
+    double seconds = (double) (now_ns() - start) / SECOND_IN_NSECS;
+    if (!ntp) {
+        pthread_join(writer_thread, NULL);
+    }
+    return (double) conversions / seconds;
+}
+
+static void
+print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-d milliseconds]\n", name);
+    fprintf(stderr, "  -t   largest number of reader threads (default: the number of online CPUs, at least 4)\n");
+    fprintf(stderr, "  -d   length of each measurement (default 1000)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned char remote[4] = { 127, 0, 0, 1 };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_readers = (cpus > MAX_READERS ? MAX_READERS : cpus > 4 ? (int) cpus : 4);
+    int duration_ms = 1000, opt;
+    old_sync_params_t old;
+    raop_callbacks_t callbacks;
+    pthread_t client;
+
+    while ((opt = getopt(argc, argv, "t:d:h")) != -1) {
+        switch (opt) {
+        case 't':
+            max_readers = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (max_readers < 1 || max_readers > MAX_READERS || duration_ms <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* the client, on a local port */
+    int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    memset(&client_addr, 0, sizeof(client_addr));
+    client_addr.sin_family = AF_INET;
+    client_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (client_sock < 0 || bind(client_sock, (struct sockaddr *) &client_addr, sizeof(client_addr)) < 0 ||
+        getsockname(client_sock, (struct sockaddr *) &client_addr, &client_addr_len) < 0) {
+        fprintf(stderr, "could not open the client socket\n");
+        return 1;
+    }
+    pthread_create(&client, NULL, client_thread, &client_sock);
+
+    logger_t *logger = logger_init();
+    logger_set_level(logger, LOGGER_WARNING);
+    memset(&callbacks, 0, sizeof(callbacks));
+    raop_ntp_t *ntp = raop_ntp_init(logger, &callbacks, remote, sizeof(remote), ntohs(client_addr.sin_port));
+    unsigned short timing_lport = 0;
+    raop_ntp_start(ntp, &timing_lport, 5);
+
+    memset(&old, 0, sizeof(old));
+    pthread_mutex_init(&old.mutex, NULL);
+
+    printf("%ld online CPUs\n", cpus);
+    printf("%8s %14s %14s %14s %14s\n", "readers", "mutex M/s", "seqlock M/s", "mutex ns", "seqlock ns");
+    for (int readers = 1; readers <= max_readers; readers = (readers < max_readers && readers * 2 > max_readers ?
+                                                            max_readers : readers * 2)) {
+        double old_rate = run(NULL, &old, readers, duration_ms);
+        double new_rate = run(ntp, &old, readers, duration_ms);
+        /* the time per conversion seen by each reader */
+        printf("%8d %14.1f %14.1f %14.1f %14.1f\n", readers, old_rate / 1e6, new_rate / 1e6,
+               readers * 1e9 / old_rate, readers * 1e9 / new_rate);
+    }
+
+    raop_ntp_destroy(ntp);
+    sendto(client_sock, "", 0, 0, (struct sockaddr *) &client_addr, client_addr_len);
+    pthread_join(client, NULL);
+    close(client_sock);
+    pthread_mutex_destroy(&old.mutex);
+    logger_destroy(logger);
+    return 0;
+}
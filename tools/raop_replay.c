@@ -0,0 +1,176 @@
+/*
+ * Replays a session recorded with raop_start_capture() through the receive path of the
+ * library (decryption, NAL conversion, audio buffering) and reports the throughput and
+ * the time spent in each stage.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "raop.h"
+#include "raop_replay.h"
+#include "logger.h"
+#include "stream.h"
+
+static FILE *video_out = NULL;
+static FILE *audio_out = NULL;
+static FILE *pcm_out = NULL;
+
+static void
+print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-r] [-d] [-s session] [-o video.h264] [-a audio.raw] [-p audio.pcm] capture_file\n", name);
+    fprintf(stderr, "  -r   replay with the recorded timing instead of as fast as possible\n");
+    fprintf(stderr, "  -d   show debug messages\n");
+    fprintf(stderr, "  -s   replay this session (connection) instead of the first one in the file\n");
+    fprintf(stderr, "  -o   write the H264 video (Annex B) to a file\n");
+    fprintf(stderr, "  -a   write the decrypted (still compressed) audio frames to a file\n");
+    fprintf(stderr, "  -p   decode the audio and write it to a file (interleaved 16-bit PCM)\n");
+}
+
+static void
+video_process(void *cls, raop_ntp_t *ntp, h264_decode_struct *data)
+{
+    if (video_out) {
+        fwrite(data->data, data->data_len, 1, video_out);
+    }
+}
+
+static void
+audio_process(void *cls, raop_ntp_t *ntp, audio_decode_struct *data)
+{
+    if (audio_out) {
+        fwrite(data->data, data->data_len, 1, audio_out);
+    }
+}
+
+static void
+audio_process_pcm(void *cls, raop_ntp_t *ntp, audio_pcm_struct *data)
+{
+    if (pcm_out) {
+        fwrite(data->data, sizeof(int16_t) * data->channels, data->sample_count, pcm_out);
+    }
+}
+
+static void
+print_stage(const char *name, uint64_t ns, uint64_t frames)
+{
+    printf("  %-10s %10.3f ms  %8.3f us/frame\n", name, (double) ns / 1e6,
+           frames ? (double) ns / 1e3 / frames : 0.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *video_file = NULL;
+    const char *audio_file = NULL;
+    const char *pcm_file = NULL;
+    bool realtime = false;
+    uint32_t session = 0;
+    int level = LOGGER_INFO;
+    raop_callbacks_t callbacks;
+    raop_replay_stats_t stats;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "rds:o:a:p:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            realtime = true;
+            break;
+        case 'd':
+            level = LOGGER_DEBUG;
+            break;
+        case 's':
+            session = (uint32_t) strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            video_file = optarg;
+            break;
+        case 'a':
+            audio_file = optarg;
+            break;
+        case 'p':
+            pcm_file = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (video_file && !(video_out = fopen(video_file, "wb"))) {
+        perror(video_file);
+        return 1;
+    }
+    if (audio_file && !(audio_out = fopen(audio_file, "wb"))) {
+        perror(audio_file);
+        return 1;
+    }
+    if (pcm_file && !(pcm_out = fopen(pcm_file, "wb"))) {
+        perror(pcm_file);
+        return 1;
+    }
+
+    logger_t *logger = logger_init();
+    logger_set_level(logger, level);
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.video_process = video_process;
+    callbacks.audio_process = audio_process;
+    if (pcm_out) {
+        callbacks.audio_process_pcm = audio_process_pcm;
+    }
+
+    ret = raop_replay_file(logger, &callbacks, argv[optind], session, realtime, &stats);
+
+    if (video_out) {
+        fclose(video_out);
+    }
+    if (audio_out) {
+        fclose(audio_out);
+    }
+    if (pcm_out) {
+        fclose(pcm_out);
+    }
+    logger_destroy(logger);
+    if (ret < 0) {
+        return 1;
+    }
+
+    double seconds = stats.wall_seconds > 0 ? stats.wall_seconds : 1e-9;
+    printf("%llu records (%llu skipped), %.3f MB, captured over %.3f s, replayed in %.3f s\n",
+           (unsigned long long) stats.records, (unsigned long long) stats.skipped,
+           (double) stats.bytes / 1e6, stats.capture_seconds, stats.wall_seconds);
+    printf("video: %llu frames, %.3f MB, %.1f frames/s, %.3f MB/s\n",
+           (unsigned long long) stats.video.frames, (double) stats.video.bytes / 1e6,
+           stats.video.frames / seconds, (double) stats.video.bytes / 1e6 / seconds);
+    print_stage("decrypt", stats.video.decrypt_ns, stats.video.frames);
+    print_stage("nal", stats.video.nal_ns, stats.video.frames);
+    print_stage("deliver", stats.video.deliver_ns, stats.video.frames);
+    printf("audio: %llu frames, %.3f MB, %.1f frames/s, %.3f MB/s\n",
+           (unsigned long long) stats.audio.frames, (double) stats.audio.bytes / 1e6,
+           stats.audio.frames / seconds, (double) stats.audio.bytes / 1e6 / seconds);
+    print_stage("enqueue", stats.audio.enqueue_ns, stats.audio.frames);
+    print_stage("dequeue", stats.audio.dequeue_ns, stats.audio.frames);
+    print_stage("callback", stats.audio.callback_ns, stats.audio.frames);
+    if (pcm_out) {
+        print_stage("decode", stats.audio.decode_ns, stats.audio.frames);
+    }
+    return 0;
+}